@@ -0,0 +1,163 @@
+/* annresultcache.h - LRU cache of myvector_ann_set() results of one index.
+ *
+ * An entry is keyed by the query vector bytes, nn and ef_search and holds
+ * the keys and distances of the search, nearest first. Entries remember
+ * the mutation epoch of the index (AbstractVectorIndex::mutationEpoch())
+ * read before their search ran; an entry from an older epoch is a miss, so
+ * an insert or delete invalidates the whole cache without walking it.
+ *
+ * Enabled per index with the result_cache_mb= option, the least recently
+ * used entries are evicted to stay within it. A hit costs one hash of the
+ * query vector, a compare and a copy of the result.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+class AnnResultCache {
+public:
+    /* setBudget - memory for entries, 0 disables the cache */
+    void setBudget(size_t bytes) {
+        std::lock_guard<std::mutex> l(m_mutex);
+        m_budget = bytes;
+        evict();
+    }
+
+    bool enabled() const { return m_budget != 0; }
+
+    bool lookup(const void* qvec,
+                size_t qlen,
+                int nn,
+                int ef,
+                uint64_t epoch,
+                std::vector<size_t>& keys,
+                std::vector<double>& dists) {
+        size_t h = hash(qvec, qlen, nn, ef);
+        std::lock_guard<std::mutex> l(m_mutex);
+        auto it = m_map.find(h);
+        if (it == m_map.end() || !matches(*it->second, qvec, qlen, nn, ef)) {
+            m_misses++;
+            return false;
+        }
+        if (it->second->epoch != epoch) {
+            erase(it);
+            m_misses++;
+            return false;
+        }
+        m_lru.splice(m_lru.begin(), m_lru, it->second);
+        keys = it->second->keys;
+        dists = it->second->dists;
+        m_hits++;
+        return true;
+    }
+
+    /* insert - 'epoch' must be read before the search that produced the
+     * result, an index change during the search then leaves it stale.
+     */
+    void insert(const void* qvec,
+                size_t qlen,
+                int nn,
+                int ef,
+                uint64_t epoch,
+                const std::vector<size_t>& keys,
+                const std::vector<double>& dists) {
+        size_t h = hash(qvec, qlen, nn, ef);
+        std::lock_guard<std::mutex> l(m_mutex);
+        auto it = m_map.find(h);
+        if (it != m_map.end())
+            erase(it);
+
+        Entry e;
+        e.hash = h;
+        e.query.assign((const char*)qvec, qlen);
+        e.nn = nn;
+        e.ef = ef;
+        e.epoch = epoch;
+        e.keys = keys;
+        e.dists = dists;
+        e.bytes = sizeof(Entry) + qlen +
+                  keys.size() * (sizeof(size_t) + sizeof(double));
+        if (e.bytes > m_budget)
+            return;
+
+        m_bytes += e.bytes;
+        m_lru.push_front(std::move(e));
+        m_map[h] = m_lru.begin();
+        evict();
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> l(m_mutex);
+        m_lru.clear();
+        m_map.clear();
+        m_bytes = 0;
+    }
+
+    void getStats(size_t& hits,
+                  size_t& misses,
+                  size_t& entries,
+                  size_t& bytes) {
+        std::lock_guard<std::mutex> l(m_mutex);
+        hits = m_hits;
+        misses = m_misses;
+        entries = m_lru.size();
+        bytes = m_bytes;
+    }
+
+private:
+    struct Entry {
+        size_t hash;
+        std::string query;
+        int nn;
+        int ef;
+        uint64_t epoch;
+        std::vector<size_t> keys;
+        std::vector<double> dists;
+        size_t bytes;
+    };
+    typedef std::list<Entry>::iterator EntryIt;
+
+    static size_t hash(const void* qvec, size_t qlen, int nn, int ef) {
+        size_t h = std::hash<std::string_view>()(
+            std::string_view((const char*)qvec, qlen));
+        return h ^ (((size_t)nn << 32 | (uint32_t)ef) * 0x9e3779b97f4a7c15ULL);
+    }
+
+    static bool matches(const Entry& e,
+                        const void* qvec,
+                        size_t qlen,
+                        int nn,
+                        int ef) {
+        return e.nn == nn && e.ef == ef && e.query.size() == qlen &&
+               !memcmp(e.query.data(), qvec, qlen);
+    }
+
+    void erase(std::unordered_map<size_t, EntryIt>::iterator it) {
+        m_bytes -= it->second->bytes;
+        m_lru.erase(it->second);
+        m_map.erase(it);
+    }
+
+    void evict() {
+        while (m_bytes > m_budget && m_lru.size())
+            erase(m_map.find(m_lru.back().hash));
+    }
+
+    std::mutex m_mutex;
+    std::atomic<size_t> m_budget{0};
+    size_t m_bytes = 0;
+    size_t m_hits = 0;
+    size_t m_misses = 0;
+    std::list<Entry> m_lru;  // most recently used first
+    std::unordered_map<size_t, EntryIt> m_map;
+};
@@ -0,0 +1,78 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+namespace hnswlib {
+
+    /* CRC32C (Castagnoli) for the index file block checksums. Uses the
+     * SSE4.2 crc32 instruction when the CPU has it (checked once at run
+     * time, so no build flag is needed), the ARMv8 crc32c instructions when
+     * the build targets them, and a table driven loop otherwise.
+     */
+    static inline uint32_t CRC32CSoftware(uint32_t crc,
+                                          const unsigned char* p,
+                                          size_t n) {
+        static const struct CRC32CTable {
+            uint32_t t[256];
+            CRC32CTable() {
+                for (uint32_t i = 0; i < 256; i++) {
+                    uint32_t c = i;
+                    for (int k = 0; k < 8; k++)
+                        c = (c & 1) ? (c >> 1) ^ 0x82f63b78 : (c >> 1);
+                    t[i] = c;
+                }
+            }
+        } table;
+
+        while (n--)
+            crc = table.t[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        return crc;
+    }
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    __attribute__((target("sse4.2"))) static inline uint32_t CRC32CSSE42(
+        uint32_t crc, const unsigned char* p, size_t n) {
+        uint64_t c = crc;
+        while (n >= 8) {
+            uint64_t v;
+            memcpy(&v, p, sizeof(v));
+            c = __builtin_ia32_crc32di(c, v);
+            p += 8;
+            n -= 8;
+        }
+        uint32_t c32 = (uint32_t)c;
+        while (n--)
+            c32 = __builtin_ia32_crc32qi(c32, *p++);
+        return c32;
+    }
+#endif
+
+    /* CRC32C of 'data', or of the stream continued after a previous
+     * CRC32C() result 'prev'.
+     */
+    static inline uint32_t CRC32C(const void* data, size_t n,
+                                  uint32_t prev = 0) {
+        const unsigned char* p = (const unsigned char*)data;
+        uint32_t crc = ~prev;
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+        static const bool sse42 = __builtin_cpu_supports("sse4.2");
+        if (sse42)
+            return ~CRC32CSSE42(crc, p, n);
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+        while (n >= 8) {
+            uint64_t v;
+            memcpy(&v, p, sizeof(v));
+            crc = __crc32cd(crc, v);
+            p += 8;
+            n -= 8;
+        }
+#endif
+        return ~CRC32CSoftware(crc, p, n);
+    }
+
+}  // namespace hnswlib
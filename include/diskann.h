@@ -0,0 +1,1662 @@
+/* diskann.h - SSD resident Vamana (DiskANN) graph index for MyVector.
+ *
+ * The index keeps a single layer Vamana graph together with the full
+ * precision vectors in one sector aligned file on disk. Only the product
+ * quantized (PQ) codes of the vectors are held in memory and are used to
+ * route the beam search; the full vectors read from disk during the search
+ * give the exact distances for the final ranking.
+ *
+ * Files :-
+ *   <index>.diskann.index       - header sector, then fixed size node records
+ *   <index>.diskann.index.pq    - PQ codebook and codes
+ *   <index>.diskann.index.status, .ckpt.state - checkpoint status & journal,
+ *                                 same protocol as hnswdisk.i
+ *   <index>.diskann.index.build, .build.labels - rows spilled before the
+ *                                 first build (VamanaBuildSpill)
+ *   <index>.diskann.index.part<N> - row ids of a build partition
+ */
+#pragma once
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <exception>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <shared_mutex>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "hnswlib.h"
+#include "myvectorutils.h"
+#include "visited_list_pool.h"
+
+namespace hnswlib {
+    typedef unsigned int tableint;
+
+    /* ProductQuantizer - 256 centroids per sub-space, 1 byte code per
+     * sub-space. Sub-spaces are contiguous dimension ranges.
+     */
+    class ProductQuantizer {
+    public:
+        static const size_t KSUB = 256;
+
+        size_t dim_{0};
+        size_t m_{0};
+        std::vector<size_t> offsets_;   // m_ + 1 sub-space boundaries
+        std::vector<float> centroids_;  // KSUB centroids per sub-space
+
+        void init(size_t dim, size_t m) {
+            dim_ = dim;
+            m_ = std::max((size_t)1, std::min(m, dim));
+            offsets_.resize(m_ + 1);
+            for (size_t s = 0; s <= m_; s++)
+                offsets_[s] = (s * dim_) / m_;
+            centroids_.assign(dim_ * KSUB, 0.0f);
+        }
+
+        const float* centroid(size_t s, size_t c) const {
+            size_t len = offsets_[s + 1] - offsets_[s];
+            return &centroids_[offsets_[s] * KSUB + c * len];
+        }
+
+        /* train - k-means (Lloyd) of every sub-space over a sample of the
+         * 'n' input vectors.
+         */
+        void train(const float* data,
+                   size_t stride,
+                   size_t n,
+                   size_t sample,
+                   int iterations,
+                   int nthreads) {
+            std::mt19937 rng(100);
+            std::vector<size_t> ids;
+            if (n <= sample) {
+                for (size_t i = 0; i < n; i++)
+                    ids.push_back(i);
+                std::shuffle(ids.begin(), ids.end(), rng);
+            } else {
+                /* no permutation of all 'n', it may not fit in memory */
+                std::uniform_int_distribution<size_t> pick(0, n - 1);
+                for (size_t i = 0; i < sample; i++)
+                    ids.push_back(pick(rng));
+            }
+            size_t ns = ids.size();
+
+            std::atomic<size_t> next(0);
+            auto trainSubspace = [&]() {
+                size_t s;
+                while ((s = next++) < m_) {
+                    size_t off = offsets_[s], len = offsets_[s + 1] - off;
+                    float* cent = &centroids_[off * KSUB];
+                    for (size_t c = 0; c < KSUB; c++)
+                        memcpy(cent + c * len,
+                               data + ids[c % ns] * stride + off,
+                               len * sizeof(float));
+
+                    std::vector<uint8_t> assign(ns);
+                    std::vector<float> sums(KSUB * len);
+                    std::vector<size_t> counts(KSUB);
+                    for (int it = 0; it < iterations; it++) {
+                        for (size_t i = 0; i < ns; i++)
+                            assign[i] = nearest(
+                                data + ids[i] * stride + off, cent, len);
+                        std::fill(sums.begin(), sums.end(), 0.0f);
+                        std::fill(counts.begin(), counts.end(), 0);
+                        for (size_t i = 0; i < ns; i++) {
+                            const float* v = data + ids[i] * stride + off;
+                            float* sum = &sums[assign[i] * len];
+                            for (size_t d = 0; d < len; d++)
+                                sum[d] += v[d];
+                            counts[assign[i]]++;
+                        }
+                        for (size_t c = 0; c < KSUB; c++) {
+                            if (!counts[c])
+                                continue;  // keep the old centroid
+                            for (size_t d = 0; d < len; d++)
+                                cent[c * len + d] = sums[c * len + d] / counts[c];
+                        }
+                    }
+                }
+            };
+
+            std::vector<std::thread> threads;
+            for (int t = 0; t < std::max(1, nthreads); t++)
+                threads.emplace_back(trainSubspace);
+            for (auto& t : threads)
+                t.join();
+        }
+
+        static uint8_t nearest(const float* v, const float* cent, size_t len) {
+            float best = std::numeric_limits<float>::max();
+            uint8_t bestc = 0;
+            for (size_t c = 0; c < KSUB; c++) {
+                float d = 0;
+                for (size_t j = 0; j < len; j++) {
+                    float t = v[j] - cent[c * len + j];
+                    d += t * t;
+                }
+                if (d < best) {
+                    best = d;
+                    bestc = (uint8_t)c;
+                }
+            }
+            return bestc;
+        }
+
+        void encode(const float* v, uint8_t* code) const {
+            for (size_t s = 0; s < m_; s++)
+                code[s] = nearest(v + offsets_[s],
+                                  &centroids_[offsets_[s] * KSUB],
+                                  offsets_[s + 1] - offsets_[s]);
+        }
+
+        /* computeTable - per query distance table, m_ x KSUB entries. For
+         * inner product spaces the entries are negated partial dot products.
+         */
+        void computeTable(const float* q, bool ip, float* table) const {
+            for (size_t s = 0; s < m_; s++) {
+                size_t off = offsets_[s], len = offsets_[s + 1] - off;
+                for (size_t c = 0; c < KSUB; c++) {
+                    const float* cv = centroid(s, c);
+                    float d = 0;
+                    for (size_t j = 0; j < len; j++) {
+                        if (ip)
+                            d -= q[off + j] * cv[j];
+                        else {
+                            float t = q[off + j] - cv[j];
+                            d += t * t;
+                        }
+                    }
+                    table[s * KSUB + c] = d;
+                }
+            }
+        }
+
+        float distance(const float* table, const uint8_t* code) const {
+            float d = 0;
+            for (size_t s = 0; s < m_; s++)
+                d += table[s * KSUB + code[s]];
+            return d;
+        }
+    };
+
+    /* VamanaBuildSpill - rows added to an index that is not built yet.
+     * They are appended to <index>.build (vectors) and <index>.build.labels
+     * through 8 MB buffers instead of being held in memory, and are read
+     * from there by VamanaDiskIndex::buildIndex(). Not thread safe.
+     */
+    class VamanaBuildSpill {
+    public:
+        ~VamanaBuildSpill() { closeFiles(); }
+
+        bool isOpen() const { return vfd_ >= 0; }
+        size_t rows() const { return rows_; }
+        const std::string& vectorFile() const { return vfile_; }
+        std::string labelFile() const { return vfile_ + ".labels"; }
+
+        /* open - start an empty spill for the index file 'file' */
+        void open(const std::string& file, size_t data_size) {
+            remove();
+            vfile_ = file + ".build";
+            data_size_ = data_size;
+            vfd_ = openFile(vfile_);
+            lfd_ = openFile(labelFile());
+        }
+
+        void append(const void* vec, labeltype label) {
+            vbuf_.insert(vbuf_.end(), (const char*)vec,
+                         (const char*)vec + data_size_);
+            lbuf_.insert(lbuf_.end(), (const char*)&label,
+                         (const char*)&label + sizeof(label));
+            rows_++;
+            if (vbuf_.size() >= BUFFER_LEN)
+                flush();
+        }
+
+        /* flush - write out the buffered rows, before a build reads them */
+        void flush() {
+            writeAll(vfd_, vbuf_, vfile_);
+            writeAll(lfd_, lbuf_, labelFile());
+        }
+
+        /* remove - discard the spilled rows and their files */
+        void remove() {
+            closeFiles();
+            if (!vfile_.empty()) {
+                unlink(vfile_.c_str());
+                unlink(labelFile().c_str());
+            }
+            vfile_.clear();
+            vbuf_.clear();
+            lbuf_.clear();
+            rows_ = 0;
+        }
+
+    private:
+        static const size_t BUFFER_LEN = 8 * 1024 * 1024;
+
+        std::string vfile_;
+        size_t data_size_{0};
+        int vfd_{-1};
+        int lfd_{-1};
+        size_t rows_{0};
+        std::vector<char> vbuf_;
+        std::vector<char> lbuf_;
+
+        static int openFile(const std::string& file) {
+            int fd = ::open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+            if (fd == -1) {
+                std::stringstream ss;
+                ss << "Error during open() on " << file << ",errno=" << errno;
+                throw std::runtime_error(ss.str());
+            }
+            return fd;
+        }
+
+        static void writeAll(int fd,
+                             std::vector<char>& buf,
+                             const std::string& file) {
+            size_t done = 0;
+            while (done < buf.size()) {
+                ssize_t rc = write(fd, buf.data() + done, buf.size() - done);
+                if (rc <= 0) {
+                    std::stringstream ss;
+                    ss << "Error writing " << buf.size() - done << " bytes to "
+                       << file << ",errno = " << errno;
+                    throw std::runtime_error(ss.str());
+                }
+                done += rc;
+            }
+            buf.clear();
+        }
+
+        void closeFiles() {
+            if (vfd_ >= 0)
+                ::close(vfd_);
+            if (lfd_ >= 0)
+                ::close(lfd_);
+            vfd_ = lfd_ = -1;
+        }
+    };
+
+    class VamanaDiskIndex {
+    public:
+        static const size_t SECTOR_LEN = 4096;
+        static const uint64_t FILE_MAGIC = 0x31304e4e4144564dULL;  // MVDANN01
+        static const uint64_t FILE_VERSION = 1;
+        static constexpr tableint INVALID_ID = (tableint)-1;
+
+        /* Same values as hnswdisk.i, the .status files read the same */
+        typedef enum {
+            CKPT_BEGIN_INCR_PASS1 = 10001,
+            CKPT_END_INCR_PASS1 = 10002,
+            CKPT_BEGIN_INCR_PASS2 = 10003,
+            CKPT_END_INCR_PASS2 = 10004,
+            CKPT_BEGIN_FULL_WRITE = 10005,
+            CKPT_END_FULL_WRITE = 10006,
+            CKPT_CONSISTENT = 11000
+        } CheckPointState;
+
+        /* First sector of the index file */
+        struct FileHeader {
+            uint64_t magic;
+            uint64_t version;
+            uint64_t dim;
+            uint64_t data_size;
+            uint64_t npoints;
+            uint64_t R;
+            uint64_t medoid;
+            uint64_t node_len;
+            uint64_t nodes_per_sector;
+            uint64_t sectors_per_node;
+            uint64_t pq_m;
+        };
+
+        /* Node record : [vector][label][neighbour count][R neighbours] */
+        size_t data_size_{0};
+        size_t dim_{0};
+        size_t R_{64};
+        size_t L_build_{100};
+        float alpha_{1.2f};
+        bool pq_ip_{false};
+
+        size_t node_len_{0};
+        size_t nodes_per_sector_{0};
+        size_t sectors_per_node_{0};
+
+        DISTFUNC<float> fstdistfunc_;
+        void* dist_func_param_{nullptr};
+
+        std::atomic<size_t> npoints_{0};
+        size_t disk_npoints_{0};
+        std::atomic<tableint> medoid_{INVALID_ID};
+
+        ProductQuantizer pq_;
+        std::vector<uint8_t> codes_;
+        size_t disk_codes_{0};
+
+        std::string file_;
+        int fd_{-1};
+
+        /* Node records not yet checkpointed (online inserts), the records
+         * a running checkpoint is writing out and the records cached around
+         * the medoid at load. All are read before going to disk.
+         */
+        std::map<tableint, std::vector<char>> dirty_;
+        std::map<tableint, std::vector<char>> flushing_;
+        std::unordered_map<tableint, std::vector<char>> cache_;
+        std::shared_mutex lock_;
+        std::mutex insert_lock_;      // one addPoint() at a time
+        std::mutex checkpoint_lock_;  // one doCheckPoint() at a time
+
+        std::string checkPointId_;
+
+        mutable std::atomic<long> metric_disk_reads{0};
+
+        VamanaDiskIndex(SpaceInterface<float>* s,
+                        size_t dim,
+                        size_t R,
+                        size_t L_build,
+                        float alpha,
+                        bool pq_ip)
+            : data_size_(s->get_data_size()),
+              dim_(dim),
+              R_(R),
+              L_build_(L_build),
+              alpha_(alpha),
+              pq_ip_(pq_ip) {
+            fstdistfunc_ = s->get_dist_func();
+            dist_func_param_ = s->get_dist_func_param();
+            setLayout();
+        }
+
+        ~VamanaDiskIndex() {
+            if (fd_ >= 0)
+                close(fd_);
+        }
+
+        void setLayout() {
+            node_len_ = data_size_ + sizeof(labeltype) + sizeof(uint32_t) +
+                        R_ * sizeof(tableint);
+            nodes_per_sector_ = SECTOR_LEN / node_len_;
+            sectors_per_node_ =
+                nodes_per_sector_ ? 1 : (node_len_ + SECTOR_LEN - 1) / SECTOR_LEN;
+        }
+
+        /* nodeOffset - file offset of a node record. A record never spans a
+         * sector boundary unless it is larger than one sector, in which case
+         * it starts on its own sector.
+         */
+        off_t nodeOffset(tableint id) const {
+            if (nodes_per_sector_)
+                return SECTOR_LEN + (off_t)(id / nodes_per_sector_) * SECTOR_LEN +
+                       (off_t)(id % nodes_per_sector_) * node_len_;
+            return SECTOR_LEN + (off_t)id * sectors_per_node_ * SECTOR_LEN;
+        }
+
+        size_t fileSize(size_t npoints) const {
+            if (nodes_per_sector_)
+                return SECTOR_LEN + ((npoints + nodes_per_sector_ - 1) /
+                                     nodes_per_sector_) *
+                                        SECTOR_LEN;
+            return SECTOR_LEN + npoints * sectors_per_node_ * SECTOR_LEN;
+        }
+
+        static const char* recVector(const char* rec) { return rec; }
+        labeltype recLabel(const char* rec) const {
+            labeltype l;
+            memcpy(&l, rec + data_size_, sizeof(l));
+            return l;
+        }
+        uint32_t recCount(const char* rec) const {
+            uint32_t c;
+            memcpy(&c, rec + data_size_ + sizeof(labeltype), sizeof(c));
+            return c;
+        }
+        const tableint* recNeighbours(const char* rec) const {
+            return (const tableint*)(rec + data_size_ + sizeof(labeltype) +
+                                     sizeof(uint32_t));
+        }
+        void makeRecord(std::vector<char>& rec,
+                        const void* vec,
+                        labeltype label,
+                        const std::vector<tableint>& nbrs) const {
+            rec.assign(node_len_, 0);
+            memcpy(rec.data(), vec, data_size_);
+            memcpy(rec.data() + data_size_, &label, sizeof(label));
+            setNeighbours(rec, nbrs);
+        }
+        void setNeighbours(std::vector<char>& rec,
+                           const std::vector<tableint>& nbrs) const {
+            uint32_t c = (uint32_t)std::min(nbrs.size(), R_);
+            memcpy(rec.data() + data_size_ + sizeof(labeltype), &c, sizeof(c));
+            memcpy(rec.data() + data_size_ + sizeof(labeltype) + sizeof(c),
+                   nbrs.data(),
+                   c * sizeof(tableint));
+        }
+
+        /* File I/O helpers, throw std::runtime_error like hnswdisk.i */
+        static int Open(const std::string& file, int flags, mode_t mode = 0) {
+            int fd = open(file.c_str(), flags, mode);
+            if (fd == -1) {
+                std::stringstream ss;
+                ss << "Error during open() on " << file << ",errno=" << errno;
+                throw std::runtime_error(ss.str());
+            }
+            return fd;
+        }
+
+        static void Pwrite(int fd,
+                           const void* buf,
+                           size_t nbytes,
+                           off_t offset,
+                           const std::string& file) {
+            ssize_t rc = pwrite(fd, buf, nbytes, offset);
+            if (rc < 0 || static_cast<size_t>(rc) != nbytes) {
+                std::stringstream ss;
+                ss << "Error writing " << nbytes << " bytes to " << file
+                   << " at offset " << offset << ",errno = " << errno;
+                throw std::runtime_error(ss.str());
+            }
+        }
+
+        static void Pread(int fd,
+                          void* buf,
+                          size_t nbytes,
+                          off_t offset,
+                          const std::string& file) {
+            ssize_t rc = pread(fd, buf, nbytes, offset);
+            if (rc < 0 || static_cast<size_t>(rc) != nbytes) {
+                std::stringstream ss;
+                ss << "Error reading " << nbytes << " bytes from " << file
+                   << " at offset " << offset << ",errno = " << errno;
+                throw std::runtime_error(ss.str());
+            }
+        }
+
+        static void Fsync(int fd, const std::string& file) {
+            if (fsync(fd) != 0) {
+                std::stringstream ss;
+                ss << "Error during fsync() on " << file << ",errno = " << errno;
+                throw std::runtime_error(ss.str());
+            }
+        }
+
+        /* parallelFor - fn(0..n-1) on 'nthreads' threads. The first
+         * exception thrown by fn stops the loop and is rethrown here.
+         */
+        template <class Function>
+        static void parallelFor(size_t n, int nthreads, Function fn) {
+            std::atomic<size_t> next(0);
+            std::exception_ptr error;
+            std::mutex errorLock;
+            std::vector<std::thread> threads;
+            for (int t = 0; t < std::max(1, nthreads); t++) {
+                threads.emplace_back([&]() {
+                    try {
+                        size_t i;
+                        while ((i = next++) < n)
+                            fn(i);
+                    } catch (...) {
+                        std::lock_guard<std::mutex> l(errorLock);
+                        if (!error)
+                            error = std::current_exception();
+                        next = n;
+                    }
+                });
+            }
+            for (auto& t : threads)
+                t.join();
+            if (error)
+                std::rethrow_exception(error);
+        }
+
+        static float l2(const float* a, const float* b, size_t dim) {
+            float d = 0;
+            for (size_t j = 0; j < dim; j++)
+                d += (a[j] - b[j]) * (a[j] - b[j]);
+            return d;
+        }
+
+        /* Read only mapping of a build input file */
+        struct MappedFile {
+            char* data{nullptr};
+            size_t len{0};
+
+            explicit MappedFile(const std::string& file) {
+                int fd = Open(file, O_RDONLY);
+                struct stat st;
+                if (fstat(fd, &st) != 0) {
+                    close(fd);
+                    throw std::runtime_error("Error during fstat() on " + file);
+                }
+                len = st.st_size;
+                if (len) {
+                    void* p = mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+                    if (p == MAP_FAILED) {
+                        close(fd);
+                        throw std::runtime_error("Error during mmap() on " + file);
+                    }
+                    data = (char*)p;
+                }
+                close(fd);
+            }
+            ~MappedFile() {
+                if (data)
+                    munmap(data, len);
+            }
+            MappedFile(const MappedFile&) = delete;
+            MappedFile& operator=(const MappedFile&) = delete;
+        };
+
+        /* robustPrune - Vamana neighbour selection. 'cand' holds (distance
+         * to p, id) pairs, 'vec' returns the vector of an id.
+         */
+        template <class VecFn>
+        std::vector<tableint> robustPrune(
+            tableint p,
+            std::vector<std::pair<float, tableint>>& cand,
+            float alpha,
+            VecFn vec) const {
+            std::sort(cand.begin(), cand.end());
+            cand.erase(std::unique(cand.begin(),
+                                   cand.end(),
+                                   [](const std::pair<float, tableint>& a,
+                                      const std::pair<float, tableint>& b) {
+                                       return a.second == b.second;
+                                   }),
+                       cand.end());
+            std::vector<tableint> result;
+            std::vector<const void*> resultVecs;
+            for (auto& c : cand) {
+                if (c.second == p)
+                    continue;
+                if (result.size() >= R_)
+                    break;
+                const void* cv = vec(c.second);
+                bool keep = true;
+                for (size_t r = 0; r < result.size() && keep; r++) {
+                    if (result[r] == c.second ||
+                        alpha * fstdistfunc_(cv, resultVecs[r], dist_func_param_) <=
+                            c.first)
+                        keep = false;
+                }
+                if (keep) {
+                    result.push_back(c.second);
+                    resultVecs.push_back(cv);
+                }
+            }
+            return result;
+        }
+
+        /* buildIndex - Build the Vamana graph of the rows spilled by a
+         * VamanaBuildSpill and write it out to 'file'. The spilled vectors
+         * are mapped, not loaded. Rows are split by k-means into partitions
+         * of about 'build_mem' bytes of build state each, every row going to
+         * its two nearest partitions; the graph of one partition at a time
+         * is built in memory and merged into the index file, where a row of
+         * two partitions gets the union of its neighbour lists pruned to R.
+         * A build that fits in 'build_mem' is a single partition. Only the PQ
+         * codes of all the rows are held in memory, as when serving.
+         */
+        void buildIndex(const std::string& file,
+                        const VamanaBuildSpill& spill,
+                        size_t pq_m,
+                        size_t build_mem,
+                        int nthreads) {
+            MappedFile vecs(spill.vectorFile()), labels(spill.labelFile());
+            size_t n = labels.len / sizeof(labeltype);
+            if (!n || vecs.len < n * data_size_)
+                throw std::runtime_error("No vectors to build the index");
+
+            auto vec = [&](size_t id) -> const void* {
+                return vecs.data + id * data_size_;
+            };
+            auto label = [&](size_t id) {
+                labeltype l;
+                memcpy(&l, labels.data + id * sizeof(l), sizeof(l));
+                return l;
+            };
+
+            pq_.init(dim_, pq_m);
+            pq_.train((const float*)vecs.data, dim_, n, 50000, 10, nthreads);
+            codes_.resize(n * pq_.m_);
+            parallelFor(n, nthreads, [&](size_t i) {
+                pq_.encode((const float*)vec(i), &codes_[i * pq_.m_]);
+            });
+            medoid_ = medoidOf(vec, n, nthreads);
+
+            /* build state of a row : vector, neighbour list, lock */
+            size_t rowMem = data_size_ + 2 * R_ * sizeof(tableint) +
+                            sizeof(std::mutex) + 64;
+            size_t partRows = std::max(build_mem / rowMem, (size_t)1000);
+            size_t nparts =
+                (n <= partRows) ? 1 : (2 * n + partRows - 1) / partRows;
+            debug_print("DiskANN build of %lu rows in %lu partitions",
+                        n, nparts);
+
+            file_ = file;
+            npoints_ = n;
+            WriteCheckPointStatus(file, CKPT_BEGIN_FULL_WRITE);
+
+            int fd = Open(file, O_RDWR | O_CREAT | O_TRUNC, 0600);
+            try {
+                writeHeader(fd, n);
+                if (ftruncate(fd, fileSize(n)) != 0) {
+                    std::stringstream ss;
+                    ss << "Error during ftruncate() on " << file
+                       << ",errno = " << errno;
+                    throw std::runtime_error(ss.str());
+                }
+                if (nparts == 1) {
+                    std::vector<tableint> ids(n);
+                    for (size_t i = 0; i < n; i++)
+                        ids[i] = i;
+                    buildPartition(fd, ids, vec, label, nthreads);
+                } else {
+                    partitionRows(file, vec, n, nparts, nthreads);
+                    for (size_t p = 0; p < nparts; p++) {
+                        std::vector<tableint> ids =
+                            readPartition(partitionFile(file, p));
+                        unlink(partitionFile(file, p).c_str());
+                        if (ids.size())
+                            buildPartition(fd, ids, vec, label, nthreads);
+                    }
+                }
+                Fsync(fd, file);
+            } catch (...) {
+                close(fd);
+                for (size_t p = 0; nparts > 1 && p < nparts; p++)
+                    unlink(partitionFile(file, p).c_str());
+                throw;
+            }
+            close(fd);
+
+            writePQFile(file, true, codes_.data(), n);
+            disk_npoints_ = n;
+
+            WriteCheckPointStatus(file, CKPT_END_FULL_WRITE);
+            setCheckPointComplete(file);
+        }
+
+        /* medoidOf - the vector nearest to the mean of vectors 0..n-1 */
+        template <class VecFn>
+        tableint medoidOf(VecFn vec, size_t n, int nthreads) const {
+            size_t nchunks = std::max(1, nthreads);
+            std::vector<std::vector<double>> sums(
+                nchunks, std::vector<double>(dim_, 0.0));
+            parallelFor(nchunks, nthreads, [&](size_t c) {
+                for (size_t i = c * n / nchunks; i < (c + 1) * n / nchunks; i++) {
+                    const float* v = (const float*)vec(i);
+                    for (size_t d = 0; d < dim_; d++)
+                        sums[c][d] += v[d];
+                }
+            });
+            std::vector<float> mean(dim_, 0.0f);
+            for (auto& sum : sums)
+                for (size_t d = 0; d < dim_; d++)
+                    mean[d] += sum[d] / n;
+
+            std::vector<std::pair<float, tableint>> best(
+                nchunks, {std::numeric_limits<float>::max(), 0});
+            parallelFor(nchunks, nthreads, [&](size_t c) {
+                for (size_t i = c * n / nchunks; i < (c + 1) * n / nchunks; i++) {
+                    float d = l2((const float*)vec(i), mean.data(), dim_);
+                    if (d < best[c].first)
+                        best[c] = {d, (tableint)i};
+                }
+            });
+            return std::min_element(best.begin(), best.end())->second;
+        }
+
+        std::pair<uint32_t, uint32_t> nearestTwo(const float* v,
+                                                 const std::vector<float>& cent,
+                                                 size_t k) const {
+            float d1 = std::numeric_limits<float>::max(), d2 = d1;
+            uint32_t c1 = 0, c2 = 0;
+            for (size_t c = 0; c < k; c++) {
+                float d = l2(v, &cent[c * dim_], dim_);
+                if (d < d1) {
+                    d2 = d1;
+                    c2 = c1;
+                    d1 = d;
+                    c1 = c;
+                } else if (d < d2) {
+                    d2 = d;
+                    c2 = c;
+                }
+            }
+            return {c1, k > 1 ? c2 : c1};
+        }
+
+        /* partitionCentroids - k-means (Lloyd) of 'k' partition centroids
+         * over a sample of the rows
+         */
+        template <class VecFn>
+        std::vector<float> partitionCentroids(VecFn vec,
+                                              size_t n,
+                                              size_t k,
+                                              int nthreads) const {
+            std::mt19937 rng(100);
+            std::uniform_int_distribution<size_t> pick(0, n - 1);
+            size_t ns = std::min(n, std::max(k * 256, (size_t)50000));
+            std::vector<size_t> sample(ns);
+            for (size_t i = 0; i < ns; i++)
+                sample[i] = (ns == n) ? i : pick(rng);
+
+            std::vector<float> cent(k * dim_);
+            for (size_t c = 0; c < k; c++)
+                memcpy(&cent[c * dim_], vec(sample[c * ns / k]),
+                       dim_ * sizeof(float));
+
+            std::vector<uint32_t> assign(ns);
+            std::vector<double> sums(k * dim_);
+            std::vector<size_t> counts(k);
+            for (int it = 0; it < 10; it++) {
+                parallelFor(ns, nthreads, [&](size_t i) {
+                    assign[i] =
+                        nearestTwo((const float*)vec(sample[i]), cent, k).first;
+                });
+                std::fill(sums.begin(), sums.end(), 0.0);
+                std::fill(counts.begin(), counts.end(), 0);
+                for (size_t i = 0; i < ns; i++) {
+                    const float* v = (const float*)vec(sample[i]);
+                    for (size_t d = 0; d < dim_; d++)
+                        sums[assign[i] * dim_ + d] += v[d];
+                    counts[assign[i]]++;
+                }
+                for (size_t c = 0; c < k; c++) {
+                    if (!counts[c])
+                        continue;  // keep the old centroid
+                    for (size_t d = 0; d < dim_; d++)
+                        cent[c * dim_ + d] = sums[c * dim_ + d] / counts[c];
+                }
+            }
+            return cent;
+        }
+
+        static std::string partitionFile(const std::string& file, size_t p) {
+            return file + ".part" + std::to_string(p);
+        }
+
+        /* partitionRows - write the ids of the rows of every partition, in
+         * id order, to its partition file. A row goes to its two nearest
+         * partitions so that the partition graphs overlap.
+         */
+        template <class VecFn>
+        void partitionRows(const std::string& file,
+                           VecFn vec,
+                           size_t n,
+                           size_t nparts,
+                           int nthreads) {
+            std::vector<float> cent = partitionCentroids(vec, n, nparts, nthreads);
+
+            const size_t block = 1 << 20, bufLen = 1 << 16;
+            std::vector<int> fds;
+            std::vector<std::vector<tableint>> bufs(nparts);
+            std::vector<off_t> ofs(nparts, 0);
+            auto flush = [&](size_t p) {
+                Pwrite(fds[p],
+                       bufs[p].data(),
+                       bufs[p].size() * sizeof(tableint),
+                       ofs[p],
+                       partitionFile(file, p));
+                ofs[p] += bufs[p].size() * sizeof(tableint);
+                bufs[p].clear();
+            };
+
+            try {
+                for (size_t p = 0; p < nparts; p++)
+                    fds.push_back(Open(partitionFile(file, p),
+                                       O_WRONLY | O_CREAT | O_TRUNC,
+                                       0600));
+                std::vector<std::pair<uint32_t, uint32_t>> assign(
+                    std::min(block, n));
+                for (size_t start = 0; start < n; start += block) {
+                    size_t cnt = std::min(block, n - start);
+                    parallelFor(cnt, nthreads, [&](size_t i) {
+                        assign[i] = nearestTwo(
+                            (const float*)vec(start + i), cent, nparts);
+                    });
+                    for (size_t i = 0; i < cnt; i++) {
+                        bufs[assign[i].first].push_back(start + i);
+                        if (assign[i].second != assign[i].first)
+                            bufs[assign[i].second].push_back(start + i);
+                    }
+                    for (size_t p = 0; p < nparts; p++)
+                        if (bufs[p].size() >= bufLen)
+                            flush(p);
+                }
+                for (size_t p = 0; p < nparts; p++)
+                    if (bufs[p].size())
+                        flush(p);
+            } catch (...) {
+                for (int fd : fds)
+                    close(fd);
+                throw;
+            }
+            for (int fd : fds)
+                close(fd);
+        }
+
+        static std::vector<tableint> readPartition(const std::string& pfile) {
+            MappedFile m(pfile);
+            std::vector<tableint> ids(m.len / sizeof(tableint));
+            if (ids.size())
+                memcpy(ids.data(), m.data, ids.size() * sizeof(tableint));
+            return ids;
+        }
+
+        /* buildPartition - build the graph of the rows 'ids' in memory and
+         * merge it into their records in the index file 'fd'
+         */
+        template <class VecFn, class LabelFn>
+        void buildPartition(int fd,
+                            const std::vector<tableint>& ids,
+                            VecFn vec,
+                            LabelFn label,
+                            int nthreads) {
+            size_t m = ids.size();
+            std::vector<std::vector<tableint>> graph;
+            {
+                std::vector<char> local(m * data_size_);
+                parallelFor(m, nthreads, [&](size_t i) {
+                    memcpy(&local[i * data_size_], vec(ids[i]), data_size_);
+                });
+                auto lvec = [&](size_t id) -> const void* {
+                    return local.data() + id * data_size_;
+                };
+                graph = buildGraph(lvec, m, medoidOf(lvec, m, nthreads), nthreads);
+            }
+
+            parallelFor(m, nthreads, [&](size_t i) {
+                tableint u = ids[i];
+                std::vector<char> rec(node_len_);
+                Pread(fd, rec.data(), node_len_, nodeOffset(u), file_);
+                const tableint* nb = recNeighbours(rec.data());
+                std::vector<tableint> nbrs(nb, nb + recCount(rec.data()));
+                for (tableint j : graph[i])
+                    if (std::find(nbrs.begin(), nbrs.end(), ids[j]) == nbrs.end())
+                        nbrs.push_back(ids[j]);
+                if (nbrs.size() > R_) {
+                    std::vector<std::pair<float, tableint>> cand;
+                    for (tableint k : nbrs)
+                        cand.emplace_back(
+                            fstdistfunc_(vec(u), vec(k), dist_func_param_), k);
+                    nbrs = robustPrune(u, cand, alpha_, vec);
+                }
+                makeRecord(rec, vec(u), label(u), nbrs);
+                Pwrite(fd, rec.data(), node_len_, nodeOffset(u), file_);
+            });
+        }
+
+        /* buildGraph - Vamana graph of 'n' in-memory vectors: a random R/2
+         * regular start graph refined by a pass with alpha 1 and a pass with
+         * alpha_, searching from 'start'.
+         */
+        template <class VecFn>
+        std::vector<std::vector<tableint>> buildGraph(VecFn vec,
+                                                      size_t n,
+                                                      tableint start,
+                                                      int nthreads) {
+            std::vector<std::vector<tableint>> graph(n);
+            std::vector<std::mutex> locks(n);
+            std::mt19937 rng(100);
+            for (size_t i = 0; i < n; i++) {
+                size_t deg = std::min(n - 1, R_ / 2);
+                while (graph[i].size() < deg) {
+                    tableint j = rng() % n;
+                    if (j != i && std::find(graph[i].begin(),
+                                            graph[i].end(),
+                                            j) == graph[i].end())
+                        graph[i].push_back(j);
+                }
+            }
+
+            std::vector<tableint> order(n);
+            for (size_t i = 0; i < n; i++)
+                order[i] = i;
+            std::shuffle(order.begin(), order.end(), rng);
+
+            VisitedListPool visitedPool(1, n);
+
+            for (float alpha : {1.0f, alpha_}) {
+                parallelFor(n, nthreads, [&](size_t idx) {
+                    tableint p = order[idx];
+                    std::vector<std::pair<float, tableint>> visited;
+                    greedySearchMem(vec(p), start, graph, locks, vec,
+                                    visitedPool, visited);
+                    {
+                        std::unique_lock<std::mutex> l(locks[p]);
+                        for (tableint j : graph[p])
+                            visited.emplace_back(
+                                fstdistfunc_(vec(p), vec(j), dist_func_param_), j);
+                    }
+                    std::vector<tableint> nbrs =
+                        robustPrune(p, visited, alpha, vec);
+                    {
+                        std::unique_lock<std::mutex> l(locks[p]);
+                        graph[p] = nbrs;
+                    }
+                    for (tableint j : nbrs) {
+                        std::unique_lock<std::mutex> l(locks[j]);
+                        if (std::find(graph[j].begin(), graph[j].end(), p) !=
+                            graph[j].end())
+                            continue;
+                        if (graph[j].size() < R_) {
+                            graph[j].push_back(p);
+                            continue;
+                        }
+                        std::vector<std::pair<float, tableint>> cand;
+                        for (tableint k : graph[j])
+                            cand.emplace_back(
+                                fstdistfunc_(vec(j), vec(k), dist_func_param_), k);
+                        cand.emplace_back(
+                            fstdistfunc_(vec(j), vec(p), dist_func_param_), p);
+                        graph[j] = robustPrune(j, cand, alpha, vec);
+                    }
+                });
+            }
+            return graph;
+        }
+
+        /* greedySearchMem - build time search over the in-memory graph from
+         * 'start', returns all the expanded nodes with their distances.
+         */
+        template <class VecFn>
+        void greedySearchMem(const void* q,
+                             tableint start,
+                             const std::vector<std::vector<tableint>>& graph,
+                             std::vector<std::mutex>& locks,
+                             VecFn vec,
+                             VisitedListPool& visitedPool,
+                             std::vector<std::pair<float, tableint>>& expanded) {
+            VisitedList* vl = visitedPool.getFreeVisitedList();
+            vl_type* visited = vl->mass;
+            vl_type tag = vl->curV;
+
+            std::vector<std::pair<float, tableint>> list;
+            std::vector<bool> done;
+            list.emplace_back(fstdistfunc_(q, vec(start), dist_func_param_),
+                              start);
+            done.push_back(false);
+            visited[start] = tag;
+
+            std::vector<tableint> nbrs;
+            while (true) {
+                size_t k = 0;
+                while (k < list.size() && done[k])
+                    k++;
+                if (k == list.size())
+                    break;
+                done[k] = true;
+                tableint cur = list[k].second;
+                expanded.push_back(list[k]);
+                {
+                    std::unique_lock<std::mutex> l(locks[cur]);
+                    nbrs = graph[cur];
+                }
+                for (tableint j : nbrs) {
+                    if (visited[j] == tag)
+                        continue;
+                    visited[j] = tag;
+                    float d = fstdistfunc_(q, vec(j), dist_func_param_);
+                    if (list.size() >= L_build_ && d >= list.back().first)
+                        continue;
+                    auto pos = std::upper_bound(
+                        list.begin(), list.end(), std::make_pair(d, j));
+                    size_t at = pos - list.begin();
+                    list.insert(pos, std::make_pair(d, j));
+                    done.insert(done.begin() + at, false);
+                    if (list.size() > L_build_) {
+                        list.pop_back();
+                        done.pop_back();
+                    }
+                }
+            }
+            visitedPool.releaseVisitedList(vl);
+        }
+
+        void writeHeader(int fd, size_t npoints) {
+            std::vector<char> sector(SECTOR_LEN, 0);
+            FileHeader h;
+            h.magic = FILE_MAGIC;
+            h.version = FILE_VERSION;
+            h.dim = dim_;
+            h.data_size = data_size_;
+            h.npoints = npoints;
+            h.R = R_;
+            h.medoid = medoid_;
+            h.node_len = node_len_;
+            h.nodes_per_sector = nodes_per_sector_;
+            h.sectors_per_node = sectors_per_node_;
+            h.pq_m = pq_.m_;
+            memcpy(sector.data(), &h, sizeof(h));
+            Pwrite(fd, sector.data(), SECTOR_LEN, 0, file_);
+        }
+
+        /* PQ file : [m][dim][ncodes][centroids][codes]. A full write writes
+         * the codes of rows 0..npoints-1, a checkpoint only the new codes and
+         * the count. 'codes' holds the codes to write, from the first one.
+         */
+        void writePQFile(const std::string& file,
+                         bool full,
+                         const uint8_t* codes,
+                         size_t npoints) {
+            std::string pqfile = file + ".pq";
+            int fd = Open(pqfile, O_RDWR | O_CREAT | (full ? O_TRUNC : 0), 0600);
+            uint64_t hdr[3] = {pq_.m_, dim_, npoints};
+            off_t codesStart =
+                sizeof(hdr) + pq_.centroids_.size() * sizeof(float);
+            if (full) {
+                Pwrite(fd,
+                       pq_.centroids_.data(),
+                       pq_.centroids_.size() * sizeof(float),
+                       sizeof(hdr),
+                       pqfile);
+                disk_codes_ = 0;
+            }
+            size_t from = disk_codes_ * pq_.m_, to = npoints * pq_.m_;
+            if (to > from)
+                Pwrite(fd, codes, to - from, codesStart + from, pqfile);
+            Fsync(fd, pqfile);
+            Pwrite(fd, hdr, sizeof(hdr), 0, pqfile);  // count after the codes
+            Fsync(fd, pqfile);
+            close(fd);
+            disk_codes_ = npoints;
+        }
+
+        void readPQFile(const std::string& file) {
+            std::string pqfile = file + ".pq";
+            int fd = Open(pqfile, O_RDONLY);
+            uint64_t hdr[3];
+            Pread(fd, hdr, sizeof(hdr), 0, pqfile);
+            pq_.init(hdr[1], hdr[0]);
+            Pread(fd,
+                  pq_.centroids_.data(),
+                  pq_.centroids_.size() * sizeof(float),
+                  sizeof(hdr),
+                  pqfile);
+            size_t ncodes = std::min((size_t)hdr[2], disk_npoints_);
+            codes_.resize(ncodes * pq_.m_);
+            Pread(fd,
+                  codes_.data(),
+                  codes_.size(),
+                  sizeof(hdr) + pq_.centroids_.size() * sizeof(float),
+                  pqfile);
+            close(fd);
+            disk_codes_ = ncodes;
+        }
+
+        /* loadIndex - open the index for serving. Only the header, the PQ
+         * data and 'cache_nodes' records around the medoid are read.
+         */
+        void loadIndex(const std::string& file, size_t cache_nodes) {
+            file_ = file;
+            readHeader(file);  // layout is needed for recovery
+            makeIndexConsistent(file);
+            readHeader(file);
+
+            fd_ = Open(file, O_RDWR);
+#ifdef POSIX_FADV_RANDOM
+            posix_fadvise(fd_, 0, 0, POSIX_FADV_RANDOM);
+#endif
+            readPQFile(file);
+
+            /* Codes of a checkpoint interrupted before the PQ file write are
+             * rebuilt from the vectors on disk.
+             */
+            std::vector<char> rec(node_len_);
+            for (size_t id = disk_codes_; id < disk_npoints_; id++) {
+                Pread(fd_, rec.data(), node_len_, nodeOffset(id), file);
+                codes_.resize((id + 1) * pq_.m_);
+                pq_.encode((const float*)recVector(rec.data()),
+                           &codes_[id * pq_.m_]);
+            }
+            if (disk_codes_ < disk_npoints_)
+                writePQFile(file,
+                            false,
+                            codes_.data() + disk_codes_ * pq_.m_,
+                            disk_npoints_);
+
+            // BFS from the medoid for the node cache
+            std::queue<tableint> q;
+            if (disk_npoints_)
+                q.push(medoid_);
+            while (!q.empty() && cache_.size() < cache_nodes) {
+                tableint id = q.front();
+                q.pop();
+                if (cache_.count(id))
+                    continue;
+                std::vector<char>& r = cache_[id];
+                r.resize(node_len_);
+                Pread(fd_, r.data(), node_len_, nodeOffset(id), file);
+                const tableint* nb = recNeighbours(r.data());
+                for (uint32_t j = 0; j < recCount(r.data()); j++)
+                    q.push(nb[j]);
+            }
+        }
+
+        void readHeader(const std::string& file) {
+            std::vector<char> sector(SECTOR_LEN);
+            int fd = Open(file, O_RDONLY);
+            Pread(fd, sector.data(), SECTOR_LEN, 0, file);
+            close(fd);
+
+            FileHeader h;
+            memcpy(&h, sector.data(), sizeof(h));
+            if (h.magic != FILE_MAGIC || h.version != FILE_VERSION ||
+                h.data_size != data_size_)
+                throw std::runtime_error("Invalid DiskANN index header in " +
+                                         file);
+            dim_ = h.dim;
+            R_ = h.R;
+            setLayout();
+            medoid_ = (tableint)h.medoid;
+            disk_npoints_ = h.npoints;
+            npoints_ = h.npoints;
+        }
+
+        /* readNodes - fetch the records of 'ids'. In-memory records are used
+         * first; the sectors of the rest are sorted and read with one pread
+         * per contiguous run, so a beam step costs at most W reads.
+         */
+        void readNodes(const std::vector<tableint>& ids,
+                       std::vector<char>& buf,
+                       std::vector<const char*>& recs) {
+            recs.assign(ids.size(), nullptr);
+            std::vector<std::pair<off_t, size_t>> reads;  // (sector ofs, idx)
+            size_t span = nodes_per_sector_ ? SECTOR_LEN
+                                            : sectors_per_node_ * SECTOR_LEN;
+            for (size_t i = 0; i < ids.size(); i++) {
+                auto d = dirty_.find(ids[i]);
+                if (d != dirty_.end()) {
+                    recs[i] = d->second.data();
+                    continue;
+                }
+                d = flushing_.find(ids[i]);
+                if (d != flushing_.end()) {
+                    recs[i] = d->second.data();
+                    continue;
+                }
+                auto c = cache_.find(ids[i]);
+                if (c != cache_.end()) {
+                    recs[i] = c->second.data();
+                    continue;
+                }
+                off_t ofs = nodeOffset(ids[i]);
+                reads.emplace_back(ofs - (ofs % SECTOR_LEN), i);
+            }
+            if (reads.empty())
+                return;
+
+            std::sort(reads.begin(), reads.end());
+            std::vector<off_t> sectors;
+            for (auto& r : reads)
+                if (sectors.empty() || sectors.back() != r.first)
+                    sectors.push_back(r.first);
+            buf.resize(sectors.size() * span);
+
+            size_t run = 0;
+            for (size_t s = 1; s <= sectors.size(); s++) {
+                if (s < sectors.size() &&
+                    sectors[s] == sectors[s - 1] + (off_t)span)
+                    continue;
+                Pread(fd_,
+                      buf.data() + run * span,
+                      (s - run) * span,
+                      sectors[run],
+                      file_);
+                metric_disk_reads++;
+                run = s;
+            }
+
+            size_t si = 0;
+            for (auto& r : reads) {
+                while (sectors[si] != r.first)
+                    si++;
+                recs[r.second] = buf.data() + si * span +
+                                 (nodeOffset(ids[r.second]) - r.first);
+            }
+        }
+
+        /* beamSearch - DiskANN search. Candidates are ordered by PQ distance
+         * and the W best unexpanded ones are read from disk per step; the
+         * full vectors give the exact distances of the expanded nodes.
+         */
+        void beamSearch(const void* q,
+                        size_t L,
+                        size_t W,
+                        std::vector<std::pair<float, tableint>>& expanded,
+                        std::unordered_map<tableint, std::vector<char>>* records =
+                            nullptr,
+                        std::vector<labeltype>* labels = nullptr) {
+            tableint start = medoid_;
+            if (!npoints_ || start == INVALID_ID)
+                return;
+
+            std::vector<float> table(pq_.m_ * ProductQuantizer::KSUB);
+            pq_.computeTable((const float*)q, pq_ip_, table.data());
+
+            struct Candidate {
+                float dist;
+                tableint id;
+                bool done;
+            };
+            std::vector<Candidate> list;
+            std::unordered_set<tableint> visited;
+            list.push_back({0.0f, start, false});
+            visited.insert(start);
+
+            std::vector<tableint> beam;
+            std::vector<char> buf;
+            std::vector<const char*> recs;
+            L = std::max(L, (size_t)1);
+            W = std::max(W, (size_t)1);
+
+            while (true) {
+                beam.clear();
+                for (auto& c : list) {
+                    if (c.done)
+                        continue;
+                    c.done = true;
+                    beam.push_back(c.id);
+                    if (beam.size() == W)
+                        break;
+                }
+                if (beam.empty())
+                    break;
+
+                readNodes(beam, buf, recs);
+
+                for (size_t b = 0; b < beam.size(); b++) {
+                    const char* rec = recs[b];
+                    expanded.emplace_back(
+                        fstdistfunc_(q, recVector(rec), dist_func_param_),
+                        beam[b]);
+                    if (labels)
+                        labels->push_back(recLabel(rec));
+                    if (records)
+                        (*records)[beam[b]].assign(rec, rec + node_len_);
+
+                    const tableint* nb = recNeighbours(rec);
+                    for (uint32_t j = 0; j < recCount(rec); j++) {
+                        tableint id = nb[j];
+                        if (id >= npoints_ || !visited.insert(id).second)
+                            continue;
+                        float d = pq_.distance(table.data(),
+                                               &codes_[(size_t)id * pq_.m_]);
+                        if (list.size() >= L && d >= list.back().dist)
+                            continue;
+                        auto pos = std::upper_bound(
+                            list.begin(),
+                            list.end(),
+                            d,
+                            [](float v, const Candidate& c) { return v < c.dist; });
+                        list.insert(pos, {d, id, false});
+                        if (list.size() > L)
+                            list.pop_back();
+                    }
+                }
+            }
+        }
+
+        std::priority_queue<std::pair<float, labeltype>> searchKnn(
+            const void* q, size_t k, size_t L, size_t W) {
+            std::shared_lock<std::shared_mutex> l(lock_);
+            std::vector<std::pair<float, tableint>> expanded;
+            std::vector<labeltype> labels;
+            beamSearch(q, std::max(L, k), W, expanded, nullptr, &labels);
+
+            std::priority_queue<std::pair<float, labeltype>> result;
+            for (size_t i = 0; i < expanded.size(); i++) {
+                if (result.size() < k)
+                    result.emplace(expanded[i].first, labels[i]);
+                else if (expanded[i].first < result.top().first) {
+                    result.pop();
+                    result.emplace(expanded[i].first, labels[i]);
+                }
+            }
+            return result;
+        }
+
+        /* addPoint - online insert (FreshDiskANN style). The new node and
+         * the neighbours that get a back edge are kept in dirty_ until the
+         * next checkpoint writes them to disk. Inserts run one at a time;
+         * the beam search and pruning, which read from disk, hold lock_
+         * shared so that searches go on, and lock_ is held exclusively only
+         * to publish the new records.
+         */
+        void addPoint(const void* vec, labeltype label) {
+            std::unique_lock<std::mutex> il(insert_lock_);
+
+            tableint id = npoints_;
+            std::vector<uint8_t> code(pq_.m_);
+            pq_.encode((const float*)vec, code.data());
+
+            std::vector<char> rec;
+            std::unordered_map<tableint, std::vector<char>> records;
+            std::vector<tableint> nbrs;
+            if (medoid_ == INVALID_ID) {
+                makeRecord(rec, vec, label, {});
+            } else {
+                std::shared_lock<std::shared_mutex> l(lock_);
+                std::vector<std::pair<float, tableint>> expanded;
+                beamSearch(vec, L_build_, 4, expanded, &records);
+
+                auto vecOf = [&](tableint v) -> const void* {
+                    if (v == id)
+                        return vec;
+                    auto r = records.find(v);
+                    if (r == records.end()) {
+                        std::vector<char> buf;
+                        std::vector<const char*> recs;
+                        readNodes({v}, buf, recs);
+                        r = records
+                                .emplace(v, std::vector<char>(
+                                                recs[0], recs[0] + node_len_))
+                                .first;
+                    }
+                    return recVector(r->second.data());
+                };
+
+                nbrs = robustPrune(id, expanded, alpha_, vecOf);
+                makeRecord(rec, vec, label, nbrs);
+
+                for (tableint j : nbrs) {
+                    vecOf(j);
+                    std::vector<char> nrec = records[j];
+                    const tableint* nb = recNeighbours(nrec.data());
+                    std::vector<tableint> jn(nb, nb + recCount(nrec.data()));
+                    if (std::find(jn.begin(), jn.end(), id) == jn.end()) {
+                        if (jn.size() < R_) {
+                            jn.push_back(id);
+                        } else {
+                            std::vector<std::pair<float, tableint>> cand;
+                            const void* jv = recVector(nrec.data());
+                            for (tableint k : jn)
+                                cand.emplace_back(
+                                    fstdistfunc_(jv, vecOf(k), dist_func_param_),
+                                    k);
+                            cand.emplace_back(
+                                fstdistfunc_(jv, vec, dist_func_param_), id);
+                            jn = robustPrune(j, cand, alpha_, vecOf);
+                        }
+                    }
+                    setNeighbours(nrec, jn);
+                    records[j] = nrec;
+                }
+            }
+
+            /* Nothing read above has changed since: other inserts wait on
+             * insert_lock_ and a checkpoint only moves records to flushing_.
+             */
+            std::unique_lock<std::shared_mutex> l(lock_);
+            codes_.resize(((size_t)id + 1) * pq_.m_);
+            memcpy(&codes_[(size_t)id * pq_.m_], code.data(), pq_.m_);
+            dirty_[id] = std::move(rec);
+            for (tableint j : nbrs) {
+                dirty_[j] = std::move(records[j]);
+                cache_.erase(j);
+            }
+            if (medoid_ == INVALID_ID)
+                medoid_ = id;
+            npoints_++;
+        }
+
+        size_t getDirtyCount() {
+            std::shared_lock<std::shared_mutex> l(lock_);
+            return dirty_.size();
+        }
+
+        size_t getCachedCount() {
+            std::shared_lock<std::shared_mutex> l(lock_);
+            return cache_.size();
+        }
+
+        /* doCheckPoint - Incremental persistence of the online inserts, same
+         * two pass protocol as hnswdisk.i :-
+         * Pass 1 - dirty records are journaled to <index>.ckpt.state
+         * Pass 2 - records are written in place, then header & PQ codes.
+         * An interrupted pass 2 is replayed from the journal on load.
+         * The dirty records are moved to flushing_ under a short exclusive
+         * lock_ and written out without it; searches read them from
+         * flushing_ until they are on disk and inserts go on into dirty_.
+         */
+        void doCheckPoint(const std::string& file) {
+            std::unique_lock<std::mutex> cl(checkpoint_lock_);
+            size_t npoints;
+            std::vector<uint8_t> newCodes;
+            {
+                std::unique_lock<std::shared_mutex> l(lock_);
+                flushing_.swap(dirty_);
+                npoints = npoints_;
+                newCodes.assign(codes_.begin() + disk_codes_ * pq_.m_,
+                                codes_.begin() + npoints * pq_.m_);
+            }
+            if (flushing_.empty()) {
+                WriteCheckPointStatus(file, CKPT_BEGIN_INCR_PASS1);
+                setCheckPointComplete(file);
+                return;
+            }
+
+            std::string journal = file + ".ckpt.state";
+            try {
+                WriteCheckPointStatus(file, CKPT_BEGIN_INCR_PASS1);
+                int jfd = Open(journal, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+                std::vector<char> jbuf;
+                uint64_t hdr[2] = {npoints, flushing_.size()};
+                jbuf.insert(jbuf.end(), (char*)hdr, (char*)hdr + sizeof(hdr));
+                for (auto& d : flushing_) {
+                    uint64_t nid = d.first;
+                    jbuf.insert(jbuf.end(), (char*)&nid, (char*)&nid + sizeof(nid));
+                    jbuf.insert(jbuf.end(), d.second.begin(), d.second.end());
+                }
+                Pwrite(jfd, jbuf.data(), jbuf.size(), 0, journal);
+                Fsync(jfd, journal);
+                close(jfd);
+                WriteCheckPointStatus(file, CKPT_END_INCR_PASS1);
+
+                WriteCheckPointStatus(file, CKPT_BEGIN_INCR_PASS2);
+                applyJournal(file);
+                writePQFile(file, false, newCodes.data(), npoints);
+                WriteCheckPointStatus(file, CKPT_END_INCR_PASS2);
+                setCheckPointComplete(file);
+                unlink(journal.c_str());
+            } catch (...) {
+                /* back to dirty_ for the next checkpoint, unless an insert
+                 * has changed them since
+                 */
+                std::unique_lock<std::shared_mutex> l(lock_);
+                for (auto& f : flushing_)
+                    dirty_.emplace(f.first, std::move(f.second));
+                flushing_.clear();
+                throw;
+            }
+
+            std::unique_lock<std::shared_mutex> l(lock_);
+            flushing_.clear();
+        }
+
+        /* applyJournal - write the journaled records in place and update
+         * the header. Idempotent, used by both checkpoint and recovery.
+         */
+        void applyJournal(const std::string& file) {
+            std::string journal = file + ".ckpt.state";
+            int jfd = Open(journal, O_RDONLY);
+            uint64_t hdr[2];
+            Pread(jfd, hdr, sizeof(hdr), 0, journal);
+
+            FileHeader h;
+            std::vector<char> sector(SECTOR_LEN);
+            int fd = Open(file, O_RDWR);
+            Pread(fd, sector.data(), SECTOR_LEN, 0, file);
+            memcpy(&h, sector.data(), sizeof(h));
+            size_t node_len = h.node_len;
+
+            std::vector<char> rec(sizeof(uint64_t) + node_len);
+            off_t jofs = sizeof(hdr);
+            for (uint64_t i = 0; i < hdr[1]; i++) {
+                Pread(jfd, rec.data(), rec.size(), jofs, journal);
+                jofs += rec.size();
+                uint64_t nid;
+                memcpy(&nid, rec.data(), sizeof(nid));
+                Pwrite(fd,
+                       rec.data() + sizeof(nid),
+                       node_len,
+                       nodeOffset(nid),
+                       file);
+            }
+
+            /* pad the file to a whole sector */
+            size_t fsize = fileSize(hdr[0]);
+            if ((size_t)lseek(fd, 0, SEEK_END) < fsize) {
+                char zero = 0;
+                Pwrite(fd, &zero, 1, fsize - 1, file);
+            }
+            Fsync(fd, file);
+
+            h.npoints = hdr[0];
+            if (medoid_ != INVALID_ID)
+                h.medoid = medoid_;
+            memcpy(sector.data(), &h, sizeof(h));
+            Pwrite(fd, sector.data(), SECTOR_LEN, 0, file);
+            Fsync(fd, file);
+            close(fd);
+            close(jfd);
+            disk_npoints_ = hdr[0];
+        }
+
+        /* Checkpoint status file - two 256 byte records, the current and the
+         * last consistent checkpoint, as in hnswdisk.i.
+         */
+        void WriteCheckPointStatus(const std::string& file,
+                                   CheckPointState status) {
+            std::string statusFileName = file + ".status";
+            char buf[512];
+            memset(buf, '.', sizeof(buf));
+
+            int fd = open(statusFileName.c_str(), O_RDWR);
+            if (fd == -1) {
+                fd = Open(statusFileName, O_RDWR | O_CREAT | O_TRUNC, 0600);
+                Pwrite(fd, buf, sizeof(buf), 0, statusFileName);
+            }
+            Pread(fd, buf, sizeof(buf), 0, statusFileName);
+
+            if (status == CKPT_BEGIN_INCR_PASS1 ||
+                status == CKPT_BEGIN_FULL_WRITE)
+                memcpy(&buf[256], &buf[0], 256);  // stash the current ckpt
+
+            struct timeval tv;
+            gettimeofday(&tv, nullptr);
+            char* ts = ctime((const time_t*)&tv.tv_sec);
+            std::string tstr(ts, strlen(ts) - 1);
+
+            std::stringstream ss;
+            ss << "time=" << tstr << ",ts=" << tv.tv_sec << ":" << tv.tv_usec
+               << ",ckptid=" << checkPointId_ << ",status=" << status << "|";
+
+            memset(&buf[0], '.', 256);
+            memcpy(buf, ss.str().c_str(), std::min((size_t)255, ss.str().length()));
+
+            Pwrite(fd, buf, sizeof(buf), 0, statusFileName);
+            Fsync(fd, statusFileName);
+            close(fd);
+        }
+
+        void setCheckPointComplete(const std::string& file) {
+            WriteCheckPointStatus(file, CKPT_CONSISTENT);
+        }
+
+        void setCheckPointId(const std::string& ckid = "") {
+            checkPointId_ = ckid;
+        }
+
+        std::string getCheckPointId() { return checkPointId_; }
+
+        static void readStatusRecord(const char* rec,
+                                     CheckPointState& cs,
+                                     std::string& ckptid) {
+            std::string logr(rec, 256);
+            logr = logr.substr(0, logr.find('|'));
+            MyVectorOptions vo(logr);
+            cs = static_cast<CheckPointState>(atoi(vo.getOption("status").c_str()));
+            ckptid = vo.getOption("ckptid");
+        }
+
+        /* makeIndexConsistent - crash recovery at load. See the table of
+         * states in hnswdisk.i.
+         */
+        void makeIndexConsistent(const std::string& file) {
+            std::string statusFileName = file + ".status";
+            char buf[512];
+            int fd = Open(statusFileName, O_RDONLY);
+            Pread(fd, buf, sizeof(buf), 0, statusFileName);
+            close(fd);
+
+            CheckPointState cs, cs2;
+            std::string ckptid, ckptid2;
+            readStatusRecord(buf, cs, ckptid);
+            readStatusRecord(buf + 256, cs2, ckptid2);
+
+            std::string journal = file + ".ckpt.state";
+            switch (cs) {
+                case CKPT_CONSISTENT:
+                    setCheckPointId(ckptid);
+                    break;
+                case CKPT_BEGIN_FULL_WRITE:
+                    error_print("DiskANN index %s was not saved completely, "
+                                "it needs to be rebuilt.",
+                                file.c_str());
+                    deleteIndexFiles(file);
+                    throw std::runtime_error("Incomplete DiskANN index " + file);
+                case CKPT_BEGIN_INCR_PASS1:
+                case CKPT_END_INCR_PASS1:
+                    warning_print("Checkpoint of DiskANN index %s was "
+                                  "interrupted, rolling back.",
+                                  file.c_str());
+                    unlink(journal.c_str());
+                    setCheckPointId(ckptid2);
+                    setCheckPointComplete(file);
+                    break;
+                case CKPT_BEGIN_INCR_PASS2:
+                    warning_print("Checkpoint of DiskANN index %s was "
+                                  "interrupted, replaying the journal.",
+                                  file.c_str());
+                    setCheckPointId(ckptid);
+                    applyJournal(file);
+                    setCheckPointComplete(file);
+                    unlink(journal.c_str());
+                    break;
+                default:
+                    setCheckPointId(ckptid);
+                    setCheckPointComplete(file);
+                    break;
+            }
+        }
+
+        static void deleteIndexFiles(const std::string& file) {
+            unlink(file.c_str());
+            unlink((file + ".pq").c_str());
+            unlink((file + ".status").c_str());
+            unlink((file + ".ckpt.state").c_str());
+            unlink((file + ".build").c_str());
+            unlink((file + ".build.labels").c_str());
+        }
+    };
+
+}  // namespace hnswlib
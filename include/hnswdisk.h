@@ -1,22 +1,35 @@
 #pragma once
 
 #include <assert.h>
+#include <limits.h>
 #include <stdlib.h>
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
 #include <list>
 #include <map>
 #include <memory>
 #include <random>
 #include <set>
+#include <shared_mutex>
 #include <sstream>
+#include <thread>
 #include <unordered_set>
 
 #include "hnswlib.h"
+#include "crc32c.h"
 #include "myvectorutils.h"
 #include "visited_list_pool.h"
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 namespace hnswlib {
@@ -92,9 +105,16 @@ namespace hnswlib {
                             const std::string& location,
                             bool nmslib = false,
                             size_t max_elements = 0,
-                            bool allow_replace_deleted = false)
+                            bool allow_replace_deleted = false,
+                            bool use_mmap = false,
+                            size_t load_threads = 1)
             : allow_replace_deleted_(allow_replace_deleted) {
-            loadIndex(location, s, max_elements);
+            if (use_mmap && !isCompactIndexFile(location))
+                loadIndexMmap(location, s);
+            else
+                loadIndex(location, s, max_elements, load_threads);
+            replayDeltaLogs(location);
+            loadHeatMap(location);
         }
 
         HierarchicalDiskNSW(SpaceInterface<dist_t>* s,
@@ -108,6 +128,8 @@ namespace hnswlib {
               element_levels_(max_elements),
               allow_replace_deleted_(allow_replace_deleted) {
             max_elements_ = max_elements;
+            resizeDirtyMaps(max_elements_);
+            resizeHeatMap(max_elements_);
             num_deleted_ = 0;
             data_size_ = s->get_data_size();
             fstdistfunc_ = s->get_dist_func();
@@ -182,12 +204,23 @@ namespace hnswlib {
         ~HierarchicalDiskNSW() { clear(); }
 
         void clear() {
-            free(data_level0_memory_);
+            if (m_deltaCompactor.joinable())
+                m_deltaCompactor.join();
+            if (m_level0Map) {
+                munmap(m_level0Map, m_level0MapSize);
+                m_level0Map = nullptr;
+            } else {
+                free(data_level0_memory_);
+            }
             data_level0_memory_ = nullptr;
             for (tableint i = 0; i < cur_element_count; i++) {
-                if (element_levels_[i] > 0)
+                if (element_levels_[i] > 0 && !isMappedLinkList(linkLists_[i]))
                     free(linkLists_[i]);
             }
+            if (m_linksMap) {
+                munmap(m_linksMap, m_linksMapSize);
+                m_linksMap = nullptr;
+            }
             free(linkLists_);
             linkLists_ = nullptr;
             cur_element_count = 0;
@@ -248,7 +281,14 @@ namespace hnswlib {
 
         size_t getCurrentElementCount() { return cur_element_count; }
 
-        size_t getDeletedCount() { return num_deleted_; }
+        /* getDeletedCount - deleted elements. A mmap loaded index counts
+         * them while building its label lookup, on the first label based
+         * operation; until then isDeletedCountKnown() is false and 0 is
+         * returned, the count is not worth faulting in every page.
+         */
+        size_t getDeletedCount() const { return num_deleted_; }
+
+        bool isDeletedCountKnown() const { return !m_labelLookupPending; }
 
         std::priority_queue<std::pair<dist_t, tableint>,
                             std::vector<std::pair<dist_t, tableint>>,
@@ -422,6 +462,7 @@ namespace hnswlib {
                 candidate_set.pop();
 
                 tableint current_node_id = current_node_pair.second;
+                recordHeat(current_node_id);
                 int* data = (int*)get_linklist0(current_node_id);
                 size_t size = getListCount((linklistsizeint*)data);
                 //                bool cur_node_deleted =
@@ -659,8 +700,6 @@ namespace hnswlib {
             // MyVector HNSW Recovery - record this new/updated Node
             addNodeToFlushList(cur_c);
 
-            std::set<tableint> linksSet1, linksSet2;
-
             for (size_t idx = 0; idx < selectedNeighbors.size(); idx++) {
                 std::unique_lock<std::mutex> lock(
                     link_list_locks_[selectedNeighbors[idx]]);
@@ -755,21 +794,18 @@ namespace hnswlib {
                     }
                     // MyVector HNSW Recovery - record this link updated node
                     if (level == 0)
-                        // addNodeLinksLevel0ToFlushList(neighbourId);
-                        linksSet1.insert(neighbourId);
+                        addNodeLinksLevel0ToFlushList(neighbourId);
                     else
-                        linksSet2.insert(neighbourId);
-                    // addNodeLinksLevelGt0ToFlushList(neighbourId, level);
+                        addNodeLinksLevelGt0ToFlushList(neighbourId, level);
                 }  // if reverse links update from neighbours
             }  // for all new node neighbours
 
-            addNodeLinksLevel0ToFlushList(linksSet1);
-            addNodeLinksLevelGt0ToFlushList(linksSet2, 100);
-
             return next_closest_entry_point;
         }
 
         void resizeIndex(size_t new_max_elements) {
+            if (m_level0Map)
+                throw std::runtime_error("Cannot resize a mmap loaded index");
             if (new_max_elements < cur_element_count)
                 throw std::runtime_error(
                     "Cannot resize, max element is less than the "
@@ -780,6 +816,8 @@ namespace hnswlib {
             element_levels_.resize(new_max_elements);
 
             std::vector<std::mutex>(new_max_elements).swap(link_list_locks_);
+            resizeDirtyMaps(new_max_elements);
+            resizeHeatMap(new_max_elements);
 
             // Reallocate base layer
             char* data_level0_memory_new = (char*)realloc(
@@ -804,6 +842,7 @@ namespace hnswlib {
 
         template <typename data_t>
         std::vector<data_t> getDataByLabel(labeltype label) const {
+            ensureLabelLookup();
             // lock all operations with element by label
             std::unique_lock<std::mutex> lock_label(getLabelOpMutex(label));
 
@@ -832,6 +871,8 @@ namespace hnswlib {
          * the current graph.
          */
         void markDelete(labeltype label) {
+            ensureLabelLookup();
+            auto epoch = enterEpoch();
             // lock all operations with element by label
             std::unique_lock<std::mutex> lock_label(getLabelOpMutex(label));
 
@@ -857,6 +898,7 @@ namespace hnswlib {
                 unsigned char* ll_cur =
                     ((unsigned char*)get_linklist0(internalId)) + 2;
                 *ll_cur |= DELETE_MARK;
+                addNodeLinksLevel0ToFlushList(internalId);
                 num_deleted_ += 1;
                 if (allow_replace_deleted_) {
                     std::unique_lock<std::mutex> lock_deleted_elements(
@@ -878,6 +920,8 @@ namespace hnswlib {
          * completely removed by addPoint
          */
         void unmarkDelete(labeltype label) {
+            ensureLabelLookup();
+            auto epoch = enterEpoch();
             // lock all operations with element by label
             std::unique_lock<std::mutex> lock_label(getLabelOpMutex(label));
 
@@ -901,6 +945,7 @@ namespace hnswlib {
                 unsigned char* ll_cur =
                     ((unsigned char*)get_linklist0(internalId)) + 2;
                 *ll_cur &= ~DELETE_MARK;
+                addNodeLinksLevel0ToFlushList(internalId);
                 num_deleted_ -= 1;
                 if (allow_replace_deleted_) {
                     std::unique_lock<std::mutex> lock_deleted_elements(
@@ -939,18 +984,39 @@ namespace hnswlib {
         void addPoint(const void* data_point,
                       labeltype label,
                       bool replace_deleted = false) {
+            addPointCounted(data_point, label, replace_deleted);
+        }
+
+        /*
+         * MyVector - addPoint() that returns true if the label was not a live
+         * element before, i.e. the index has one more live row. Replacing
+         * the vector of a live label returns false.
+         */
+        bool addPointCounted(const void* data_point,
+                             labeltype label,
+                             bool replace_deleted = false) {
             if ((allow_replace_deleted_ == false) &&
                 (replace_deleted == true)) {
                 throw std::runtime_error(
                     "Replacement of deleted elements is disabled in "
                     "constructor");
             }
+            ensureLabelLookup();
+            // checkpoint epoch, see snapshotJournal()
+            auto epoch = enterEpoch();
 
             // lock all operations with element by label
             std::unique_lock<std::mutex> lock_label(getLabelOpMutex(label));
+            bool live = false;
+            {
+                std::unique_lock<std::mutex> lock_table(label_lookup_lock);
+                auto search = label_lookup_.find(label);
+                live = search != label_lookup_.end() &&
+                       !isMarkedDeleted(search->second);
+            }
             if (!replace_deleted) {
                 addPoint(data_point, label, -1);
-                return;
+                return !live;
             }
             // check if there is vacant place
             tableint internal_id_replaced;
@@ -982,6 +1048,7 @@ namespace hnswlib {
                 unmarkDeletedInternal(internal_id_replaced);
                 updatePoint(data_point, internal_id_replaced, 1.0);
             }
+            return !live;
         }
 
         void updatePoint(const void* dataPoint,
@@ -989,7 +1056,12 @@ namespace hnswlib {
                          float updateNeighborProbability) {
             // update the feature vector associated with existing point with new
             // vector
-            memcpy(getDataByInternalId(internalId), dataPoint, data_size_);
+            {
+                std::unique_lock<std::mutex> lock(link_list_locks_[internalId]);
+                memcpy(getDataByInternalId(internalId), dataPoint, data_size_);
+            }
+            // MyVector HNSW Recovery - the new vector goes to the next checkpoint
+            addNodeToFlushList(internalId);
 
             int maxLevelCopy = maxlevel_;
             tableint entryPointCopy = enterpoint_node_;
@@ -1076,6 +1148,11 @@ namespace hnswlib {
                             candidates.pop();
                         }
                     }
+                    // MyVector HNSW Recovery - record this link updated node
+                    if (layer == 0)
+                        addNodeLinksLevel0ToFlushList(neigh);
+                    else
+                        addNodeLinksLevelGt0ToFlushList(neigh, layer);
                 }
             }
 
@@ -1184,6 +1261,7 @@ namespace hnswlib {
         }
 
         tableint addPoint(const void* data_point, labeltype label, int level) {
+            ensureLabelLookup();
             tableint cur_c = 0;
             {
                 // Checking if the element with the same label already exists
@@ -1332,6 +1410,19 @@ namespace hnswlib {
             const void* query_data,
             size_t k,
             BaseFilterFunctor* isIdAllowed = nullptr) const {
+            return searchKnnEf(query_data, k, ef_, isIdAllowed);
+        }
+
+        /* searchKnnEf - searchKnn() with this search's own ef instead of
+         * the ef_ of the index. A stop_condition replaces the ef bound of
+         * the level 0 search (see BudgetSearchStopCondition).
+         */
+        std::priority_queue<std::pair<dist_t, labeltype>> searchKnnEf(
+            const void* query_data,
+            size_t k,
+            size_t ef,
+            BaseFilterFunctor* isIdAllowed = nullptr,
+            BaseSearchStopCondition<dist_t>* stop_condition = nullptr) const {
             std::priority_queue<std::pair<dist_t, labeltype>> result;
             if (cur_element_count == 0)
                 return result;
@@ -1374,13 +1465,17 @@ namespace hnswlib {
                                 std::vector<std::pair<dist_t, tableint>>,
                                 CompareByFirst>
                 top_candidates;
-            bool bare_bone_search = !num_deleted_ && !isIdAllowed;
+            bool bare_bone_search = !num_deleted_ && !m_labelLookupPending &&
+                                    !isIdAllowed && !stop_condition;
             if (bare_bone_search) {
                 top_candidates = searchBaseLayerST<true>(
-                    currObj, query_data, std::max(ef_, k), isIdAllowed);
+                    currObj, query_data, std::max(ef, k), isIdAllowed);
             } else {
-                top_candidates = searchBaseLayerST<false>(
-                    currObj, query_data, std::max(ef_, k), isIdAllowed);
+                top_candidates = searchBaseLayerST<false>(currObj,
+                                                          query_data,
+                                                          std::max(ef, k),
+                                                          isIdAllowed,
+                                                          stop_condition);
             }
 
             while (top_candidates.size() > k) {
@@ -1456,6 +1551,294 @@ namespace hnswlib {
             return result;
         }
 
+        /* MyVector sharded build : appendShard() copies a fully built,
+         * independent sub-graph into this index at internal id offset
+         * 'base'. Both graphs must have been created with the same space and
+         * M/ef parameters so that the element layout is identical.
+         */
+        void appendShard(const HierarchicalDiskNSW<dist_t>& shard,
+                         tableint base) {
+            size_t n = shard.cur_element_count;
+            if (shard.size_data_per_element_ != size_data_per_element_ ||
+                shard.size_links_per_element_ != size_links_per_element_)
+                throw std::runtime_error("Shard layout mismatch");
+            if (base + n > max_elements_)
+                throw std::runtime_error(
+                    "The number of elements exceeds the specified limit");
+
+            memcpy(data_level0_memory_ + base * size_data_per_element_,
+                   shard.data_level0_memory_,
+                   n * size_data_per_element_);
+
+            for (tableint i = 0; i < n; i++) {
+                tableint id = base + i;
+                linklistsizeint* ll = get_linklist0(id);
+                tableint* data = (tableint*)(ll + 1);
+                for (size_t j = 0; j < getListCount(ll); j++)
+                    data[j] += base;
+
+                element_levels_[id] = shard.element_levels_[i];
+                linkLists_[id] = nullptr;
+                if (element_levels_[id] > 0) {
+                    size_t sz = size_links_per_element_ * element_levels_[id] + 1;
+                    linkLists_[id] = (char*)malloc(sz);
+                    if (linkLists_[id] == nullptr)
+                        throw std::runtime_error(
+                            "Not enough memory: appendShard failed to allocate "
+                            "linklist");
+                    memcpy(linkLists_[id], shard.linkLists_[i], sz);
+                    for (int level = 1; level <= element_levels_[id]; level++) {
+                        ll = get_linklist(id, level);
+                        data = (tableint*)(ll + 1);
+                        for (size_t j = 0; j < getListCount(ll); j++)
+                            data[j] += base;
+                    }
+                }
+                label_lookup_[getExternalLabel(id)] = id;
+                if (isMarkedDeleted(id))
+                    num_deleted_ += 1;
+            }
+
+            if (n && ((signed)enterpoint_node_ == -1 ||
+                      shard.maxlevel_ > maxlevel_)) {
+                enterpoint_node_ = base + shard.enterpoint_node_;
+                maxlevel_ = shard.maxlevel_;
+            }
+            cur_element_count += n;
+        }
+
+        /* searchLayerFromTop - greedy descent from the entry point down to
+         * 'layer', followed by an ef_construction_ bounded search of that
+         * layer. Returns internal ids of this graph.
+         */
+        std::priority_queue<std::pair<dist_t, tableint>,
+                            std::vector<std::pair<dist_t, tableint>>,
+                            CompareByFirst>
+        searchLayerFromTop(const void* data_point, int layer) {
+            tableint currObj = enterpoint_node_;
+            dist_t curdist = fstdistfunc_(
+                data_point, getDataByInternalId(currObj), dist_func_param_);
+            for (int level = maxlevel_; level > layer; level--) {
+                bool changed = true;
+                while (changed) {
+                    changed = false;
+                    linklistsizeint* data = get_linklist(currObj, level);
+                    int size = getListCount(data);
+                    tableint* datal = (tableint*)(data + 1);
+                    for (int i = 0; i < size; i++) {
+                        tableint cand = datal[i];
+                        dist_t d = fstdistfunc_(data_point,
+                                                getDataByInternalId(cand),
+                                                dist_func_param_);
+                        if (d < curdist) {
+                            curdist = d;
+                            currObj = cand;
+                            changed = true;
+                        }
+                    }
+                }
+            }
+            return searchBaseLayer(currObj, data_point, layer);
+        }
+
+        /* crossLinkShards - Merge step of the sharded build. The neighbour
+         * list of 'id' at 'level' is recomputed from its current (same
+         * shard) neighbours plus the nearest elements found by a bounded
+         * search in every other shard. Only the list of 'id' is written, so
+         * the caller can run this for all elements in parallel.
+         */
+        void crossLinkShards(
+            tableint id,
+            int level,
+            const std::vector<HierarchicalDiskNSW<dist_t>*>& shards,
+            const std::vector<tableint>& bases) {
+            std::priority_queue<std::pair<dist_t, tableint>,
+                                std::vector<std::pair<dist_t, tableint>>,
+                                CompareByFirst>
+                candidates;
+            std::unordered_set<tableint> seen;
+            const void* data_point = getDataByInternalId(id);
+
+            linklistsizeint* ll = get_linklist_at_level(id, level);
+            tableint* data = (tableint*)(ll + 1);
+            for (size_t j = 0; j < getListCount(ll); j++) {
+                if (seen.insert(data[j]).second)
+                    candidates.emplace(
+                        fstdistfunc_(data_point,
+                                     getDataByInternalId(data[j]),
+                                     dist_func_param_),
+                        data[j]);
+            }
+
+            for (size_t s = 0; s < shards.size(); s++) {
+                HierarchicalDiskNSW<dist_t>* shard = shards[s];
+                if (!shard->cur_element_count || shard->maxlevel_ < level)
+                    continue;
+                if (id >= bases[s] && id < bases[s] + shard->cur_element_count)
+                    continue;  // own shard, links are already present
+
+                auto top = shard->searchLayerFromTop(data_point, level);
+                while (!top.empty()) {
+                    tableint cand = top.top().second + bases[s];
+                    if (seen.insert(cand).second)
+                        candidates.emplace(top.top().first, cand);
+                    top.pop();
+                }
+            }
+
+            getNeighborsByHeuristic2(candidates, level ? maxM_ : maxM0_);
+
+            size_t sz = candidates.size();
+            setListCount(ll, sz);
+            for (size_t idx = 0; idx < sz; idx++) {
+                data[idx] = candidates.top().second;
+                candidates.pop();
+            }
+        }
+
+        /* MyVector compaction : compactCopyElements() copies the live (not
+         * deleted) elements among the first 'n' into 'dst', an empty index
+         * created with the same space and M/ef parameters. Live elements get
+         * dense internal ids in their original order; newIds[old] is the new
+         * id or INVALID_ID for deleted elements. Neighbour lists are copied
+         * as is and must be rewritten with compactRepairLinks(). Returns the
+         * number of bytes held by the dropped elements. Online inserts may
+         * run meanwhile, each element is read under its link_list_locks_.
+         */
+        static constexpr tableint INVALID_ID = (tableint)-1;
+
+        size_t compactCopyElements(HierarchicalDiskNSW<dist_t>& dst,
+                                   size_t n,
+                                   std::vector<tableint>& newIds) {
+            if (dst.size_data_per_element_ != size_data_per_element_ ||
+                dst.size_links_per_element_ != size_links_per_element_)
+                throw std::runtime_error("Compaction layout mismatch");
+
+            size_t reclaimed = 0;
+            tableint next = 0;
+            int newMaxLevel = -1;
+            tableint newEnterPoint = INVALID_ID;
+
+            newIds.assign(n, INVALID_ID);
+            for (tableint i = 0; i < n; i++) {
+                if (isMarkedDeleted(i)) {
+                    reclaimed += size_data_per_element_;
+                    if (element_levels_[i] > 0)
+                        reclaimed += size_links_per_element_ * element_levels_[i] + 1;
+                    continue;
+                }
+                tableint id = next++;
+                newIds[i] = id;
+                {
+                    std::unique_lock<std::mutex> lock(link_list_locks_[i]);
+                    memcpy(dst.data_level0_memory_ + id * size_data_per_element_,
+                           data_level0_memory_ + i * size_data_per_element_,
+                           size_data_per_element_);
+                }
+                /* deleted since the check above, the delete is replayed */
+                *((unsigned char*)dst.get_linklist0(id) + 2) &= ~DELETE_MARK;
+                dst.element_levels_[id] = element_levels_[i];
+                dst.linkLists_[id] = nullptr;
+                if (element_levels_[i] > 0) {
+                    size_t sz = size_links_per_element_ * element_levels_[i] + 1;
+                    dst.linkLists_[id] = (char*)malloc(sz);
+                    if (dst.linkLists_[id] == nullptr)
+                        throw std::runtime_error(
+                            "Not enough memory: compaction failed to allocate "
+                            "linklist");
+                    memset(dst.linkLists_[id], 0, sz);
+                }
+                dst.label_lookup_[getExternalLabel(i)] = id;
+                if (element_levels_[i] > newMaxLevel) {
+                    newMaxLevel = element_levels_[i];
+                    newEnterPoint = id;
+                }
+            }
+
+            if (enterpoint_node_ < n && newIds[enterpoint_node_] != INVALID_ID) {
+                dst.enterpoint_node_ = newIds[enterpoint_node_];
+                dst.maxlevel_ = maxlevel_;
+            } else {
+                dst.enterpoint_node_ = newEnterPoint;
+                dst.maxlevel_ = newMaxLevel;
+            }
+            dst.cur_element_count = next;
+            dst.num_deleted_ = 0;
+            return reclaimed;
+        }
+
+        /* compactRepairLinks - rewrite the neighbour lists of live element
+         * 'id' into 'dst' using the new ids. Lists that pointed at deleted
+         * elements are repaired from the deleted elements' own neighbours
+         * and pruned with the selection heuristic. Only the lists of 'id'
+         * are written, so the caller can run this for all ids in parallel.
+         * Lists of this index are read with getConnectionsWithLock(), online
+         * inserts may be changing them.
+         */
+        void compactRepairLinks(HierarchicalDiskNSW<dist_t>& dst,
+                                tableint id,
+                                const std::vector<tableint>& newIds) {
+            tableint nid = newIds[id];
+            const void* data_point = getDataByInternalId(id);
+
+            for (int level = 0; level <= element_levels_[id]; level++) {
+                std::vector<tableint> links = getConnectionsWithLock(id, level);
+                const tableint* data = links.data();
+                size_t size = links.size();
+                linklistsizeint* dll = dst.get_linklist_at_level(nid, level);
+                tableint* ddata = (tableint*)(dll + 1);
+
+                bool intact = true;
+                for (size_t j = 0; j < size && intact; j++)
+                    intact = data[j] < newIds.size() &&
+                             newIds[data[j]] != INVALID_ID;
+
+                if (intact) {
+                    for (size_t j = 0; j < size; j++)
+                        ddata[j] = newIds[data[j]];
+                    dst.setListCount(dll, size);
+                    continue;
+                }
+
+                std::priority_queue<std::pair<dist_t, tableint>,
+                                    std::vector<std::pair<dist_t, tableint>>,
+                                    CompareByFirst>
+                    candidates;
+                std::unordered_set<tableint> seen;
+                auto addCandidate = [&](tableint cand) {
+                    if (cand == id || cand >= newIds.size() ||
+                        newIds[cand] == INVALID_ID || !seen.insert(cand).second)
+                        return;
+                    candidates.emplace(
+                        fstdistfunc_(data_point,
+                                     getDataByInternalId(cand),
+                                     dist_func_param_),
+                        newIds[cand]);
+                };
+
+                for (size_t j = 0; j < size; j++) {
+                    if (data[j] >= newIds.size())
+                        continue;  // added after the compaction snapshot
+                    if (newIds[data[j]] != INVALID_ID) {
+                        addCandidate(data[j]);
+                        continue;
+                    }
+                    for (tableint cand : getConnectionsWithLock(data[j], level))
+                        addCandidate(cand);
+                }
+
+                dst.getNeighborsByHeuristic2(candidates,
+                                             level ? maxM_ : maxM0_);
+
+                size_t sz = candidates.size();
+                dst.setListCount(dll, sz);
+                for (size_t idx = 0; idx < sz; idx++) {
+                    ddata[idx] = candidates.top().second;
+                    candidates.pop();
+                }
+            }
+        }
+
         void checkIntegrity() {
             int connections_checked = 0;
             std::vector<int> inbound_connections_num(cur_element_count, 0);
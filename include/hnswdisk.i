@@ -4,10 +4,10 @@
  * incremental disk persistence and crash recovery for MyVector.
  */
 
-/* Flush list is partitioned/sharded to avoid mutex contention during
- * high volume, parallel insert.
+/* Flush lists are bitmaps of atomic words, one bit per internal id, so a
+ * parallel insert marks a node with one fetch_or and no lock.
  */
-#define FLUSH_LIST_PARTS                             32
+#define DIRTY_MAP_WORD_BITS                          64
     
     void Write(int fd, void * buf, size_t nbytes,
                const std::string & file, int line)
@@ -86,62 +86,197 @@
         return fd;
     }
 
+    /* Checkpoint writes are batched : journal records are appended to a
+     * CKPT_IO_BUFFER_BYTES buffer, in place updates are coalesced into runs
+     * of adjacent file ranges and written with one pwrite()/pwritev() each.
+     */
+#define CKPT_IO_BUFFER_BYTES                         (8UL * 1024 * 1024)
+    /* a journal is written and applied in segments of about this size */
+#ifndef CKPT_JOURNAL_SEGMENT_BYTES
+#define CKPT_JOURNAL_SEGMENT_BYTES                   (64UL * 1024 * 1024)
+#endif
+#ifndef IOV_MAX
+#define IOV_MAX                                      1024
+#endif
+
+    void BufferedWrite(int fd, std::vector<char> & buf, const void * data,
+                       size_t nbytes, const std::string & file)
+    {
+        if (buf.size() + nbytes > CKPT_IO_BUFFER_BYTES)
+            FlushWriteBuffer(fd, buf, file);
+        if (nbytes > CKPT_IO_BUFFER_BYTES) {
+            Write(fd, (void *) data, nbytes, file, __LINE__);
+            return;
+        }
+        buf.insert(buf.end(), (const char *) data, (const char *) data + nbytes);
+    }
+
+    void FlushWriteBuffer(int fd, std::vector<char> & buf, const std::string & file)
+    {
+        if (buf.size())
+            Write(fd, buf.data(), buf.size(), file, __LINE__);
+        buf.clear();
+    }
+
+    void Pwrite(int fd, const void * buf, size_t nbytes, off_t offset,
+                const std::string & file, int line)
+    {
+        const char * p = (const char *) buf;
+        while (nbytes) {
+            ssize_t rc = pwrite(fd, p, nbytes, offset);
+            if (rc <= 0) {
+                std::stringstream ss;
+                ss << "Error writing " << nbytes << " bytes to " << file
+                   << " at offset " << offset << " at line " << line
+                   << ",rc = " << rc << ",errno = " << errno;
+                throw std::runtime_error(ss.str());
+            }
+            p += rc;
+            nbytes -= rc;
+            offset += rc;
+            throttleCheckPointIO(rc);
+        }
+    }
+
+    /* Pwritev() - write 'iov' contiguously at 'offset', IOV_MAX entries per
+     * call. 'iov' is consumed.
+     */
+    void Pwritev(int fd, std::vector<struct iovec> & iov, off_t offset,
+                 const std::string & file, int line)
+    {
+        size_t i = 0;
+        while (i < iov.size()) {
+            int cnt = (int) std::min(iov.size() - i, (size_t) IOV_MAX);
+            ssize_t rc = pwritev(fd, &iov[i], cnt, offset);
+            if (rc <= 0) {
+                std::stringstream ss;
+                ss << "Error writing " << cnt << " buffers to " << file
+                   << " at offset " << offset << " at line " << line
+                   << ",rc = " << rc << ",errno = " << errno;
+                throw std::runtime_error(ss.str());
+            }
+            offset += rc;
+            throttleCheckPointIO(rc);
+            while (rc > 0 && i < iov.size()) {
+                if ((size_t) rc >= iov[i].iov_len) {
+                    rc -= iov[i].iov_len;
+                    i++;
+                } else {
+                    iov[i].iov_base = (char *) iov[i].iov_base + rc;
+                    iov[i].iov_len -= rc;
+                    rc = 0;
+                }
+            }
+        }
+        iov.clear();
+    }
+
 
     /* A node in the HNSW graph contains the vector and links.
      * We distinguish between :-
      * Full Node flush - New or Updated node, where vector also needs to be
-     * flushed to disk -> m_nodeUpdates[]
+     * flushed to disk -> m_dirtyFull
      *
      * Node Links Level0 flush - Only the links (or edges list) has to tbe flushed
      * to disk (because the node's links got updated due to another vector insert).
+     * -> m_dirtyLevel0
      *
      * Node Links Level > 0 flush - A very low number of nodes will have level1,
-     * level2, level3 ... links updated.
+     * level2, level3 ... links updated. -> m_dirtyLevelGt0
      */
-    void addNodeToFlushList(tableint id) 
+    typedef std::vector<std::atomic<uint64_t>> DirtyMap;
+    typedef std::vector<std::atomic<uint8_t>> HeatMap; /* recordHeat() */
+
+    static void markDirty(DirtyMap & map, tableint id)
     {
-        unsigned int index = rand() % FLUSH_LIST_PARTS;
-        std::unique_lock <std::mutex> locklist(m_flushListMutex[index]);
-        m_nodeUpdates[index].insert(id);
+        uint64_t bit = 1UL << (id % DIRTY_MAP_WORD_BITS);
+        std::atomic<uint64_t> & word = map[id / DIRTY_MAP_WORD_BITS];
+        if (!(word.load(std::memory_order_relaxed) & bit))
+            word.fetch_or(bit, std::memory_order_release);
     }
-    void addNodeLinksLevel0ToFlushList(tableint id) 
+
+    /* resizeDirtyMaps() - size the bitmaps for maxElements ids, keeping the
+     * bits already set. Called wherever link_list_locks_ is (re)allocated.
+     */
+    void resizeDirtyMaps(size_t maxElements)
     {
-        unsigned int index = rand() % FLUSH_LIST_PARTS;
-        std::unique_lock <std::mutex> locklist(m_flushListMutex[index]);
-        m_nodeLinksLevel0Updates[index].insert(id);
+        size_t words = (maxElements + DIRTY_MAP_WORD_BITS - 1) / DIRTY_MAP_WORD_BITS;
+        for (DirtyMap * map : {&m_dirtyFull, &m_dirtyLevel0, &m_dirtyLevelGt0}) {
+            DirtyMap resized(words);
+            for (size_t i = 0; i < std::min(words, map->size()); i++)
+                resized[i].store((*map)[i].load(std::memory_order_relaxed),
+                                 std::memory_order_relaxed);
+            map->swap(resized);
+        }
     }
-    void addNodeLinksLevel0ToFlushList(std::set<tableint> & ids) 
+
+    void addNodeToFlushList(tableint id) 
     {
-        unsigned int index = rand() % FLUSH_LIST_PARTS;
-        std::unique_lock <std::mutex> locklist(m_flushListMutex[index]);
-        for (auto id : ids)
-          m_nodeLinksLevel0Updates[index].insert(id);
+        markDirty(m_dirtyFull, id);
     }
-    void addNodeLinksLevelGt0ToFlushList(tableint id, int level)
+    void addNodeLinksLevel0ToFlushList(tableint id) 
     {
-        unsigned int index = rand() % FLUSH_LIST_PARTS;
-        std::unique_lock <std::mutex> locklist(m_flushListMutex[index]);
-        m_nodeLinksLevelGt0Updates[index].insert(id);
+        markDirty(m_dirtyLevel0, id);
     }
-    void addNodeLinksLevelGt0ToFlushList(std::set<tableint> & ids, int level)
+    void addNodeLinksLevelGt0ToFlushList(tableint id, int level)
     {
         (void)level;
-        unsigned int index = rand() % FLUSH_LIST_PARTS;
-        std::unique_lock <std::mutex> locklist(m_flushListMutex[index]);
-        for (auto id : ids)
-            m_nodeLinksLevelGt0Updates[index].insert(id);
+        markDirty(m_dirtyLevelGt0, id);
     }
 
     /* clearFlushList() - clear the "dirty" nodes lists after a checkpoint.*/
     void clearFlushList()
     {
-        for (int i = 0; i < FLUSH_LIST_PARTS; i++)
+        for (DirtyMap * map : {&m_dirtyFull, &m_dirtyLevel0, &m_dirtyLevelGt0})
+            for (auto & word : *map)
+                word.store(0, std::memory_order_relaxed);
+    }
+
+    /* getDirtyStats() - number of nodes in the flush lists and an estimate
+     * of the bytes the next checkpoint will write for them.
+     */
+    void getDirtyStats(size_t & nodes, size_t & bytes)
+    {
+        size_t full = 0, level0 = 0, levelGt0 = 0;
+        for (size_t i = 0; i < m_dirtyFull.size(); i++)
         {
-            std::unique_lock <std::mutex> locklist(m_flushListMutex[i]);
-            m_nodeUpdates[i].clear();
-            m_nodeLinksLevel0Updates[i].clear();
-            m_nodeLinksLevelGt0Updates[i].clear();
+            uint64_t f = m_dirtyFull[i].load(std::memory_order_relaxed);
+            full += __builtin_popcountll(f);
+            level0 += __builtin_popcountll(m_dirtyLevel0[i].load(std::memory_order_relaxed) & ~f);
+            levelGt0 += __builtin_popcountll(m_dirtyLevelGt0[i].load(std::memory_order_relaxed) & ~f);
         }
+        nodes = full + level0 + levelGt0;
+        bytes = full * size_data_per_element_ + level0 * size_links_level0_ +
+                levelGt0 * size_links_per_element_;
+    }
+
+    /* Checkpoint I/O budget. When a rate is set, the file writes made
+     * while doCheckPoint() runs are paced to average at most m_ckptIORate
+     * bytes per second since the checkpoint started. Recovery and full
+     * saves are not paced.
+     */
+    void setCheckPointIORate(size_t bytesPerSec) { m_ckptIORate = bytesPerSec; }
+
+    void beginCheckPointIO()
+    {
+        m_ckptIOBytes = 0;
+        m_ckptIOStart = std::chrono::steady_clock::now().time_since_epoch().count();
+        m_ckptIOThrottle = (m_ckptIORate > 0);
+    }
+
+    void endCheckPointIO() { m_ckptIOThrottle = false; }
+
+    void throttleCheckPointIO(size_t nbytes)
+    {
+        size_t rate = m_ckptIORate;
+        if (!m_ckptIOThrottle.load() || !rate)
+            return;
+        double secs = (double) (m_ckptIOBytes += nbytes) / rate;
+        std::chrono::steady_clock::time_point due(
+            std::chrono::steady_clock::duration(m_ckptIOStart.load()) +
+            std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double>(secs)));
+        std::this_thread::sleep_until(due);
     }
 
     typedef enum
@@ -207,6 +342,7 @@
 
         setCheckPointId(ckptid2);
         setCheckPointComplete(hnswFile);
+        setCheckPointId(ckptid2); // reset by setCheckPointComplete()
     }
 
     void makeIndexConsistent(const std::string & hnswFile, bool & consistent,
@@ -269,6 +405,7 @@
                       "recovery is required.", hnswFile.c_str());
         setCheckPointId(ckptid);
         doRecovery(hnswFile);
+        setCheckPointId(ckptid); // reset by setCheckPointComplete()
         consistent = true;
       }
 
@@ -277,6 +414,7 @@
                       "not required.", hnswFile.c_str());
         setCheckPointId(ckptid);
         setCheckPointComplete(hnswFile);
+        setCheckPointId(ckptid);
         consistent = true;
       }
 
@@ -294,12 +432,21 @@
       unlink(filename.c_str());
       filename = hnswFile + ".links.data";
       unlink(filename.c_str());
+      filename = hnswFile + ".delta";
+      unlink(filename.c_str());
+      filename = hnswFile + ".delta.old";
+      unlink(filename.c_str());
       filename = hnswFile + ".ckpt.state";
       unlink(filename.c_str());
+      for (const char * sidecar : {".crc", ".links.crc", ".links.data.crc", ".heat", ".recall"}) {
+        filename = hnswFile + sidecar;
+        unlink(filename.c_str());
+      }
     }
 
     void WriteCheckPointStatus(const std::string &hnswFile,
-                               CheckPointState status)
+                               CheckPointState status,
+                               const std::string &ckptid = "")
       {
         std::string statusFileName = hnswFile + ".status";
         char buf[512];
@@ -329,7 +476,8 @@
 
         std::stringstream ss;
         ss << "time=" << tstr  << ",ts=" << tv.tv_sec << ":" << tv.tv_usec
-           << ",ckptid=" << getCheckPointId() << ",status=" << status << "|";
+           << ",ckptid=" << (ckptid.length() ? ckptid : getCheckPointId())
+           << ",status=" << status << "|";
 
         memset(&buf[0], '.', 256);
         memcpy(buf, ss.str().c_str(), ss.str().length());
@@ -351,347 +499,1306 @@
     const unsigned int HNSW_FILE_METADATA_SIZE    = 96;
 
 
-    std::mutex                                m_flushListMutex[FLUSH_LIST_PARTS];
-    std::set<tableint>                        m_nodeUpdates[FLUSH_LIST_PARTS];
-    std::set<tableint>                        m_nodeLinksLevel0Updates[FLUSH_LIST_PARTS];
-    std::set<tableint>                        m_nodeLinksLevelGt0Updates[FLUSH_LIST_PARTS];
+    DirtyMap                                  m_dirtyFull;
+    DirtyMap                                  m_dirtyLevel0;
+    DirtyMap                                  m_dirtyLevelGt0;
     std::unordered_map<tableint, size_t>      m_linksOffsetsInFile;
     std::string                               m_checkPointId;
 
-    void doCheckPoint(const std::string &hnswFileName)
+    /* mmap load mode (loadIndexMmap) */
+    char *                                    m_level0Map = nullptr;
+    size_t                                    m_level0MapSize = 0;
+    char *                                    m_linksMap = nullptr;
+    size_t                                    m_linksMapSize = 0;
+    mutable std::atomic<bool>                 m_labelLookupPending{false};
+    mutable std::once_flag                    m_labelLookupOnce;
+
+    /* access heat sketch (recordHeat) */
+    mutable HeatMap                           m_heat;
+
+    /* checkpoint epoch (snapshotJournal) */
+    std::shared_mutex                         m_epochMutex;
+    std::mutex                                m_epochTurnstile;
+    std::atomic<int>                          m_epochSwapsPending{0};
+
+    /* enterEpoch() - shared hold of the current epoch for one update. The
+     * turnstile is passed only while an epoch swap is waiting, so updates
+     * do not serialise on it otherwise.
+     */
+    std::shared_lock<std::shared_mutex> enterEpoch() {
+      if (m_epochSwapsPending.load(std::memory_order_acquire)) {
+        std::unique_lock<std::mutex> turnstile(m_epochTurnstile);
+      }
+      return std::shared_lock<std::shared_mutex>(m_epochMutex);
+    }
+
+    /* swapEpoch() - exclusive hold of the epoch. The turnstile keeps new
+     * updates out while it waits for the current ones, so the swap is not
+     * starved.
+     */
+    std::unique_lock<std::shared_mutex> swapEpoch() {
+      m_epochSwapsPending.fetch_add(1, std::memory_order_acq_rel);
+      std::unique_lock<std::mutex> turnstile(m_epochTurnstile);
+      std::unique_lock<std::shared_mutex> epoch(m_epochMutex);
+      m_epochSwapsPending.fetch_sub(1, std::memory_order_acq_rel);
+      return epoch;
+    }
+
+    /* held while the index files and their .crc sidecars are written */
+    std::mutex                                m_fileWriteMutex;
+
+    /* the index file is in the compact format (saveIndexCompact) */
+    bool                                      m_compactOnDisk = false;
+
+    /* delta log durability mode (appendDeltaLog) */
+    bool                                      m_deltaLog = false;
+    size_t                                    m_deltaLogCompactBytes = 0;
+    std::thread                               m_deltaCompactor;
+    std::atomic<bool>                         m_deltaCompacting{false};
+
+    /* checkpoint I/O budget (setCheckPointIORate) */
+    std::atomic<size_t>                       m_ckptIORate{0};
+    std::atomic<size_t>                       m_ckptIOBytes{0};
+    std::atomic<int64_t>                      m_ckptIOStart{0};
+    std::atomic<bool>                         m_ckptIOThrottle{false};
+
+    /* Checkpoint epochs. addPoint()/markDelete() hold m_epochMutex shared
+     * while they mutate the graph. A checkpoint takes it exclusive only to
+     * take ownership of the flush lists and the header fields, a new epoch
+     * starts with empty lists. The dirty nodes are then copied one at a
+     * time under their link_list_locks_ into an in memory journal image
+     * and all file writes come from that image, so inserts and searches run
+     * during the checkpoint I/O. A node changed again after the swap is in
+     * the new epoch's lists and is written by the next checkpoint; its
+     * links to nodes inserted after the swap are dropped from this image
+     * so every id in the checkpoint is below its element count.
+     */
+    void takeFlushLists(std::vector<tableint> & mx_nodeUpdates,
+                        std::vector<tableint> & mx_nodeLinksLevel0Updates,
+                        std::vector<tableint> & mx_nodeLinksLevelGt0Updates)
     {
-   /* 
-    * 0. CreateOrOpenFile(m_name.hnsw.ckpt);
-    * 1. Write(ckptString_Step1) to file
-    * 2. fsync(file);
-    * 3. open() checkpoint state file;
-    * 4. Write all updatedNodes and all updatedLinksNodes to file - 10MB
-    * 5. fsync(file)
-    * 6. Write(ckptString_Step1_Complete) to ckpt file
-    * 7. fsync(ckpt_file);
-    * 8. Write all updatedNodes/updatedLinksNodes to real hnsw file in-place
-    * 9. fsync(hnsw file);
-    *10. Write(ckptString_Complete) to ckpt file
-    *11. Delete m_name.hnsw.ckpt.state file
-  */
+      // one pass over the bitmaps, the ids come out sorted
+      auto scan = [](uint64_t bits, size_t i, std::vector<tableint> & ids) {
+        while (bits) {
+          ids.push_back(i * DIRTY_MAP_WORD_BITS + __builtin_ctzll(bits));
+          bits &= bits - 1;
+        }
+      };
+      for (size_t i = 0; i < m_dirtyFull.size(); i++) {
+        uint64_t full = 0, level0 = 0, levelGt0 = 0;
+        if (m_dirtyFull[i].load(std::memory_order_relaxed))
+          full = m_dirtyFull[i].exchange(0, std::memory_order_acq_rel);
+        if (m_dirtyLevel0[i].load(std::memory_order_relaxed))
+          level0 = m_dirtyLevel0[i].exchange(0, std::memory_order_acq_rel);
+        if (m_dirtyLevelGt0[i].load(std::memory_order_relaxed))
+          levelGt0 = m_dirtyLevelGt0[i].exchange(0, std::memory_order_acq_rel);
+        scan(full, i, mx_nodeUpdates);
+        scan(level0 & ~full, i, mx_nodeLinksLevel0Updates);
+        scan(levelGt0 & ~full, i, mx_nodeLinksLevelGt0Updates);
+      }
+    }
 
-    WriteCheckPointStatus(hnswFileName, CKPT_BEGIN_INCR_PASS1);
+    /* requeueFlushLists() - a failed checkpoint hands its nodes back to the
+     * current epoch.
+     */
+    void requeueFlushLists(std::vector<tableint> & mx_nodeUpdates,
+                           std::vector<tableint> & mx_nodeLinksLevel0Updates,
+                           std::vector<tableint> & mx_nodeLinksLevelGt0Updates)
+    {
+      for (auto id : mx_nodeUpdates)
+        markDirty(m_dirtyFull, id);
+      for (auto id : mx_nodeLinksLevel0Updates)
+        markDirty(m_dirtyLevel0, id);
+      for (auto id : mx_nodeLinksLevelGt0Updates)
+        markDirty(m_dirtyLevelGt0, id);
+    }
 
-    std::string ckptFileName = hnswFileName + ".ckpt.state";
+    /* dropLinksFrom() - remove the ids >= 'count' from a copied link list */
+    void dropLinksFrom(char * list, size_t count)
+    {
+      linklistsizeint * ll = (linklistsizeint *) list;
+      tableint * data = (tableint *) (ll + 1);
+      size_t n = getListCount(ll), kept = 0;
+      for (size_t j = 0; j < n; j++)
+        if (data[j] < count)
+          data[kept++] = data[j];
+      setListCount(ll, kept);
+    }
 
-    int ckptFile = Open(ckptFileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600); // new
+    /* snapshotJournal() - start a new epoch and stream the journal of the
+     * previous one to 'sink' in segments of about CKPT_JOURNAL_SEGMENT_BYTES,
+     * so a checkpoint holds one segment in memory whatever its dirty set.
+     * A journal is one or more segments in the .ckpt.state format :-
+     *   header | #full | #level0 | #levelGt0 |
+     *   full records    : id, size, level0 links + vector + label, gt0 size, gt0 links
+     *   level0 records  : id, size, level0 links
+     *   levelGt0 records: id, size, links of levels 1..n
+     * Each segment is applied on its own (applyJournal()).
+     */
+    void snapshotJournal(std::function<void(const char *, size_t)> sink,
+                         std::vector<tableint> & mx_nodeUpdates,
+                         std::vector<tableint> & mx_nodeLinksLevel0Updates,
+                         std::vector<tableint> & mx_nodeLinksLevelGt0Updates)
+    {
+      size_t count;
+      int maxlevel;
+      tableint enterpoint;
+      {
+        auto epoch = swapEpoch();
+        takeFlushLists(mx_nodeUpdates, mx_nodeLinksLevel0Updates, mx_nodeLinksLevelGt0Updates);
+        count = cur_element_count;
+        maxlevel = maxlevel_;
+        enterpoint = enterpoint_node_;
+      }
 
-    /* First merge all the partitioned lists into single set - automatic
-     * duplicate removal due to set<>
+      std::vector<char> image;
+      auto append = [&](const void * p, size_t n) {
+        image.insert(image.end(), (const char *) p, (const char *) p + n);
+      };
+      // drop links to elements of the new epoch
+      auto dropNewLinks = [&](char * list) { dropLinksFrom(list, count); };
+      auto appendNode = [&](tableint nodeId, bool level0, bool upper) {
+        std::unique_lock<std::mutex> lock(link_list_locks_[nodeId]);
+        if (level0) {
+          unsigned int sz = upper ? size_data_per_element_ : size_links_level0_;
+          append(&nodeId, sizeof(nodeId));
+          append(&sz, sizeof(sz));
+          size_t at = image.size();
+          append(get_linklist0(nodeId), sz);
+          dropNewLinks(&image[at]);
+        }
+        if (upper) {
+          unsigned int sz = element_levels_[nodeId] > 0 ?
+                              size_links_per_element_ * element_levels_[nodeId] : 0;
+          if (!level0)
+            append(&nodeId, sizeof(nodeId));
+          append(&sz, sizeof(sz));
+          size_t at = image.size();
+          append(linkLists_[nodeId], sz);
+          for (int l = 0; l < element_levels_[nodeId]; l++)
+            dropNewLinks(&image[at + l * size_links_per_element_]);
+        }
+      };
+
+      // a full record carries all the links of its node (takeFlushLists())
+      mx_nodeLinksLevelGt0Updates.erase(
+          std::remove_if(mx_nodeLinksLevelGt0Updates.begin(), mx_nodeLinksLevelGt0Updates.end(),
+                         [&](tableint id) { return element_levels_[id] <= 0; }),
+          mx_nodeLinksLevelGt0Updates.end());
+
+      std::vector<char> header;
+      appendIndexHeader(header);
+      memcpy(&header[2 * sizeof(size_t)], &count, sizeof(count));
+      memcpy(&header[6 * sizeof(size_t)], &maxlevel, sizeof(maxlevel));
+      memcpy(&header[6 * sizeof(size_t) + sizeof(int)], &enterpoint, sizeof(enterpoint));
+
+      debug_print("Flush List Sizes (%lu) (%lu) (%lu).", mx_nodeUpdates.size(),
+                  mx_nodeLinksLevel0Updates.size(), mx_nodeLinksLevelGt0Updates.size());
+
+      size_t counts[3] = {0, 0, 0};
+      auto startSegment = [&]() {
+        image.assign(header.begin(), header.end());
+        memset(counts, 0, sizeof(counts));
+        append(counts, sizeof(counts));
+      };
+      auto endSegment = [&]() {
+        memcpy(&image[header.size()], counts, sizeof(counts));
+        sink(image.data(), image.size());
+      };
+
+      startSegment();
+      auto appendRecords = [&](std::vector<tableint> & ids, int type, bool level0, bool upper) {
+        for (auto nodeId : ids) {
+          appendNode(nodeId, level0, upper);
+          counts[type]++;
+          if (image.size() >= CKPT_JOURNAL_SEGMENT_BYTES) {
+            endSegment();
+            startSegment();
+          }
+        }
+      };
+      appendRecords(mx_nodeUpdates, 0, true, true);
+      appendRecords(mx_nodeLinksLevel0Updates, 1, true, false);
+      appendRecords(mx_nodeLinksLevelGt0Updates, 2, false, true);
+      if (counts[0] + counts[1] + counts[2] ||
+          !(mx_nodeUpdates.size() + mx_nodeLinksLevel0Updates.size() +
+            mx_nodeLinksLevelGt0Updates.size()))
+        endSegment(); // a journal has at least one segment
+    }
+
+    /* Block checksums. Each index data file <f> (.hnsw.index, .links and
+     * .links.data) has a sidecar <f>.crc :-
+     *
+     *   HNSW_CRC_MAGIC | version | block size | size of <f> | CRC32C of
+     *   every HNSW_CRC_BLOCK_BYTES block of <f>, the last one partial
+     *
+     * saveIndex() writes the sidecars after the full write, applyJournal()
+     * (checkpoint pass 2, recovery, delta log fold) recomputes the blocks
+     * it wrote from the page cache and rewrites only their slots. loadIndex()
+     * verifies all blocks in a background thread while it reads the index
+     * and fails the load on a mismatch, verifyChecksums() is the same scan
+     * on demand. An index without sidecars loads unverified.
      */
-    std::set<tableint> mx_nodeUpdates;
-    std::set<tableint> mx_nodeLinksLevel0Updates;
-    std::set<tableint> mx_nodeLinksLevelGt0Updates;
+#define HNSW_CRC_MAGIC                               0x313043524356594dUL /* MYVCRC01 */
+#define HNSW_CRC_VERSION                             1
+#define HNSW_CRC_BLOCK_BYTES                         4096UL
+#define HNSW_CRC_HEADER_BYTES                        24
+
+    struct ChecksumHeader {
+        uint64_t magic;
+        uint32_t version;
+        uint32_t blockSize;
+        uint64_t fileSize;
+    };
+
+    /* computeBlockChecksums() - CRC32C of blocks [first, last) of 'fd'. */
+    void computeBlockChecksums(int fd, const std::string & file, size_t fileSize,
+                               size_t first, size_t last, uint32_t * out)
+    {
+        const size_t runBlocks = 256;
+        std::vector<char> buf(runBlocks * HNSW_CRC_BLOCK_BYTES);
+        for (size_t b = first; b < last; b += runBlocks) {
+            size_t ofs = b * HNSW_CRC_BLOCK_BYTES;
+            size_t n = std::min(fileSize - ofs,
+                                std::min(last - b, runBlocks) * HNSW_CRC_BLOCK_BYTES);
+            Pread(fd, buf.data(), n, ofs, file, __LINE__);
+            for (size_t i = 0; i * HNSW_CRC_BLOCK_BYTES < n; i++)
+                out[b - first + i] = CRC32C(&buf[i * HNSW_CRC_BLOCK_BYTES],
+                    std::min(HNSW_CRC_BLOCK_BYTES, n - i * HNSW_CRC_BLOCK_BYTES));
+        }
+    }
 
-    for (int i = 0; i < FLUSH_LIST_PARTS; i++) {
-      mx_nodeUpdates.insert(m_nodeUpdates[i].begin(), m_nodeUpdates[i].end());
-      mx_nodeLinksLevel0Updates.insert(m_nodeLinksLevel0Updates[i].begin(), m_nodeLinksLevel0Updates[i].end());
-      mx_nodeLinksLevelGt0Updates.insert(m_nodeLinksLevelGt0Updates[i].begin(), m_nodeLinksLevelGt0Updates[i].end());
+    size_t fileSizeOf(int fd, const std::string & file)
+    {
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+            throw std::runtime_error("Cannot stat " + file);
+        return st.st_size;
     }
 
+    /* writeChecksumFile() - full sidecar of 'file' after a full write. */
+    void writeChecksumFile(const std::string & file)
+    {
+        int fd = Open(file, O_RDONLY);
+        size_t fileSize = fileSizeOf(fd, file);
+        size_t nblocks = (fileSize + HNSW_CRC_BLOCK_BYTES - 1) / HNSW_CRC_BLOCK_BYTES;
+        std::vector<uint32_t> crcs(nblocks);
+        computeBlockChecksums(fd, file, fileSize, 0, nblocks, crcs.data());
+        Close(fd, file);
+
+        std::string crcFile = file + ".crc";
+        ChecksumHeader hdr = {HNSW_CRC_MAGIC, HNSW_CRC_VERSION, HNSW_CRC_BLOCK_BYTES, fileSize};
+        int crcFd = Open(crcFile, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        std::vector<struct iovec> iov = {{&hdr, sizeof(hdr)}};
+        if (crcs.size())
+            iov.push_back({crcs.data(), crcs.size() * sizeof(uint32_t)});
+        Pwritev(crcFd, iov, 0, crcFile, __LINE__);
+        Fsync(crcFd, crcFile);
+        Close(crcFd, crcFile);
+    }
 
-    saveIndexHeader(ckptFile, ckptFileName);
+    /* updateChecksums() - refresh the sidecar slots of the blocks written
+     * through 'fd' since the last update. Blocks past the old end of the
+     * file (appends) are always included.
+     */
+    void updateChecksums(int fd, const std::string & file, std::vector<size_t> & blocks)
+    {
+        std::string crcFile = file + ".crc";
+        int crcFd = open(crcFile.c_str(), O_RDWR);
+        if (crcFd < 0)
+            return; // index saved without checksums
+
+        ChecksumHeader hdr;
+        Pread(crcFd, &hdr, sizeof(hdr), 0, crcFile, __LINE__);
+        size_t fileSize = fileSizeOf(fd, file);
+        for (size_t b = hdr.fileSize / HNSW_CRC_BLOCK_BYTES;
+             b * HNSW_CRC_BLOCK_BYTES < fileSize; b++)
+            blocks.push_back(b);
+        std::sort(blocks.begin(), blocks.end());
+        blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+
+        std::vector<uint32_t> crcs(blocks.size());
+        for (size_t i = 0; i < blocks.size(); ) {
+            size_t j = i + 1;
+            while (j < blocks.size() && blocks[j] == blocks[j - 1] + 1 && j - i < 256)
+                j++;
+            computeBlockChecksums(fd, file, fileSize, blocks[i], blocks[i] + (j - i), &crcs[i]);
+            Pwrite(crcFd, &crcs[i], (j - i) * sizeof(uint32_t),
+                   HNSW_CRC_HEADER_BYTES + blocks[i] * sizeof(uint32_t), crcFile, __LINE__);
+            i = j;
+        }
+        hdr.fileSize = fileSize;
+        Pwrite(crcFd, &hdr, sizeof(hdr), 0, crcFile, __LINE__);
+        Fsync(crcFd, crcFile);
+        Close(crcFd, crcFile);
+        blocks.clear();
+    }
 
-    /* Next is the scope or size of this checkpoint. */
-    size_t s = mx_nodeUpdates.size();
-    Write(ckptFile, &s, sizeof(s), ckptFileName, __LINE__);
-    s = mx_nodeLinksLevel0Updates.size();
-    Write(ckptFile, &s, sizeof(s), ckptFileName, __LINE__);
-    s = mx_nodeLinksLevelGt0Updates.size();
-    Write(ckptFile, &s, sizeof(s), ckptFileName, __LINE__);
+    static void touchBlocks(std::vector<size_t> & blocks, size_t ofs, size_t n)
+    {
+        for (size_t b = ofs / HNSW_CRC_BLOCK_BYTES; n && b <= (ofs + n - 1) / HNSW_CRC_BLOCK_BYTES; b++)
+            blocks.push_back(b);
+    }
 
-    debug_print("Flush List Sizes (%lu) (%lu) (%lu).", mx_nodeUpdates.size(),
-                mx_nodeLinksLevel0Updates.size(), mx_nodeLinksLevelGt0Updates.size());
+    /* verifyFileChecksums() - returns "" or a description of the first
+     * mismatch of 'file'. Blocks are checked by 'nthreads' threads.
+     */
+    std::string verifyFileChecksums(const std::string & file, size_t nthreads, size_t & nblocks)
+    {
+        std::string crcFile = file + ".crc";
+        int crcFd = open(crcFile.c_str(), O_RDONLY);
+        nblocks = 0;
+        if (crcFd < 0)
+            return "";
+
+        ChecksumHeader hdr;
+        int fd = -1;
+        std::string error;
+        try {
+            Pread(crcFd, &hdr, sizeof(hdr), 0, crcFile, __LINE__);
+            if (hdr.magic != HNSW_CRC_MAGIC || hdr.version != HNSW_CRC_VERSION ||
+                hdr.blockSize != HNSW_CRC_BLOCK_BYTES)
+                return "unsupported checksum file " + crcFile;
+
+            fd = Open(file, O_RDONLY);
+            size_t fileSize = fileSizeOf(fd, file);
+            if (fileSize != hdr.fileSize) {
+                Close(fd, file);
+                Close(crcFd, crcFile);
+                return file + " is " + std::to_string(fileSize) + " bytes, checksummed " +
+                       std::to_string(hdr.fileSize);
+            }
+            nblocks = (fileSize + HNSW_CRC_BLOCK_BYTES - 1) / HNSW_CRC_BLOCK_BYTES;
+            std::vector<uint32_t> expected(nblocks);
+            if (nblocks)
+                Pread(crcFd, expected.data(), nblocks * sizeof(uint32_t),
+                      HNSW_CRC_HEADER_BYTES, crcFile, __LINE__);
+
+            std::atomic<size_t> nextRun{0}, firstBad{SIZE_MAX};
+            const size_t runBlocks = 1024;
+            auto worker = [&]() {
+                std::vector<uint32_t> crcs(runBlocks);
+                size_t b;
+                while ((b = nextRun.fetch_add(runBlocks)) < nblocks) {
+                    size_t n = std::min(runBlocks, nblocks - b);
+                    computeBlockChecksums(fd, file, fileSize, b, b + n, crcs.data());
+                    for (size_t i = 0; i < n; i++) {
+                        size_t bad = firstBad.load();
+                        while (crcs[i] != expected[b + i] && b + i < bad &&
+                               !firstBad.compare_exchange_weak(bad, b + i))
+                            ;
+                    }
+                }
+            };
+            std::vector<std::thread> threads;
+            for (size_t t = 1; t < std::max((size_t) 1, nthreads); t++)
+                threads.emplace_back(worker);
+            worker();
+            for (auto & t : threads)
+                t.join();
+
+            if (firstBad.load() != SIZE_MAX) {
+                std::stringstream ss;
+                ss << "checksum mismatch in " << file << " at offset "
+                   << firstBad.load() * HNSW_CRC_BLOCK_BYTES;
+                error = ss.str();
+            }
+        } catch (std::runtime_error & e) {
+            error = e.what();
+        }
+        if (fd >= 0)
+            close(fd);
+        close(crcFd);
+        return error;
+    }
 
-    // Sort the flush lists in NodeID order - already done in ordered_set<>
+    /* verifyChecksums() - full scan of all index files against their block
+     * checksums. Returns "" if they match, else the first mismatch. Not run
+     * concurrently with a checkpoint write.
+     */
+    std::string verifyChecksums(const std::string & location, size_t nthreads, size_t & nblocks)
+    {
+        std::unique_lock<std::mutex> lock(m_fileWriteMutex);
+        return verifyIndexFiles(location, nthreads, nblocks);
+    }
 
-    for (auto nodeId : mx_nodeUpdates) {
-        Write(ckptFile, &nodeId, sizeof(nodeId), ckptFileName, __LINE__);
-        unsigned int sz = size_data_per_element_;
-        Write(ckptFile, &sz, sizeof(sz), ckptFileName, __LINE__);
+    std::string verifyIndexFiles(const std::string & location, size_t nthreads, size_t & nblocks)
+    {
+        nblocks = 0;
+        for (const std::string & file : {location, location + ".links", location + ".links.data"}) {
+            size_t n = 0;
+            std::string error = verifyFileChecksums(file, nthreads, n);
+            nblocks += n;
+            if (error.length())
+                return error;
+        }
+        return "";
+    }
 
-        char *nodeVectorAndLevel0Links = getDataByInternalId(nodeId);
-        Write(ckptFile, nodeVectorAndLevel0Links, size_data_per_element_,
-              ckptFileName, __LINE__);
+    /* Access heat sketch. searchBaseLayerST() samples 1 in HNSW_HEAT_SAMPLE
+     * of the level 0 nodes it expands into m_heat, a saturating 8 bit
+     * counter per HNSW_HEAT_IDS_PER_BUCKET ids. saveIndex() and
+     * doCheckPoint() write it to <index>.heat and halve it, so it follows
+     * the recent query load. After a mmap load, warmUp() uses it to fault
+     * in the hot level 0 regions before the index serves queries. The
+     * counters are updated without a CAS, a lost increment is harmless.
+     */
+#define HNSW_HEAT_MAGIC                              0x315441454856594dUL /* MYVHEAT1 */
+#define HNSW_HEAT_VERSION                            1
+#define HNSW_HEAT_IDS_PER_BUCKET                     16
+#define HNSW_HEAT_SAMPLE                             16
+
+    struct HeatHeader {
+        uint64_t magic;
+        uint32_t version;
+        uint32_t idsPerBucket;
+        uint64_t nbuckets;
+    };
+
+    void resizeHeatMap(size_t maxElements)
+    {
+        size_t buckets = (maxElements + HNSW_HEAT_IDS_PER_BUCKET - 1) / HNSW_HEAT_IDS_PER_BUCKET;
+        HeatMap resized(buckets);
+        for (size_t i = 0; i < std::min(buckets, m_heat.size()); i++)
+            resized[i].store(m_heat[i].load(std::memory_order_relaxed),
+                             std::memory_order_relaxed);
+        m_heat.swap(resized);
+    }
 
-        unsigned int linkListSizeLevelGt0 =
-          element_levels_[nodeId] > 0 ? size_links_per_element_ * element_levels_[nodeId] : 0;
-        Write(ckptFile, &linkListSizeLevelGt0, sizeof(linkListSizeLevelGt0),
-              ckptFileName, __LINE__);
-        if (linkListSizeLevelGt0) {
-          Write(ckptFile, linkLists_[nodeId], linkListSizeLevelGt0,
-                ckptFileName, __LINE__);
+    void recordHeat(tableint id) const
+    {
+        static thread_local unsigned sample = 0;
+        if (++sample % HNSW_HEAT_SAMPLE)
+            return;
+        size_t b = id / HNSW_HEAT_IDS_PER_BUCKET;
+        if (b < m_heat.size()) {
+            uint8_t h = m_heat[b].load(std::memory_order_relaxed);
+            if (h < UINT8_MAX)
+                m_heat[b].store(h + 1, std::memory_order_relaxed);
         }
-    } // full node flush - vector data + level 0 links and higher level links
+    }
 
+    /* saveHeatMap() - write <index>.heat through a rename and halve the
+     * counters. The sketch is only a hint, so it is not fsynced and a
+     * failure is logged, not thrown.
+     */
+    void saveHeatMap(const std::string & hnswFileName)
+    {
+        std::string heatFile = hnswFileName + ".heat";
+        std::string tmpFile = heatFile + ".tmp";
+        size_t n = std::min(m_heat.size(),
+            (cur_element_count + HNSW_HEAT_IDS_PER_BUCKET - 1) / HNSW_HEAT_IDS_PER_BUCKET);
+        HeatHeader hdr = {HNSW_HEAT_MAGIC, HNSW_HEAT_VERSION, HNSW_HEAT_IDS_PER_BUCKET, n};
+        std::vector<uint8_t> counts(n);
+        for (size_t i = 0; i < n; i++) {
+            counts[i] = m_heat[i].load(std::memory_order_relaxed);
+            m_heat[i].store(counts[i] / 2, std::memory_order_relaxed);
+        }
 
-    for (auto nodeId : mx_nodeLinksLevel0Updates) {
-        unsigned int sz = size_links_level0_;
-        Write(ckptFile, &nodeId, sizeof(nodeId), ckptFileName, __LINE__);
-        Write(ckptFile, &sz, sizeof(sz), ckptFileName, __LINE__);
+        int fd = -1;
+        try {
+            fd = Open(tmpFile, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+            Write(fd, &hdr, sizeof(hdr), tmpFile, __LINE__);
+            if (n)
+                Write(fd, counts.data(), n, tmpFile, __LINE__);
+            Close(fd, tmpFile);
+            fd = -1;
+            if (rename(tmpFile.c_str(), heatFile.c_str()) != 0)
+                throw std::runtime_error("rename of " + tmpFile + " failed");
+        } catch (std::runtime_error & e) {
+            if (fd >= 0)
+                close(fd);
+            unlink(tmpFile.c_str());
+            warning_print("Heat map of %s not saved : %s", hnswFileName.c_str(), e.what());
+        }
+    }
 
-        char *level0Links = (char *)get_linklist0(nodeId);
-        Write(ckptFile, level0Links, size_links_level0_, ckptFileName, __LINE__);
-    } // level = 0 links
+    /* loadHeatMap() - read <index>.heat into m_heat, if there is one. */
+    void loadHeatMap(const std::string & location)
+    {
+        std::ifstream input(location + ".heat", std::ios::binary);
+        HeatHeader hdr;
+        readBinaryPOD(input, hdr);
+        if (!input.good() || hdr.magic != HNSW_HEAT_MAGIC ||
+            hdr.version != HNSW_HEAT_VERSION ||
+            hdr.idsPerBucket != HNSW_HEAT_IDS_PER_BUCKET)
+            return;
+        std::vector<uint8_t> counts(std::min((size_t) hdr.nbuckets, m_heat.size()));
+        input.read((char *) counts.data(), counts.size());
+        if (!input.good())
+            return;
+        for (size_t i = 0; i < counts.size(); i++)
+            m_heat[i].store(counts[i], std::memory_order_relaxed);
+    }
 
-    for (auto nodeId : mx_nodeLinksLevelGt0Updates) {
-        unsigned int linkListSize =
-          element_levels_[nodeId] > 0 ? size_links_per_element_ * element_levels_[nodeId] : 0;
+    /* warmUp() - fault in the hot part of a mmap loaded index with
+     * 'nthreads' threads, up to 'budgetBytes'. The upper level links go
+     * first, then the level 0 buckets holding upper level elements (every
+     * search enters through them), then the other buckets by heat. The
+     * ranges are merged, madvise(MADV_WILLNEED)'d and then read one byte
+     * per page so they are resident when this returns. Returns the bytes
+     * warmed. A heap loaded index is resident already, returns 0.
+     */
+    size_t warmUp(size_t budgetBytes, size_t nthreads)
+    {
+        if (!m_level0Map || !budgetBytes)
+            return 0;
+
+        const uintptr_t page = sysconf(_SC_PAGESIZE);
+        std::vector<std::pair<uintptr_t, uintptr_t>> ranges;
+        size_t bytes = 0;
+        auto addRange = [&](const char * p, size_t len) {
+            uintptr_t start = (uintptr_t) p & ~(page - 1);
+            uintptr_t end = ((uintptr_t) p + len + page - 1) & ~(page - 1);
+            ranges.emplace_back(start, end);
+            bytes += end - start;
+        };
+
+        if (m_linksMap)
+            addRange(m_linksMap, std::min(m_linksMapSize, budgetBytes));
+
+        size_t nbuckets = std::min(m_heat.size(),
+            (cur_element_count + HNSW_HEAT_IDS_PER_BUCKET - 1) / HNSW_HEAT_IDS_PER_BUCKET);
+        std::vector<std::pair<unsigned, size_t>> order;
+        for (size_t b = 0; b < nbuckets; b++) {
+            unsigned score = m_heat[b].load(std::memory_order_relaxed);
+            size_t last = std::min((size_t) cur_element_count, (b + 1) * HNSW_HEAT_IDS_PER_BUCKET);
+            for (size_t id = b * HNSW_HEAT_IDS_PER_BUCKET; id < last; id++) {
+                if (element_levels_[id] > 0) {
+                    score += UINT8_MAX + 1;
+                    break;
+                }
+            }
+            if (score)
+                order.emplace_back(score, b);
+        }
+        std::sort(order.begin(), order.end(), std::greater<std::pair<unsigned, size_t>>());
 
-        if (linkListSize) {
-          Write(ckptFile, &nodeId, sizeof(nodeId), ckptFileName, __LINE__);
-          Write(ckptFile, &linkListSize, sizeof(linkListSize), ckptFileName, __LINE__);
-          Write(ckptFile, linkLists_[nodeId], linkListSize, ckptFileName, __LINE__);
+        for (size_t i = 0; i < order.size() && bytes < budgetBytes; i++) {
+            size_t first = order[i].second * HNSW_HEAT_IDS_PER_BUCKET;
+            size_t last = std::min((size_t) cur_element_count, first + HNSW_HEAT_IDS_PER_BUCKET);
+            addRange(data_level0_memory_ + first * size_data_per_element_,
+                     (last - first) * size_data_per_element_);
         }
-        else {
-          throw std::runtime_error("checkpoint internal error #1");
+
+        std::sort(ranges.begin(), ranges.end());
+        std::vector<std::pair<uintptr_t, uintptr_t>> merged;
+        for (auto & r : ranges) {
+            if (merged.size() && r.first <= merged.back().second)
+                merged.back().second = std::max(merged.back().second, r.second);
+            else
+                merged.push_back(r);
+        }
+        bytes = 0;
+        for (auto & r : merged) {
+            madvise((void *) r.first, r.second - r.first, MADV_WILLNEED);
+            bytes += r.second - r.first;
         }
-    } // level >= 1 links
 
-    Fsync(ckptFile, ckptFileName);
+        std::atomic<size_t> next{0};
+        auto worker = [&]() {
+            size_t i;
+            while ((i = next.fetch_add(1)) < merged.size()) {
+                unsigned char sum = 0;
+                for (uintptr_t p = merged[i].first; p < merged[i].second; p += page)
+                    sum += *(volatile unsigned char *) p;
+                (void) sum;
+            }
+        };
+        std::vector<std::thread> threads;
+        for (size_t t = 1; t < std::max((size_t) 1, nthreads); t++)
+            threads.emplace_back(worker);
+        worker();
+        for (auto & t : threads)
+            t.join();
+        return bytes;
+    }
 
-    Close(ckptFile, ckptFileName);
-    
-    WriteCheckPointStatus(hnswFileName, CKPT_END_INCR_PASS1);
+    /* applyJournal() - write a journal image in place to the index files.
+     * Records of adjacent elements are coalesced into one pwritev(), link
+     * lists already in .links.data are rewritten in file order and new ones
+     * are appended with one pwritev() and one directory write. Used by
+     * pass 2 of doCheckPoint(), doRecovery() and the delta log fold. The
+     * caller fsyncs.
+     */
+    void applyJournal(int hnswFile, int linksDirOutput, int linksDataOutput,
+                      const std::string & hnswFileName, const char * payload, size_t len)
+    {
+      std::string linksLocation = hnswFileName + ".links";
+      std::string linksDataLocation = hnswFileName + ".links.data";
 
-    /* All incremental state has been saved to ckpt file. Now we write to
-     * the "real" HNSW index files.
+      std::unique_lock<std::mutex> lock(m_fileWriteMutex);
+      std::vector<size_t> hnswBlocks, linksDataBlocks, linksDirBlocks;
+
+      std::vector<struct iovec> iov;
+      size_t iovStart = 0, iovEnd = 0;
+      auto writeRun = [&](int fd, size_t ofs, const char * p, size_t n, const std::string & file) {
+        if (iov.size() && ofs != iovEnd)
+          Pwritev(fd, iov, iovStart, file, __LINE__);
+        if (iov.empty())
+          iovStart = iovEnd = ofs;
+        iov.push_back({(void *) p, n});
+        iovEnd += n;
+        touchBlocks(fd == hnswFile ? hnswBlocks : linksDataBlocks, ofs, n);
+      };
+
+      std::vector<std::pair<size_t, std::pair<const char *, unsigned int>>> inPlace;
+      std::vector<std::pair<tableint, std::pair<const char *, unsigned int>>> appended;
+      auto gt0Links = [&](tableint nodeId, const char * links, unsigned int sz) {
+        if (!sz)
+          return;
+        // the directory decides, offset 0 (the first upper level node) is
+        // an existing slot, not a new node
+        auto ofsIter = m_linksOffsetsInFile.find(nodeId);
+        if (ofsIter != m_linksOffsetsInFile.end())
+          inPlace.push_back({ofsIter->second, {links, sz}});
+        else
+          appended.push_back({nodeId, {links, sz}}); // first time addition of this node
+      };
+
+      forEachJournalRecord(payload, len,
+        [&](const char * hdr) {
+          Pwrite(hnswFile, hdr, HNSW_FILE_METADATA_SIZE, 0, hnswFileName, __LINE__);
+          touchBlocks(hnswBlocks, 0, HNSW_FILE_METADATA_SIZE);
+        },
+        [&](tableint nodeId, const char * data, const char * links, unsigned int sz) {
+          writeRun(hnswFile, nodeId * size_data_per_element_ + offsetLevel0_ + HNSW_FILE_METADATA_SIZE,
+                   data, size_data_per_element_, hnswFileName);
+          gt0Links(nodeId, links, sz);
+        },
+        [&](tableint nodeId, const char * links) {
+          writeRun(hnswFile, nodeId * size_data_per_element_ + offsetLevel0_ + HNSW_FILE_METADATA_SIZE,
+                   links, size_links_level0_, hnswFileName);
+        },
+        gt0Links);
+      if (iov.size())
+        Pwritev(hnswFile, iov, iovStart, hnswFileName, __LINE__);
+
+      std::sort(inPlace.begin(), inPlace.end());
+      for (auto & entry : inPlace)
+        writeRun(linksDataOutput, entry.first, entry.second.first, entry.second.second,
+                 linksDataLocation);
+      if (iov.size())
+        Pwritev(linksDataOutput, iov, iovStart, linksDataLocation, __LINE__);
+
+      if (appended.size()) {
+        std::vector<char> dirBuf;
+        size_t dataEnd = Lseek(linksDataOutput, 0, SEEK_END, linksDataLocation);
+        size_t appendStart = dataEnd;
+        for (auto & entry : appended) {
+          unsigned int linkListSize = entry.second.second;
+          BufferedWrite(linksDirOutput, dirBuf, &entry.first, sizeof(entry.first), linksLocation);
+          BufferedWrite(linksDirOutput, dirBuf, &linkListSize, sizeof(linkListSize),
+                        linksLocation);
+          iov.push_back({(void *) entry.second.first, linkListSize});
+          m_linksOffsetsInFile[entry.first] = dataEnd;
+          dataEnd += linkListSize;
+        }
+        Pwritev(linksDataOutput, iov, appendStart, linksDataLocation, __LINE__);
+        Lseek(linksDirOutput, 0, SEEK_END, linksLocation);
+        FlushWriteBuffer(linksDirOutput, dirBuf, linksLocation);
+      }
+
+      updateChecksums(hnswFile, hnswFileName, hnswBlocks);
+      updateChecksums(linksDirOutput, linksLocation, linksDirBlocks);
+      updateChecksums(linksDataOutput, linksDataLocation, linksDataBlocks);
+    }
+
+    /* loadLinksOffsets() - .links.data offsets from the .links directory,
+     * for recovery before loadIndex() has run.
      */
-    
-    WriteCheckPointStatus(hnswFileName, CKPT_BEGIN_INCR_PASS2);
+    void loadLinksOffsets(const std::string & hnswFileName)
+    {
+      std::ifstream inputLinksDir(hnswFileName + ".links", std::ios::binary);
+      size_t current_data_pos = 0;
+      m_linksOffsetsInFile.clear();
+      while (inputLinksDir.good()) {
+        unsigned int nodeID = 0, linkListSize = 0;
+        readBinaryPOD(inputLinksDir, nodeID);
+        readBinaryPOD(inputLinksDir, linkListSize);
 
-    // Step 2 - Write to real hnsw index file now
-    int hnswFile = Open(hnswFileName.c_str(), O_RDWR | O_CREAT, 0600);
+        if (!inputLinksDir.good() || !linkListSize)
+          break;
 
-    saveIndexHeader(hnswFile, hnswFileName);
+        m_linksOffsetsInFile[nodeID] = current_data_pos;
+        current_data_pos = current_data_pos + linkListSize;
+      }
+    }
+
+    void doCheckPoint(const std::string &hnswFileName)
+    {
+   /* 
+    * 1. Write(ckptString_Step1) to status file
+    * 2. fsync(file);
+    * 3. open() checkpoint state file;
+    * 4. Start a new epoch, stream the dirty nodes to the file in journal
+    *    segments (snapshotJournal())
+    * 5. fsync(file)
+    * 6. Write(ckptString_Step1_Complete) to status file
+    * 7. fsync(status file);
+    * 8. Write the journal to real hnsw files in-place, a segment at a time
+    * 9. fsync(hnsw file);
+    *10. Write(ckptString_Complete) to status file
+    *
+    * In delta log mode (setDeltaLogMode()) steps 1-10 are replaced by one
+    * append + fsync to the delta log, see appendDeltaLog().
+  */
 
-    for (auto nodeId : mx_nodeUpdates) {
-        //char *nodeVectorAndLevel0Links = getDataByInternalId(nodeId);
-        char *nodeVectorAndLevel0Links = (char *)get_linklist0(nodeId);
-        
-        size_t ofs = (nodeVectorAndLevel0Links - data_level0_memory_) + HNSW_FILE_METADATA_SIZE;
-        Lseek(hnswFile, ofs, SEEK_SET, hnswFileName);
+    if (m_compactOnDisk) {
+      // in place writes need the fixed layout, one full rewrite first
+      rewriteIndexOnline(hnswFileName);
+      return;
+    }
+    saveHeatMap(hnswFileName);
+    if (m_deltaLog) {
+      appendDeltaLog(hnswFileName);
+      return;
+    }
+    foldDeltaLogs(hnswFileName); // left over from an earlier delta log mode
 
-        Write(hnswFile, nodeVectorAndLevel0Links, size_data_per_element_,
-              hnswFileName, __LINE__);
+    std::string ckptId = getCheckPointId();
+    std::vector<tableint> mx_nodeUpdates;
+    std::vector<tableint> mx_nodeLinksLevel0Updates;
+    std::vector<tableint> mx_nodeLinksLevelGt0Updates;
 
-        unsigned int linkListSizeLevelGt0 =
-          element_levels_[nodeId] > 0 ? size_links_per_element_ * element_levels_[nodeId] : 0;
-        if (linkListSizeLevelGt0)
-           mx_nodeLinksLevelGt0Updates.insert(nodeId); // defer pattern!
-    } // full node - vector data, level 0 links and higher level links
+    beginCheckPointIO();
+    try {
+      WriteCheckPointStatus(hnswFileName, CKPT_BEGIN_INCR_PASS1, ckptId);
 
+      std::string ckptFileName = hnswFileName + ".ckpt.state";
 
-    for (auto nodeId : mx_nodeLinksLevel0Updates) {
-        // check if this node level0 update is already processed above
-        if (mx_nodeUpdates.find(nodeId) != mx_nodeUpdates.end()) continue;
+      int ckptFile = Open(ckptFileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600); // new
+      size_t ckptOfs = 0;
+      snapshotJournal(
+          [&](const char * segment, size_t n) {
+            Pwrite(ckptFile, segment, n, ckptOfs, ckptFileName, __LINE__);
+            ckptOfs += n;
+          },
+          mx_nodeUpdates, mx_nodeLinksLevel0Updates, mx_nodeLinksLevelGt0Updates);
+      Fsync(ckptFile, ckptFileName);
+      Close(ckptFile, ckptFileName);
+
+      WriteCheckPointStatus(hnswFileName, CKPT_END_INCR_PASS1, ckptId);
+
+      /* All incremental state has been saved to ckpt file. Now we write to
+       * the "real" HNSW index files.
+       */
 
-        char *level0Links = (char *)get_linklist0(nodeId);
-        size_t ofs = (level0Links - data_level0_memory_) + HNSW_FILE_METADATA_SIZE;
-        Lseek(hnswFile, ofs, SEEK_SET, hnswFileName);
-        Write(hnswFile, level0Links, size_links_level0_, hnswFileName, __LINE__);
-        /// debug_print("Write level0 links of %lu at %lu.", nodeId, ofs);
-    }
+      WriteCheckPointStatus(hnswFileName, CKPT_BEGIN_INCR_PASS2, ckptId);
 
-    Fsync(hnswFile, hnswFileName);
+      std::string linksLocation = hnswFileName + ".links";
+      std::string linksDataLocation = hnswFileName + ".links.data";
 
-    Close(hnswFile, hnswFileName);
+      int hnswFile = Open(hnswFileName.c_str(), O_RDWR | O_CREAT, 0600);
+      int linksDirOutput  = Open(linksLocation.c_str(), O_RDWR | O_CREAT, 0600);
+      int linksDataOutput = Open(linksDataLocation.c_str(), O_RDWR | O_CREAT, 0600);
 
-    std::string linksLocation = hnswFileName + ".links";
-    std::string linksDataLocation = hnswFileName + ".links.data";
-    
-    int linksDirOutput  = Open(linksLocation.c_str(), O_RDWR | O_CREAT, 0600);
-    int linksDataOutput = Open(linksDataLocation.c_str(), O_RDWR | O_CREAT, 0600);
-
-    for (auto nodeId : mx_nodeLinksLevelGt0Updates) {
-        unsigned int linkListSize =
-          element_levels_[nodeId] > 0 ? size_links_per_element_ * element_levels_[nodeId] : 0;
-        if (linkListSize) {
-            size_t datafileOfs = 0;
-            if (m_linksOffsetsInFile.find(nodeId) == m_linksOffsetsInFile.end()) {
-              // first time addition of this node
-              Lseek(linksDirOutput, 0, SEEK_END, linksLocation);
-              Write(linksDirOutput, &nodeId, sizeof(nodeId),
-                    linksLocation, __LINE__);
-              Write(linksDirOutput, &linkListSize, sizeof(linkListSize), 
-                    linksLocation, __LINE__);
-              /// debug_print("Flushing new gt0 node %lu.", nodeId);
-            }
-            else {
-              datafileOfs = m_linksOffsetsInFile[nodeId];
-            }
-            if (datafileOfs)
-               Lseek(linksDataOutput, datafileOfs, SEEK_SET, linksDataLocation);
-            else
-            {
-               Lseek(linksDataOutput, 0, SEEK_END, linksDataLocation);
-               m_linksOffsetsInFile[nodeId] = Lseek(linksDataOutput, 0, SEEK_CUR, linksDataLocation);
-               /// debug_print("Writing Gt0 links of node %lu, size %lu, file offset %lu.",
-               ///            nodeId, linkListSize, m_linksOffsetsInFile[nodeId]);
-            }
-            Write(linksDataOutput, linkLists_[nodeId], linkListSize, linksDataLocation, __LINE__);
-        }
-    } // for Gt0 updates
+      applyJournalFile(hnswFile, linksDirOutput, linksDataOutput, hnswFileName,
+                       ckptFileName);
 
-    Fsync(linksDirOutput, linksLocation);
-    Fsync(linksDataOutput, linksDataLocation);
+      Fsync(hnswFile, hnswFileName);
+      Fsync(linksDirOutput, linksLocation);
+      Fsync(linksDataOutput, linksDataLocation);
 
-    Close(linksDirOutput, linksLocation);
-    Close(linksDataOutput, linksDataLocation);
+      Close(hnswFile, hnswFileName);
+      Close(linksDirOutput, linksLocation);
+      Close(linksDataOutput, linksDataLocation);
 
-    WriteCheckPointStatus(hnswFileName, CKPT_END_INCR_PASS2);
+      WriteCheckPointStatus(hnswFileName, CKPT_END_INCR_PASS2, ckptId);
 
-    setCheckPointComplete(hnswFileName);
+      // the flush lists now belong to the next epoch, do not clear them
+      WriteCheckPointStatus(hnswFileName, CKPT_CONSISTENT, ckptId);
+    } catch (...) {
+      endCheckPointIO();
+      requeueFlushLists(mx_nodeUpdates, mx_nodeLinksLevel0Updates,
+                        mx_nodeLinksLevelGt0Updates);
+      throw;
+    }
+    endCheckPointIO();
+    m_checkPointId = "[Invalid]";
 
     // ckpt file is not needed any more.
 
     } // doCheckPoint()
 
-    void doRecovery(const std::string &hnswFileName) {
+    /* Delta log durability mode. Each checkpoint appends one record to
+     * <index>.delta and fsyncs it once, instead of the two pass
+     * .ckpt.state + in place write. A record is :-
+     *
+     *   DELTA_LOG_MAGIC | payload length | ckptid[256] | payload | hash
+     *
+     * where the payload is a snapshotJournal() image and the hash is FNV-1a
+     * over ckptid and payload. A torn tail record fails the hash and is
+     * truncated away on load. When .delta grows past m_deltaLogCompactBytes
+     * it is renamed to .delta.old and a background thread folds it into
+     * the base files (the same writes doRecovery() does) and records its
+     * last ckptid in the status file before unlinking it. Loading replays
+     * .delta.old and then .delta over the base files in memory.
+     */
+#define DELTA_LOG_MAGIC                              0x31474f4c44564d59UL /* MYVDLOG1 */
+#define DELTA_LOG_CKPTID_SIZE                        256
 
-      /* Don't touch the checkpoint status file. We just "replay" the
-       * previous checkpoint and mark the index consistent on completion.
-       * If we crash during recovery, then the process is just repeated
-       * again from start.
-       */
-    
-      std::string ckptFileName = hnswFileName + ".ckpt.state";
-      int ckptFile = Open(ckptFileName.c_str(), O_RDWR);
-      int hnswFile = Open(hnswFileName.c_str(), O_RDWR);
-      
-      //read all the metadata fields first - directly into members
-      readIndexHeader(ckptFile);
+    static uint64_t DeltaLogHash(uint64_t h, const void * data, size_t nbytes)
+    {
+        const unsigned char * p = (const unsigned char *) data;
+        for (size_t i = 0; i < nbytes; i++) {
+            h ^= p[i];
+            h *= 0x100000001b3UL;
+        }
+        return h;
+    }
 
-      saveIndexHeader(hnswFile, hnswFileName);
+    void FsyncDir(const std::string & file)
+    {
+        size_t slash = file.find_last_of('/');
+        std::string dir = (slash == std::string::npos ? "." : file.substr(0, slash));
+        int fd = Open(dir, O_RDONLY);
+        Fsync(fd, dir);
+        Close(fd, dir);
+    }
 
-      cur_element_count = 0; // IMPORTANT
+    void setDeltaLogMode(bool enable, size_t compactBytes = 256UL * 1024 * 1024) {
+        m_deltaLog = enable;
+        m_deltaLogCompactBytes = compactBytes;
+    }
 
-      size_t nodeCount = 0, nodeLevel0LinksCount = 0, nodeLevelGt0LinksCount = 0;
+    bool getDeltaLogMode() const { return m_deltaLog; }
 
-      Read(ckptFile, &nodeCount, sizeof(nodeCount), ckptFileName, __LINE__);
-      Read(ckptFile, &nodeLevel0LinksCount, sizeof(nodeLevel0LinksCount),
-           ckptFileName, __LINE__);
-      Read(ckptFile, &nodeLevelGt0LinksCount, sizeof(nodeLevelGt0LinksCount),
-           ckptFileName, __LINE__);
+    void appendDeltaLog(const std::string & hnswFileName)
+    {
+        std::string logFileName = hnswFileName + ".delta";
 
-      debug_print("Recovery of %s, nodeCount=%lu,level0Links=%lu,levelGt0Links=%lu.",
-                  hnswFileName.c_str(), nodeCount, nodeLevel0LinksCount,
-                  nodeLevelGt0LinksCount);
- 
-      unsigned char *rdbuf = new unsigned char [65536];
+        std::string ckptId = getCheckPointId();
+        std::vector<tableint> mx_nodeUpdates;
+        std::vector<tableint> mx_nodeLinksLevel0Updates;
+        std::vector<tableint> mx_nodeLinksLevelGt0Updates;
 
-      std::map<tableint, std::vector<unsigned char>> levelGt0NodesLists;
+        beginCheckPointIO();
+        try {
+            struct stat st;
+            bool newFile = (stat(logFileName.c_str(), &st) != 0);
+
+            int logFile = Open(logFileName, O_WRONLY | O_CREAT, 0600);
+            if (fstat(logFile, &st) != 0)
+                throw std::runtime_error("Cannot stat " + logFileName);
+
+            // the payload is streamed after the ckptid, the header with its
+            // length and the hash are written last, all under one fsync
+            uint64_t hdr[2] = {DELTA_LOG_MAGIC, 0};
+            char ckptid[DELTA_LOG_CKPTID_SIZE];
+            memset(ckptid, 0, sizeof(ckptid));
+            strncpy(ckptid, ckptId.c_str(), sizeof(ckptid) - 1);
+            uint64_t hash = DeltaLogHash(0xcbf29ce484222325UL, ckptid, sizeof(ckptid));
+            size_t payloadOfs = st.st_size + sizeof(hdr) + sizeof(ckptid);
+            try {
+                Pwrite(logFile, ckptid, sizeof(ckptid), st.st_size + sizeof(hdr),
+                       logFileName, __LINE__);
+                snapshotJournal(
+                    [&](const char * segment, size_t n) {
+                        Pwrite(logFile, segment, n, payloadOfs + hdr[1], logFileName,
+                               __LINE__);
+                        hash = DeltaLogHash(hash, segment, n);
+                        hdr[1] += n;
+                    },
+                    mx_nodeUpdates, mx_nodeLinksLevel0Updates, mx_nodeLinksLevelGt0Updates);
+                Pwrite(logFile, &hash, sizeof(hash), payloadOfs + hdr[1], logFileName,
+                       __LINE__);
+                Pwrite(logFile, hdr, sizeof(hdr), st.st_size, logFileName, __LINE__);
+            } catch (...) {
+                // a partial record would hide the records appended after it
+                if (ftruncate(logFile, st.st_size) != 0)
+                    error_print("Cannot truncate %s.", logFileName.c_str());
+                close(logFile);
+                throw;
+            }
 
-      for (size_t i = 0; i < nodeCount; i++) {
+            Fsync(logFile, logFileName);
+            Close(logFile, logFileName);
+            if (newFile)
+                FsyncDir(logFileName);
+        } catch (...) {
+            endCheckPointIO();
+            requeueFlushLists(mx_nodeUpdates, mx_nodeLinksLevel0Updates,
+                              mx_nodeLinksLevelGt0Updates);
+            throw;
+        }
+        endCheckPointIO();
+        m_checkPointId = "[Invalid]";
+
+        startDeltaLogCompaction(hnswFileName);
+    }
+
+    /* readDeltaLog() - call fn(ckptid, payload, length) for each complete
+     * record of 'logFileName', truncate a torn tail. Returns the number of
+     * records.
+     */
+    size_t readDeltaLog(const std::string & logFileName,
+                        std::function<void(const std::string &, const char *, size_t)> fn)
+    {
+        int logFile = open(logFileName.c_str(), O_RDWR);
+        if (logFile == -1)
+            return 0;
+
+        struct stat st;
+        if (fstat(logFile, &st) != 0) {
+            Close(logFile, logFileName);
+            throw std::runtime_error("Cannot stat " + logFileName);
+        }
+        size_t fileSize = st.st_size, ofs = 0, nrecords = 0;
+        const size_t fixed = 2 * sizeof(uint64_t) + DELTA_LOG_CKPTID_SIZE + sizeof(uint64_t);
+        std::vector<char> rec;
+        while (ofs + fixed <= fileSize) {
+            uint64_t hdr[2];
+            Pread(logFile, hdr, sizeof(hdr), ofs, logFileName, __LINE__);
+            if (hdr[0] != DELTA_LOG_MAGIC || ofs + fixed + hdr[1] > fileSize)
+                break;
+            rec.resize(DELTA_LOG_CKPTID_SIZE + hdr[1] + sizeof(uint64_t));
+            Pread(logFile, rec.data(), rec.size(), ofs + sizeof(hdr), logFileName, __LINE__);
+            uint64_t hash = 0;
+            memcpy(&hash, rec.data() + rec.size() - sizeof(hash), sizeof(hash));
+            if (hash != DeltaLogHash(0xcbf29ce484222325UL, rec.data(), rec.size() - sizeof(hash)))
+                break;
+            std::string ckptid(rec.data(), strnlen(rec.data(), DELTA_LOG_CKPTID_SIZE));
+            fn(ckptid, rec.data() + DELTA_LOG_CKPTID_SIZE, hdr[1]);
+            ofs += fixed + hdr[1];
+            nrecords++;
+        }
+        if (ofs < fileSize) {
+            warning_print("Delta log %s has an incomplete record at offset %lu, "
+                          "truncating %lu bytes.", logFileName.c_str(), ofs, fileSize - ofs);
+            if (ftruncate(logFile, ofs) != 0)
+                throw std::runtime_error("Cannot truncate " + logFileName);
+            Fsync(logFile, logFileName);
+        }
+        Close(logFile, logFileName);
+        return nrecords;
+    }
+
+    /* walkJournalSegment() - the records of the segment at 'p'. Returns the
+     * end of the segment, or nullptr if it runs past 'end'.
+     */
+    const char * walkJournalSegment(const char * p, const char * end,
+                                    std::function<void(const char *)> header,
+                                    std::function<void(tableint, const char *, const char *, unsigned int)> fullNode,
+                                    std::function<void(tableint, const char *)> level0Links,
+                                    std::function<void(tableint, const char *, unsigned int)> levelGt0Links)
+    {
+        bool ok = true;
+        auto take = [&](size_t n) {
+            ok = ok && n <= (size_t) (end - p);
+            const char * q = p;
+            if (ok)
+                p += n;
+            return q;
+        };
+        const char * hdr = take(HNSW_FILE_METADATA_SIZE);
+        size_t counts[3] = {0, 0, 0};
+        const char * c = take(sizeof(counts));
+        if (!ok)
+            return nullptr;
+        header(hdr);
+        memcpy(counts, c, sizeof(counts));
         tableint nodeId;
         unsigned int sz;
-        
-        Read(ckptFile, &nodeId, sizeof(nodeId), ckptFileName, __LINE__);
-        Read(ckptFile, &sz, sizeof(sz), ckptFileName, __LINE__);
+        auto next = [&](unsigned int & size) {
+            const char * q = take(sizeof(nodeId) + sizeof(size));
+            if (ok) {
+                memcpy(&nodeId, q, sizeof(nodeId));
+                memcpy(&size, q + sizeof(nodeId), sizeof(size));
+            }
+            return ok;
+        };
+        for (size_t i = 0; i < counts[0]; i++) {
+            if (!next(sz))
+                return nullptr;
+            const char * data = take(sz);
+            const char * q = take(sizeof(sz));
+            if (!ok)
+                return nullptr;
+            memcpy(&sz, q, sizeof(sz));
+            const char * links = take(sz);
+            if (!ok)
+                return nullptr;
+            fullNode(nodeId, data, links, sz);
+        }
+        for (size_t i = 0; i < counts[1]; i++) {
+            if (!next(sz))
+                return nullptr;
+            const char * links = take(sz);
+            if (!ok)
+                return nullptr;
+            level0Links(nodeId, links);
+        }
+        for (size_t i = 0; i < counts[2]; i++) {
+            if (!next(sz))
+                return nullptr;
+            const char * links = take(sz);
+            if (!ok)
+                return nullptr;
+            levelGt0Links(nodeId, links, sz);
+        }
+        return p;
+    }
 
-        Read(ckptFile, rdbuf, sz, ckptFileName, __LINE__);
+    /* forEachJournalRecord() - walk the segments of a snapshotJournal() image. */
+    void forEachJournalRecord(const char * payload, size_t len,
+                              std::function<void(const char *)> header,
+                              std::function<void(tableint, const char *, const char *, unsigned int)> fullNode,
+                              std::function<void(tableint, const char *)> level0Links,
+                              std::function<void(tableint, const char *, unsigned int)> levelGt0Links)
+    {
+        const char * p = payload, * end = payload + len;
+        do {
+            p = walkJournalSegment(p, end, header, fullNode, level0Links, levelGt0Links);
+            if (!p)
+                throw std::runtime_error("Journal record is corrupted");
+        } while (p < end);
+    }
 
-        size_t ofs = (nodeId * size_data_per_element_) + offsetData_ +
-                        HNSW_FILE_METADATA_SIZE;
+    /* applyJournalFile() - apply a journal file segment by segment, reading
+     * each into a window that grows only for a segment larger than
+     * CKPT_JOURNAL_SEGMENT_BYTES.
+     */
+    void applyJournalFile(int hnswFile, int linksDirOutput, int linksDataOutput,
+                          const std::string & hnswFileName, const std::string & journalFile)
+    {
+      int fd = Open(journalFile.c_str(), O_RDONLY);
+      try {
+        size_t size = fileSizeOf(fd, journalFile);
+        size_t window = CKPT_JOURNAL_SEGMENT_BYTES + CKPT_IO_BUFFER_BYTES;
+        std::vector<char> segment;
+        auto none = [](tableint, const char *, unsigned int) {};
+        size_t ofs = 0;
+        do {
+          size_t n = std::min(window, size - ofs);
+          segment.resize(n);
+          Pread(fd, segment.data(), n, ofs, journalFile, __LINE__);
+          const char * end = walkJournalSegment(segment.data(), segment.data() + n,
+              [](const char *) {}, [](tableint, const char *, const char *, unsigned int) {},
+              [](tableint, const char *) {}, none);
+          if (!end) {
+            if (ofs + n == size)
+              throw std::runtime_error("Journal " + journalFile + " is truncated");
+            window *= 2;
+            continue;
+          }
+          size_t len = end - segment.data();
+          applyJournal(hnswFile, linksDirOutput, linksDataOutput, hnswFileName,
+                       segment.data(), len);
+          ofs += len;
+        } while (ofs < size);
+      } catch (...) {
+        close(fd);
+        throw;
+      }
+      Close(fd, journalFile);
+    }
 
-        Lseek(hnswFile, ofs, SEEK_SET, hnswFileName);
-        Write(hnswFile, rdbuf, sz, hnswFileName, __LINE__);
-	
-        unsigned int listsz = 0;
-        Read(ckptFile, &listsz, sizeof(listsz), ckptFileName, __LINE__);
-        if (listsz) {
-          Read(ckptFile, rdbuf, listsz, ckptFileName, __LINE__);
-          std::vector<unsigned char> saveList(rdbuf, rdbuf + listsz);
-          levelGt0NodesLists[nodeId] = saveList; // stash for later
+    /* replayDeltaLogs() - called after the base files are loaded. */
+    void replayDeltaLogs(const std::string & hnswFileName)
+    {
+        std::string lastCkptId;
+        size_t nrecords = 0;
+
+        auto setLinks = [&](tableint nodeId, const char * links, unsigned int sz) {
+            if (element_levels_[nodeId] > 0 && !isMappedLinkList(linkLists_[nodeId]))
+                free(linkLists_[nodeId]);
+            linkLists_[nodeId] = nullptr;
+            element_levels_[nodeId] = sz / size_links_per_element_;
+            if (sz) {
+                linkLists_[nodeId] = (char *) malloc(sz);
+                if (linkLists_[nodeId] == nullptr)
+                    throw std::runtime_error("Not enough memory: replayDeltaLogs failed to allocate linklist");
+                memcpy(linkLists_[nodeId], links, sz);
+            }
+        };
+
+        auto apply = [&](const std::string & ckptid, const char * payload, size_t len) {
+            forEachJournalRecord(payload, len,
+                [&](const char * hdr) {
+                    size_t maxElements, count;
+                    memcpy(&maxElements, hdr + sizeof(size_t), sizeof(maxElements));
+                    memcpy(&count, hdr + 2 * sizeof(size_t), sizeof(count));
+                    if (maxElements != max_elements_ || count > max_elements_)
+                        throw std::runtime_error("Delta log does not match index " + hnswFileName);
+                    for (size_t i = cur_element_count; i < count; i++) {
+                        element_levels_[i] = 0;
+                        linkLists_[i] = nullptr;
+                    }
+                    cur_element_count = std::max((size_t) cur_element_count, count);
+                    memcpy(&maxlevel_, hdr + 6 * sizeof(size_t), sizeof(maxlevel_));
+                    memcpy(&enterpoint_node_, hdr + 6 * sizeof(size_t) + sizeof(int),
+                           sizeof(enterpoint_node_));
+                },
+                [&](tableint nodeId, const char * data, const char * links, unsigned int sz) {
+                    memcpy(get_linklist0(nodeId), data, size_data_per_element_);
+                    setLinks(nodeId, links, sz);
+                },
+                [&](tableint nodeId, const char * links) {
+                    memcpy(get_linklist0(nodeId), links, size_links_level0_);
+                },
+                setLinks);
+            lastCkptId = ckptid;
+            nrecords++;
+        };
+
+        readDeltaLog(hnswFileName + ".delta.old", apply);
+        readDeltaLog(hnswFileName + ".delta", apply);
+        if (!nrecords)
+            return;
+
+        info_print("Replayed %lu delta log records of %s, checkpoint %s.", nrecords,
+                   hnswFileName.c_str(), lastCkptId.c_str());
+        setCheckPointId(lastCkptId);
+
+        if (m_labelLookupPending)
+            return; // mmap load, built from the replayed memory on first use
+        label_lookup_.clear();
+        deleted_elements.clear();
+        num_deleted_ = 0;
+        for (size_t i = 0; i < cur_element_count; i++) {
+            label_lookup_[getExternalLabel(i)] = i;
+            if (isMarkedDeleted(i)) {
+                num_deleted_ += 1;
+                if (allow_replace_deleted_) deleted_elements.insert(i);
+            }
         }
-      }
+    }
 
-      for (size_t i = 0; i < nodeLevel0LinksCount; i++) {
-        tableint nodeId;
-        unsigned int listsz;
+    /* foldDeltaLog() - apply the records of 'logFileName' to the base files
+     * and make that the consistent checkpoint. Runs on the compactor thread
+     * or, when leaving delta log mode, inline.
+     */
+    void foldDeltaLog(const std::string & hnswFileName, const std::string & logFileName)
+    {
+        std::string linksLocation = hnswFileName + ".links";
+        std::string linksDataLocation = hnswFileName + ".links.data";
+        std::string lastCkptId;
 
-        Read(ckptFile, &nodeId, sizeof(nodeId), ckptFileName, __LINE__);
-        Read(ckptFile, &listsz, sizeof(listsz), ckptFileName, __LINE__);
+        int hnswFile = Open(hnswFileName, O_RDWR);
+        int linksDirOutput  = Open(linksLocation, O_RDWR | O_CREAT, 0600);
+        int linksDataOutput = Open(linksDataLocation, O_RDWR | O_CREAT, 0600);
 
-        Read(ckptFile, rdbuf, listsz, ckptFileName, __LINE__);
+        size_t nrecords = readDeltaLog(logFileName,
+            [&](const std::string & ckptid, const char * payload, size_t len) {
+                applyJournal(hnswFile, linksDirOutput, linksDataOutput, hnswFileName,
+                             payload, len);
+                lastCkptId = ckptid;
+            });
 
-        size_t ofs = (nodeId * size_data_per_element_) + offsetLevel0_ + 
-                        HNSW_FILE_METADATA_SIZE;
+        Fsync(hnswFile, hnswFileName);
+        Fsync(linksDirOutput, linksLocation);
+        Fsync(linksDataOutput, linksDataLocation);
+        Close(hnswFile, hnswFileName);
+        Close(linksDirOutput, linksLocation);
+        Close(linksDataOutput, linksDataLocation);
+
+        if (nrecords)
+            WriteCheckPointStatus(hnswFileName, CKPT_CONSISTENT, lastCkptId);
+        unlink(logFileName.c_str());
+        FsyncDir(logFileName);
+        info_print("Folded %lu delta log records of %s into the index files.",
+                   nrecords, hnswFileName.c_str());
+    }
 
-        Lseek(hnswFile, ofs, SEEK_SET, hnswFileName);
-        Write(hnswFile, rdbuf, listsz, hnswFileName, __LINE__);
-      }
+    /* startDeltaLogCompaction() - rotate .delta to .delta.old once it is
+     * past the size limit and fold it on a background thread.
+     */
+    void startDeltaLogCompaction(const std::string & hnswFileName)
+    {
+        if (m_deltaCompacting)
+            return;
+        if (m_deltaCompactor.joinable())
+            m_deltaCompactor.join();
+
+        std::string logFileName = hnswFileName + ".delta";
+        std::string oldFileName = hnswFileName + ".delta.old";
+        struct stat st;
+        if (stat(oldFileName.c_str(), &st) != 0) { // no left over to fold first
+            if (stat(logFileName.c_str(), &st) != 0 ||
+                static_cast<size_t>(st.st_size) < m_deltaLogCompactBytes)
+                return;
+            if (rename(logFileName.c_str(), oldFileName.c_str()) != 0)
+                throw std::runtime_error("Cannot rename " + logFileName);
+            FsyncDir(oldFileName);
+        }
 
-      for (size_t i = 0; i < nodeLevelGt0LinksCount; i++) {
-        tableint nodeId;
-        unsigned int listsz;
-        
-        Read(ckptFile, &nodeId, sizeof(nodeId), ckptFileName, __LINE__);
-        Read(ckptFile, &listsz, sizeof(listsz), ckptFileName, __LINE__);
-        
-        Read(ckptFile, rdbuf, listsz, ckptFileName, __LINE__);
-        
-        std::vector<unsigned char> saveList(rdbuf, rdbuf + listsz);
-        levelGt0NodesLists[nodeId] = saveList;
-      }
+        m_deltaCompacting = true;
+        m_deltaCompactor = std::thread([this, hnswFileName, oldFileName]() {
+            try {
+                foldDeltaLog(hnswFileName, oldFileName);
+            } catch (std::exception & e) {
+                error_print("Delta log compaction of %s failed : %s",
+                            hnswFileName.c_str(), e.what());
+            }
+            m_deltaCompacting = false;
+        });
+    }
+
+    /* foldDeltaLogs() - wait for the compactor and fold whatever is left,
+     * used before the classic checkpoint touches the base files.
+     */
+    void foldDeltaLogs(const std::string & hnswFileName)
+    {
+        if (m_deltaCompactor.joinable())
+            m_deltaCompactor.join();
+        struct stat st;
+        for (auto suffix : {".delta.old", ".delta"}) {
+            std::string logFileName = hnswFileName + suffix;
+            if (stat(logFileName.c_str(), &st) == 0)
+                foldDeltaLog(hnswFileName, logFileName);
+        }
+    }
+
+    void removeDeltaLogs(const std::string & hnswFileName)
+    {
+        if (m_deltaCompactor.joinable())
+            m_deltaCompactor.join();
+        unlink((hnswFileName + ".delta.old").c_str());
+        unlink((hnswFileName + ".delta").c_str());
+    }
+
+    void doRecovery(const std::string &hnswFileName) {
 
+      /* Don't touch the checkpoint status file. We just "replay" the
+       * previous checkpoint and mark the index consistent on completion.
+       * If we crash during recovery, then the process is just repeated
+       * again from start.
+       */
+    
+      std::string ckptFileName = hnswFileName + ".ckpt.state";
       std::string linksLocation = hnswFileName + ".links";
       std::string linksDataLocation = hnswFileName + ".links.data";
 
-      // Restarting after crash - read & load the offsets map for links gt 0
-      size_t current_data_pos = 0;
-      std::map<tableint, size_t> gt0linksOffsetsInFile; // temporary
-      std::ifstream inputLinksDir(linksLocation, std::ios::binary);
-      while (inputLinksDir.good()) {
-            unsigned int nodeID = 0,linkListSize = 0;
-            readBinaryPOD(inputLinksDir, nodeID);
-            readBinaryPOD(inputLinksDir, linkListSize);
-            
-            gt0linksOffsetsInFile[nodeID] = current_data_pos;
-            current_data_pos = current_data_pos + linkListSize;
-      }
-      inputLinksDir.close();
+      // header fields are needed for the record offsets
+      std::vector<char> image(HNSW_FILE_METADATA_SIZE);
+      int ckptFile = Open(ckptFileName.c_str(), O_RDONLY);
+      size_t journalSize = fileSizeOf(ckptFile, ckptFileName);
+      if (journalSize < image.size())
+        throw std::runtime_error("Journal " + ckptFileName + " is truncated");
+      Pread(ckptFile, image.data(), image.size(), 0, ckptFileName, __LINE__);
+      Close(ckptFile, ckptFileName); // No writes, only read
 
-      // Now write the levels > 0 links to specific files
-    
-      int linksDirOutput  = Open(linksLocation.c_str(), O_RDWR);
-      int linksDataOutput = Open(linksDataLocation.c_str(), O_RDWR);
-
-      /* ordered map is important for levelGt0NodesLists */
-
-      Lseek(linksDirOutput, 0, SEEK_SET, linksLocation);
-      for (auto iter : levelGt0NodesLists) { 
-        tableint nodeId = iter.first;
-        unsigned int linkListSize = iter.second.size();
-        if (linkListSize) {
-            size_t datafileOfs = 0;
-            if (gt0linksOffsetsInFile.find(nodeId) == gt0linksOffsetsInFile.end()) {
-              // First time addition of this node - ordered map is key
-              Lseek(linksDirOutput, 0, SEEK_END, linksLocation);
-              Write(linksDirOutput, &nodeId, sizeof(nodeId),
-                    linksLocation, __LINE__);
-              Write(linksDirOutput, &linkListSize, sizeof(linkListSize), 
-                    linksLocation, __LINE__);
-            }
-            else {
-              datafileOfs = gt0linksOffsetsInFile[nodeId];
-            }
-            if (datafileOfs)
-               Lseek(linksDataOutput, datafileOfs, SEEK_SET, linksDataLocation);
-            else
-            {
-               Lseek(linksDataOutput, 0, SEEK_END, linksDataLocation);
-               gt0linksOffsetsInFile[nodeId] = Lseek(linksDataOutput, 0, SEEK_CUR, linksDataLocation);
-            }
-            std::vector<unsigned char> li = iter.second;
-            Write(linksDataOutput, li.data(), linkListSize, linksDataLocation, __LINE__);
-        }
-      } // for Gt0 updates - ordered map
+      debug_print("Recovery of %s, journal of %lu bytes.", hnswFileName.c_str(),
+                  journalSize);
+
+      loadLinksOffsets(hnswFileName); // Restarting after crash
+
+      int hnswFile = Open(hnswFileName.c_str(), O_RDWR);
+      int linksDirOutput  = Open(linksLocation.c_str(), O_RDWR | O_CREAT, 0600);
+      int linksDataOutput = Open(linksDataLocation.c_str(), O_RDWR | O_CREAT, 0600);
+
+      memcpy(&offsetLevel0_, image.data(), sizeof(offsetLevel0_));
+      memcpy(&size_data_per_element_, image.data() + 3 * sizeof(size_t),
+             sizeof(size_data_per_element_));
+      memcpy(&maxM_, image.data() + 6 * sizeof(size_t) + sizeof(int) + sizeof(tableint),
+             sizeof(maxM_));
+      memcpy(&maxM0_, image.data() + 7 * sizeof(size_t) + sizeof(int) + sizeof(tableint),
+             sizeof(maxM0_));
+      size_links_level0_ = maxM0_ * sizeof(tableint) + sizeof(linklistsizeint);
+
+      applyJournalFile(hnswFile, linksDirOutput, linksDataOutput, hnswFileName,
+                       ckptFileName);
 
       Fsync(linksDirOutput, linksLocation);
 
@@ -705,12 +1812,8 @@
 
       Close(hnswFile, hnswFileName);
 
-      Close(ckptFile, ckptFileName); // No writes, only read
-      
       setCheckPointComplete(hnswFileName); // Recovery complete, mark CONSISTENT
 
-      delete[] rdbuf;
-      
     } // doRecovery()
 
     size_t indexFileMetadataSize() const {
@@ -763,6 +1866,27 @@
         Write(hnswFile, &ef_construction_, sizeof(ef_construction_), filename, __LINE__);
     }
     
+    /* appendIndexHeader() - the saveIndexHeader() bytes into a journal image. */
+    void appendIndexHeader(std::vector<char> & image) {
+        size_t count = cur_element_count;
+        auto append = [&](const void * p, size_t n) {
+            image.insert(image.end(), (const char *) p, (const char *) p + n);
+        };
+        append(&offsetLevel0_, sizeof(offsetLevel0_));
+        append(&max_elements_, sizeof(max_elements_));
+        append(&count, sizeof(count));
+        append(&size_data_per_element_, sizeof(size_data_per_element_));
+        append(&label_offset_, sizeof(label_offset_));
+        append(&offsetData_, sizeof(offsetData_));
+        append(&maxlevel_, sizeof(maxlevel_));
+        append(&enterpoint_node_, sizeof(enterpoint_node_));
+        append(&maxM_, sizeof(maxM_));
+        append(&maxM0_, sizeof(maxM0_));
+        append(&M_, sizeof(M_));
+        append(&mult_, sizeof(mult_));
+        append(&ef_construction_, sizeof(ef_construction_));
+    }
+
     void readIndexHeader(int hnswFile) {
         Read(hnswFile, &offsetLevel0_, sizeof(offsetLevel0_), __FILE__, __LINE__);
         Read(hnswFile, &max_elements_, sizeof(max_elements_), __FILE__, __LINE__);
@@ -806,24 +1930,38 @@
       m_checkPointId = "[Invalid]";
     }
 
+    /* saveIndex() - full write of the index. With 'compact' the snapshot
+     * is written in the compact format (saveIndexCompact()) and .links /
+     * .links.data are left empty.
+     */
     void saveIndex(const std::string &hnswFileName) {
+        saveIndex(hnswFileName, false);
+    }
+
+    void saveIndex(const std::string &hnswFileName, bool compact) {
+        if (m_level0Map)
+          detachMmap(); // the files below are truncated & rewritten
+        removeDeltaLogs(hnswFileName); // the full write supersedes the log
+        std::unique_lock<std::mutex> lock(m_fileWriteMutex);
         WriteCheckPointStatus(hnswFileName, CKPT_BEGIN_FULL_WRITE);
         int hnswFile = Open(hnswFileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
 
-        saveIndexHeader(hnswFile, hnswFileName);
-
-        // This write() could do GBs of data write. All vectors & all level0
-        // links are written to disk by this single Write() call.
-        size_t xx = cur_element_count;
-        size_t wrc = 0, wc = (cur_element_count * size_data_per_element_);
-        while (1) {
-          ssize_t ret = write(hnswFile, &data_level0_memory_[wrc], wc);
-          if (ret < 0) {
-            break;
+        if (compact) {
+          saveIndexCompact(hnswFile, hnswFileName);
+        } else {
+          saveIndexHeader(hnswFile, hnswFileName);
+
+          // This write() could do GBs of data write. All vectors & all level0
+          // links are written to disk by this single Write() call.
+          size_t wrc = 0, wc = (cur_element_count * size_data_per_element_);
+          while (wc) {
+            ssize_t ret = write(hnswFile, &data_level0_memory_[wrc], wc);
+            if (ret < 0) {
+              break;
+            }
+            wrc += ret;
+            wc -= ret;
           }
-          wrc += ret;
-          wc -= ret;
-          if (!wc) break;
         }
 
         Fsync(hnswFile, hnswFileName);
@@ -834,13 +1972,17 @@
         std::string linksDataLocation = hnswFileName + ".links.data";
         int gt0LinksDataF = Open(linksDataLocation.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
 
-        for (size_t i = 0; i < cur_element_count; i++) {
+        m_linksOffsetsInFile.clear();
+        size_t current_data_pos = 0;
+        for (size_t i = 0; !compact && i < cur_element_count; i++) {
             unsigned int linkListSize = element_levels_[i] > 0 ? 
               (size_links_per_element_ * element_levels_[i]) : 0;
             if (linkListSize)
               debug_print("Writing links of size %u for node %lu.", linkListSize, i);
             if (linkListSize) {
               unsigned int nodeID = i;
+              m_linksOffsetsInFile[nodeID] = current_data_pos;
+              current_data_pos += linkListSize;
               Write(gt0LinksF, &nodeID, sizeof(nodeID), linksLocation, __LINE__);
               Write(gt0LinksF, &linkListSize, sizeof(linkListSize), linksLocation, __LINE__);
 
@@ -852,17 +1994,461 @@
 
         Fsync(gt0LinksDataF, linksDataLocation);
         Close(gt0LinksDataF, linksDataLocation);
-        
+
+        writeChecksumFile(hnswFileName);
+        writeChecksumFile(linksLocation);
+        writeChecksumFile(linksDataLocation);
+
         WriteCheckPointStatus(hnswFileName, CKPT_END_FULL_WRITE);
 
+        m_compactOnDisk = compact;
         setCheckPointComplete(hnswFileName);
+        saveHeatMap(hnswFileName);
     } // saveIndex()
 
+    /* rewriteIndexOnline() - full write of the index in the fixed layout,
+     * for the first checkpoint after a compact save or load and for the
+     * graph that a compaction or an import swapped in. As in
+     * snapshotJournal() the epoch is held exclusive only to take the flush
+     * lists and the header fields. Each element is then copied under its
+     * link_list_locks_, without links to elements added since, and written
+     * while inserts and deletes go on; they are in the new epoch's flush
+     * lists for the next checkpoint.
+     */
+    void rewriteIndexOnline(const std::string &hnswFileName)
+    {
+      std::vector<tableint> mx_nodeUpdates;
+      std::vector<tableint> mx_nodeLinksLevel0Updates;
+      std::vector<tableint> mx_nodeLinksLevelGt0Updates;
+      size_t count;
+      int maxlevel;
+      tableint enterpoint;
+      {
+        auto epoch = swapEpoch();
+        takeFlushLists(mx_nodeUpdates, mx_nodeLinksLevel0Updates, mx_nodeLinksLevelGt0Updates);
+        count = cur_element_count;
+        maxlevel = maxlevel_;
+        enterpoint = enterpoint_node_;
+      }
+
+      std::string ckptId = getCheckPointId();
+      std::string linksLocation = hnswFileName + ".links";
+      std::string linksDataLocation = hnswFileName + ".links.data";
+      std::unordered_map<tableint, size_t> linksOffsets;
+      try {
+        removeDeltaLogs(hnswFileName); // the full write supersedes the log
+        std::unique_lock<std::mutex> lock(m_fileWriteMutex);
+        WriteCheckPointStatus(hnswFileName, CKPT_BEGIN_FULL_WRITE, ckptId);
+
+        int hnswFile = Open(hnswFileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        int gt0LinksF = Open(linksLocation.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        int gt0LinksDataF = Open(linksDataLocation.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+        std::vector<char> buf, linksBuf, linksDataBuf, element, upper;
+        appendIndexHeader(element);
+        memcpy(&element[2 * sizeof(size_t)], &count, sizeof(count));
+        memcpy(&element[6 * sizeof(size_t)], &maxlevel, sizeof(maxlevel));
+        memcpy(&element[6 * sizeof(size_t) + sizeof(int)], &enterpoint, sizeof(enterpoint));
+        BufferedWrite(hnswFile, buf, element.data(), element.size(), hnswFileName);
+
+        size_t current_data_pos = 0;
+        for (size_t i = 0; i < count; i++) {
+          unsigned int linkListSize;
+          {
+            std::unique_lock<std::mutex> l(link_list_locks_[i]);
+            const char * p = data_level0_memory_ + i * size_data_per_element_;
+            element.assign(p, p + size_data_per_element_);
+            linkListSize = element_levels_[i] > 0 ?
+                             size_links_per_element_ * element_levels_[i] : 0;
+            upper.assign(linkLists_[i], linkLists_[i] + linkListSize);
+          }
+          dropLinksFrom(&element[offsetLevel0_], count);
+          BufferedWrite(hnswFile, buf, element.data(), element.size(), hnswFileName);
+          if (!linkListSize)
+            continue;
+          for (size_t l = 0; l < linkListSize / size_links_per_element_; l++)
+            dropLinksFrom(&upper[l * size_links_per_element_], count);
+          unsigned int nodeID = i;
+          linksOffsets[nodeID] = current_data_pos;
+          current_data_pos += linkListSize;
+          BufferedWrite(gt0LinksF, linksBuf, &nodeID, sizeof(nodeID), linksLocation);
+          BufferedWrite(gt0LinksF, linksBuf, &linkListSize, sizeof(linkListSize), linksLocation);
+          BufferedWrite(gt0LinksDataF, linksDataBuf, upper.data(), linkListSize, linksDataLocation);
+        }
+        FlushWriteBuffer(hnswFile, buf, hnswFileName);
+        FlushWriteBuffer(gt0LinksF, linksBuf, linksLocation);
+        FlushWriteBuffer(gt0LinksDataF, linksDataBuf, linksDataLocation);
+
+        Fsync(hnswFile, hnswFileName);
+        Close(hnswFile, hnswFileName);
+        Fsync(gt0LinksF, linksLocation);
+        Close(gt0LinksF, linksLocation);
+        Fsync(gt0LinksDataF, linksDataLocation);
+        Close(gt0LinksDataF, linksDataLocation);
+
+        writeChecksumFile(hnswFileName);
+        writeChecksumFile(linksLocation);
+        writeChecksumFile(linksDataLocation);
+
+        WriteCheckPointStatus(hnswFileName, CKPT_END_FULL_WRITE, ckptId);
+        // the flush lists now belong to the next epoch, do not clear them
+        WriteCheckPointStatus(hnswFileName, CKPT_CONSISTENT, ckptId);
+      } catch (...) {
+        requeueFlushLists(mx_nodeUpdates, mx_nodeLinksLevel0Updates,
+                          mx_nodeLinksLevelGt0Updates);
+        throw;
+      }
+      m_linksOffsetsInFile.swap(linksOffsets);
+      m_compactOnDisk = false;
+      m_checkPointId = "[Invalid]";
+      saveHeatMap(hnswFileName);
+    }
+
+    /* Compact snapshot format. The fixed layout stores maxM0_ level 0 slots
+     * and maxM_ slots per upper level for every element, mostly empty. The
+     * compact format stores each element as :-
+     *
+     *   flags byte | level 0 list | vector + label | level | upper lists
+     *
+     * where a list is a varint count followed by the sorted neighbour ids,
+     * first as a varint and the rest as varint deltas. The file starts with
+     * HNSW_COMPACT_MAGIC and the usual 96 byte header. loadIndex() decodes
+     * it into the in-memory layout. In place checkpoints need the fixed
+     * layout, so the first doCheckPoint() after a compact save or load
+     * rewrites the index in the fixed layout.
+     */
+#define HNSW_COMPACT_MAGIC                           0x3154504d4356594dUL /* MYVCMPT1 */
+
+    static void PutVarint(std::vector<char> & buf, uint32_t v)
+    {
+        while (v >= 0x80) {
+            buf.push_back((char) (v | 0x80));
+            v >>= 7;
+        }
+        buf.push_back((char) v);
+    }
+
+    static const char * GetVarint(const char * p, const char * end, uint32_t & v)
+    {
+        v = 0;
+        for (int shift = 0; shift < 35; shift += 7) {
+            if (p >= end)
+                break;
+            unsigned char b = *p++;
+            v |= (uint32_t) (b & 0x7f) << shift;
+            if (!(b & 0x80))
+                return p;
+        }
+        throw std::runtime_error("Compact index seems to be corrupted");
+    }
+
+    static bool isCompactIndexFile(const std::string & location)
+    {
+        std::ifstream input(location, std::ios::binary);
+        uint64_t magic = 0;
+        readBinaryPOD(input, magic);
+        return input.good() && magic == HNSW_COMPACT_MAGIC;
+    }
+
+    void saveIndexCompact(int hnswFile, const std::string & hnswFileName)
+    {
+        saveIndexCompact(hnswFile, hnswFileName, cur_element_count, maxlevel_,
+                         enterpoint_node_);
+    }
+
+    /* saveIndexCompact() - the first 'count' elements with the header fields
+     * taken at the same time. Each element is copied under its
+     * link_list_locks_ and its links to elements added since are dropped,
+     * so inserts and deletes may run during the write (exportIndex()).
+     */
+    void saveIndexCompact(int hnswFile, const std::string & hnswFileName,
+                          size_t count, int maxlevel, tableint enterpoint)
+    {
+        std::vector<char> buf, rec, element, upper;
+        uint64_t magic = HNSW_COMPACT_MAGIC;
+        BufferedWrite(hnswFile, buf, &magic, sizeof(magic), hnswFileName);
+        appendIndexHeader(rec);
+        memcpy(&rec[2 * sizeof(size_t)], &count, sizeof(count));
+        memcpy(&rec[6 * sizeof(size_t)], &maxlevel, sizeof(maxlevel));
+        memcpy(&rec[6 * sizeof(size_t) + sizeof(int)], &enterpoint, sizeof(enterpoint));
+        BufferedWrite(hnswFile, buf, rec.data(), rec.size(), hnswFileName);
+
+        std::vector<tableint> ids;
+        auto putList = [&](const char * list) {
+          linklistsizeint * ll = (linklistsizeint *) list;
+          tableint * data = (tableint *) (ll + 1);
+          ids.assign(data, data + getListCount(ll));
+          std::sort(ids.begin(), ids.end());
+          PutVarint(rec, ids.size());
+          tableint prev = 0;
+          for (auto id : ids) {
+            PutVarint(rec, id - prev);
+            prev = id;
+          }
+        };
+
+        for (size_t i = 0; i < count; i++) {
+          int level;
+          {
+            std::unique_lock<std::mutex> l(link_list_locks_[i]);
+            const char * p = data_level0_memory_ + i * size_data_per_element_;
+            element.assign(p, p + size_data_per_element_);
+            level = element_levels_[i];
+            upper.assign(linkLists_[i], linkLists_[i] +
+                         (level > 0 ? size_links_per_element_ * level : 0));
+          }
+          dropLinksFrom(&element[offsetLevel0_], count);
+          for (int l = 0; l < level; l++)
+            dropLinksFrom(&upper[l * size_links_per_element_], count);
+
+          rec.clear();
+          rec.push_back(element[offsetLevel0_ + 2]); // DELETE_MARK
+          putList(&element[offsetLevel0_]);
+          rec.insert(rec.end(), element.begin() + offsetData_, element.end());
+          PutVarint(rec, level);
+          for (int l = 0; l < level; l++)
+            putList(&upper[l * size_links_per_element_]);
+          BufferedWrite(hnswFile, buf, rec.data(), rec.size(), hnswFileName);
+        }
+        FlushWriteBuffer(hnswFile, buf, hnswFileName);
+    }
+
+    /* loadIndexCompact() - decode the element records that follow the
+     * header. The file is read in a CKPT_IO_BUFFER_BYTES window that is
+     * refilled whenever less than one maximal record is left in it.
+     */
+    void loadIndexCompact(std::ifstream & input)
+    {
+        size_t rawLen = size_data_per_element_ - offsetData_;
+        size_t maxList = 5 * (1 + std::max(maxM0_, maxM_));
+        size_t maxRecord = 1 + maxList + rawLen + 5 + std::max(maxlevel_, 0) * maxList;
+        std::vector<char> window(std::max(CKPT_IO_BUFFER_BYTES, 2 * maxRecord));
+        size_t begin = 0, end = 0;
+
+        auto getList = [&](const char * p, const char * e, linklistsizeint * ll, size_t maxM) {
+          tableint * data = (tableint *) (ll + 1);
+          uint32_t n, id = 0, delta;
+          p = GetVarint(p, e, n);
+          if (n > maxM)
+            throw std::runtime_error("Compact index seems to be corrupted");
+          for (uint32_t j = 0; j < n; j++) {
+            p = GetVarint(p, e, delta);
+            id += delta;
+            if (id >= cur_element_count)
+              throw std::runtime_error("Compact index seems to be corrupted");
+            data[j] = id;
+          }
+          setListCount(ll, n);
+          return p;
+        };
+
+        for (size_t i = 0; i < cur_element_count; i++) {
+          if (end - begin < maxRecord && input.good()) {
+            memmove(window.data(), window.data() + begin, end - begin);
+            end -= begin;
+            begin = 0;
+            input.read(window.data() + end, window.size() - end);
+            end += input.gcount();
+          }
+          const char * p = window.data() + begin;
+          const char * e = window.data() + end;
+          char * element = data_level0_memory_ + i * size_data_per_element_;
+
+          memset(element + offsetLevel0_, 0, size_links_level0_);
+          if (p >= e)
+            throw std::runtime_error("Compact index seems to be corrupted");
+          char flags = *p++;
+          p = getList(p, e, get_linklist0(i), maxM0_);
+          element[offsetLevel0_ + 2] = flags;
+          if ((size_t) (e - p) < rawLen)
+            throw std::runtime_error("Compact index seems to be corrupted");
+          memcpy(element + offsetData_, p, rawLen);
+          p += rawLen;
+
+          uint32_t level;
+          p = GetVarint(p, e, level);
+          element_levels_[i] = level;
+          linkLists_[i] = nullptr;
+          if (level) {
+            linkLists_[i] = (char *) calloc(level, size_links_per_element_);
+            if (linkLists_[i] == nullptr)
+              throw std::runtime_error("Not enough memory: loadIndex failed to allocate linklist");
+            for (uint32_t l = 1; l <= level; l++)
+              p = getList(p, e, get_linklist(i, l), maxM_);
+          }
+          label_lookup_[getExternalLabel(i)] = i;
+          begin = p - window.data();
+        }
+
+        for (size_t i = 0; i < cur_element_count; i++) {
+            if (isMarkedDeleted(i)) {
+                num_deleted_ += 1;
+                if (allow_replace_deleted_) deleted_elements.insert(i);
+            }
+        }
+        m_linksOffsetsInFile.clear();
+        m_compactOnDisk = true;
+    }
+
+
+    /* Export file - a consistent copy of the index in one file, to seed
+     * another host without a rebuild :-
+     *
+     *   HNSW_EXPORT_MAGIC | version | checkpoint id length | checkpoint id |
+     *   compact index image (saveIndexCompact()) | CRC32C of all before it
+     *
+     * The checkpoint id carries the binlog coordinates or the refresh
+     * timestamp the copy is consistent with, importIndex() restores it.
+     */
+#define HNSW_EXPORT_MAGIC                            0x315450584556594dUL /* MYVEXPT1 */
+#define HNSW_EXPORT_VERSION                          1
+
+    /* exportIndex() - write the export file. As in snapshotJournal() the
+     * epoch is held exclusive only to read the element count and the header
+     * fields, the elements are then copied one at a time while inserts and
+     * deletes go on. The file is checksummed, fsynced and renamed into
+     * place. Returns the number of elements written.
+     */
+    size_t exportIndex(const std::string & exportFile, const std::string & ckptId)
+    {
+        size_t count;
+        int maxlevel;
+        tableint enterpoint;
+        {
+            auto epoch = swapEpoch();
+            count = cur_element_count;
+            maxlevel = maxlevel_;
+            enterpoint = enterpoint_node_;
+        }
+
+        std::string tmpFile = exportFile + ".tmp";
+        int fd = Open(tmpFile, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        try {
+            {
+                std::vector<char> buf;
+                uint64_t magic = HNSW_EXPORT_MAGIC;
+                uint32_t version = HNSW_EXPORT_VERSION, idLen = ckptId.length();
+                BufferedWrite(fd, buf, &magic, sizeof(magic), tmpFile);
+                BufferedWrite(fd, buf, &version, sizeof(version), tmpFile);
+                BufferedWrite(fd, buf, &idLen, sizeof(idLen), tmpFile);
+                BufferedWrite(fd, buf, ckptId.data(), idLen, tmpFile);
+                FlushWriteBuffer(fd, buf, tmpFile);
+                saveIndexCompact(fd, tmpFile, count, maxlevel, enterpoint);
+            }
+
+            size_t size = Lseek(fd, 0, SEEK_END, tmpFile);
+            std::vector<char> buf(CKPT_IO_BUFFER_BYTES);
+            uint32_t crc = 0;
+            for (size_t ofs = 0; ofs < size; ofs += buf.size()) {
+                size_t n = std::min(buf.size(), size - ofs);
+                Pread(fd, buf.data(), n, ofs, tmpFile, __LINE__);
+                crc = CRC32C(buf.data(), n, crc);
+            }
+            Pwrite(fd, &crc, sizeof(crc), size, tmpFile, __LINE__);
+            Fsync(fd, tmpFile);
+        } catch (...) {
+            close(fd);
+            unlink(tmpFile.c_str());
+            throw;
+        }
+        Close(fd, tmpFile);
+        if (rename(tmpFile.c_str(), exportFile.c_str()) != 0)
+            throw std::runtime_error("Cannot rename " + tmpFile + " to " + exportFile);
+        FsyncDir(exportFile);
+        return count;
+    }
+
+    /* importIndex() - load the graph of an export file into this (empty)
+     * object after checking its CRC32C. Returns the checkpoint id of the
+     * export, the caller persists the graph with rewriteIndexOnline().
+     */
+    std::string importIndex(const std::string & exportFile, SpaceInterface<dist_t> *s)
+    {
+        std::ifstream input(exportFile, std::ios::binary);
+        if (!input.is_open())
+            throw std::runtime_error("Cannot open export file " + exportFile);
+
+        input.seekg(0, input.end);
+        size_t size = input.tellg();
+        input.seekg(0, input.beg);
+        if (size < sizeof(uint64_t) + 2 * sizeof(uint32_t) + sizeof(uint32_t))
+            throw std::runtime_error("Export file " + exportFile + " is truncated");
+
+        std::vector<char> buf(CKPT_IO_BUFFER_BYTES);
+        uint32_t crc = 0, expected = 0;
+        for (size_t ofs = 0; ofs < size - sizeof(crc); ofs += buf.size()) {
+            size_t n = std::min(buf.size(), size - sizeof(crc) - ofs);
+            input.read(buf.data(), n);
+            crc = CRC32C(buf.data(), n, crc);
+        }
+        readBinaryPOD(input, expected);
+        if (!input.good() || crc != expected)
+            throw std::runtime_error("Export file " + exportFile + " failed checksum verification");
+
+        input.seekg(0, input.beg);
+        uint64_t magic = 0;
+        uint32_t version = 0, idLen = 0;
+        readBinaryPOD(input, magic);
+        readBinaryPOD(input, version);
+        readBinaryPOD(input, idLen);
+        if (magic != HNSW_EXPORT_MAGIC || version != HNSW_EXPORT_VERSION ||
+            idLen > size)
+            throw std::runtime_error("Unsupported export file " + exportFile);
+        std::string ckptId(idLen, '\0');
+        input.read(&ckptId[0], idLen);
+        size_t base = input.tellg();
+        readBinaryPOD(input, magic);
+        if (!input.good() || magic != HNSW_COMPACT_MAGIC)
+            throw std::runtime_error("Export file " + exportFile + " seems to be corrupted");
+        input.close();
+
+        loadIndexFiles(exportFile, s, 1, base);
+        m_compactOnDisk = false; // not the layout of the index files
+        setCheckPointId(ckptId);
+        return ckptId;
+    }
 
-    void loadIndex(const std::string &location, SpaceInterface<dist_t> *s, size_t max_elements_i = 0) {
+    /* loadIndex() - recover the index files if needed, then read them
+     * while another thread verifies their block checksums. A delta log
+     * fold that was interrupted may have written blocks without their
+     * checksums, verification is skipped until the fold completes.
+     */
+    void loadIndex(const std::string &location, SpaceInterface<dist_t> *s, size_t max_elements_i = 0,
+                   size_t load_threads = 1) {
         size_t ts = 0;
         bool bConsistent = true;
         makeIndexConsistent(location, bConsistent, ts);
+
+        std::string verifyError;
+        std::thread verifier;
+        struct stat st;
+        if (stat((location + ".delta.old").c_str(), &st) != 0) {
+            verifier = std::thread([&]() {
+                size_t nblocks = 0;
+                verifyError = verifyIndexFiles(location, load_threads, nblocks);
+            });
+        }
+        try {
+            loadIndexFiles(location, s, load_threads);
+        } catch (...) {
+            if (verifier.joinable())
+                verifier.join();
+            throw;
+        }
+        if (verifier.joinable())
+            verifier.join();
+        if (verifyError.length()) {
+            error_print("HNSW index %s failed verification : %s", location.c_str(),
+                        verifyError.c_str());
+            throw std::runtime_error("Index verification failed : " + verifyError);
+        }
+    }
+
+    /* 'base' is the offset of the index image in 'location', non zero only
+     * for an export file (importIndex()).
+     */
+    void loadIndexFiles(const std::string &location, SpaceInterface<dist_t> *s,
+                        size_t load_threads, size_t base = 0) {
         std::ifstream input(location, std::ios::binary);
 
         if (!input.is_open())
@@ -872,7 +2458,13 @@
         // get file size:
         input.seekg(0, input.end);
         std::streampos total_filesize = input.tellg();
-        input.seekg(0, input.beg);
+        input.seekg(base, input.beg);
+
+        uint64_t magic = 0;
+        readBinaryPOD(input, magic);
+        bool compact = (magic == HNSW_COMPACT_MAGIC);
+        if (!compact)
+            input.seekg(base, input.beg);
 
         readBinaryPOD(input, offsetLevel0_);
         readBinaryPOD(input, max_elements_);
@@ -928,12 +2520,13 @@
         data_level0_memory_ = (char *) malloc(max_elements * size_data_per_element_);
         if (data_level0_memory_ == nullptr)
             throw std::runtime_error("Not enough memory: loadIndex failed to allocate level0");
-        input.read(data_level0_memory_, cur_element_count * size_data_per_element_);
 
         size_links_per_element_ = maxM_ * sizeof(tableint) + sizeof(linklistsizeint);
 
         size_links_level0_ = maxM0_ * sizeof(tableint) + sizeof(linklistsizeint);
         std::vector<std::mutex>(max_elements).swap(link_list_locks_);
+        resizeDirtyMaps(max_elements);
+        resizeHeatMap(max_elements);
         std::vector<std::mutex>(MAX_LABEL_OPERATION_LOCKS).swap(label_op_locks_);
 
         visited_list_pool_.reset(new VisitedListPool(1, max_elements));
@@ -944,6 +2537,20 @@
         element_levels_ = std::vector<int>(max_elements);
         revSize_ = 1.0 / mult_;
         ef_ = 10;
+
+        if (compact) {
+            loadIndexCompact(input);
+            return;
+        }
+        m_compactOnDisk = false;
+
+        if (load_threads > 1) {
+            input.close();
+            loadIndexParallel(location, static_cast<size_t>(pos), load_threads);
+            return;
+        }
+
+        input.read(data_level0_memory_, cur_element_count * size_data_per_element_);
         for (size_t i = 0; i < cur_element_count; i++) {
             label_lookup_[getExternalLabel(i)] = i;
             element_levels_[i] = 0;
@@ -990,4 +2597,335 @@
         return;
     }
 
+    /* Pread() - pread() until nbytes are read, large reads may return short. */
+    void Pread(int fd, void * buf, size_t nbytes, off_t offset,
+               const std::string & file, int line)
+    {
+        char * p = (char *) buf;
+        while (nbytes) {
+            ssize_t rc = pread(fd, p, nbytes, offset);
+            if (rc <= 0) {
+                std::stringstream ss;
+                ss << "Error reading " << nbytes << " bytes from " << file
+                   << " at offset " << offset << " at line " << line
+                   << ",rc = " << rc << ",errno = " << errno;
+                throw std::runtime_error(ss.str());
+            }
+            p += rc;
+            nbytes -= rc;
+            offset += rc;
+        }
+    }
+
+    /* loadIndexParallel() - called from loadIndex() once the header is read
+     * and the arrays are allocated. The level0 block is split in chunks of
+     * LOAD_CHUNK_BYTES that 'nthreads' readers pread() directly into
+     * data_level0_memory_. A finished chunk is queued to one indexer thread
+     * that fills label_lookup_ and the deleted set while the remaining
+     * chunks are still being read. The .links directory and .links.data are
+     * loaded by another thread at the same time. Load time is bounded by
+     * the disk rather than by one core doing read + parse serially.
+     */
+#define LOAD_CHUNK_BYTES                             (64UL * 1024 * 1024)
+
+    void loadIndexParallel(const std::string &location, size_t level0Offset, size_t nthreads) {
+        for (size_t i = 0; i < cur_element_count; i++) {
+            element_levels_[i] = 0;
+            linkLists_[i] = nullptr;
+        }
+
+        size_t nElements = cur_element_count;
+        size_t chunkElements = std::max((size_t)1, LOAD_CHUNK_BYTES / size_data_per_element_);
+        size_t nChunks = (nElements + chunkElements - 1) / chunkElements;
+        nthreads = std::max((size_t)1, std::min(nthreads, nChunks));
+
+        int fd = Open(location, O_RDONLY);
+
+        std::atomic<size_t> nextChunk{0};
+        std::atomic<bool> failed{false};
+        std::mutex errorMutex;
+        std::exception_ptr error;
+        auto setError = [&]() {
+            std::unique_lock<std::mutex> lock(errorMutex);
+            if (!error) error = std::current_exception();
+            failed = true;
+        };
+
+        std::mutex readyMutex;
+        std::condition_variable readyCv;
+        std::deque<size_t> readyChunks;
+        size_t readersDone = 0;
+
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < nthreads; t++) {
+            threads.push_back(std::thread([&]() {
+                try {
+                    while (!failed) {
+                        size_t chunk = nextChunk.fetch_add(1);
+                        if (chunk >= nChunks)
+                            break;
+                        size_t first = chunk * chunkElements;
+                        size_t count = std::min(chunkElements, nElements - first);
+                        Pread(fd, data_level0_memory_ + first * size_data_per_element_,
+                              count * size_data_per_element_,
+                              level0Offset + first * size_data_per_element_,
+                              location, __LINE__);
+                        std::unique_lock<std::mutex> lock(readyMutex);
+                        readyChunks.push_back(chunk);
+                        readyCv.notify_one();
+                    }
+                } catch (...) {
+                    setError();
+                }
+                std::unique_lock<std::mutex> lock(readyMutex);
+                readersDone++;
+                readyCv.notify_one();
+            }));
+        }
+
+        // indexer - label_lookup_ and deleted set, in chunk completion order
+        threads.push_back(std::thread([&]() {
+            try {
+                label_lookup_.reserve(nElements);
+                while (true) {
+                    size_t chunk = 0;
+                    {
+                        std::unique_lock<std::mutex> lock(readyMutex);
+                        readyCv.wait(lock, [&]() {
+                            return !readyChunks.empty() || readersDone == nthreads;
+                        });
+                        if (readyChunks.empty())
+                            break;
+                        chunk = readyChunks.front();
+                        readyChunks.pop_front();
+                    }
+                    size_t first = chunk * chunkElements;
+                    size_t last = std::min(first + chunkElements, nElements);
+                    for (size_t i = first; i < last; i++) {
+                        label_lookup_[getExternalLabel(i)] = i;
+                        if (isMarkedDeleted(i)) {
+                            num_deleted_ += 1;
+                            if (allow_replace_deleted_) deleted_elements.insert(i);
+                        }
+                    }
+                }
+            } catch (...) {
+                setError();
+            }
+        }));
+
+        // upper level links - directory read whole, data in one pread
+        threads.push_back(std::thread([&]() {
+            int dirFd = -1, dataFd = -1;
+            std::string linksDirLocation = location + ".links";
+            std::string linksDataLocation = location + ".links.data";
+            try {
+                struct stat st;
+                dirFd = Open(linksDirLocation, O_RDONLY);
+                dataFd = Open(linksDataLocation, O_RDONLY);
+
+                if (fstat(dirFd, &st) != 0)
+                    throw std::runtime_error("Cannot stat " + linksDirLocation);
+                const size_t entrySize = sizeof(unsigned int) + sizeof(unsigned int);
+                std::vector<char> dir(st.st_size);
+                Pread(dirFd, dir.data(), dir.size(), 0, linksDirLocation, __LINE__);
+
+                if (fstat(dataFd, &st) != 0)
+                    throw std::runtime_error("Cannot stat " + linksDataLocation);
+                std::vector<char> data(st.st_size);
+                Pread(dataFd, data.data(), data.size(), 0, linksDataLocation, __LINE__);
+
+                size_t current_data_pos = 0;
+                for (size_t e = 0; e + entrySize <= dir.size() && !failed; e += entrySize) {
+                    unsigned int nodeID = 0, linkListSize = 0;
+                    memcpy(&nodeID, dir.data() + e, sizeof(nodeID));
+                    memcpy(&linkListSize, dir.data() + e + sizeof(nodeID), sizeof(linkListSize));
+                    if (!linkListSize)
+                        break;
+                    if (nodeID >= nElements || current_data_pos + linkListSize > data.size())
+                        throw std::runtime_error("Index seems to be corrupted : " + linksDirLocation);
+
+                    element_levels_[nodeID] = linkListSize / size_links_per_element_;
+                    free(linkLists_[nodeID]);
+                    linkLists_[nodeID] = (char *) malloc(linkListSize);
+                    if (linkLists_[nodeID] == nullptr)
+                        throw std::runtime_error("Not enough memory: loadIndex failed to allocate linklist");
+                    memcpy(linkLists_[nodeID], data.data() + current_data_pos, linkListSize);
+                    m_linksOffsetsInFile[nodeID] = current_data_pos;
+                    current_data_pos = current_data_pos + linkListSize;
+                }
+            } catch (...) {
+                setError();
+            }
+            if (dirFd >= 0) close(dirFd);
+            if (dataFd >= 0) close(dataFd);
+        }));
+
+        for (auto &t : threads)
+            t.join();
+        close(fd);
+
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+    /* loadIndexMmap() - Zero-copy load. The header and level0 region of the
+     * .hnsw.index file is mapped MAP_PRIVATE at the start of an anonymous
+     * reservation sized for max_elements_, so inserts need no remap. The
+     * .links.data file is mapped in place for the upper level links. Pages
+     * fault in on demand. Modified pages stay private and reach the files
+     * only through doCheckPoint(), so the checkpoint & recovery protocol is
+     * unchanged. label_lookup_ and the deleted count are built on first use
+     * by ensureLabelLookup(), load time is O(header + .links directory).
+     */
+    void loadIndexMmap(const std::string &location, SpaceInterface<dist_t> *s) {
+        size_t ts = 0;
+        bool bConsistent = true;
+        makeIndexConsistent(location, bConsistent, ts);
+
+        clear();
+
+        int fd = Open(location, O_RDONLY);
+        readIndexHeader(fd);
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+            throw std::runtime_error("Cannot stat index file " + location);
+
+        size_t fileLen = st.st_size;
+        size_t regionLen = HNSW_FILE_METADATA_SIZE + max_elements_ * size_data_per_element_;
+        if (fileLen > regionLen)
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+
+        char *base = (char *) mmap(nullptr, regionLen, PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (base == MAP_FAILED)
+            throw std::runtime_error("Not enough memory: loadIndexMmap failed to reserve level0");
+        m_level0Map = base;
+        m_level0MapSize = regionLen;
+        if (fileLen && mmap(base, fileLen, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+            throw std::runtime_error("mmap of index file failed : " + location);
+        madvise(base, regionLen, MADV_RANDOM);
+        Close(fd, location);
+
+        data_level0_memory_ = base + HNSW_FILE_METADATA_SIZE;
+
+        data_size_ = s->get_data_size();
+        fstdistfunc_ = s->get_dist_func();
+        dist_func_param_ = s->get_dist_func_param();
+
+        size_links_per_element_ = maxM_ * sizeof(tableint) + sizeof(linklistsizeint);
+        size_links_level0_ = maxM0_ * sizeof(tableint) + sizeof(linklistsizeint);
+        std::vector<std::mutex>(max_elements_).swap(link_list_locks_);
+        resizeDirtyMaps(max_elements_);
+        resizeHeatMap(max_elements_);
+        std::vector<std::mutex>(MAX_LABEL_OPERATION_LOCKS).swap(label_op_locks_);
+
+        visited_list_pool_.reset(new VisitedListPool(1, max_elements_));
+
+        linkLists_ = (char **) calloc(max_elements_, sizeof(void *));
+        if (linkLists_ == nullptr)
+            throw std::runtime_error("Not enough memory: loadIndexMmap failed to allocate linklists");
+        element_levels_ = std::vector<int>(max_elements_);
+        revSize_ = 1.0 / mult_;
+        ef_ = 10;
+
+        // .links is small (one entry per element with level > 0), read it
+        std::string linksDirLocation = location + ".links";
+        std::string linksDataLocation = location + ".links.data";
+        int dirfd = Open(linksDirLocation, O_RDONLY);
+        if (fstat(dirfd, &st) != 0)
+            throw std::runtime_error("Cannot stat " + linksDirLocation);
+        std::vector<unsigned int> dir(st.st_size / sizeof(unsigned int));
+        Read(dirfd, dir.data(), dir.size() * sizeof(unsigned int), linksDirLocation, __LINE__);
+        Close(dirfd, linksDirLocation);
+
+        int datafd = Open(linksDataLocation, O_RDONLY);
+        if (fstat(datafd, &st) != 0)
+            throw std::runtime_error("Cannot stat " + linksDataLocation);
+        m_linksMapSize = st.st_size;
+        if (m_linksMapSize) {
+            m_linksMap = (char *) mmap(nullptr, m_linksMapSize, PROT_READ | PROT_WRITE,
+                                       MAP_PRIVATE, datafd, 0);
+            if (m_linksMap == MAP_FAILED) {
+                m_linksMap = nullptr;
+                throw std::runtime_error("mmap of links file failed : " + linksDataLocation);
+            }
+        }
+        Close(datafd, linksDataLocation);
+
+        size_t current_data_pos = 0;
+        for (size_t i = 0; i + 1 < dir.size(); i += 2) {
+            unsigned int nodeID = dir[i], linkListSize = dir[i + 1];
+            if (!linkListSize)
+              break;
+            if (nodeID >= max_elements_ || current_data_pos + linkListSize > m_linksMapSize)
+              throw std::runtime_error("Index seems to be corrupted or unsupported");
+            element_levels_[nodeID] = linkListSize / size_links_per_element_;
+            linkLists_[nodeID] = m_linksMap + current_data_pos;
+            m_linksOffsetsInFile[nodeID] = current_data_pos;
+            current_data_pos = current_data_pos + linkListSize;
+        }
+
+        m_labelLookupPending = true;
+    }
+
+    bool isMappedLinkList(const char *p) const {
+        return m_linksMap && p >= m_linksMap && p < m_linksMap + m_linksMapSize;
+    }
+
+    /* ensureLabelLookup() - Build label_lookup_ and count the deleted
+     * elements of a mmap loaded index. This touches every element once and
+     * runs on the first label based operation (insert, delete, lookup), not
+     * at load. Until then searches check each element for the delete mark.
+     */
+    void ensureLabelLookup() const {
+        if (!m_labelLookupPending)
+            return;
+        std::call_once(m_labelLookupOnce, [this]() {
+            auto self = const_cast<HierarchicalDiskNSW<dist_t> *>(this);
+            std::unique_lock<std::mutex> lock_table(label_lookup_lock);
+            size_t ndeleted = 0;
+            for (size_t i = 0; i < cur_element_count; i++) {
+                self->label_lookup_[getExternalLabel(i)] = i;
+                if (isMarkedDeleted(i)) {
+                    ndeleted++;
+                    if (allow_replace_deleted_)
+                        self->deleted_elements.insert(i);
+                }
+            }
+            num_deleted_ += ndeleted;
+            m_labelLookupPending = false;
+        });
+    }
 
+    /* detachMmap() - Copy a mmap loaded index into malloc memory, needed
+     * before the index files are rewritten by a full saveIndex().
+     */
+    void detachMmap() {
+        ensureLabelLookup();
+
+        char *level0 = (char *) malloc(max_elements_ * size_data_per_element_);
+        if (level0 == nullptr)
+            throw std::runtime_error("Not enough memory: detachMmap failed to allocate level0");
+        memcpy(level0, data_level0_memory_, cur_element_count * size_data_per_element_);
+
+        for (size_t i = 0; i < cur_element_count; i++) {
+            if (!isMappedLinkList(linkLists_[i]))
+              continue;
+            size_t sz = size_links_per_element_ * element_levels_[i] + 1;
+            char *ll = (char *) malloc(sz);
+            if (ll == nullptr)
+                throw std::runtime_error("Not enough memory: detachMmap failed to allocate linklist");
+            memcpy(ll, linkLists_[i], sz - 1);
+            linkLists_[i] = ll;
+        }
+
+        munmap(m_level0Map, m_level0MapSize);
+        m_level0Map = nullptr;
+        data_level0_memory_ = level0;
+        if (m_linksMap) {
+            munmap(m_linksMap, m_linksMapSize);
+            m_linksMap = nullptr;
+        }
+    }
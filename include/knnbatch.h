@@ -0,0 +1,327 @@
+/* knnbatch.h - Blocked exact search of many query vectors against the
+ * row major matrix of a KNN index (type=KNN), see knnflat.h.
+ *
+ * One scan per query streams the whole matrix from memory for every query.
+ * FlatBatchSearch instead walks the matrix in blocks of ROW_BLOCK_BYTES
+ * (L2 resident) and runs every group of QUERY_GROUP queries of its query
+ * block over a row block before moving on. The micro-kernel loads each row
+ * once for the QUERY_GROUP queries held in L1, so the matrix is read once
+ * per query block instead of once per query. Each query keeps its top-n in
+ * a bounded max heap.
+ *
+ * The kernel is picked once at run time: AVX-512F or AVX2+FMA when the CPU
+ * has them (no build flag is needed) and a portable loop otherwise. Query
+ * blocks are the unit of work of the caller's thread pool.
+ */
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define MYVECTOR_KNN_BATCH_X86
+#endif
+
+namespace hnswlib {
+
+    class FlatBatchSearch {
+    public:
+        /* Same distances as computeL2Distance(), computeIPDistance() and
+         * computeCosineDistance() in myvector.cc
+         */
+        enum Metric { L2, IP, COSINE };
+
+        static constexpr size_t QUERY_GROUP = 4;
+        static constexpr size_t QUERY_BLOCK = 64;
+        static constexpr size_t ROW_BLOCK_BYTES = 256 * 1024;
+
+        typedef std::vector<std::pair<float, uint64_t>> Neighbours;
+
+        FlatBatchSearch(size_t dim, Metric metric)
+            : dim_(dim), metric_(metric), kernel_(pickKernel()) {}
+
+        /* queryBlockSize - queries per block, smaller than QUERY_BLOCK when
+         * that is needed to give each of 'nthreads' threads a block.
+         */
+        size_t queryBlockSize(size_t nq, size_t nthreads) const {
+            size_t qb = QUERY_BLOCK;
+            if (nthreads > 1 && nq < qb * nthreads) {
+                qb = (nq + nthreads - 1) / nthreads;
+                qb = std::max(QUERY_GROUP,
+                              (qb + QUERY_GROUP - 1) / QUERY_GROUP * QUERY_GROUP);
+            }
+            return qb;
+        }
+
+        /* searchBlock - top 'n' rows of 'matrix' for queries [qbegin, qend)
+         * into results[q], nearest first.
+         */
+        void searchBlock(const float* const* queries,
+                         size_t qbegin,
+                         size_t qend,
+                         const float* matrix,
+                         const uint64_t* keys,
+                         size_t nrows,
+                         size_t n,
+                         std::vector<Neighbours>& results) const {
+            const size_t rowBlock =
+                std::max<size_t>(16, ROW_BLOCK_BYTES / (dim_ * sizeof(float)));
+            std::vector<float> dist(rowBlock * QUERY_GROUP);
+            std::vector<float> rowNorms(metric_ == COSINE ? rowBlock : 0);
+            std::vector<float> queryNorms(qend - qbegin);
+
+            if (metric_ == COSINE) {
+                for (size_t q = qbegin; q < qend; q++) {
+                    const float* qv = queries[q];
+                    queryNorms[q - qbegin] = norm(qv);
+                }
+            }
+            for (size_t q = qbegin; q < qend; q++) {
+                results[q].clear();
+                results[q].reserve(n);
+            }
+            if (n == 0)
+                return;
+
+            for (size_t r0 = 0; r0 < nrows; r0 += rowBlock) {
+                size_t nr = std::min(rowBlock, nrows - r0);
+                const float* rows = matrix + r0 * dim_;
+                if (metric_ == COSINE) {
+                    for (size_t r = 0; r < nr; r++)
+                        rowNorms[r] = norm(rows + r * dim_);
+                }
+
+                for (size_t g = qbegin; g < qend; g += QUERY_GROUP) {
+                    size_t nq = std::min(QUERY_GROUP, qend - g);
+                    kernel_(queries + g, nq, rows, nr, dim_, metric_ == L2,
+                            dist.data());
+
+                    for (size_t j = 0; j < nq; j++) {
+                        Neighbours& heap = results[g + j];
+                        const float* d = dist.data() + j;
+                        for (size_t r = 0; r < nr; r++) {
+                            float v = d[r * QUERY_GROUP];
+                            if (metric_ == IP) {
+                                v = 1.0f - v;
+                            } else if (metric_ == COSINE) {
+                                float t = queryNorms[g + j - qbegin] * rowNorms[r];
+                                v = 1.0f - (t ? v / t : 0.0f);
+                            }
+                            push(heap, n, v, keys[r0 + r]);
+                        }
+                    }
+                }
+            }
+
+            for (size_t q = qbegin; q < qend; q++)
+                std::sort_heap(results[q].begin(), results[q].end());
+        }
+
+    private:
+        /* kernel - dist[r * QUERY_GROUP + j] is the squared L2 distance
+         * ('l2') or the dot product of query j and row r
+         */
+        typedef void (*Kernel)(const float* const* q,
+                               size_t nq,
+                               const float* rows,
+                               size_t nrows,
+                               size_t dim,
+                               bool l2,
+                               float* dist);
+
+        size_t dim_;
+        Metric metric_;
+        Kernel kernel_;
+
+        float norm(const float* v) const {
+            double s = 0;
+            for (size_t i = 0; i < dim_; i++)
+                s += (double)v[i] * v[i];
+            return (float)sqrt(s);
+        }
+
+        static void push(Neighbours& heap, size_t n, float dist, uint64_t key) {
+            std::pair<float, uint64_t> e(dist, key);
+            if (heap.size() < n) {
+                heap.push_back(e);
+                std::push_heap(heap.begin(), heap.end());
+            } else if (e < heap.front()) {
+                std::pop_heap(heap.begin(), heap.end());
+                heap.back() = e;
+                std::push_heap(heap.begin(), heap.end());
+            }
+        }
+
+        static void kernelScalar(const float* const* q,
+                                 size_t nq,
+                                 const float* rows,
+                                 size_t nrows,
+                                 size_t dim,
+                                 bool l2,
+                                 float* dist) {
+            for (size_t r = 0; r < nrows; r++) {
+                const float* x = rows + r * dim;
+                for (size_t j = 0; j < nq; j++) {
+                    const float* qv = q[j];
+                    float s = 0;
+                    if (l2) {
+                        for (size_t i = 0; i < dim; i++) {
+                            float t = qv[i] - x[i];
+                            s += t * t;
+                        }
+                    } else {
+                        for (size_t i = 0; i < dim; i++)
+                            s += qv[i] * x[i];
+                    }
+                    dist[r * QUERY_GROUP + j] = s;
+                }
+            }
+        }
+
+#ifdef MYVECTOR_KNN_BATCH_X86
+        /* The SIMD kernels keep QUERY_GROUP accumulators, one per query, and
+         * load each 8 (16) floats of a row once for all of them. A short
+         * group pads with its first query.
+         */
+        __attribute__((target("avx2,fma"))) static void kernelAVX2(
+            const float* const* q,
+            size_t nq,
+            const float* rows,
+            size_t nrows,
+            size_t dim,
+            bool l2,
+            float* dist) {
+            const float* q0 = q[0];
+            const float* q1 = nq > 1 ? q[1] : q0;
+            const float* q2 = nq > 2 ? q[2] : q0;
+            const float* q3 = nq > 3 ? q[3] : q0;
+            const size_t dim8 = dim & ~(size_t)7;
+
+            for (size_t r = 0; r < nrows; r++) {
+                const float* x = rows + r * dim;
+                __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps();
+                __m256 a2 = _mm256_setzero_ps(), a3 = _mm256_setzero_ps();
+                for (size_t i = 0; i < dim8; i += 8) {
+                    __m256 xv = _mm256_loadu_ps(x + i);
+                    __m256 v0 = _mm256_loadu_ps(q0 + i);
+                    __m256 v1 = _mm256_loadu_ps(q1 + i);
+                    __m256 v2 = _mm256_loadu_ps(q2 + i);
+                    __m256 v3 = _mm256_loadu_ps(q3 + i);
+                    if (l2) {
+                        v0 = _mm256_sub_ps(v0, xv);
+                        v1 = _mm256_sub_ps(v1, xv);
+                        v2 = _mm256_sub_ps(v2, xv);
+                        v3 = _mm256_sub_ps(v3, xv);
+                        a0 = _mm256_fmadd_ps(v0, v0, a0);
+                        a1 = _mm256_fmadd_ps(v1, v1, a1);
+                        a2 = _mm256_fmadd_ps(v2, v2, a2);
+                        a3 = _mm256_fmadd_ps(v3, v3, a3);
+                    } else {
+                        a0 = _mm256_fmadd_ps(v0, xv, a0);
+                        a1 = _mm256_fmadd_ps(v1, xv, a1);
+                        a2 = _mm256_fmadd_ps(v2, xv, a2);
+                        a3 = _mm256_fmadd_ps(v3, xv, a3);
+                    }
+                }
+                float s[4] = {hsum256(a0), hsum256(a1), hsum256(a2),
+                              hsum256(a3)};
+                tail(q, nq, x, dim8, dim, l2, s);
+                for (size_t j = 0; j < nq; j++)
+                    dist[r * QUERY_GROUP + j] = s[j];
+            }
+        }
+
+        __attribute__((target("avx2,fma"))) static float hsum256(__m256 v) {
+            __m128 s = _mm_add_ps(_mm256_castps256_ps128(v),
+                                  _mm256_extractf128_ps(v, 1));
+            s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+            s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+            return _mm_cvtss_f32(s);
+        }
+
+        __attribute__((target("avx512f"))) static void kernelAVX512(
+            const float* const* q,
+            size_t nq,
+            const float* rows,
+            size_t nrows,
+            size_t dim,
+            bool l2,
+            float* dist) {
+            const float* q0 = q[0];
+            const float* q1 = nq > 1 ? q[1] : q0;
+            const float* q2 = nq > 2 ? q[2] : q0;
+            const float* q3 = nq > 3 ? q[3] : q0;
+            const size_t dim16 = dim & ~(size_t)15;
+
+            for (size_t r = 0; r < nrows; r++) {
+                const float* x = rows + r * dim;
+                __m512 a0 = _mm512_setzero_ps(), a1 = _mm512_setzero_ps();
+                __m512 a2 = _mm512_setzero_ps(), a3 = _mm512_setzero_ps();
+                for (size_t i = 0; i < dim16; i += 16) {
+                    __m512 xv = _mm512_loadu_ps(x + i);
+                    __m512 v0 = _mm512_loadu_ps(q0 + i);
+                    __m512 v1 = _mm512_loadu_ps(q1 + i);
+                    __m512 v2 = _mm512_loadu_ps(q2 + i);
+                    __m512 v3 = _mm512_loadu_ps(q3 + i);
+                    if (l2) {
+                        v0 = _mm512_sub_ps(v0, xv);
+                        v1 = _mm512_sub_ps(v1, xv);
+                        v2 = _mm512_sub_ps(v2, xv);
+                        v3 = _mm512_sub_ps(v3, xv);
+                        a0 = _mm512_fmadd_ps(v0, v0, a0);
+                        a1 = _mm512_fmadd_ps(v1, v1, a1);
+                        a2 = _mm512_fmadd_ps(v2, v2, a2);
+                        a3 = _mm512_fmadd_ps(v3, v3, a3);
+                    } else {
+                        a0 = _mm512_fmadd_ps(v0, xv, a0);
+                        a1 = _mm512_fmadd_ps(v1, xv, a1);
+                        a2 = _mm512_fmadd_ps(v2, xv, a2);
+                        a3 = _mm512_fmadd_ps(v3, xv, a3);
+                    }
+                }
+                float s[4] = {_mm512_reduce_add_ps(a0), _mm512_reduce_add_ps(a1),
+                              _mm512_reduce_add_ps(a2), _mm512_reduce_add_ps(a3)};
+                tail(q, nq, x, dim16, dim, l2, s);
+                for (size_t j = 0; j < nq; j++)
+                    dist[r * QUERY_GROUP + j] = s[j];
+            }
+        }
+#endif
+
+        /* tail - the dimensions past the last full SIMD register */
+        static void tail(const float* const* q,
+                         size_t nq,
+                         const float* x,
+                         size_t from,
+                         size_t dim,
+                         bool l2,
+                         float* s) {
+            for (size_t j = 0; j < nq; j++) {
+                for (size_t i = from; i < dim; i++) {
+                    float t = l2 ? q[j][i] - x[i] : q[j][i];
+                    s[j] += l2 ? t * t : t * x[i];
+                }
+            }
+        }
+
+        static Kernel pickKernel() {
+#ifdef MYVECTOR_KNN_BATCH_X86
+            static const bool avx512 = __builtin_cpu_supports("avx512f");
+            static const bool avx2 = __builtin_cpu_supports("avx2") &&
+                                     __builtin_cpu_supports("fma");
+            if (avx512)
+                return kernelAVX512;
+            if (avx2)
+                return kernelAVX2;
+#endif
+            return kernelScalar;
+        }
+    };
+
+}  // namespace hnswlib
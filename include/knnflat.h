@@ -0,0 +1,567 @@
+/* knnflat.h - Persistent flat vector store of the KNN index (type=KNN).
+ *
+ * The rows are kept in one page aligned mapping with the layout of the
+ * index file <name>.knn.index :-
+ *
+ *   header sector - two FileHeader slots, written alternately
+ *   keys          - capacity x uint64_t
+ *   matrix        - capacity x dim floats, page aligned
+ *
+ * load() maps the file MAP_PRIVATE, so a restart pages the vectors in
+ * instead of rebuilding with a full table scan. Changes stay in memory
+ * until save(). The first save() and a save() after the capacity grew
+ * write a new file through a rename, other saves are incremental :-
+ *
+ *   1. pwrite the rows appended past the header row count, fdatasync
+ *   2. if rows below the header row count changed (upsert() of a present
+ *      key, remove()), write them to <file>.journal with a CRC32C and
+ *      fsync it, then pwrite them in place and fdatasync
+ *   3. write the row count & checkpoint id to the older header slot,
+ *      fdatasync and unlink the journal
+ *
+ * A torn header write leaves the other slot current and load() re-applies
+ * a complete journal left by a crash between 2 and 3. Rows past the
+ * header row count are ignored by load(), they are applied again from the
+ * checkpoint coordinates.
+ *
+ * Keys are unique, upsert() of a present key overwrites its vector and
+ * remove() moves the last row into the freed slot.
+ */
+#pragma once
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "crc32c.h"
+
+namespace hnswlib {
+
+    class FlatVectorFile {
+    public:
+        static constexpr size_t PAGE_LEN = 4096;
+        static constexpr size_t HEADER_SLOT_LEN = 2048;
+        static constexpr uint64_t FILE_MAGIC = 0x31304e4e4b56594dULL;  // MYVKNN01
+        static constexpr uint64_t FILE_VERSION = 1;
+        static constexpr uint64_t JOURNAL_MAGIC = 0x314a4e4e4b56594dULL;  // MYVKNNJ1
+        static constexpr size_t CKPTID_LEN = 256;
+        static constexpr size_t MIN_CAPACITY = 1024;
+
+        struct FileHeader {
+            uint64_t magic;
+            uint64_t version;
+            uint64_t seq;  // the slot with the higher seq is current
+            uint64_t dim;
+            uint64_t capacity;
+            uint64_t count;
+            char ckptid[CKPTID_LEN];
+            uint32_t crc;  // CRC32C of the fields above
+            uint32_t pad;
+        };
+
+        /* <file>.journal is this header, 'nrows' (slot, key, vector)
+         * records and a CRC32C of both.
+         */
+        struct JournalHeader {
+            uint64_t magic;
+            uint64_t count;  // header row count once the journal is applied
+            uint64_t nrows;
+            char ckptid[CKPTID_LEN];
+        };
+
+        explicit FlatVectorFile(size_t dim) : dim_(dim) {}
+
+        ~FlatVectorFile() { unmap(); }
+
+        FlatVectorFile(const FlatVectorFile&) = delete;
+        FlatVectorFile& operator=(const FlatVectorFile&) = delete;
+
+        size_t size() const { return count_; }
+        size_t committed() const { return committed_; }
+        size_t capacity() const { return capacity_; }
+        size_t rowBytes() const { return sizeof(uint64_t) + vectorBytes(); }
+
+        /* changed - rows the next save() writes */
+        size_t changed() const {
+            return (count_ > committed_ ? count_ - committed_ : 0) +
+                   dirty_.size();
+        }
+
+        const uint64_t* keys() const { return keys_; }
+        const float* vector(size_t i) const { return matrix_ + i * dim_; }
+
+        /* reset - drop all rows and forget the file, if any */
+        void reset() {
+            unmap();
+            count_ = committed_ = capacity_ = fileCapacity_ = 0;
+            keyIndex_.clear();
+            dirty_.clear();
+            file_.clear();
+        }
+
+        void upsert(const float* vec, uint64_t key) {
+            size_t i;
+            auto it = keyIndex_.find(key);
+            if (it != keyIndex_.end()) {
+                i = it->second;
+            } else {
+                if (count_ == capacity_)
+                    grow(std::max(MIN_CAPACITY, capacity_ * 2));
+                i = count_++;
+                keys_[i] = key;
+                keyIndex_[key] = i;
+            }
+            memcpy(matrix_ + i * dim_, vec, vectorBytes());
+            touch(i);
+        }
+
+        /* remove - O(1), the last row moves into the freed slot */
+        bool remove(uint64_t key) {
+            auto it = keyIndex_.find(key);
+            if (it == keyIndex_.end())
+                return false;
+            size_t i = it->second, last = count_ - 1;
+            keyIndex_.erase(it);
+            if (i != last) {
+                keys_[i] = keys_[last];
+                memcpy(matrix_ + i * dim_, matrix_ + last * dim_, vectorBytes());
+                keyIndex_[keys_[i]] = i;
+                touch(i);
+            }
+            count_--;
+            return true;
+        }
+
+        /* save - persist the rows to 'file' with checkpoint id 'ckptid' */
+        void save(const std::string& file, const std::string& ckptid) {
+            if (file != file_ || capacity_ != fileCapacity_) {
+                writeFile(file, ckptid);
+                return;
+            }
+            int fd = Open(file_, O_RDWR);
+            try {
+                checkpoint(fd, ckptid);
+            } catch (...) {
+                close(fd);
+                throw;
+            }
+            close(fd);
+        }
+
+        /* load - map 'file' and return its checkpoint id. Throws
+         * std::runtime_error if the file is missing or unusable.
+         */
+        std::string load(const std::string& file) {
+            reset();
+            int fd = Open(file, O_RDWR);
+            FileHeader hdr;
+            try {
+                if (!readHeader(fd, hdr))
+                    throw std::runtime_error("No valid header in " + file);
+                if (hdr.dim != dim_) {
+                    std::stringstream ss;
+                    ss << file << " has dimension " << hdr.dim
+                       << ", index has " << dim_;
+                    throw std::runtime_error(ss.str());
+                }
+                struct stat st;
+                if (fstat(fd, &st) != 0 ||
+                    (size_t)st.st_size < fileLength(hdr.capacity) ||
+                    hdr.count > hdr.capacity)
+                    throw std::runtime_error(file + " is truncated");
+                file_ = file;
+                fileCapacity_ = hdr.capacity;
+                seq_ = hdr.seq;
+                ckptid_ = hdr.ckptid;
+                count_ = hdr.count;
+                applyJournal(fd);
+                map(fd, file, hdr.capacity);
+            } catch (...) {
+                close(fd);
+                reset();
+                throw;
+            }
+            close(fd);
+            committed_ = count_;
+            keyIndex_.reserve(count_);
+            for (size_t i = 0; i < count_; i++)
+                keyIndex_[keys_[i]] = i;
+            return ckptid_;
+        }
+
+        static void deleteIndexFiles(const std::string& file) {
+            unlink(file.c_str());
+            unlink((file + ".tmp").c_str());
+            unlink((file + ".journal").c_str());
+        }
+
+    private:
+        size_t dim_;
+        size_t count_{0};
+        size_t committed_{0};  // row count in the current header slot
+        size_t capacity_{0};
+        size_t fileCapacity_{0};
+
+        char* base_{nullptr};
+        size_t baseLen_{0};
+        uint64_t* keys_{nullptr};
+        float* matrix_{nullptr};
+
+        std::unordered_map<uint64_t, size_t> keyIndex_;
+        std::unordered_set<size_t> dirty_;  // changed rows below committed_
+
+        std::string file_;
+        std::string ckptid_;
+        uint64_t seq_{0};
+
+        size_t vectorBytes() const { return dim_ * sizeof(float); }
+
+        static size_t pageAlign(size_t n) {
+            return (n + PAGE_LEN - 1) & ~(PAGE_LEN - 1);
+        }
+        size_t matrixOffset(size_t capacity) const {
+            return pageAlign(PAGE_LEN + capacity * sizeof(uint64_t));
+        }
+        size_t fileLength(size_t capacity) const {
+            return pageAlign(matrixOffset(capacity) + capacity * vectorBytes());
+        }
+
+        void touch(size_t i) {
+            if (i < committed_)
+                dirty_.insert(i);
+        }
+
+        void unmap() {
+            if (base_)
+                munmap(base_, baseLen_);
+            base_ = nullptr;
+            baseLen_ = 0;
+            keys_ = nullptr;
+            matrix_ = nullptr;
+        }
+
+        /* map - map 'fd' private, or anonymous memory if fd is -1 */
+        void map(int fd, const std::string& file, size_t capacity) {
+            size_t len = fileLength(capacity);
+            void* p = mmap(nullptr,
+                           len,
+                           PROT_READ | PROT_WRITE,
+                           (fd >= 0 ? MAP_PRIVATE
+                                    : MAP_PRIVATE | MAP_ANONYMOUS |
+                                          MAP_NORESERVE),
+                           fd,
+                           0);
+            if (p == MAP_FAILED) {
+                std::stringstream ss;
+                ss << "mmap of " << len << " bytes failed for "
+                   << (fd >= 0 ? file : "KNN index") << ",errno = " << errno;
+                throw std::runtime_error(ss.str());
+            }
+            base_ = (char*)p;
+            baseLen_ = len;
+            capacity_ = capacity;
+            keys_ = (uint64_t*)(base_ + PAGE_LEN);
+            matrix_ = (float*)(base_ + matrixOffset(capacity));
+        }
+
+        /* grow - move the rows to a larger anonymous mapping. The file is
+         * rewritten in the new layout by the next save().
+         */
+        void grow(size_t capacity) {
+            char* oldBase = base_;
+            size_t oldLen = baseLen_;
+            const uint64_t* oldKeys = keys_;
+            const float* oldMatrix = matrix_;
+
+            map(-1, "", capacity);
+            if (count_) {
+                memcpy(keys_, oldKeys, count_ * sizeof(uint64_t));
+                memcpy(matrix_, oldMatrix, count_ * vectorBytes());
+            }
+            if (oldBase)
+                munmap(oldBase, oldLen);
+        }
+
+        /* writeFile - write all rows to a new file that replaces 'file' */
+        void writeFile(const std::string& file, const std::string& ckptid) {
+            std::string tmpFile = file + ".tmp";
+            int fd = Open(tmpFile, O_RDWR | O_CREAT | O_TRUNC, 0600);
+            try {
+                Allocate(fd, tmpFile, fileLength(capacity_));
+                if (count_) {
+                    Pwrite(fd,
+                           keys_,
+                           count_ * sizeof(uint64_t),
+                           PAGE_LEN,
+                           tmpFile);
+                    Pwrite(fd,
+                           matrix_,
+                           count_ * vectorBytes(),
+                           matrixOffset(capacity_),
+                           tmpFile);
+                }
+                seq_ = 0;
+                fileCapacity_ = capacity_;
+                writeHeader(fd, tmpFile, count_, ckptid);
+            } catch (...) {
+                close(fd);
+                unlink(tmpFile.c_str());
+                throw;
+            }
+            close(fd);
+            unlink((file + ".journal").c_str());  // belongs to the old file
+            if (rename(tmpFile.c_str(), file.c_str()) != 0)
+                throw std::runtime_error("rename of " + tmpFile + " failed");
+            FsyncDir(file);
+            file_ = file;
+            committed_ = count_;
+            dirty_.clear();
+        }
+
+        void checkpoint(int fd, const std::string& ckptid) {
+            if (count_ > committed_) {
+                Pwrite(fd,
+                       keys_ + committed_,
+                       (count_ - committed_) * sizeof(uint64_t),
+                       PAGE_LEN + committed_ * sizeof(uint64_t),
+                       file_);
+                Pwrite(fd,
+                       matrix_ + committed_ * dim_,
+                       (count_ - committed_) * vectorBytes(),
+                       matrixOffset(fileCapacity_) + committed_ * vectorBytes(),
+                       file_);
+                Fdatasync(fd, file_);
+            }
+
+            std::vector<size_t> slots;
+            for (size_t s : dirty_)
+                if (s < std::min(count_, committed_))
+                    slots.push_back(s);
+            std::sort(slots.begin(), slots.end());
+
+            std::string journal = file_ + ".journal";
+            if (slots.size()) {
+                writeJournal(journal, slots, ckptid);
+                for (size_t s : slots)
+                    writeRow(fd, s, keys_[s], vector(s));
+                Fdatasync(fd, file_);
+            }
+            writeHeader(fd, file_, count_, ckptid);
+            if (slots.size())
+                unlink(journal.c_str());
+            committed_ = count_;
+            dirty_.clear();
+        }
+
+        void writeRow(int fd, size_t slot, uint64_t key, const float* vec) {
+            Pwrite(fd,
+                   &key,
+                   sizeof(key),
+                   PAGE_LEN + slot * sizeof(uint64_t),
+                   file_);
+            Pwrite(fd,
+                   vec,
+                   vectorBytes(),
+                   matrixOffset(fileCapacity_) + slot * vectorBytes(),
+                   file_);
+        }
+
+        void writeJournal(const std::string& journal,
+                          const std::vector<size_t>& slots,
+                          const std::string& ckptid) {
+            JournalHeader jh;
+            memset(&jh, 0, sizeof(jh));
+            jh.magic = JOURNAL_MAGIC;
+            jh.count = count_;
+            jh.nrows = slots.size();
+            strncpy(jh.ckptid, ckptid.c_str(), CKPTID_LEN - 1);
+
+            std::vector<char> buf(sizeof(jh));
+            memcpy(buf.data(), &jh, sizeof(jh));
+            for (size_t s : slots) {
+                uint64_t rec[2] = {s, keys_[s]};
+                buf.insert(buf.end(), (char*)rec, (char*)(rec + 2));
+                buf.insert(buf.end(),
+                           (const char*)vector(s),
+                           (const char*)vector(s) + vectorBytes());
+            }
+            uint32_t crc = CRC32C(buf.data(), buf.size());
+            buf.insert(buf.end(), (char*)&crc, (char*)(&crc + 1));
+
+            int jfd = Open(journal, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+            try {
+                Pwrite(jfd, buf.data(), buf.size(), 0, journal);
+                Fdatasync(jfd, journal);
+            } catch (...) {
+                close(jfd);
+                throw;
+            }
+            close(jfd);
+            FsyncDir(journal);
+        }
+
+        /* applyJournal - finish a checkpoint interrupted after its journal
+         * was written. An incomplete journal is from before any in place
+         * write and is discarded.
+         */
+        void applyJournal(int fd) {
+            std::string journal = file_ + ".journal";
+            int jfd = open(journal.c_str(), O_RDONLY);
+            if (jfd < 0)
+                return;
+            struct stat st;
+            std::vector<char> buf;
+            if (fstat(jfd, &st) == 0) {
+                buf.resize(st.st_size);
+                if (pread(jfd, buf.data(), buf.size(), 0) != (ssize_t)buf.size())
+                    buf.clear();
+            }
+            close(jfd);
+
+            const size_t recLen = 2 * sizeof(uint64_t) + vectorBytes();
+            JournalHeader jh;
+            uint32_t crc = 0;
+            bool valid = buf.size() >= sizeof(jh) + sizeof(crc);
+            if (valid) {
+                memcpy(&jh, buf.data(), sizeof(jh));
+                memcpy(&crc, buf.data() + buf.size() - sizeof(crc), sizeof(crc));
+                valid = jh.magic == JOURNAL_MAGIC &&
+                        jh.count <= fileCapacity_ &&
+                        buf.size() == sizeof(jh) + jh.nrows * recLen + sizeof(crc) &&
+                        crc == CRC32C(buf.data(), buf.size() - sizeof(crc));
+            }
+            if (valid) {
+                const char* p = buf.data() + sizeof(jh);
+                for (uint64_t r = 0; r < jh.nrows; r++, p += recLen) {
+                    uint64_t rec[2];
+                    memcpy(rec, p, sizeof(rec));
+                    if (rec[0] >= fileCapacity_)
+                        throw std::runtime_error(journal + " is corrupted");
+                    writeRow(fd, rec[0], rec[1], (const float*)(p + sizeof(rec)));
+                }
+                Fdatasync(fd, file_);
+                jh.ckptid[CKPTID_LEN - 1] = 0;
+                writeHeader(fd, file_, jh.count, jh.ckptid);
+                count_ = jh.count;
+            }
+            unlink(journal.c_str());
+        }
+
+        /* writeHeader - write the older header slot and fdatasync. The
+         * other slot stays current if this write is torn.
+         */
+        void writeHeader(int fd,
+                         const std::string& file,
+                         size_t count,
+                         const std::string& ckptid) {
+            FileHeader hdr;
+            memset(&hdr, 0, sizeof(hdr));
+            hdr.magic = FILE_MAGIC;
+            hdr.version = FILE_VERSION;
+            hdr.seq = ++seq_;
+            hdr.dim = dim_;
+            hdr.capacity = fileCapacity_;
+            hdr.count = count;
+            strncpy(hdr.ckptid, ckptid.c_str(), CKPTID_LEN - 1);
+            hdr.crc = CRC32C(&hdr, offsetof(FileHeader, crc));
+            Pwrite(fd, &hdr, sizeof(hdr), (hdr.seq % 2) * HEADER_SLOT_LEN, file);
+            Fdatasync(fd, file);
+            ckptid_ = ckptid;
+        }
+
+        static bool readHeader(int fd, FileHeader& hdr) {
+            bool found = false;
+            for (size_t slot = 0; slot < 2; slot++) {
+                FileHeader h;
+                if (pread(fd, &h, sizeof(h), slot * HEADER_SLOT_LEN) !=
+                    (ssize_t)sizeof(h))
+                    continue;
+                if (h.magic != FILE_MAGIC || h.version != FILE_VERSION ||
+                    h.crc != CRC32C(&h, offsetof(FileHeader, crc)))
+                    continue;
+                if (!found || h.seq > hdr.seq)
+                    hdr = h;
+                found = true;
+            }
+            hdr.ckptid[CKPTID_LEN - 1] = 0;
+            return found;
+        }
+
+        /* File I/O helpers, throw std::runtime_error like hnswdisk.i */
+        static int Open(const std::string& file, int flags, mode_t mode = 0) {
+            int fd = open(file.c_str(), flags, mode);
+            if (fd == -1) {
+                std::stringstream ss;
+                ss << "Error during open() on " << file << ",errno=" << errno;
+                throw std::runtime_error(ss.str());
+            }
+            return fd;
+        }
+
+        static void Allocate(int fd, const std::string& file, size_t len) {
+            int rc = posix_fallocate(fd, 0, len);
+            if (rc != 0) {
+                std::stringstream ss;
+                ss << "Error allocating " << len << " bytes for " << file
+                   << ",errno = " << rc;
+                throw std::runtime_error(ss.str());
+            }
+        }
+
+        static void Pwrite(int fd,
+                           const void* buf,
+                           size_t nbytes,
+                           off_t offset,
+                           const std::string& file) {
+            const char* p = (const char*)buf;
+            while (nbytes) {
+                ssize_t rc = pwrite(fd, p, nbytes, offset);
+                if (rc <= 0) {
+                    std::stringstream ss;
+                    ss << "Error writing " << nbytes << " bytes to " << file
+                       << " at offset " << offset << ",errno = " << errno;
+                    throw std::runtime_error(ss.str());
+                }
+                p += rc;
+                offset += rc;
+                nbytes -= rc;
+            }
+        }
+
+        static void Fdatasync(int fd, const std::string& file) {
+            if (fdatasync(fd) != 0) {
+                std::stringstream ss;
+                ss << "Error during fdatasync() on " << file
+                   << ",errno = " << errno;
+                throw std::runtime_error(ss.str());
+            }
+        }
+
+        static void FsyncDir(const std::string& file) {
+            size_t slash = file.find_last_of('/');
+            std::string dir =
+                (slash == std::string::npos ? "." : file.substr(0, slash));
+            int fd = Open(dir, O_RDONLY);
+            int rc = fsync(fd);
+            close(fd);
+            if (rc != 0) {
+                std::stringstream ss;
+                ss << "Error during fsync() on " << dir << ",errno = " << errno;
+                throw std::runtime_error(ss.str());
+            }
+        }
+    };
+
+}  // namespace hnswlib
@@ -25,6 +25,7 @@
 
 #define MYVECTOR_PLUGIN_VERSION "1.0.2-rc3"
 
+#include <atomic>
 #include <map>
 #include <mutex>
 #include <shared_mutex>
@@ -32,6 +33,8 @@
 #include <unordered_map>
 #include <vector>
 
+#include "annresultcache.h"
+
 bool myvector_query_rewrite(const std::string& query,
                             std::string* rewritten_query);
 
@@ -58,6 +61,39 @@ typedef void* VectorPtr;
 
 /* using namespace std; - Removed for code quality */
 
+/* Load state of an index. Indexes found at plugin start are loaded by a
+ * pool of loader threads (myvector.cc IndexLoader), eagerly in priority
+ * order or lazily on the first query; searches need INDEX_READY.
+ */
+enum IndexLoadState {
+    INDEX_UNLOADED = 0, /* opened, not loaded yet */
+    INDEX_LOADING,      /* queued for or being loaded */
+    INDEX_READY,
+    INDEX_FAILED
+};
+
+/* Row operation of a binlog event applied to an online index */
+enum VectorIndexOp {
+    VECTOR_INDEX_INSERT = 0,
+    VECTOR_INDEX_UPDATE,
+    VECTOR_INDEX_DELETE
+};
+
+/* SearchBudget - limits of one search from the budget_us= and
+ * max_dist_comps= options, 0 is no limit. A search that runs out returns
+ * the nearest neighbours found so far and sets 'exhausted'. 'efSearch' is
+ * the search effort of this search from the ef_search= or recall= options,
+ * 0 is the index ef_search.
+ */
+struct SearchBudget {
+    long budgetUs = 0;
+    size_t maxDistComps = 0;
+    int efSearch = 0;
+    std::atomic<bool> exhausted{false};
+
+    bool limited() const { return budgetUs > 0 || maxDistComps > 0; }
+};
+
 /* Interface for various types of vector indexes. Initial design is based
  * on 2 index types - 1) KNN in-memory using vector<> and priority_queue<>
  * 2) HNSW in-memory with persistence from hnswlib.
@@ -80,10 +116,23 @@ public:
 
     virtual bool supportsIncrRefresh() { return false; }
 
+    /* supportsDeletes - deleteVector() is implemented and insertVector()
+     * of a present id replaces its vector, so binlog UPDATE and DELETE rows
+     * can be applied.
+     */
+    virtual bool supportsDeletes() { return false; }
+
     virtual bool isReady() { return false; }
 
     virtual bool isDirty() { return false; }
 
+    /* getDirtyStats - nodes waiting for the next checkpoint and an estimate
+     * of the bytes it will write. Used by the background checkpointer.
+     */
+    virtual void getDirtyStats(size_t& nodes, size_t& bytes) {
+        nodes = bytes = 0;
+    }
+
     virtual std::string getStatus() { return getName() + "<Status>"; }
 
     virtual bool loadIndex(const std::string& path) = 0;
@@ -100,15 +149,37 @@ public:
 
     virtual bool closeIndex() = 0;
 
-    /* searchVectorNN - search and return 'n' Nearest Neighbours */
+    /* searchVectorNN - search and return 'n' Nearest Neighbours and their
+     * distances, nearest first. An approximate index stops at the 'budget',
+     * if there is one, with the neighbours found so far.
+     */
     virtual bool searchVectorNN(VectorPtr qvec,
                                 int dim,
                                 std::vector<KeyTypeInteger>& nnkeys,
-                                int n) = 0;
+                                std::vector<double>& nndists,
+                                int n,
+                                SearchBudget* budget = nullptr) = 0;
+
+    /* searchVectorsNN - search 'n' Nearest Neighbours of each of 'qvecs'.
+     * nnkeys[i] and nndists[i] are the results of qvecs[i], nearest first.
+     * The default runs searchVectorNN() per query on up to 'nthreads'
+     * threads, indexes that can share the work between the queries
+     * override it.
+     */
+    virtual bool searchVectorsNN(const std::vector<VectorPtr>& qvecs,
+                                 int dim,
+                                 std::vector<std::vector<KeyTypeInteger>>& nnkeys,
+                                 std::vector<std::vector<double>>& nndists,
+                                 int n,
+                                 int nthreads,
+                                 SearchBudget* budget = nullptr);
 
     /* insertVectortor - insert a vector into the index */
     virtual bool insertVector(VectorPtr vec, int dim, KeyTypeInteger id) = 0;
 
+    /* deleteVector - remove a vector, see supportsDeletes() */
+    virtual bool deleteVector(KeyTypeInteger /* id */) { return false; }
+
     /* startParallelBuild - User has initiated parallel index build/rebuild */
     virtual bool startParallelBuild(int nthreads) = 0;
 
@@ -128,10 +199,65 @@ public:
     virtual void setLastUpdateCoordinates(const std::string& /* file */,
                                           const size_t& /* pos */) {}
 
+    /* compactIndex - rebuild the index without deleted rows. Called with
+     * the shared lock held, the exclusive lock is taken only for the final
+     * swap. 'report' is a one line summary for the caller.
+     */
+    virtual bool compactIndex(const std::string& /* path */,
+                              std::string& report) {
+        report = "Compaction is not supported for " + getType() + " index.";
+        return false;
+    }
+
+    /* verifyIndex - check the persisted index files against their block
+     * checksums. 'report' is a one line summary for the caller.
+     */
+    virtual bool verifyIndex(const std::string& /* path */,
+                             std::string& report) {
+        report = "Verify is not supported for " + getType() + " index.";
+        return false;
+    }
+
+    /* exportIndex - write a consistent copy of the index to one checksummed
+     * file, stamped with the checkpoint id (binlog coordinates or refresh
+     * timestamp) it is consistent with. importIndex - replace the index
+     * with an export file and persist it. 'file' is a file name in 'path'.
+     */
+    virtual bool exportIndex(const std::string& /* path */,
+                             const std::string& /* file */,
+                             std::string& report) {
+        report = "Export is not supported for " + getType() + " index.";
+        return false;
+    }
+
+    virtual bool importIndex(const std::string& /* path */,
+                             const std::string& /* file */,
+                             std::string& report) {
+        report = "Import is not supported for " + getType() + " index.";
+        return false;
+    }
+
     virtual void setSearchEffort(int ef_search) {
         (void)ef_search;
     } /* how much deep/wide to go? e.g ef_search in HNSW */
 
+    /* searchEffortForRecall - the least search effort that finds 'recall'
+     * of the 'n' nearest neighbours, 0 if the index cannot tell (yet)
+     */
+    virtual int searchEffortForRecall(int n, double recall) {
+        (void)n;
+        (void)recall;
+        return 0;
+    }
+
+    /* recallCalibrationDue - searchEffortForRecall() needs calibrateRecall()
+     * to measure it again. calibrateRecall() is run by a background thread
+     * with the shared lock held, not by the search that finds it due.
+     */
+    virtual bool recallCalibrationDue() { return false; }
+
+    virtual void calibrateRecall() {}
+
     void lockShared() { m_mutex.lock_shared(); }
     void lockExclusive() { m_mutex.lock(); }
 
@@ -140,8 +266,38 @@ public:
 
     std::shared_mutex& mutex() { return m_mutex; }
 
+    IndexLoadState getLoadState() const { return m_loadState.load(); }
+    void setLoadState(IndexLoadState state) { m_loadState = state; }
+    bool casLoadState(IndexLoadState from, IndexLoadState to) {
+        return m_loadState.compare_exchange_strong(from, to);
+    }
+
+    /* held while the index is loaded, built, saved, dropped, compacted,
+     * verified, exported, imported or checkpointed, by a loader thread, the
+     * checkpointer or an admin action. Taken with
+     * try_lock() under the shared lock: compaction and import trade the
+     * shared lock for the exclusive one to swap in their graph, and would
+     * deadlock with a thread blocked here holding the shared lock.
+     */
+    std::mutex& loadMutex() { return m_loadMutex; }
+
+    /* mutationEpoch - changes after every change of the indexed vectors,
+     * results cached at an older epoch are stale (annresultcache.h)
+     */
+    uint64_t mutationEpoch() const { return m_mutationEpoch.load(); }
+
+    AnnResultCache& resultCache() { return m_resultCache; }
+
+protected:
+    /* bumpMutationEpoch - once the change is visible to searches */
+    void bumpMutationEpoch() { m_mutationEpoch++; }
+
 private:
     mutable std::shared_mutex m_mutex;
+    std::atomic<IndexLoadState> m_loadState{INDEX_UNLOADED};
+    std::mutex m_loadMutex;
+    std::atomic<uint64_t> m_mutationEpoch{0};
+    AnnResultCache m_resultCache;
 };
 
 class VectorIndexCollection {
@@ -152,7 +308,11 @@ public:
 
     AbstractVectorIndex* get(const std::string& name);
 
-    bool close(AbstractVectorIndex* hindex);
+    /* close() - remove and free the index. 'adminLock' (loadMutex() of the
+     * index, held by a drop) is released once no other thread can reach it.
+     */
+    bool close(AbstractVectorIndex* hindex,
+               std::unique_lock<std::mutex>* adminLock = nullptr);
 
     std::string FindEarliestBinlogFile();
 
@@ -190,6 +350,12 @@ private:
 
 extern long myvector_index_bg_threads;
 extern long myvector_feature_level;
+extern long myvector_checkpoint_dirty_nodes;
+extern long myvector_checkpoint_dirty_mb;
+extern long myvector_checkpoint_interval;
+extern long myvector_checkpoint_io_mbps;
+extern long myvector_index_load_threads;
+extern long myvector_search_threads;
 extern char* myvector_config_file;
 
 #endif  // PLUGIN_MYVECTOR_H
@@ -14,6 +14,11 @@
     "Incorrect arguments. Please check the function's documentation."
 #define ER_MYVECTOR_INDEX_NOT_FOUND                                            \
     "Vector index not defined or not open for access."
+#define ER_MYVECTOR_INDEX_LOADING                                              \
+    "Vector index is loading, retry shortly."
+#define ER_MYVECTOR_INDEX_NOT_LOADED                                           \
+    "Vector index failed to load, check the error log and run "               \
+    "MYVECTOR_INDEX_LOAD."
 #define ER_MYVECTOR_INVALID_VECTOR "Invalid vector format or checksum mismatch."
 
 // Stored Procedure Errors
@@ -1,7 +1,9 @@
 #pragma once
+#include <charconv>
+#include <cstdlib>
 #include <cstring>
-#include <regex>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 
@@ -9,71 +11,102 @@
 typedef std::unordered_map<std::string, std::string> OptionsMap;
 
 /* Trim leading & trailing spaces */
-inline std::string lrtrim(const std::string& str) {
-    std::string ret =
-        std::regex_replace(str, std::regex("^ +| +$|( ) +"), "$1");
+inline std::string_view lrtrim(std::string_view str) {
+    size_t b = str.find_first_not_of(' ');
+    if (b == std::string_view::npos)
+        return std::string_view();
+    return str.substr(b, str.find_last_not_of(' ') - b + 1);
+}
 
-    return ret;
+/* forEachToken - call fn(token) for each trimmed comma separated token of
+ * str, empty tokens between adjacent commas are skipped. Stops and returns
+ * false when fn returns false.
+ */
+template <typename Fn>
+inline bool forEachToken(std::string_view str, Fn&& fn) {
+    size_t pos = 0;
+    while (pos < str.size()) {
+        size_t end = str.find(',', pos);
+        if (end == std::string_view::npos)
+            end = str.size();
+        if (end > pos && !fn(lrtrim(str.substr(pos, end - pos))))
+            return false;
+        pos = end + 1;
+    }
+    return true;
 }
 
 /* Split a string at comma and return ordered list */
-inline void split(const std::string& str, std::vector<std::string>& out) {
-    static const std::regex re("[^,]+");
-
-    std::sregex_iterator current(str.begin(), str.end(), re);
-    std::sregex_iterator end;
-    while (current != end) {
-        std::string val = lrtrim((*current).str());
-        out.push_back(val);
-        current++;
-    }
+inline void split(std::string_view str, std::vector<std::string>& out) {
+    forEachToken(str, [&out](std::string_view tok) {
+        out.emplace_back(tok);
+        return true;
+    });
 }
 
-/* Helper class to manage vector index options as k-v map.
- * e.g type=HNSW,dim=1536,size=1000000,M=64,ef=100
+/* forEachOption - call fn(key, value) for each key=value pair of an options
+ * list, e.g MYVECTOR(type=hnsw,dim=50,size=4000000,M=64,ef=100) or the same
+ * after a '|' start marker. The keys and values point into 'line', nothing
+ * is allocated. Returns false at the first badly formed pair.
  */
-class MyVectorOptions {
-private:
-    /* Returns true on success, false on format error */
-    bool parseKV(const char* line) {
-        /* e.g options list-MYVECTOR(type=hnsw,dim=50,size=4000000,M=64,ef=100)
-         */
-        const char* ptr1 = line;
-        if (std::strchr(line, '|'))  /// start marker
-        {
-            ptr1 = std::strchr(line, '|');
-            ptr1++;
-        }
-        std::string sline(ptr1);
-        std::vector<std::string> listoptions;
-
-        split(sline, listoptions);
-
-        for (auto s : listoptions) {
-            size_t eq = s.find_first_of('=');
-            if (eq == std::string::npos)  /// badly formed
-                return false;
-
-            std::string k = s.substr(0, eq);
-            std::string v = s.substr(eq + 1);
-
-            k = lrtrim(k);
-            v = lrtrim(v);
-
-            if (!k.length() || !v.length())
-                return false;
+template <typename Fn>
+inline bool forEachOption(std::string_view line, Fn&& fn) {
+    size_t marker = line.find('|');
+    if (marker != std::string_view::npos)
+        line.remove_prefix(marker + 1);
+
+    return forEachToken(line, [&fn](std::string_view s) {
+        size_t eq = s.find('=');
+        if (eq == std::string_view::npos)  /// badly formed
+            return false;
+
+        std::string_view k = lrtrim(s.substr(0, eq));
+        std::string_view v = lrtrim(s.substr(eq + 1));
+        if (!k.length() || !v.length())
+            return false;
+
+        fn(k, v);
+        return true;
+    });
+}
 
-            setOption(k, v);
-        }
+/* parseIntOption - Parse all of val as a decimal integer, false if it is
+ * not one or does not fit in an int.
+ */
+inline bool parseIntOption(std::string_view val, int& result) {
+    if (val.length() > 1 && val[0] == '+' && val[1] != '-')
+        val.remove_prefix(1);
+    const char* end = val.data() + val.length();
+    auto r = std::from_chars(val.data(), end, result);
+    return r.ec == std::errc() && r.ptr == end;
+}
 
-        return true;
-    } /* parseKV */
+/* parseDoubleOption - Parse all of val as a decimal number. from_chars of
+ * a double needs GCC 11, older compilers use strtod on a copy.
+ */
+inline bool parseDoubleOption(std::string_view val, double& result) {
+#if defined(__cpp_lib_to_chars)
+    const char* end = val.data() + val.length();
+    auto r = std::from_chars(val.data(), end, result);
+    return r.ec == std::errc() && r.ptr == end;
+#else
+    std::string copy(val);
+    char* end = nullptr;
+    result = strtod(copy.c_str(), &end);
+    return copy.length() && *end == '\0';
+#endif
+}
 
+/* Helper class to manage vector index options as k-v map.
+ * e.g type=HNSW,dim=1536,size=1000000,M=64,ef=100
+ */
+class MyVectorOptions {
 public:
-    MyVectorOptions(const std::string& options) {
-        m_valid = false;
-        if (parseKV(options.c_str()))
-            m_valid = true;
+    MyVectorOptions(std::string_view options) {
+        m_valid = forEachOption(
+            options, [this](std::string_view k, std::string_view v) {
+                m_options[std::string(k)] = std::string(v);
+            });
     }
 
     bool isValid() const { return m_valid; }
@@ -82,11 +115,9 @@ public:
         m_options[name] = val;
     }
 
-    std::string getOption(const std::string& name) {
-        std::string ret = "";
-        if (m_options.find(name) != m_options.end())
-            ret = m_options[name];
-        return ret;
+    std::string getOption(const std::string& name) const {
+        auto it = m_options.find(name);
+        return (it != m_options.end() ? it->second : std::string());
     }
 
     /* getIntOption - Safely parse an integer option with validation.
@@ -96,27 +127,19 @@ public:
      */
     int getIntOption(const std::string& name,
                      int defaultVal = 0,
-                     bool* valid = nullptr) {
-        std::string val = getOption(name);
-        if (val.empty()) {
+                     bool* valid = nullptr) const {
+        auto it = m_options.find(name);
+        if (it == m_options.end()) {
             if (valid)
                 *valid = true;  // Missing is OK, use default
             return defaultVal;
         }
 
-        char* end = nullptr;
-        long result = strtol(val.c_str(), &end, 10);
-
-        // Check if entire string was consumed (valid integer)
-        if (end == val.c_str() || *end != '\0') {
-            if (valid)
-                *valid = false;
-            return defaultVal;
-        }
-
+        int result = 0;
+        bool ok = parseIntOption(it->second, result);
         if (valid)
-            *valid = true;
-        return static_cast<int>(result);
+            *valid = ok;
+        return (ok ? result : defaultVal);
     }
 
 private:
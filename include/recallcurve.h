@@ -0,0 +1,209 @@
+/* recallcurve.h - Recall of the searches of an HNSW index as a function of
+ * nn and ef, for the recall= option of myvector_ann_set().
+ *
+ * The index runs a sample of its own vectors as queries, with each ef of
+ * EF_GRID, and measures the recall of each against exact search (the query
+ * row itself left out of both). The mean recall is kept per (nn, ef) for
+ * each nn of NN_GRID. efFor() gives the cheapest ef that meets a recall
+ * target, interpolated between the measured efs of the nearest nn of the
+ * grid at or above the requested nn.
+ *
+ * A sample row is a node of the graph, the search reaches it and its links
+ * go straight to its neighbours, so the measured recall is higher than that
+ * of queries that are not in the index. efFor() makes up for it by aiming
+ * at half the miss rate asked for.
+ *
+ * The curve is saved next to the index as <index>.recall, with the row
+ * count it was measured at so that the index can tell when it is stale.
+ */
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+namespace hnswlib {
+
+    class RecallCurve {
+    public:
+        static constexpr size_t N_NN = 4;
+        static constexpr size_t N_EF = 14;
+        static constexpr int NN_GRID[N_NN] = {1, 10, 50, 100};
+        static constexpr int EF_GRID[N_EF] = {
+            10, 16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024};
+
+        /* Recall of one sample query per (nn, ef), NN_GRID major */
+        typedef std::vector<double> Sample;
+
+        bool valid() const { return m_rows != 0; }
+
+        /* rows - live rows of the index when the curve was measured */
+        size_t rows() const { return m_rows; }
+
+        size_t samples() const { return m_samples; }
+
+        /* measure - recall of one sample query. 'truth' are the exact
+         * neighbours nearest first, found[e] the neighbours returned by the
+         * search with EF_GRID[e], both without the query row. A search with
+         * ef < nn is run with ef = nn, so those cells are not measured.
+         */
+        static void measure(const std::vector<size_t>& truth,
+                            const std::vector<std::vector<size_t>>& found,
+                            Sample& recall) {
+            recall.assign(N_NN * N_EF, 0);
+            for (size_t i = 0; i < N_NN; i++) {
+                size_t nn = std::min((size_t)NN_GRID[i], truth.size());
+                if (!nn)
+                    continue;
+                std::vector<size_t> exact(truth.begin(), truth.begin() + nn);
+                std::sort(exact.begin(), exact.end());
+                for (size_t e = 0; e < N_EF && e < found.size(); e++) {
+                    if (EF_GRID[e] < NN_GRID[i])
+                        continue;
+                    size_t hits = 0;
+                    for (size_t j = 0; j < nn && j < found[e].size(); j++) {
+                        if (std::binary_search(
+                                exact.begin(), exact.end(), found[e][j]))
+                            hits++;
+                    }
+                    recall[i * N_EF + e] = (double)hits / nn;
+                }
+            }
+        }
+
+        /* set - the curve from the recall of 'samples', measured on an index
+         * of 'rows' live rows
+         */
+        void set(const std::vector<Sample>& samples, size_t rows) {
+            m_recall.assign(N_NN * N_EF, 0);
+            for (auto& s : samples) {
+                for (size_t c = 0; c < m_recall.size() && c < s.size(); c++)
+                    m_recall[c] += s[c];
+            }
+            for (auto& r : m_recall)
+                r /= std::max((size_t)1, samples.size());
+            m_samples = samples.size();
+            m_rows = (samples.size() ? rows : 0);
+        }
+
+        void clear() {
+            m_recall.clear();
+            m_samples = m_rows = 0;
+        }
+
+        /* efFor - cheapest ef meeting 'recall' for 'nn' neighbours, the
+         * largest ef of the grid if none does, 0 if not calibrated. Above
+         * the largest nn of the grid, ef grows in proportion to nn.
+         */
+        int efFor(int nn, double recall) const {
+            if (!valid() || nn <= 0)
+                return 0;
+            recall = 1 - (1 - recall) / 2;
+
+            size_t i = 0;
+            while (i < N_NN - 1 && NN_GRID[i] < nn)
+                i++;
+
+            int ef = EF_GRID[N_EF - 1];
+            int prevEf = 0;
+            double prevRecall = 0;
+            for (size_t e = 0; e < N_EF; e++) {
+                if (EF_GRID[e] < NN_GRID[i])
+                    continue;
+                double r = m_recall[i * N_EF + e];
+                if (r >= recall) {
+                    ef = EF_GRID[e];
+                    if (prevEf)
+                        ef = prevEf + (int)ceil((EF_GRID[e] - prevEf) *
+                                                (recall - prevRecall) /
+                                                (r - prevRecall));
+                    break;
+                }
+                prevEf = EF_GRID[e];
+                prevRecall = r;
+            }
+
+            if (nn > NN_GRID[N_NN - 1])
+                ef = (int)((long)ef * nn / NN_GRID[N_NN - 1]);
+            return std::max(ef, nn);
+        }
+
+        /* recallAt - measured recall of (NN_GRID[i], EF_GRID[e]) */
+        double recallAt(size_t i, size_t e) const {
+            return (valid() ? m_recall[i * N_EF + e] : 0);
+        }
+
+        /* save() - write the curve through a rename. It can be measured
+         * again, so a failure is only reported.
+         */
+        bool save(const std::string& file) const {
+            std::string tmpFile = file + ".tmp";
+            FILE* fp = fopen(tmpFile.c_str(), "wb");
+            if (!fp)
+                return false;
+            Header hdr = {RECALL_MAGIC, RECALL_VERSION, N_NN, N_EF,
+                          m_rows, m_samples};
+            bool ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+                      fwrite(NN_GRID, sizeof(NN_GRID), 1, fp) == 1 &&
+                      fwrite(EF_GRID, sizeof(EF_GRID), 1, fp) == 1 &&
+                      fwrite(m_recall.data(),
+                             sizeof(double) * m_recall.size(), 1, fp) == 1;
+            ok = (fclose(fp) == 0) && ok;
+            if (ok)
+                ok = (rename(tmpFile.c_str(), file.c_str()) == 0);
+            if (!ok)
+                remove(tmpFile.c_str());
+            return ok;
+        }
+
+        /* load() - read a curve saved with the same grids */
+        bool load(const std::string& file) {
+            clear();
+            FILE* fp = fopen(file.c_str(), "rb");
+            if (!fp)
+                return false;
+            Header hdr;
+            int nnGrid[N_NN], efGrid[N_EF];
+            std::vector<double> recall(N_NN * N_EF);
+            bool ok = fread(&hdr, sizeof(hdr), 1, fp) == 1 &&
+                      hdr.magic == RECALL_MAGIC &&
+                      hdr.version == RECALL_VERSION && hdr.nnn == N_NN &&
+                      hdr.nef == N_EF &&
+                      fread(nnGrid, sizeof(nnGrid), 1, fp) == 1 &&
+                      fread(efGrid, sizeof(efGrid), 1, fp) == 1 &&
+                      std::equal(nnGrid, nnGrid + N_NN, NN_GRID) &&
+                      std::equal(efGrid, efGrid + N_EF, EF_GRID) &&
+                      fread(recall.data(), sizeof(double) * recall.size(), 1,
+                            fp) == 1;
+            fclose(fp);
+            if (!ok)
+                return false;
+            m_recall.swap(recall);
+            m_rows = hdr.rows;
+            m_samples = hdr.samples;
+            return true;
+        }
+
+    private:
+        static constexpr uint64_t RECALL_MAGIC = 0x314c434556594dUL; /* MYVECL1 */
+        static constexpr uint32_t RECALL_VERSION = 1;
+
+        struct Header {
+            uint64_t magic;
+            uint32_t version;
+            uint16_t nnn;
+            uint16_t nef;
+            uint64_t rows;
+            uint64_t samples;
+        };
+
+        std::vector<double> m_recall;
+        size_t m_rows{0};
+        size_t m_samples{0};
+    };
+
+}  // namespace hnswlib
@@ -1,6 +1,8 @@
 #pragma once
 #include <assert.h>
 
+#include <algorithm>
+#include <chrono>
 #include <unordered_map>
 
 #include "space_ip.h"
@@ -285,4 +287,86 @@ namespace hnswlib {
 
         ~EpsilonSearchStopCondition() {}
     };
+
+    /* BudgetSearchStopCondition - the usual ef bounded search that also
+     * stops when it has spent 'budget_us' microseconds (from construction)
+     * or 'max_dist_comps' level 0 distance computations, 0 for no limit.
+     * The clock is read every BUDGET_CHECK_HOPS hops. It does not stop
+     * before 'min_num_candidates' results are held, the search then
+     * returns the best candidates found so far and exhausted() is set.
+     */
+    template <typename dist_t>
+    class BudgetSearchStopCondition : public BaseSearchStopCondition<dist_t> {
+        static const size_t BUDGET_CHECK_HOPS = 8;
+
+        size_t ef_;
+        size_t min_num_candidates_;
+        size_t curr_num_items_;
+        std::chrono::steady_clock::time_point deadline_;
+        bool timed_;
+        size_t max_dist_comps_;
+        size_t dist_comps_;
+        size_t hops_;
+        bool exhausted_;
+
+    public:
+        BudgetSearchStopCondition(size_t ef,
+                                  size_t min_num_candidates,
+                                  long budget_us,
+                                  size_t max_dist_comps) {
+            ef_ = std::max(ef, min_num_candidates);
+            min_num_candidates_ = min_num_candidates;
+            curr_num_items_ = 0;
+            timed_ = budget_us > 0;
+            deadline_ = std::chrono::steady_clock::now() +
+                        std::chrono::microseconds(timed_ ? budget_us : 0);
+            max_dist_comps_ = max_dist_comps;
+            dist_comps_ = 0;
+            hops_ = 0;
+            exhausted_ = false;
+        }
+
+        bool exhausted() const { return exhausted_; }
+
+        void add_point_to_result(labeltype label,
+                                 const void* datapoint,
+                                 dist_t dist) override {
+            curr_num_items_ += 1;
+        }
+
+        void remove_point_from_result(labeltype label,
+                                      const void* datapoint,
+                                      dist_t dist) override {
+            curr_num_items_ -= 1;
+        }
+
+        bool should_stop_search(dist_t candidate_dist,
+                                dist_t lowerBound) override {
+            if (candidate_dist > lowerBound && curr_num_items_ == ef_)
+                return true;
+            if (curr_num_items_ < min_num_candidates_)
+                return false;
+            if ((max_dist_comps_ && dist_comps_ >= max_dist_comps_) ||
+                (timed_ && ++hops_ % BUDGET_CHECK_HOPS == 0 &&
+                 std::chrono::steady_clock::now() >= deadline_)) {
+                exhausted_ = true;
+                return true;
+            }
+            return false;
+        }
+
+        /* called once for each distance computed at level 0 */
+        bool should_consider_candidate(dist_t candidate_dist,
+                                       dist_t lowerBound) override {
+            dist_comps_ += 1;
+            return curr_num_items_ < ef_ || lowerBound > candidate_dist;
+        }
+
+        bool should_remove_extra() override { return curr_num_items_ > ef_; }
+
+        void filter_results(
+            std::vector<std::pair<dist_t, labeltype>>& candidates) override {}
+
+        ~BudgetSearchStopCondition() {}
+    };
 }  // namespace hnswlib
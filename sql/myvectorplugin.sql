@@ -48,6 +48,7 @@ DROP FUNCTION IF EXISTS myvector_display;
 DROP FUNCTION IF EXISTS myvector_distance;
 DROP FUNCTION IF EXISTS myvector_row_distance;
 DROP FUNCTION IF EXISTS myvector_ann_set;
+DROP FUNCTION IF EXISTS myvector_ann_batch;
 DROP FUNCTION IF EXISTS myvector_is_valid;
 
 DROP FUNCTION IF EXISTS myvector_search_open_udf;
@@ -64,18 +65,28 @@ CREATE FUNCTION myvector_display   RETURNS STRING SONAME 'myvector.so';
 -- Return : Computed distance between 2 vectors. disttype is 1 of L2/EUCLIDEAN/IP
 CREATE FUNCTION myvector_distance  RETURNS REAL   SONAME 'myvector.so';
 
--- myvector_ann_set(veccol VARCHAR, options VARCHAR, searchvec VARCHAR/VARBINARY)
--- Return : Comma separated list of IDs of nearest neighbours
+-- myvector_ann_set(veccol VARCHAR, idcol VARCHAR, searchvec VARBINARY
+--                  [, options VARCHAR [, handle INT]])
+-- Return : JSON list of IDs of nearest neighbours, [[id,distance],...] with
+-- options 'output=distance'. handle is set by the query rewrite.
 CREATE FUNCTION myvector_ann_set  RETURNS STRING  SONAME 'myvector.so';
 
+-- myvector_ann_batch(veccol VARCHAR, idcol VARCHAR, searchvec VARBINARY
+--                    [, options VARCHAR [, handle INT]])
+-- Return : Aggregate of myvector_ann_set() over the query vectors of a group,
+-- searched as one batch. Each ID once, with its nearest distance. Used by
+-- the MYVECTOR_SEARCH rewrite.
+CREATE AGGREGATE FUNCTION myvector_ann_batch RETURNS STRING SONAME 'myvector.so';
+
 -- myvector_is_valid(vec1 VARBINARY, INT dim)
 -- Return : 1 if vector is valid with respect to dimension & checksum, 0 otherwise
 -- This function is critical to detect vector column tampering or malformed vectors.
 CREATE FUNCTION myvector_is_valid RETURNS INTEGER  SONAME 'myvector.so';
 
--- myvector_row_distance(pkid INT)
+-- myvector_row_distance(pkid INT [, handle INT])
 -- Return : Distance of the select approximate near neighbour to the query vector
 -- This function is used in the SELECT list when a MYVECTOR_IS_ANN query is run
+-- handle N picks the N-th MYVECTOR_IS_ANN of the statement, default the last
 CREATE FUNCTION myvector_row_distance  RETURNS REAL   SONAME 'myvector.so';
 
 -- myvector_search_open_udf() - internal function, not for direct use
@@ -91,6 +102,14 @@ DROP PROCEDURE IF EXISTS MYVECTOR_INDEX_LOAD;
 
 DROP PROCEDURE IF EXISTS MYVECTOR_INDEX_STATUS;
 
+DROP PROCEDURE IF EXISTS MYVECTOR_INDEX_COMPACT;
+
+DROP PROCEDURE IF EXISTS MYVECTOR_INDEX_VERIFY;
+
+DROP PROCEDURE IF EXISTS MYVECTOR_INDEX_EXPORT;
+
+DROP PROCEDURE IF EXISTS MYVECTOR_INDEX_IMPORT;
+
 DROP PROCEDURE IF EXISTS MYVECTOR_INDEX_INTERNAL;
 
 DELIMITER //
@@ -123,6 +142,57 @@ BEGIN
 END
 //
 
+CREATE PROCEDURE MYVECTOR_INDEX_COMPACT(
+	IN myvectorcolumn VARCHAR(256))
+BEGIN
+        DECLARE extra   VARCHAR(1024);
+        DECLARE pkid    VARCHAR(1024);
+
+        SET extra = '';
+        SET pkid  = '';
+        
+        CALL MYVECTOR_INDEX_INTERNAL(myvectorcolumn, pkid, 'compact', extra);
+END
+//
+
+CREATE PROCEDURE MYVECTOR_INDEX_VERIFY(
+	IN myvectorcolumn VARCHAR(256))
+BEGIN
+        DECLARE extra   VARCHAR(1024);
+        DECLARE pkid    VARCHAR(1024);
+
+        SET extra = '';
+        SET pkid  = '';
+        
+        CALL MYVECTOR_INDEX_INTERNAL(myvectorcolumn, pkid, 'verify', extra);
+END
+//
+
+-- exportfile is a file name in myvector_index_dir, '' for the default
+CREATE PROCEDURE MYVECTOR_INDEX_EXPORT(
+	IN myvectorcolumn VARCHAR(256),
+	IN exportfile     VARCHAR(1024))
+BEGIN
+        DECLARE pkid    VARCHAR(1024);
+
+        SET pkid  = '';
+        
+        CALL MYVECTOR_INDEX_INTERNAL(myvectorcolumn, pkid, 'export', exportfile);
+END
+//
+
+CREATE PROCEDURE MYVECTOR_INDEX_IMPORT(
+	IN myvectorcolumn VARCHAR(256),
+	IN exportfile     VARCHAR(1024))
+BEGIN
+        DECLARE pkid    VARCHAR(1024);
+
+        SET pkid  = '';
+        
+        CALL MYVECTOR_INDEX_INTERNAL(myvectorcolumn, pkid, 'import', exportfile);
+END
+//
+
 CREATE PROCEDURE MYVECTOR_INDEX_LOAD(
 	IN myvectorcolumn VARCHAR(256))
 BEGIN
@@ -202,7 +272,8 @@ BEGIN
 END
 //
 
--- action is 'build', 'refresh', 'load', 'drop'
+-- action is 'build', 'refresh', 'load', 'drop', 'compact', 'verify', 'export',
+-- 'import'
 CREATE PROCEDURE MYVECTOR_INDEX_BUILD(
 	IN myvectorcolumn VARCHAR(256),
 	IN pkidcolumn     VARCHAR(64))
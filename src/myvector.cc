@@ -21,12 +21,16 @@
 */
 
 #include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <condition_variable>
 #include <iomanip>
 #include <list>
 #include <memory>
 #include <mutex>
 #include <queue>
-#include <regex>
 #include <set>
 #include <shared_mutex>
 #include <string>
@@ -81,6 +85,7 @@ extern MYSQL_PLUGIN gplugin;
 
 // using namespace std; - Removed for code quality
 using std::atomic;
+using std::condition_variable;
 using std::current_exception;
 using std::endl;
 using std::exception_ptr;
@@ -93,8 +98,6 @@ using std::min;
 using std::mutex;
 using std::pair;
 using std::priority_queue;
-using std::regex;
-using std::regex_search;
 using std::reverse;
 using std::set;
 using std::shared_lock;
@@ -112,8 +115,12 @@ using std::vector;
 #include <mysql/components/services/mysql_string.h>
 #include <mysql/components/services/udf_metadata.h>
 
+#include "diskann.h"
 #include "hnswdisk.h"
 #include "hnswlib.h"
+#include "knnbatch.h"
+#include "knnflat.h"
+#include "recallcurve.h"
 #include "my_checksum.h"
 #include "myvectorutils.h"
 
@@ -166,6 +173,11 @@ static const unsigned int MYVECTOR_CONSTRUCT_MAX_LEN = 128000;
  */
 static const unsigned int MYVECTOR_DISPLAY_MAX_LEN = 128000;
 
+/* Buffer for the report of an index admin action, e.g the status lines.
+   Longer reports are truncated.
+ */
+static const unsigned int MYVECTOR_OPEN_RESULT_MAX_LEN = 16384;
+
 /* Default precision for float output in myvector_display() */
 static const unsigned int MYVECTOR_DISPLAY_DEF_PREC = 7;
 
@@ -185,6 +197,15 @@ static const unsigned int MYVECTOR_DEFAULT_ANN_RETURN_COUNT = 10;
  */
 static const unsigned int MYVECTOR_MAX_ANN_RETURN_COUNT = 10000;
 
+/* Longest myvector_ann_set() entry - a 20 digit id, or [id,dist] with a
+ * 15 character float, and the separating comma
+ */
+static const unsigned int MYVECTOR_ANN_ID_MAX_LEN = 21;
+static const unsigned int MYVECTOR_ANN_ID_DIST_MAX_LEN = 40;
+
+/* myvector_ann_batch() returns nn entries per query row, LONGTEXT */
+static const unsigned long MYVECTOR_ANN_BATCH_MAX_LEN = 0xFFFFFFFFUL;
+
 /* Basic check for validity of index last update timestamp > '01-01-2024' */
 static const unsigned long MYVECTOR_MIN_VALID_UPDATE_TS = 1704047400;
 
@@ -197,16 +218,52 @@ extern long myvector_feature_level;
 
 char* latin1 = const_cast<char*>("latin1");
 
-const set<string> MYVECTOR_INDEX_TYPES{"KNN", "HNSW", "HNSW_BV"};
+const set<string> MYVECTOR_INDEX_TYPES{"KNN", "HNSW", "HNSW_BV", "DISKANN"};
+
+/* AnnResult - the (id, distance) pairs of a myvector_ann_set() search,
+ * sorted by id so that myvector_row_distance() is a binary search. The
+ * pairs vector is reused by the next search with the same handle.
+ */
+class AnnResult {
+public:
+    void set(const vector<KeyTypeInteger>& keys, const vector<double>& dists) {
+        m_rows.clear();
+        for (size_t i = 0; i < keys.size(); i++)
+            m_rows.push_back({keys[i], i < dists.size() ? dists[i] : 0});
+        sort(m_rows.begin(), m_rows.end());
+    }
+
+    bool find(KeyTypeInteger id, double& dist) const {
+        auto it = lower_bound(m_rows.begin(),
+                              m_rows.end(),
+                              pair<KeyTypeInteger, double>(id, -HUGE_VAL));
+        if (it == m_rows.end() || it->first != id)
+            return false;
+        dist = it->second;
+        return true;
+    }
+
+    void clear() { m_rows.clear(); }
+
+private:
+    vector<pair<KeyTypeInteger, double>> m_rows;
+};
 
-/* Thread-local storage for distances from last ANN search.
- * Using a static thread_local object avoids manual memory management
- * and prevents memory leaks. The map is automatically constructed
- * on first use per thread and destroyed when the thread exits.
+/* Results of the ANN searches of a connection, by handle. The query rewrite
+ * gives the n-th MYVECTOR_IS_ANN / MYVECTOR_SEARCH of a statement handle n,
+ * so myvector_row_distance(id, n) reads its distances. Handle 0 is used by
+ * direct myvector_ann_set() calls. myvector_row_distance(id) reads the
+ * handle of the last search.
  */
-static thread_local unordered_map<KeyTypeInteger, double> tls_distances_map;
-static thread_local unordered_map<KeyTypeInteger, double>* tls_distances =
-    &tls_distances_map;
+static const unsigned int MYVECTOR_MAX_ANN_HANDLES = 64;
+static thread_local vector<AnnResult> tls_ann_results;
+static thread_local unsigned int tls_ann_last_handle = 0;
+
+static AnnResult& annResult(unsigned int handle) {
+    if (tls_ann_results.size() <= handle)
+        tls_ann_results.resize(handle + 1);
+    return tls_ann_results[handle];
+}
 
 inline bool isValidIndexType(const string& indextype) {
     return (MYVECTOR_INDEX_TYPES.find(indextype) != MYVECTOR_INDEX_TYPES.end());
@@ -363,10 +420,131 @@ public:
     ~HammingBinaryVectorSpace() {}
 };
 
+/* makeCheckPointString - checkpoint id persisted with an index. Online
+ * indexes record the binlog coordinates, others the last refresh timestamp.
+ */
+static void makeCheckPointString(AbstractVectorIndex* vi, string& ckstr) {
+    stringstream ss;
+
+    if (vi->supportsIncrUpdates()) {
+        string binlogFile;
+        size_t binlogPos = 0;
+
+        vi->getLastUpdateCoordinates(binlogFile, binlogPos);
+        ss << "Checkpoint:binlog:" << binlogFile << ":" << binlogPos;
+    } else {
+        ss << "Checkpoint:timestamp:" << vi->getUpdateTs();
+    }
+    ckstr = ss.str();
+}
+
+/* applyCheckPointString - restore the timestamp or binlog coordinates of a
+ * loaded index from its checkpoint id.
+ */
+static void applyCheckPointString(AbstractVectorIndex* vi, const string& ckid) {
+    if (ckid.find("Checkpoint:timestamp") != string::npos) {
+        size_t ts = atol(ckid.substr(ckid.rfind(":") + 1).c_str());
+        debug_print("load index checkpoint ts = %lu.", ts);
+        vi->setUpdateTs(ts);
+    } else if (ckid.find("Checkpoint:binlog") != string::npos) {
+        // ckptid=Checkpoint:binlog:binlog.000516:6761
+        size_t p1 = ckid.rfind(":");
+        size_t binlogPosition = atol(ckid.substr(p1 + 1).c_str());
+        size_t p2 = ckid.rfind(":", p1 - 1);
+        string binlogFile = ckid.substr(p2 + 1, (p1 - (p2 + 1)));
+        vi->setLastUpdateCoordinates(binlogFile, binlogPosition);
+    }
+}
+
+// Parallel index build, load and batch search (hnswlib:example_search_mt.cpp)
+template <class Function>
+inline void ParallelFor(size_t start,
+                        size_t end,
+                        size_t numThreads,
+                        Function fn) {
+    debug_print("Entered ParallelFor %lu %lu t=%lu", start, end, numThreads);
+    if (numThreads <= 0) {
+        numThreads = thread::hardware_concurrency();
+    }
+
+    if (numThreads == 1) {
+        for (size_t id = start; id < end; id++) {
+            fn(id, 0);
+        }
+    } else {
+        vector<thread> threads;
+        atomic<size_t> current(start);
+
+        // keep track of exceptions in threads
+        // https://stackoverflow.com/a/32428427/1713196
+        exception_ptr lastException = nullptr;
+        mutex lastExceptMutex;
+
+        for (size_t threadId = 0; threadId < numThreads; ++threadId) {
+            threads.push_back(thread([&, threadId] {
+                while (true) {
+                    size_t id = current.fetch_add(1);
+
+                    if (id >= end) {
+                        break;
+                    }
+
+                    try {
+                        fn(id, threadId);
+                    } catch (...) {
+                        unique_lock<mutex> lastExcepLock(lastExceptMutex);
+                        lastException = current_exception();
+                        /*
+                         * This will work even when current is the largest value
+                         * that size_t can fit, because fetch_add returns the
+                         * previous value before the increment (what will result
+                         * in overflow and produce 0 instead of current + 1).
+                         */
+                        current = end;
+                        break;
+                    }
+                }
+            }));
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        if (lastException) {
+            rethrow_exception(lastException);
+        }
+    }
+}
+
+/* searchVectorsNN - one searchVectorNN() per query, the queries are shared
+ * out to 'nthreads' threads
+ */
+bool AbstractVectorIndex::searchVectorsNN(const vector<VectorPtr>& qvecs,
+                                          int dim,
+                                          vector<vector<KeyTypeInteger>>& nnkeys,
+                                          vector<vector<double>>& nndists,
+                                          int n,
+                                          int nthreads,
+                                          SearchBudget* budget) {
+    const size_t nq = qvecs.size();
+    nnkeys.assign(nq, {});
+    nndists.assign(nq, {});
+    if (!nq)
+        return true;
+
+    size_t t = (nthreads > 0 ? nthreads : thread::hardware_concurrency());
+    atomic<bool> ok(true);
+    ParallelFor(0, nq, std::max((size_t)1, std::min(t, nq)), [&](size_t q, size_t) {
+        if (!searchVectorNN(qvecs[q], dim, nnkeys[q], nndists[q], n, budget))
+            ok = false;
+    });
+    return ok;
+}
+
 /* KNNIndex - A vector index type that implements brute-force KNN search in
  * the MyVector plugin. This index type could possibly be faster than SQL
  * performing ORDER BY myvector_distance(...) [as long as all vectors fit
- * in memory].
+ * in memory]. The rows are kept in a flat file (knnflat.h) that is mapped
+ * at load, so a restart does not need a rebuild.
  */
 class KNNIndex : public AbstractVectorIndex {
 public:
@@ -374,7 +552,6 @@ public:
 
     ~KNNIndex() {}
 
-    /* Next 4 methods are no-op in the KNN in-memory index */
     bool saveIndex(const string& path, const string& option = "");
 
     bool saveIndexIncr(const string& path, const string& option = "");
@@ -395,20 +572,42 @@ public:
     bool searchVectorNN(VectorPtr qvec,
                         int dim,
                         vector<KeyTypeInteger>& keys,
-                        int n);
+                        vector<double>& dists,
+                        int n,
+                        SearchBudget* budget = nullptr);
+    bool searchVectorsNN(const vector<VectorPtr>& qvecs,
+                         int dim,
+                         vector<vector<KeyTypeInteger>>& nnkeys,
+                         vector<vector<double>>& nndists,
+                         int n,
+                         int nthreads,
+                         SearchBudget* budget = nullptr);
     bool insertVector(VectorPtr vec, int dim, KeyTypeInteger id);
 
-    bool supportsIncrUpdates() { return true; }
+    bool deleteVector(KeyTypeInteger id);
+
+    bool supportsIncrUpdates() { return m_incrUpdates; }
 
-    bool supportsPersist() { return false; }
+    bool supportsPersist() { return true; }
 
     bool supportsConcurrentUpdates() { return false; }  /// no mutexing!
 
-    bool supportsIncrRefresh() { return true; }
+    bool supportsIncrRefresh() { return m_incrRefresh; }
+
+    bool supportsDeletes() { return true; }
 
     bool isReady() { return true; }
 
-    bool isDirty() { return false; }  /// No persistence
+    bool isDirty() {
+        std::shared_lock lock(search_insert_mutex_);
+        return m_store.changed() > 0;
+    }
+
+    void getDirtyStats(size_t& nodes, size_t& bytes) {
+        std::shared_lock lock(search_insert_mutex_);
+        nodes = m_store.changed();
+        bytes = nodes * m_store.rowBytes();
+    }
 
     int getDimension() { return m_dim; }
 
@@ -420,6 +619,17 @@ public:
 
     unsigned long getRowCount() { return m_n_rows; }
 
+    void getLastUpdateCoordinates(string& binlogFile, size_t& binlogPos) {
+        binlogFile = m_binlogFile;
+        binlogPos = m_binlogPosition;
+    }
+
+    void setLastUpdateCoordinates(const string& binlogFile,
+                                  const size_t& binlogPos) {
+        m_binlogFile = binlogFile;
+        m_binlogPosition = binlogPos;
+    }
+
 private:
     string m_name;
     string m_options;
@@ -432,22 +642,43 @@ private:
     atomic<unsigned long> m_n_rows{0};
     atomic<unsigned long> m_n_searches{0};
 
-    /* The in-memory data store for the vectors */
-    vector<pair<vector<FP32>, KeyTypeInteger>> m_vectors;
+    /* The vectors and their keys, see knnflat.h */
+    hnswlib::FlatVectorFile m_store;
+
+    bool m_incrUpdates;
+    bool m_incrRefresh;
+
+    string m_binlogFile;
+    size_t m_binlogPosition{0};
+
+    string indexFile(const string& path) {
+        return path + "/" + m_name + ".knn.index";
+    }
 
     double (*m_distfn)(const FP32* v1, const FP32* v2, int dim);
+    hnswlib::FlatBatchSearch::Metric m_metric;
 };
 
 KNNIndex::KNNIndex(const string& name, const string& options)
-    : m_name(name), m_options(options), m_optionsMap(options), m_updateTs(0) {
+    : m_name(name),
+      m_options(options),
+      m_updateTs(0),
+      m_optionsMap(options),
+      m_store(m_optionsMap.getIntOption("dim", 0)) {
     m_dim = m_optionsMap.getIntOption("dim", 0);
+    m_incrUpdates = m_optionsMap.getOption("online") == "Y";
+    m_incrRefresh = m_optionsMap.getOption("track").length() > 0;
 
     m_distfn = computeL2Distance;
+    m_metric = hnswlib::FlatBatchSearch::L2;
     if (m_optionsMap.getOption("dist").size()) {
-        if (m_optionsMap.getOption("dist") == "Cosine")
+        if (m_optionsMap.getOption("dist") == "Cosine") {
             m_distfn = computeCosineDistance;
-        else if (m_optionsMap.getOption("dist") == "IP")
+            m_metric = hnswlib::FlatBatchSearch::COSINE;
+        } else if (m_optionsMap.getOption("dist") == "IP") {
             m_distfn = computeIPDistance;
+            m_metric = hnswlib::FlatBatchSearch::IP;
+        }
     } else {
         m_optionsMap.setOption("dist", "L2");
     }
@@ -461,24 +692,27 @@ KNNIndex::KNNIndex(const string& name, const string& options)
 bool KNNIndex::searchVectorNN(VectorPtr qvec,
                               int dim,
                               vector<KeyTypeInteger>& keys,
-                              int n) {
+                              vector<double>& dists,
+                              int n,
+                              SearchBudget* /* exact search, no budget */) {
     std::shared_lock lock(search_insert_mutex_);
 
     priority_queue<pair<FP32, KeyTypeInteger>> pq;
     keys.clear();
+    dists.clear();
 
     /* Use priority queue to find out 'n' neighbours with least distance */
-    for (auto row : m_vectors) {
-        vector<FP32>& a = row.first;
-        double dist = m_distfn((FP32*)qvec, a.data(), m_dim);
+    const uint64_t* rowkeys = m_store.keys();
+    for (size_t i = 0; i < m_store.size(); i++) {
+        double dist = m_distfn((FP32*)qvec, m_store.vector(i), m_dim);
 
         if (pq.size() < n)
-            pq.push({dist, row.second});
+            pq.push({dist, rowkeys[i]});
         else {
             auto top = pq.top();
             if (dist < top.first) {
                 pq.pop();
-                pq.push({dist, row.second});
+                pq.push({dist, rowkeys[i]});
             }
         }
     } /* for */
@@ -487,33 +721,113 @@ bool KNNIndex::searchVectorNN(VectorPtr qvec,
         auto r = pq.top();
         pq.pop();
         keys.push_back(r.second);
-        (*tls_distances)[r.second] = r.first;  /// pkid -> distance
+        dists.push_back(r.first);
     }
 
     reverse(keys.begin(), keys.end());  /// nearest to farthest
+    reverse(dists.begin(), dists.end());
 
     m_n_searches++;
     return true;
 }
 
-/* insertVector - just stash the vector into in-memory vector<> collection */
+/* searchVectorsNN - exact search of a batch of queries, one pass over the
+ * vectors per block of queries instead of one per query (knnbatch.h). The
+ * query blocks are shared out to 'nthreads' threads.
+ */
+bool KNNIndex::searchVectorsNN(const vector<VectorPtr>& qvecs,
+                               int dim,
+                               vector<vector<KeyTypeInteger>>& nnkeys,
+                               vector<vector<double>>& nndists,
+                               int n,
+                               int nthreads,
+                               SearchBudget* /* exact search, no budget */) {
+    std::shared_lock lock(search_insert_mutex_);
+
+    if (nthreads <= 0)
+        nthreads = thread::hardware_concurrency();
+    if (n < 0)
+        n = 0;
+
+    hnswlib::FlatBatchSearch bs(m_dim, m_metric);
+    const size_t nq = qvecs.size();
+    const size_t qb = bs.queryBlockSize(nq, nthreads);
+    vector<hnswlib::FlatBatchSearch::Neighbours> results(nq);
+
+    ParallelFor(0, (nq + qb - 1) / qb, nthreads, [&](size_t b, size_t) {
+        bs.searchBlock((const FP32* const*)qvecs.data(),
+                       b * qb,
+                       std::min(nq, (b + 1) * qb),
+                       m_store.vector(0),
+                       m_store.keys(),
+                       m_store.size(),
+                       n,
+                       results);
+    });
+
+    nnkeys.assign(nq, {});
+    nndists.assign(nq, {});
+    for (size_t q = 0; q < nq; q++) {
+        for (auto& r : results[q]) {
+            nnkeys[q].push_back(r.second);
+            nndists[q].push_back(r.first);
+        }
+    }
+
+    m_n_searches += nq;
+    return true;
+}
+
+/* insertVector - add the vector to the flat store, or replace the vector
+ * of an id already present. The next saveIndex() makes it durable.
+ */
 bool KNNIndex::insertVector(VectorPtr vec, int dim, KeyTypeInteger id) {
     std::unique_lock lock(search_insert_mutex_);
 
-    FP32* fvec = static_cast<FP32*>(vec);
-    vector<FP32> row(fvec, fvec + m_dim);
-    m_vectors.push_back({row, id});  /// simple index - multithread safe
+    try {
+        m_store.upsert(static_cast<FP32*>(vec), id);
+    } catch (std::runtime_error& e) {
+        error_print("KNN Memory Index (%s) - insert failed : %s",
+                    m_name.c_str(),
+                    e.what());
+        return false;
+    }
 
-    m_n_rows++;
+    m_n_rows = m_store.size();
+    bumpMutationEpoch();
 
     return true;
 }
 
-bool KNNIndex::saveIndex(const string&, const string&) {
-    my_plugin_log_message(&gplugin,
-                          MY_WARNING_LEVEL,
-                          "KNN Memory Index (%s) - Save Index to disk is no-op",
-                          m_name.c_str());
+/* deleteVector - O(1), the last row of the store takes the freed slot */
+bool KNNIndex::deleteVector(KeyTypeInteger id) {
+    std::unique_lock lock(search_insert_mutex_);
+
+    bool found = m_store.remove(id);
+    m_n_rows = m_store.size();
+    if (found)
+        bumpMutationEpoch();
+    return found;
+}
+
+/* saveIndex - "build" writes a new <name>.knn.index file, later saves
+ * checkpoint the rows appended since the last one, see knnflat.h.
+ */
+bool KNNIndex::saveIndex(const string& path, const string& option) {
+    string checkPointStr;
+    makeCheckPointString(this, checkPointStr);
+
+    debug_print("KNNIndex::saveIndex %s %s.", path.c_str(), option.c_str());
+
+    std::unique_lock lock(search_insert_mutex_);
+    try {
+        m_store.save(indexFile(path), checkPointStr);
+    } catch (std::runtime_error& e) {
+        error_print("KNN Memory Index (%s) - save failed : %s",
+                    m_name.c_str(),
+                    e.what());
+        return false;
+    }
 
     return true;
 }
@@ -528,30 +842,54 @@ bool KNNIndex::saveIndexIncr(const string&, const string&) {
     return true;
 }
 
-bool KNNIndex::dropIndex(const string&) {
-    my_plugin_log_message(&gplugin,
-                          MY_WARNING_LEVEL,
-                          "KNN Memory Index (%s) - Drop Index is no-op",
-                          m_name.c_str());
+bool KNNIndex::dropIndex(const string& path) {
+    hnswlib::FlatVectorFile::deleteIndexFiles(indexFile(path));
 
+    std::unique_lock lock(search_insert_mutex_);
+    m_store.reset();
+    m_n_rows = 0;
+    bumpMutationEpoch();
     return true;
 }
 
-bool KNNIndex::loadIndex(const string&) {
-    my_plugin_log_message(&gplugin,
-                          MY_WARNING_LEVEL,
-                          "KNN Memory Index (%s) - Load Index is no op",
-                          m_name.c_str());
+bool KNNIndex::loadIndex(const string& path) {
+    initIndex();
+
+    string filename = indexFile(path);
+    debug_print(
+        "Loading KNN index %s from %s", m_name.c_str(), filename.c_str());
+
+    string ckid;
+    {
+        std::unique_lock lock(search_insert_mutex_);
+        try {
+            ckid = m_store.load(filename);
+        } catch (std::runtime_error& e) {
+            warning_print("Error loading KNN index (%s) from file : %s",
+                          m_name.c_str(),
+                          e.what());
+            m_store.reset();  // empty index, the next build writes the file
+            return true;
+        }
+        m_n_rows = m_store.size();
+        bumpMutationEpoch();
+    }
+
+    applyCheckPointString(this, ckid);
     return true;
 }
 
 bool KNNIndex::initIndex() {
     debug_print("KNN Memory Index (%s) - initIndex()", m_name.c_str());
 
-    /// nothing much to do!!
-    m_vectors.clear();
+    std::unique_lock lock(search_insert_mutex_);
+    m_store.reset();
     m_n_rows = 0;
     m_n_searches = 0;
+    bumpMutationEpoch();
+
+    setLastUpdateCoordinates("zzzzzz.bin", 99999999999);
+    setUpdateTs(0);
 
     return true;
 }
@@ -566,7 +904,11 @@ string KNNIndex::getStatus() {
     ss << "Type : KNN" << endl;
     ss << "Dimension : " << m_dim << endl;
     ss << "Distance : " << m_optionsMap.getOption("dist") << endl;
-    ss << "Rows Inserted : " << m_n_rows << endl;
+    ss << "Current Rows : " << m_n_rows << endl;
+    {
+        std::shared_lock lock(search_insert_mutex_);
+        ss << "Rows Persisted : " << m_store.committed() << endl;
+    }
     ss << "Searches : " << m_n_searches << endl;
 
     return ss.str();
@@ -580,8 +922,11 @@ public:
 
     bool supportsIncrUpdates() { return m_incrUpdates; }
     bool supportsIncrRefresh() { return m_incrRefresh; }
+    bool supportsDeletes() { return true; }
     bool isDirty() { return m_isDirty; }
 
+    void getDirtyStats(size_t& nodes, size_t& bytes);
+
     bool saveIndex(const string& path, const string& option);
 
     bool saveIndexIncr(const string& path, const string& option);
@@ -603,10 +948,14 @@ public:
     bool searchVectorNN(VectorPtr qvec,
                         int dim,
                         vector<KeyTypeInteger>& keys,
-                        int n);
+                        vector<double>& dists,
+                        int n,
+                        SearchBudget* budget = nullptr);
 
     bool insertVector(VectorPtr vec, int dim, KeyTypeInteger id);
 
+    bool deleteVector(KeyTypeInteger id);
+
     int getDimension() { return m_dim; }
 
     void setUpdateTs(unsigned long ts) { m_updateTs = ts; }
@@ -630,7 +979,23 @@ public:
 
     void setSearchEffort(int ef_search);
 
+    int searchEffortForRecall(int n, double recall);
+    bool recallCalibrationDue();
+    void calibrateRecall();
+
+    bool compactIndex(const string& path, string& report);
+
+    bool verifyIndex(const string& path, string& report);
+
+    bool exportIndex(const string& path, const string& file, string& report);
+    bool importIndex(const string& path, const string& file, string& report);
+
 private:
+    bool exportFilePath(const string& path,
+                        const string& file,
+                        string& exportfile,
+                        string& report);
+
     string m_name;
     string m_type;
     string m_options;
@@ -650,6 +1015,7 @@ private:
 
     atomic<unsigned long> m_n_rows{0};
     atomic<unsigned long> m_n_searches{0};
+    atomic<unsigned long> m_n_budget_exhausted{0};
 
     bool m_isDirty;
 
@@ -666,6 +1032,45 @@ private:
 
     int m_threads;
 
+    /* Sharded parallel build - build_shards=S builds S independent
+     * sub-graphs and merges them into m_alg_hnsw at the end of the build.
+     */
+    int m_buildShards{1};
+    size_t m_shardedRows{0};
+    vector<hnswlib::HierarchicalDiskNSW<FP32>*> m_shards;
+
+    bool flushBatchSharded();
+    bool mergeShards();
+
+    /* Online compaction - rows inserted or deleted while the compacted copy
+     * is being built are captured here and replayed into the copy before
+     * the swap. Inserts and deletes hold m_compactGate shared, compaction
+     * takes it exclusive to start the capture and read the row count, so a
+     * row is either in the copy or in the replay, not in both.
+     */
+    std::shared_mutex m_compactGate;
+    std::mutex m_compactMutex;
+    atomic<bool> m_compacting{false};
+    vector<char> m_compactBatch;               // vectors of the inserts
+    vector<KeyTypeInteger> m_compactKeys;
+    vector<bool> m_compactDeletes;             // per key, a delete
+
+    void captureCompactOp(KeyTypeInteger id, VectorPtr vec);
+    void replayCompactBatch(hnswlib::HierarchicalDiskNSW<FP32>* alg_hnsw);
+
+    /* ef(nn, recall) curve for recall= searches, recalibrated in the
+     * background after the first recall= search that finds changes to a
+     * tenth of the rows it was measured on. recall_samples=0 disables it.
+     */
+    std::mutex m_recallMutex;      // m_recallCurve, m_recallEpoch
+    std::mutex m_calibrateMutex;   // one calibration at a time
+    hnswlib::RecallCurve m_recallCurve;
+    uint64_t m_recallEpoch{0};
+    int m_recallSamples{100};
+    string m_recallFile;
+
+    bool isRecallCurveStale();
+
     /// last update coordinates
     string m_binlogFile;
     size_t m_binlogPosition;
@@ -695,6 +1100,12 @@ HNSWMemoryIndex::HNSWMemoryIndex(const string& name, const string& options)
     if (m_optionsMap.getOption("ef_search").length())
         m_ef_search = m_optionsMap.getIntOption("ef_search", m_ef_construction);
 
+    m_buildShards = m_optionsMap.getIntOption("build_shards", 1);
+    if (m_buildShards < 1)
+        m_buildShards = 1;
+
+    m_recallSamples = m_optionsMap.getIntOption("recall_samples", 100);
+
     debug_print("hnsw index params %s %s  %d %d %d %d %d",
                 name.c_str(),
                 m_type.c_str(),
@@ -706,6 +1117,8 @@ HNSWMemoryIndex::HNSWMemoryIndex(const string& name, const string& options)
 }
 
 HNSWMemoryIndex::~HNSWMemoryIndex() {
+    for (auto shard : m_shards)
+        delete shard;
     if (m_alg_hnsw)
         delete m_alg_hnsw;
     if (m_space)
@@ -731,6 +1144,8 @@ bool HNSWMemoryIndex::initIndex() {
 
     m_n_rows = 0;
     m_n_searches = 0;
+    m_n_budget_exhausted = 0;
+    bumpMutationEpoch();
 
     setLastUpdateCoordinates("zzzzzz.bin", 99999999999);
     setUpdateTs(0);
@@ -739,18 +1154,7 @@ bool HNSWMemoryIndex::initIndex() {
 }
 
 void HNSWMemoryIndex::getCheckPointString(string& ckstr) {
-    stringstream ss;
-
-    if (supportsIncrUpdates()) {
-        string binlogFile;
-        size_t binlogPos = 0;
-
-        getLastUpdateCoordinates(binlogFile, binlogPos);
-        ss << "Checkpoint:binlog:" << binlogFile << ":" << binlogPos;
-    } else {
-        ss << "Checkpoint:timestamp:" << getUpdateTs();
-    }
-    ckstr = ss.str();
+    makeCheckPointString(this, ckstr);
 }
 
 bool HNSWMemoryIndex::saveIndex(const string& path, const string& option) {
@@ -766,8 +1170,13 @@ bool HNSWMemoryIndex::saveIndex(const string& path, const string& option) {
 
     // lockExclusive();
 
-    if (m_isParallelBuild) {
+    if (m_isParallelBuild && m_shards.size()) {
+        flushBatchSharded();  // last batch, then merge the sub-graphs
+        mergeShards();
+        bumpMutationEpoch();
+    } else if (m_isParallelBuild) {
         flushBatchSerial();  // last batch, maybe small
+        bumpMutationEpoch();
     }
 
     debug_print(
@@ -788,11 +1197,31 @@ bool HNSWMemoryIndex::saveIndex(const string& path, const string& option) {
         dynamic_cast<hnswlib::HierarchicalDiskNSW<FP32>*>(m_alg_hnsw);
     alg_hnsw->setCheckPointId(checkPointStr);
 
-    if (option == "build") {
+    m_recallFile = filename + ".recall";
+    if (option == "build" || option == "rewrite") {
         // hnswlib method for full write/rewrite. Expect 10GB to take 10 secs.
-        alg_hnsw->saveIndex(filename);
+        // save_format=compact writes delta/varint encoded neighbour lists.
+        // "rewrite" - the same full write of a graph that is already online
+        // (compaction, import), see hnswdisk.i rewriteIndexOnline().
+        if (option == "build")
+            alg_hnsw->saveIndex(
+                filename, m_optionsMap.getOption("save_format") == "compact");
+        else
+            alg_hnsw->rewriteIndexOnline(filename);
+
+        // A new graph, the recall curve is measured again when needed
+        lock_guard<std::mutex> l(m_recallMutex);
+        m_recallCurve.clear();
+        myvector_unlink(m_recallFile.c_str());
     } else {
         // "refresh" or "checkpoint" - special MyVector incremental persistence.
+        // durability=deltalog appends to a sequential log instead of the
+        // two pass in place write, see hnswdisk.i appendDeltaLog().
+        alg_hnsw->setDeltaLogMode(
+            m_optionsMap.getOption("durability") == "deltalog",
+            m_optionsMap.getIntOption("delta_compact_mb", 256) * 1024UL * 1024);
+        alg_hnsw->setCheckPointIORate(myvector_checkpoint_io_mbps * 1024UL *
+                                      1024);
         alg_hnsw->doCheckPoint(filename);
     }
 
@@ -806,6 +1235,14 @@ bool HNSWMemoryIndex::saveIndexIncr(const string& path, const string& option) {
     return true;
 }
 
+void HNSWMemoryIndex::getDirtyStats(size_t& nodes, size_t& bytes) {
+    nodes = bytes = 0;
+    hnswlib::HierarchicalDiskNSW<FP32>* alg_hnsw =
+        dynamic_cast<hnswlib::HierarchicalDiskNSW<FP32>*>(m_alg_hnsw);
+    if (alg_hnsw && !m_isParallelBuild)
+        alg_hnsw->getDirtyStats(nodes, bytes);
+}
+
 bool HNSWMemoryIndex::loadIndex(const string& path) {
     if (m_alg_hnsw)
         delete m_alg_hnsw;
@@ -822,10 +1259,17 @@ bool HNSWMemoryIndex::loadIndex(const string& path) {
     debug_print(
         "Loading HNSW index %s from %s", m_name.c_str(), indexfile.c_str());
 
+    /* load=mmap maps the index file instead of reading it, pages come in
+     * on first access and the label map is built on first update.
+     */
+    bool useMmap = (m_optionsMap.getOption("load") == "mmap");
+
     /* hnswlib throws std::runtime_error for errors */
     m_alg_hnsw = nullptr;
     try {
-        m_alg_hnsw = new hnswlib::HierarchicalDiskNSW<FP32>(m_space, indexfile);
+        m_alg_hnsw = new hnswlib::HierarchicalDiskNSW<FP32>(
+            m_space, indexfile, false, 0, false, useMmap,
+            myvector_index_bg_threads);
     } catch (std::runtime_error& e) {
         warning_print("Error loading hnsw index (%s) from file : %s",
                       m_name.c_str(),
@@ -835,31 +1279,41 @@ bool HNSWMemoryIndex::loadIndex(const string& path) {
     if (!m_alg_hnsw) { /* no disk files found */
         initIndex();
     } else {
-        string binlogFile;
-        size_t binlogPosition = 0;
-        size_t ts = 0;
-
         string ckid =
             dynamic_cast<hnswlib::HierarchicalDiskNSW<FP32>*>(m_alg_hnsw)
                 ->getCheckPointId();
+        applyCheckPointString(this, ckid);
+
+        {
+            lock_guard<std::mutex> l(m_recallMutex);
+            m_recallCurve.load(indexfile + ".recall");
+        }
 
-        if (ckid.find("Checkpoint:timestamp") != string::npos) {
-            ts = atol(ckid.substr(ckid.rfind(":") + 1).c_str());
-            debug_print("load index checkpoint ts = %lu.", ts);
-            setUpdateTs(ts);
-        } else if (ckid.find("Checkpoint:binlog") != string::npos) {
-            // ckptid=Checkpoint:binlog:binlog.000516:6761
-            size_t p1 = ckid.rfind(":");
-            binlogPosition = atol(ckid.substr(p1 + 1).c_str());
-            size_t p2 = ckid.rfind(":", p1 - 1);
-            binlogFile = ckid.substr(p2 + 1, (p1 - (p2 + 1)));
-            setLastUpdateCoordinates(binlogFile, binlogPosition);
+        /* Fault in the hot part of a mapped index before it serves queries,
+         * warmup_mb=0 leaves it all to demand paging.
+         */
+        long warmupMB = m_optionsMap.getIntOption("warmup_mb", 1024);
+        if (useMmap && warmupMB > 0) {
+            auto start = std::chrono::steady_clock::now();
+            size_t bytes =
+                dynamic_cast<hnswlib::HierarchicalDiskNSW<FP32>*>(m_alg_hnsw)
+                    ->warmUp(warmupMB * 1024UL * 1024,
+                             myvector_index_bg_threads);
+            std::chrono::duration<double> secs =
+                std::chrono::steady_clock::now() - start;
+            info_print("HNSW index %s warmed up %lu MB in %.2f secs",
+                       m_name.c_str(),
+                       bytes / (1024 * 1024),
+                       secs.count());
         }
     }
 
     debug_print(
         "debug HNSW index %s from %s", m_name.c_str(), indexfile.c_str());
     dynamic_cast<hnswlib::HierarchicalDiskNSW<FP32>*>(m_alg_hnsw)->debug();
+    bumpMutationEpoch();
+    m_recallFile = indexfile + ".recall";
+    m_recallEpoch = mutationEpoch();
     return true;
 }
 
@@ -873,6 +1327,14 @@ bool HNSWMemoryIndex::dropIndex(const string& path) {
     myvector_unlink(linksdatafile.c_str());
     string statusfile = path + "/" + m_name + ".hnsw.index.status";
     myvector_unlink(statusfile.c_str());
+    string heatfile = path + "/" + m_name + ".hnsw.index.heat";
+    myvector_unlink(heatfile.c_str());
+    string recallfile = path + "/" + m_name + ".hnsw.index.recall";
+    myvector_unlink(recallfile.c_str());
+    {
+        lock_guard<std::mutex> l(m_recallMutex);
+        m_recallCurve.clear();
+    }
 
     if (m_alg_hnsw)
         delete m_alg_hnsw;
@@ -881,6 +1343,7 @@ bool HNSWMemoryIndex::dropIndex(const string& path) {
     if (m_space)
         delete m_space;
     m_space = nullptr;
+    bumpMutationEpoch();
 
     return true;
 }
@@ -892,6 +1355,130 @@ void HNSWMemoryIndex::setSearchEffort(int ef_search) {
         ->setEf(ef_search);
 }
 
+/* searchEffortForRecall - ef from the recall curve (recallcurve.h). Until
+ * a missing curve has been measured in the background this is 0, the index
+ * ef_search, a stale curve is used until it is replaced.
+ */
+int HNSWMemoryIndex::searchEffortForRecall(int n, double recall) {
+    lock_guard<std::mutex> l(m_recallMutex);
+    return m_recallCurve.efFor(n, recall);
+}
+
+bool HNSWMemoryIndex::recallCalibrationDue() {
+    return (m_recallSamples > 0 && m_alg_hnsw && isRecallCurveStale());
+}
+
+/* isRecallCurveStale - no curve, or rows added, updated or deleted since
+ * it was measured are more than a tenth of the rows it was measured on.
+ * Deleted rows of a mmap load count only once they have been counted.
+ */
+bool HNSWMemoryIndex::isRecallCurveStale() {
+    hnswlib::HierarchicalDiskNSW<FP32>* alg_hnsw =
+        dynamic_cast<hnswlib::HierarchicalDiskNSW<FP32>*>(m_alg_hnsw);
+    size_t rows = alg_hnsw->getCurrentElementCount() -
+                  alg_hnsw->getDeletedCount();
+
+    lock_guard<std::mutex> l(m_recallMutex);
+    if (!m_recallCurve.valid())
+        return (rows > 1);
+    size_t limit = m_recallCurve.rows() / 10;
+    size_t changed = std::max(rows, m_recallCurve.rows()) -
+                     std::min(rows, m_recallCurve.rows());
+    return (changed > limit || mutationEpoch() - m_recallEpoch > limit);
+}
+
+/* calibrateRecall - run recall_samples rows of the index as queries with
+ * each ef of the grid and compare them with exact search of the rows, on
+ * myvector_index_bg_threads threads. The searches pass their own ef, the
+ * ef of concurrent searches is not touched.
+ */
+void HNSWMemoryIndex::calibrateRecall() {
+    unique_lock<std::mutex> cl(m_calibrateMutex, std::try_to_lock);
+    if (!cl.owns_lock() || !recallCalibrationDue())
+        return;
+
+    hnswlib::HierarchicalDiskNSW<FP32>* alg_hnsw =
+        dynamic_cast<hnswlib::HierarchicalDiskNSW<FP32>*>(m_alg_hnsw);
+    typedef hnswlib::RecallCurve RC;
+
+    auto start = std::chrono::steady_clock::now();
+    uint64_t epoch = mutationEpoch();  // before, see isRecallCurveStale()
+    size_t count = alg_hnsw->getCurrentElementCount();
+    size_t rows = count - alg_hnsw->getDeletedCount();
+    if (rows < 2)
+        return;
+    const size_t K = std::min((size_t)RC::NN_GRID[RC::N_NN - 1], rows - 1);
+
+    std::mt19937_64 rng(count);
+    vector<hnswlib::tableint> sample;
+    for (size_t tries = 0;
+         sample.size() < (size_t)m_recallSamples && tries < 4 * count;
+         tries++) {
+        hnswlib::tableint id = rng() % count;
+        if (!alg_hnsw->isMarkedDeleted(id))
+            sample.push_back(id);
+    }
+
+    vector<RC::Sample> recall(sample.size());
+    ParallelFor(0, sample.size(), myvector_index_bg_threads, [&](size_t s, size_t) {
+        hnswlib::tableint qid = sample[s];
+        const char* qvec = alg_hnsw->getDataByInternalId(qid);
+        hnswlib::labeltype self = alg_hnsw->getExternalLabel(qid);
+
+        priority_queue<pair<FP32, hnswlib::labeltype>> exact;
+        for (hnswlib::tableint id = 0; id < count; id++) {
+            if (id == qid || alg_hnsw->isMarkedDeleted(id))
+                continue;
+            FP32 d = alg_hnsw->fstdistfunc_(qvec,
+                                            alg_hnsw->getDataByInternalId(id),
+                                            alg_hnsw->dist_func_param_);
+            if (exact.size() < K || d < exact.top().first) {
+                exact.emplace(d, alg_hnsw->getExternalLabel(id));
+                if (exact.size() > K)
+                    exact.pop();
+            }
+        }
+        vector<size_t> truth(exact.size());
+        for (size_t i = exact.size(); i > 0; i--) {
+            truth[i - 1] = exact.top().second;
+            exact.pop();
+        }
+
+        vector<vector<size_t>> found(RC::N_EF);
+        for (size_t e = 0; e < RC::N_EF; e++) {
+            size_t ef = RC::EF_GRID[e];
+            auto result = alg_hnsw->searchKnnEf(qvec, std::min(ef, K + 1), ef);
+            found[e].resize(result.size());
+            for (size_t i = result.size(); i > 0; i--) {
+                found[e][i - 1] = result.top().second;
+                result.pop();
+            }
+            found[e].erase(std::remove(found[e].begin(), found[e].end(), self),
+                           found[e].end());
+        }
+        RC::measure(truth, found, recall[s]);
+    });
+
+    RC curve;
+    curve.set(recall, rows);
+    if (m_recallFile.length() && !curve.save(m_recallFile))
+        warning_print("Recall curve of HNSW index %s not saved to %s",
+                      m_name.c_str(),
+                      m_recallFile.c_str());
+
+    lock_guard<std::mutex> l(m_recallMutex);
+    m_recallCurve = curve;
+    m_recallEpoch = epoch;
+
+    std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+    info_print("HNSW index %s recall calibrated with %lu samples of %lu rows "
+               "in %.2f secs",
+               m_name.c_str(),
+               sample.size(),
+               rows,
+               secs.count());
+}
+
 hnswlib::SpaceInterface<float>* HNSWMemoryIndex::getSpace(size_t dim) {
     if (m_type == "HNSW" && m_dist == "L2")
         return new hnswlib::L2Space(m_dim);
@@ -917,6 +1504,14 @@ string HNSWMemoryIndex::getStatus() {
     ss << "Distance : " << m_optionsMap.getOption("dist") << endl;
     ss << "Max. Capacity : " << m_size << endl;
     ss << "M = " << m_M << endl;
+    if (m_buildShards > 1)
+        ss << "Build Shards : " << m_buildShards << endl;
+    if (m_optionsMap.getOption("load") == "mmap")
+        ss << "Load : mmap" << endl;
+    if (m_optionsMap.getOption("durability") == "deltalog")
+        ss << "Durability : deltalog" << endl;
+    if (m_optionsMap.getOption("save_format") == "compact")
+        ss << "Save Format : compact" << endl;
 
     if (m_alg_hnsw) {
         ss << "Element Data Size : "
@@ -927,7 +1522,25 @@ string HNSWMemoryIndex::getStatus() {
            << (dynamic_cast<hnswlib::HierarchicalDiskNSW<FP32>*>(m_alg_hnsw))
                   ->cur_element_count
            << endl;
+        auto alg_hnsw =
+            dynamic_cast<hnswlib::HierarchicalDiskNSW<FP32>*>(m_alg_hnsw);
+        if (alg_hnsw->isDeletedCountKnown())
+            ss << "Deleted Rows : " << alg_hnsw->getDeletedCount() << endl;
+        else
+            ss << "Deleted Rows : n/a (mmap, counted on first update)" << endl;
         ss << "Searches : " << m_n_searches << endl;
+        ss << "Budget Exhausted Searches : " << m_n_budget_exhausted << endl;
+    }
+
+    lock_guard<std::mutex> l(m_recallMutex);
+    if (m_recallCurve.valid()) {
+        /* ef for recall 0.9, 0.95 and 0.99 of 10 neighbours */
+        ss << "Recall Curve : " << m_recallCurve.samples() << " samples of "
+           << m_recallCurve.rows() << " rows, nn=10 ef "
+           << m_recallCurve.efFor(10, 0.90) << "/"
+           << m_recallCurve.efFor(10, 0.95) << "/"
+           << m_recallCurve.efFor(10, 0.99) << " for recall 0.9/0.95/0.99"
+           << endl;
     }
 
     return ss.str();
@@ -936,20 +1549,40 @@ string HNSWMemoryIndex::getStatus() {
 bool HNSWMemoryIndex::searchVectorNN(VectorPtr qvec,
                                      int dim,
                                      vector<KeyTypeInteger>& keys,
-                                     int n) {
-    priority_queue<pair<FP32, hnswlib::labeltype>> result =
-        m_alg_hnsw->searchKnn(qvec, n);
+                                     vector<double>& dists,
+                                     int n,
+                                     SearchBudget* budget) {
+    priority_queue<pair<FP32, hnswlib::labeltype>> result;
+    auto alg_hnsw = dynamic_cast<hnswlib::HierarchicalDiskNSW<FP32>*>(m_alg_hnsw);
+    /* The ef of this search is passed down, the index ef is not changed */
+    size_t ef = ((budget && budget->efSearch > 0) ? (size_t)budget->efSearch
+                                                   : alg_hnsw->ef_);
+    ef = std::max(ef, (size_t)n);
+    if (budget && budget->limited()) {
+        /* The search keeps going until it holds 'n' candidates whatever the
+         * budget, then stops at the first check past it.
+         */
+        hnswlib::BudgetSearchStopCondition<FP32> stop(
+            ef, n, budget->budgetUs, budget->maxDistComps);
+        result = alg_hnsw->searchKnnEf(qvec, n, ef, nullptr, &stop);
+        if (stop.exhausted()) {
+            m_n_budget_exhausted++;
+            budget->exhausted = true;
+        }
+    } else {
+        result = alg_hnsw->searchKnnEf(qvec, n, ef);
+    }
 
     keys.clear();
-    tls_distances->clear();
+    dists.clear();
     while (!result.empty()) {
         keys.push_back(result.top().second);
-        (*tls_distances)[result.top().second] =
-            result.top().first;  /// pkid -> distance
+        dists.push_back(result.top().first);
         result.pop();
     }
 
     reverse(keys.begin(), keys.end());  // nearest to farthest
+    reverse(dists.begin(), dists.end());
     m_n_searches++;
     return true;
 }
@@ -968,70 +1601,36 @@ void HNSWMemoryIndex::setLastUpdateCoordinates(const string& binlogFile,
         "setLastUpdateCoordinates %s %lu", binlogFile.c_str(), binlogPosition);
 }
 
-// Parallel HNSW index load (hnswlib:example_search_mt.cpp)
-template <class Function>
-inline void ParallelFor(size_t start,
-                        size_t end,
-                        size_t numThreads,
-                        Function fn) {
-    debug_print("Entered ParallelFor %lu %lu t=%lu", start, end, numThreads);
-    if (numThreads <= 0) {
-        numThreads = thread::hardware_concurrency();
-    }
+bool HNSWMemoryIndex::startParallelBuild(int nthreads) {
+    m_batch.clear();
+    m_batchkeys.clear();
+    m_isParallelBuild = true;
+    m_threads = nthreads;
 
-    if (numThreads == 1) {
-        for (size_t id = start; id < end; id++) {
-            fn(id, 0);
-        }
-    } else {
-        vector<thread> threads;
-        atomic<size_t> current(start);
-
-        // keep track of exceptions in threads
-        // https://stackoverflow.com/a/32428427/1713196
-        exception_ptr lastException = nullptr;
-        mutex lastExceptMutex;
+    for (auto shard : m_shards)
+        delete shard;
+    m_shards.clear();
+    m_shardedRows = 0;
 
-        for (size_t threadId = 0; threadId < numThreads; ++threadId) {
-            threads.push_back(thread([&, threadId] {
-                while (true) {
-                    size_t id = current.fetch_add(1);
-
-                    if (id >= end) {
-                        break;
-                    }
-
-                    try {
-                        fn(id, threadId);
-                    } catch (...) {
-                        unique_lock<mutex> lastExcepLock(lastExceptMutex);
-                        lastException = current_exception();
-                        /*
-                         * This will work even when current is the largest value
-                         * that size_t can fit, because fetch_add returns the
-                         * previous value before the increment (what will result
-                         * in overflow and produce 0 instead of current + 1).
-                         */
-                        current = end;
-                        break;
-                    }
-                }
-            }));
-        }
-        for (auto& thread : threads) {
-            thread.join();
-        }
-        if (lastException) {
-            rethrow_exception(lastException);
+    /* Sharded build is only for a fresh build, a "refresh" adds to the
+     * existing graph. The empty graph gives back its 'size' elements until
+     * mergeShards() and the shards grow with their rows, so the sub-graphs
+     * and the merged graph are both resident only while merging.
+     */
+    if (m_buildShards > 1 && m_alg_hnsw && m_n_rows == 0) {
+        dynamic_cast<hnswlib::HierarchicalDiskNSW<FP32>*>(m_alg_hnsw)
+            ->resizeIndex(1);
+        for (int i = 0; i < m_buildShards; i++) {
+            m_shards.push_back(new hnswlib::HierarchicalDiskNSW<FP32>(
+                m_space,
+                HNSW_PARALLEL_BUILD_UNIT_SIZE / m_buildShards + 1,
+                m_M,
+                m_ef_construction));
         }
+        debug_print("Sharded build of (%s), shards = %d",
+                    m_name.c_str(),
+                    m_buildShards);
     }
-}
-
-bool HNSWMemoryIndex::startParallelBuild(int nthreads) {
-    m_batch.clear();
-    m_batchkeys.clear();
-    m_isParallelBuild = true;
-    m_threads = nthreads;
     return true;
 }
 
@@ -1059,30 +1658,812 @@ bool HNSWMemoryIndex::flushBatchParallel() {
                 m_batchkeys[row]);
         });
 
-    m_batch.clear();
-    m_batchkeys.clear();
+    m_batch.clear();
+    m_batchkeys.clear();
+
+    return true;
+}
+
+/* flushBatchSharded - Rows are dealt round-robin to the shards. Each shard
+ * is a separate graph with its own entry point & link locks, so shard
+ * builders never contend with each other.
+ */
+bool HNSWMemoryIndex::flushBatchSharded() {
+    size_t nshards = m_shards.size();
+    size_t perShardThreads = std::max(1, m_threads / (int)nshards);
+    size_t rowBase = m_shardedRows;
+
+    debug_print("Entered flushBatchSharded for (%s), shards = %lu, sz = %u",
+                m_name.c_str(),
+                nshards,
+                (unsigned int)m_batchkeys.size());
+
+    ParallelFor(0, nshards, nshards, [&](size_t shard, size_t threadId) {
+        vector<size_t> rows;
+        for (size_t row = 0; row < m_batchkeys.size(); row++) {
+            if ((rowBase + row) % nshards == shard)
+                rows.push_back(row);
+        }
+        // only this thread touches the shard, grow it before the inserts
+        size_t need = m_shards[shard]->cur_element_count + rows.size();
+        if (need > m_shards[shard]->max_elements_)
+            m_shards[shard]->resizeIndex(
+                std::max(need, 2 * m_shards[shard]->max_elements_));
+        ParallelFor(
+            0, rows.size(), perShardThreads, [&](size_t i, size_t threadId) {
+                size_t row = rows[i];
+                m_shards[shard]->addPoint(
+                    (void*)&(m_batch[row * m_space->get_data_size()]),
+                    m_batchkeys[row]);
+            });
+    });
+
+    m_shardedRows += m_batchkeys.size();
+    m_batch.clear();
+    m_batchkeys.clear();
+
+    return true;
+}
+
+/* mergeShards - Concatenate the shard graphs into m_alg_hnsw and then
+ * cross-link every element with its nearest neighbours in the other shards
+ * using bounded (ef_construction) searches of the other sub-graphs. The
+ * searches need every shard, so the shards are freed after the merge and
+ * m_alg_hnsw, sized to the rows for the merge, then grows back to 'size'.
+ */
+bool HNSWMemoryIndex::mergeShards() {
+    hnswlib::HierarchicalDiskNSW<FP32>* alg_hnsw =
+        dynamic_cast<hnswlib::HierarchicalDiskNSW<FP32>*>(m_alg_hnsw);
+
+    size_t nrows = alg_hnsw->cur_element_count;
+    for (auto shard : m_shards)
+        nrows += shard->cur_element_count;
+    if (nrows > alg_hnsw->max_elements_)
+        alg_hnsw->resizeIndex(nrows);
+
+    vector<hnswlib::tableint> bases;
+    hnswlib::tableint base = alg_hnsw->cur_element_count;
+    for (auto shard : m_shards) {
+        bases.push_back(base);
+        alg_hnsw->appendShard(*shard, base);
+        base += shard->cur_element_count;
+    }
+
+    debug_print("Merging %lu shards of (%s), rows = %u",
+                m_shards.size(),
+                m_name.c_str(),
+                (unsigned int)base);
+
+    ParallelFor(0, base, m_threads, [&](size_t id, size_t threadId) {
+        for (int level = alg_hnsw->element_levels_[id]; level >= 0; level--)
+            alg_hnsw->crossLinkShards(id, level, m_shards, bases);
+    });
+
+    for (auto shard : m_shards)
+        delete shard;
+    m_shards.clear();
+    m_shardedRows = 0;
+
+    if ((size_t)m_size > alg_hnsw->max_elements_)
+        alg_hnsw->resizeIndex(m_size);  // room for online inserts
+
+    return true;
+}
+
+/* captureCompactOp - an insert ('vec') or delete (nullptr) made during a
+ * compaction, called with m_compactGate held shared
+ */
+void HNSWMemoryIndex::captureCompactOp(KeyTypeInteger id, VectorPtr vec) {
+    lock_guard<std::mutex> l(m_compactMutex);
+    if (vec)
+        m_compactBatch.insert(m_compactBatch.end(),
+                              (char*)vec,
+                              ((char*)vec + m_space->get_data_size()));
+    m_compactKeys.push_back(id);
+    m_compactDeletes.push_back(vec == nullptr);
+}
+
+void HNSWMemoryIndex::replayCompactBatch(
+    hnswlib::HierarchicalDiskNSW<FP32>* alg_hnsw) {
+    lock_guard<std::mutex> l(m_compactMutex);
+    size_t dsize = m_space->get_data_size();
+    size_t offset = 0;
+    for (size_t i = 0; i < m_compactKeys.size(); i++) {
+        if (!m_compactDeletes[i]) {
+            alg_hnsw->addPoint(&m_compactBatch[offset], m_compactKeys[i]);
+            offset += dsize;
+            continue;
+        }
+        try {
+            alg_hnsw->markDelete(m_compactKeys[i]);
+        } catch (std::runtime_error&) {
+            /* not copied, it was deleted before the copy */
+        }
+    }
+    m_compactBatch.clear();
+    m_compactKeys.clear();
+    m_compactDeletes.clear();
+}
+
+/* verifyIndex - Full scan of the index files against the CRC32C block
+ * checksums written by saveIndex() and the checkpoints. Index load does the
+ * same scan, this is for periodic checks of a loaded index.
+ */
+bool HNSWMemoryIndex::verifyIndex(const string& path, string& report) {
+    hnswlib::HierarchicalDiskNSW<FP32>* alg_hnsw =
+        dynamic_cast<hnswlib::HierarchicalDiskNSW<FP32>*>(m_alg_hnsw);
+
+    if (!alg_hnsw) {
+        report = "Index is not loaded.";
+        return false;
+    }
+
+    string filename = path + "/" + m_name + ".hnsw.index";
+    size_t nblocks = 0;
+    string error;
+    try {
+        error = alg_hnsw->verifyChecksums(
+            filename, myvector_index_bg_threads, nblocks);
+    } catch (std::runtime_error& e) {
+        error = e.what();
+    }
+
+    if (error.length()) {
+        error_print("Verify of index (%s) failed : %s",
+                    m_name.c_str(),
+                    error.c_str());
+        report = "Verify failed : " + error;
+        return false;
+    }
+    if (!nblocks) {
+        report = "Index files have no checksums, save the index to add them.";
+        return true;
+    }
+    report = "Verify OK, " + std::to_string(nblocks) + " blocks checked.";
+    return true;
+}
+
+/* exportFilePath - export files are kept in myvector_index_dir, 'file' is
+ * a plain file name, default <index name>.hnsw.export.
+ */
+bool HNSWMemoryIndex::exportFilePath(const string& path,
+                                     const string& file,
+                                     string& exportfile,
+                                     string& report) {
+    if (file.find('/') != string::npos || file == "." || file == "..") {
+        report = "Export file must be a file name in myvector_index_dir.";
+        return false;
+    }
+    exportfile =
+        path + "/" + (file.length() ? file : m_name + ".hnsw.export");
+    return true;
+}
+
+/* exportIndex - Snapshot of the rows present at the epoch gate, written
+ * in the compact encoding with the checkpoint id of the last checkpoint
+ * while online inserts go on. Online inserts after that id may be in the
+ * snapshot too, they are replayed as updates after an import.
+ */
+bool HNSWMemoryIndex::exportIndex(const string& path,
+                                  const string& file,
+                                  string& report) {
+    hnswlib::HierarchicalDiskNSW<FP32>* alg_hnsw =
+        dynamic_cast<hnswlib::HierarchicalDiskNSW<FP32>*>(m_alg_hnsw);
+
+    if (!alg_hnsw || m_isParallelBuild) {
+        report = "Index is not loaded or a build is in progress.";
+        return false;
+    }
+
+    string exportfile, ckid;
+    if (!exportFilePath(path, file, exportfile, report))
+        return false;
+    getCheckPointString(ckid);
+
+    size_t rows = 0;
+    try {
+        rows = alg_hnsw->exportIndex(exportfile, ckid);
+    } catch (std::runtime_error& e) {
+        error_print("Export of index (%s) failed : %s", m_name.c_str(), e.what());
+        report = string("Export failed : ") + e.what();
+        return false;
+    }
+
+    info_print("Exported index (%s) to %s at %s",
+               m_name.c_str(),
+               exportfile.c_str(),
+               ckid.c_str());
+    report = "Exported " + std::to_string(rows) + " rows to " + exportfile +
+             " at " + ckid;
+    return true;
+}
+
+/* importIndex - Replace the graph with the one of an export file. The
+ * file is checked and decoded into a new graph while searches go on on the
+ * current one, the exclusive lock is held only to swap the graphs. The
+ * caller holds loadMutex() (myvector_open_index_impl), so no other import,
+ * compaction, build or load can swap or free the graph meanwhile. The index
+ * then resumes from the checkpoint id of the export.
+ */
+bool HNSWMemoryIndex::importIndex(const string& path,
+                                  const string& file,
+                                  string& report) {
+    string exportfile;
+    if (!exportFilePath(path, file, exportfile, report))
+        return false;
+
+    if (m_isParallelBuild || m_compacting) {
+        report = "A build or compaction is in progress.";
+        return false;
+    }
+
+    if (!m_space)
+        m_space = getSpace(m_dim);
+
+    hnswlib::HierarchicalDiskNSW<FP32>* new_hnsw =
+        new hnswlib::HierarchicalDiskNSW<FP32>(m_space);
+    string ckid;
+    try {
+        ckid = new_hnsw->importIndex(exportfile, m_space);
+        if (new_hnsw->label_offset_ - new_hnsw->offsetData_ !=
+            m_space->get_data_size())
+            throw std::runtime_error("vector dimension does not match");
+    } catch (std::runtime_error& e) {
+        delete new_hnsw;
+        error_print("Import of index (%s) failed : %s", m_name.c_str(), e.what());
+        report = string("Import failed : ") + e.what();
+        return false;
+    }
+    new_hnsw->setEf(m_ef_search);
+
+    unlockShared();  // taken by the caller
+    lockExclusive();
+    hnswlib::AlgorithmInterface<FP32>* old_hnsw = m_alg_hnsw;
+    m_alg_hnsw = new_hnsw;
+    m_n_rows = new_hnsw->cur_element_count.load();
+    applyCheckPointString(this, ckid);
+    bumpMutationEpoch();
+    unlockExclusive();
+    lockShared();
+
+    delete old_hnsw;
+
+    info_print("Imported index (%s) from %s at %s",
+               m_name.c_str(),
+               exportfile.c_str(),
+               ckid.c_str());
+
+    saveIndex(path, "rewrite");  // inserts go on during the write
+
+    report = "Imported " + std::to_string(m_n_rows) + " rows from " +
+             exportfile + " at " + ckid;
+    return true;
+}
+
+/* compactIndex - Online compaction. A new graph holding only the live rows
+ * is built next to the current one while searches and online inserts
+ * continue on the current graph. Inserts made meanwhile are replayed into
+ * the new graph, the exclusive lock is held only to swap the graph pointers
+ * and the compacted index is then persisted with a full write.
+ */
+bool HNSWMemoryIndex::compactIndex(const string& path, string& report) {
+    hnswlib::HierarchicalDiskNSW<FP32>* old_hnsw =
+        dynamic_cast<hnswlib::HierarchicalDiskNSW<FP32>*>(m_alg_hnsw);
+
+    if (!old_hnsw || m_isParallelBuild) {
+        report = "Index is not loaded or a build is in progress.";
+        return false;
+    }
+
+    old_hnsw->ensureLabelLookup();  // counts the deleted rows of a mmap load
+    size_t ndeleted = old_hnsw->getDeletedCount();
+    if (!ndeleted) {
+        report = "No deleted rows, compaction not required.";
+        return true;
+    }
+
+    size_t n = 0;
+    {
+        std::unique_lock<std::shared_mutex> g(m_compactGate);
+        lock_guard<std::mutex> l(m_compactMutex);
+        m_compactBatch.clear();
+        m_compactKeys.clear();
+        m_compactDeletes.clear();
+        m_compacting = true;
+        n = old_hnsw->cur_element_count;
+    }
+
+    size_t reclaimed = 0;
+    vector<hnswlib::tableint> newIds;
+    hnswlib::HierarchicalDiskNSW<FP32>* new_hnsw = nullptr;
+
+    try {
+        new_hnsw = new hnswlib::HierarchicalDiskNSW<FP32>(
+            m_space, m_size, m_M, m_ef_construction);
+        new_hnsw->setEf(m_ef_search);
+
+        reclaimed = old_hnsw->compactCopyElements(*new_hnsw, n, newIds);
+
+        ParallelFor(
+            0, n, myvector_index_bg_threads, [&](size_t id, size_t threadId) {
+                if (newIds[id] != old_hnsw->INVALID_ID)
+                    old_hnsw->compactRepairLinks(*new_hnsw, id, newIds);
+            });
+    } catch (std::runtime_error& e) {
+        error_print("Compaction of index (%s) failed : %s",
+                    m_name.c_str(),
+                    e.what());
+        m_compacting = false;
+        delete new_hnsw;
+        report = string("Compaction failed : ") + e.what();
+        return false;
+    }
+
+    /* Recall drift - top 10 of a sample of live rows searched in both the
+     * old and the compacted graph.
+     */
+    const size_t kDriftK = 10, kDriftSamples = 100;
+    size_t step = std::max((size_t)1, n / kDriftSamples);
+    size_t matched = 0, expected = 0;
+    for (size_t id = 0; id < n; id += step) {
+        if (newIds[id] == old_hnsw->INVALID_ID)
+            continue;
+        const void* qvec = old_hnsw->getDataByInternalId(id);
+        auto r1 = old_hnsw->searchKnn(qvec, kDriftK);
+        auto r2 = new_hnsw->searchKnn(qvec, kDriftK);
+        std::unordered_set<hnswlib::labeltype> s;
+        while (!r2.empty()) {
+            s.insert(r2.top().second);
+            r2.pop();
+        }
+        expected += r1.size();
+        while (!r1.empty()) {
+            matched += s.count(r1.top().second);
+            r1.pop();
+        }
+    }
+    double drift = expected ? 1.0 - (double)matched / expected : 0.0;
+
+    replayCompactBatch(new_hnsw);  // readers are not blocked
+
+    unlockShared();  // taken by the caller
+    lockExclusive();
+    replayCompactBatch(new_hnsw);  // rows added since the first replay
+    m_compacting = false;
+    m_alg_hnsw = new_hnsw;
+    m_n_rows = new_hnsw->cur_element_count.load();
+    bumpMutationEpoch();
+    unlockExclusive();
+    lockShared();
+
+    delete old_hnsw;
+
+    info_print("Compacted index (%s) : %lu deleted rows removed, %lu bytes "
+               "reclaimed, recall drift %.4f",
+               m_name.c_str(),
+               ndeleted,
+               reclaimed,
+               drift);
+
+    /* Internal ids have changed, incremental checkpoint is not possible.
+     * Online inserts and deletes go on during the full write.
+     */
+    saveIndex(path, "rewrite");
+
+    stringstream ss;
+    ss << "Compaction completed, removed " << ndeleted << " rows, reclaimed "
+       << reclaimed << " bytes, recall drift " << drift;
+    report = ss.str();
+    return true;
+}
+
+bool HNSWMemoryIndex::insertVector(VectorPtr vec, int dim, KeyTypeInteger id) {
+    FP32* fvec = static_cast<FP32*>(vec);
+    if (m_isParallelBuild) {
+        // m_batch.insert(m_batch.end(), fvec, fvec + m_dim);
+        m_batch.insert(
+            m_batch.end(), (char*)vec, ((char*)vec + m_space->get_data_size()));
+        m_batchkeys.push_back(id);
+
+        if (m_batchkeys.size() == HNSW_PARALLEL_BUILD_UNIT_SIZE) {
+            if (m_shards.size())
+                flushBatchSharded();
+            else
+                flushBatchParallel();
+        }
+    } else {
+        std::shared_lock<std::shared_mutex> g(m_compactGate);
+        // an existing row (UPDATE) has its vector and links replaced
+        bool added = dynamic_cast<hnswlib::HierarchicalDiskNSW<FP32>*>(
+                         m_alg_hnsw)
+                         ->addPointCounted(fvec, id);
+        if (m_compacting)
+            captureCompactOp(id, vec);
+        if (!added) {
+            m_isDirty = true;
+            bumpMutationEpoch();
+            return true;
+        }
+    }
+
+    m_n_rows++;  // atomic
+    m_isDirty = true;
+    bumpMutationEpoch();
+    return true;
+}
+
+/* deleteVector - mark the row deleted, searches skip it and compactIndex()
+ * reclaims its space. Deleting an id that is not in the index is a no-op.
+ */
+bool HNSWMemoryIndex::deleteVector(KeyTypeInteger id) {
+    if (m_isParallelBuild || !m_alg_hnsw)
+        return false;
+
+    std::shared_lock<std::shared_mutex> g(m_compactGate);
+    try {
+        dynamic_cast<hnswlib::HierarchicalDiskNSW<FP32>*>(m_alg_hnsw)
+            ->markDelete(id);
+    } catch (std::runtime_error& e) {
+        debug_print("HNSW index %s delete of %lu skipped : %s",
+                    m_name.c_str(),
+                    (unsigned long)id,
+                    e.what());
+        return false;
+    }
+    if (m_compacting)
+        captureCompactOp(id, nullptr);
+
+    if (m_n_rows)
+        m_n_rows--;  // atomic
+    m_isDirty = true;
+    bumpMutationEpoch();
+    return true;
+}
+
+/* DiskANNIndex - SSD resident Vamana graph index (type=DISKANN), see
+ * diskann.h. The graph and the full vectors stay on disk and only the PQ
+ * codes are held in memory, so the index can be much larger than RAM. The
+ * rows added during "build" are spilled to disk and the graph is built from
+ * there in partitions of build_mem_mb; later online inserts are applied to
+ * the on-disk graph at every checkpoint.
+ */
+class DiskANNIndex : public AbstractVectorIndex {
+public:
+    DiskANNIndex(const string& name, const string& options);
+
+    ~DiskANNIndex();
+
+    bool supportsIncrUpdates() { return m_incrUpdates; }
+    bool supportsIncrRefresh() { return m_incrRefresh; }
+    bool supportsPersist() { return true; }
+    bool isReady() { return m_disk != nullptr; }
+    bool isDirty() { return m_isDirty; }
+
+    void getDirtyStats(size_t& nodes, size_t& bytes) {
+        nodes = (m_disk ? m_disk->getDirtyCount() : 0);
+        bytes = (m_disk ? nodes * m_disk->node_len_ : 0);
+    }
+
+    string getName() { return m_name; }
+
+    string getType() { return "DISKANN"; }
+
+    string getStatus();
+
+    bool saveIndex(const string& path, const string& option);
+
+    bool saveIndexIncr(const string& path, const string& option) {
+        return true;
+    }
+
+    bool loadIndex(const string& path);
+
+    bool dropIndex(const string& path);
+
+    bool initIndex();
+
+    bool closeIndex() { return true; }
+
+    bool searchVectorNN(VectorPtr qvec,
+                        int dim,
+                        vector<KeyTypeInteger>& keys,
+                        vector<double>& dists,
+                        int n,
+                        SearchBudget* budget = nullptr);
+
+    bool insertVector(VectorPtr vec, int dim, KeyTypeInteger id);
+
+    int getDimension() { return m_dim; }
+
+    void setUpdateTs(unsigned long ts) { m_updateTs = ts; }
+
+    unsigned long getUpdateTs() { return m_updateTs; }
+
+    unsigned long getRowCount() { return m_n_rows; }
+
+    bool startParallelBuild(int nthreads) {
+        m_threads = nthreads;
+        return true;
+    }
+
+    void getLastUpdateCoordinates(string& binlogFile, size_t& binlogPos) {
+        binlogFile = m_binlogFile;
+        binlogPos = m_binlogPosition;
+    }
+
+    void setLastUpdateCoordinates(const string& binlogFile,
+                                  const size_t& binlogPos) {
+        m_binlogFile = binlogFile;
+        m_binlogPosition = binlogPos;
+    }
+
+    void setSearchEffort(int ef_search) { m_L_search = ef_search; }
+
+private:
+    string m_name;
+    string m_options;
+    MyVectorOptions m_optionsMap;
+    unsigned long m_updateTs;
+
+    int m_dim;
+    int m_R;         // max. graph degree
+    int m_L;         // build search list size
+    int m_L_search;  // search list size
+    int m_beamWidth;
+    int m_pq_m;  // PQ code bytes per vector
+    int m_cacheNodes;
+    int m_buildMemMb;  // memory of one build partition
+    int m_threads;
+    string m_dist;
+
+    hnswlib::SpaceInterface<float>* m_space = nullptr;
+    hnswlib::VamanaDiskIndex* m_disk = nullptr;
+
+    /* Rows waiting for the graph build */
+    std::mutex m_batchMutex;
+    hnswlib::VamanaBuildSpill m_spill;
+
+    atomic<unsigned long> m_n_rows{0};
+    atomic<unsigned long> m_n_searches{0};
+
+    bool m_isDirty{false};
+    bool m_incrUpdates;
+    bool m_incrRefresh;
+
+    string m_binlogFile;
+    size_t m_binlogPosition;
+
+    string indexFile(const string& path) {
+        return path + "/" + m_name + ".diskann.index";
+    }
+
+    hnswlib::VamanaDiskIndex* newDiskIndex() {
+        return new hnswlib::VamanaDiskIndex(
+            m_space, m_dim, m_R, m_L, 1.2f, m_dist != "L2");
+    }
+};
+
+DiskANNIndex::DiskANNIndex(const string& name, const string& options)
+    : m_name(name), m_options(options), m_optionsMap(options), m_updateTs(0) {
+    m_dim = m_optionsMap.getIntOption("dim", 0);
+    m_R = m_optionsMap.getIntOption("R", 64);
+    m_L = m_optionsMap.getIntOption("ef", 100);
+    m_L_search = m_optionsMap.getIntOption("ef_search", m_L);
+    m_beamWidth = m_optionsMap.getIntOption("beamwidth", 4);
+    m_pq_m = m_optionsMap.getIntOption("pq_m", 32);
+    m_cacheNodes = m_optionsMap.getIntOption("cache_nodes", 10000);
+    m_buildMemMb = m_optionsMap.getIntOption("build_mem_mb", 1024);
+    m_threads = myvector_index_bg_threads;
+    m_incrUpdates = m_optionsMap.getOption("online") == "Y";
+    m_incrRefresh = m_optionsMap.getOption("track").length() > 0;
+
+    m_dist = "L2";
+    if (m_optionsMap.getOption("dist") == "Cosine")
+        m_dist = "Cosine";
+    else if (m_optionsMap.getOption("dist") == "CosineNorm")
+        m_dist = "CosineNorm";
+    else if (m_optionsMap.getOption("dist") == "Angular")
+        m_dist = "Angular";
+
+    debug_print("diskann index params %s %d %d %d %d %d",
+                name.c_str(),
+                m_dim,
+                m_R,
+                m_L,
+                m_L_search,
+                m_pq_m);
+}
+
+DiskANNIndex::~DiskANNIndex() {
+    if (m_disk)
+        delete m_disk;
+    if (m_space)
+        delete m_space;
+}
+
+bool DiskANNIndex::initIndex() {
+    if (m_disk)
+        delete m_disk;
+    m_disk = nullptr;
+    if (!m_space) {
+        if (m_dist == "L2")
+            m_space = new hnswlib::L2Space(m_dim);
+        else if (m_dist == "CosineNorm")
+            m_space = new hnswlib::InnerProductSpace(m_dim);
+        else
+            m_space = new AngularDistanceSpace(m_dim);
+    }
+
+    {
+        lock_guard<std::mutex> l(m_batchMutex);
+        m_spill.remove();
+    }
+    m_n_rows = 0;
+    m_n_searches = 0;
+    bumpMutationEpoch();
+
+    setLastUpdateCoordinates("zzzzzz.bin", 99999999999);
+    setUpdateTs(0);
+    return true;
+}
+
+bool DiskANNIndex::insertVector(VectorPtr vec, int dim, KeyTypeInteger id) {
+    try {
+        unique_lock<std::mutex> l(m_batchMutex);
+        if (m_disk) {
+            l.unlock();
+            m_disk->addPoint(vec, id);
+        } else {
+            if (!m_spill.isOpen())
+                m_spill.open(indexFile(myvector_index_dir),
+                             m_space->get_data_size());
+            m_spill.append(vec, id);
+        }
+    } catch (std::runtime_error& e) {
+        error_print("DiskANNIndex::insertVector (%s) failed : %s",
+                    m_name.c_str(),
+                    e.what());
+        return false;
+    }
+
+    m_n_rows++;  // atomic
+    m_isDirty = true;
+    bumpMutationEpoch();
+    return true;
+}
+
+/* saveIndex - the first save after "build" builds the graph from the
+ * spilled rows and writes it out; later saves checkpoint online inserts.
+ */
+bool DiskANNIndex::saveIndex(const string& path, const string& option) {
+    string filename = indexFile(path);
+    string checkPointStr;
+    makeCheckPointString(this, checkPointStr);
+
+    debug_print("DiskANNIndex::saveIndex %s %s.", path.c_str(), option.c_str());
+
+    try {
+        unique_lock<std::mutex> l(m_batchMutex);
+        if (!m_disk && m_spill.rows()) {
+            m_spill.flush();
+            std::unique_ptr<hnswlib::VamanaDiskIndex> builder(newDiskIndex());
+            builder->setCheckPointId(checkPointStr);
+            builder->buildIndex(filename,
+                                m_spill,
+                                m_pq_m,
+                                (size_t)m_buildMemMb * 1024 * 1024,
+                                m_threads);
+            builder.reset();
+            m_spill.remove();
+
+            m_disk = newDiskIndex();
+            m_disk->loadIndex(filename, m_cacheNodes);
+            bumpMutationEpoch();
+        } else if (m_disk) {
+            l.unlock();  // inserts go on during the checkpoint
+            m_disk->setCheckPointId(checkPointStr);
+            m_disk->doCheckPoint(filename);
+        }
+    } catch (std::runtime_error& e) {
+        error_print("DiskANNIndex::saveIndex (%s) failed : %s",
+                    m_name.c_str(),
+                    e.what());
+        return false;
+    }
+
+    m_isDirty = false;
+    return true;
+}
+
+bool DiskANNIndex::loadIndex(const string& path) {
+    initIndex();
+
+    string filename = indexFile(path);
+    debug_print(
+        "Loading DiskANN index %s from %s", m_name.c_str(), filename.c_str());
+
+    m_disk = newDiskIndex();
+    try {
+        m_disk->loadIndex(filename, m_cacheNodes);
+    } catch (std::runtime_error& e) {
+        warning_print("Error loading diskann index (%s) from file : %s",
+                      m_name.c_str(),
+                      e.what());
+        delete m_disk;
+        m_disk = nullptr;  // empty index, the next build writes the files
+        return true;
+    }
+
+    m_n_rows = m_disk->npoints_.load();
+    applyCheckPointString(this, m_disk->getCheckPointId());
+    bumpMutationEpoch();
+    return true;
+}
+
+bool DiskANNIndex::dropIndex(const string& path) {
+    hnswlib::VamanaDiskIndex::deleteIndexFiles(indexFile(path));
+
+    if (m_disk)
+        delete m_disk;
+    m_disk = nullptr;
+
+    lock_guard<std::mutex> l(m_batchMutex);
+    m_spill.remove();
+    bumpMutationEpoch();
+    return true;
+}
+
+bool DiskANNIndex::searchVectorNN(VectorPtr qvec,
+                                  int dim,
+                                  vector<KeyTypeInteger>& keys,
+                                  vector<double>& dists,
+                                  int n,
+                                  SearchBudget* budget) {
+    keys.clear();
+    dists.clear();
+    if (!m_disk)
+        return true;
+
+    /* Only the search list size of the budget is supported */
+    int L = ((budget && budget->efSearch > 0) ? budget->efSearch : m_L_search);
+    priority_queue<pair<FP32, hnswlib::labeltype>> result =
+        m_disk->searchKnn(qvec, n, L, m_beamWidth);
+
+    while (!result.empty()) {
+        keys.push_back(result.top().second);
+        dists.push_back(result.top().first);
+        result.pop();
+    }
 
+    reverse(keys.begin(), keys.end());  // nearest to farthest
+    reverse(dists.begin(), dists.end());
+    m_n_searches++;
     return true;
 }
 
-bool HNSWMemoryIndex::insertVector(VectorPtr vec, int dim, KeyTypeInteger id) {
-    FP32* fvec = static_cast<FP32*>(vec);
-    if (m_isParallelBuild) {
-        // m_batch.insert(m_batch.end(), fvec, fvec + m_dim);
-        m_batch.insert(
-            m_batch.end(), (char*)vec, ((char*)vec + m_space->get_data_size()));
-        m_batchkeys.push_back(id);
+string DiskANNIndex::getStatus() {
+    std::stringstream ss;
 
-        if (m_batchkeys.size() == HNSW_PARALLEL_BUILD_UNIT_SIZE) {
-            flushBatchParallel();
-        }
+    ss << endl;
+    ss << "Vector Index : " << m_name << endl;
+    ss << "Type : DISKANN" << endl;
+    ss << "Dimension : " << m_dim << endl;
+    ss << "Distance : " << m_optionsMap.getOption("dist") << endl;
+    ss << "R = " << m_R << ", L = " << m_L << ", L search = " << m_L_search
+       << ", Beam width = " << m_beamWidth << endl;
+
+    if (m_disk) {
+        ss << "PQ Bytes per Vector : " << m_disk->pq_.m_ << endl;
+        ss << "Current Rows : " << m_disk->npoints_ << endl;
+        ss << "Cached Nodes : " << m_disk->getCachedCount() << endl;
+        ss << "Unflushed Nodes : " << m_disk->getDirtyCount() << endl;
+        ss << "Disk Reads : " << m_disk->metric_disk_reads << endl;
     } else {
-        m_alg_hnsw->addPoint(fvec, id);
+        ss << "Rows Pending Build : " << m_n_rows << endl;
     }
+    ss << "Searches : " << m_n_searches << endl;
 
-    m_n_rows++;  // atomic
-    m_isDirty = true;
-    return true;
+    return ss.str();
 }
 
 AbstractVectorIndex* VectorIndexCollection::open(const string& name,
@@ -1100,6 +2481,8 @@ AbstractVectorIndex* VectorIndexCollection::open(const string& name,
     /* First case handles both HNSW and HNSW_BV */
     if (options.rfind("type=HNSW") != string::npos) {
         hnewindex = new HNSWMemoryIndex(name, options);
+    } else if (options.rfind("type=DISKANN") != string::npos) {
+        hnewindex = new DiskANNIndex(name, options);
     } else if (options.rfind("type=KNN") != string::npos) {
         hnewindex = new KNNIndex(name, options);
     } else {
@@ -1112,6 +2495,11 @@ AbstractVectorIndex* VectorIndexCollection::open(const string& name,
         hnewindex = new KNNIndex(name, options);
     }
 
+    /* result_cache_mb= enables the myvector_ann_set() result cache */
+    MyVectorOptions vo(options);
+    hnewindex->resultCache().setBudget(
+        std::max(0, vo.getIntOption("result_cache_mb", 0)) * 1024UL * 1024);
+
     m_indexes[name] = hnewindex;
     hnewindex->lockShared(); /* acquire lock before returning, matching get() */
 
@@ -1134,7 +2522,8 @@ AbstractVectorIndex* VectorIndexCollection::get(const string& name) {
     return hindex;
 }
 
-bool VectorIndexCollection::close(AbstractVectorIndex* hindex) {
+bool VectorIndexCollection::close(AbstractVectorIndex* hindex,
+                                  unique_lock<mutex>* adminLock) {
     lock_guard<mutex> l(m_mutex);
 
     hindex->unlockShared(); /* taken when opening the index */
@@ -1142,6 +2531,8 @@ bool VectorIndexCollection::close(AbstractVectorIndex* hindex) {
     hindex->lockExclusive(); /* wait for all readers to drain */
     hindex->closeIndex();
     m_indexes.erase(m_indexes.find(hindex->getName()));
+    if (adminLock && adminLock->owns_lock())
+        adminLock->unlock(); /* not reachable by get() or open() anymore */
     hindex->unlockExclusive();
 
     delete hindex; /* no other thread can hold shared lock */
@@ -1172,6 +2563,143 @@ string VectorIndexCollection::FindEarliestBinlogFile() {
 
 static VectorIndexCollection g_indexes;
 
+/* IndexLoader - Loads the vector indexes found at plugin start on a pool
+ * of up to myvector_index_load_threads threads, highest load_priority
+ * first. Threads are started when requests are queued and exit when the
+ * queue is empty. An index is INDEX_LOADING while it is queued, searches
+ * on it fail with ER_MYVECTOR_INDEX_LOADING until it is INDEX_READY.
+ */
+class IndexLoader {
+public:
+    /* schedule - queue an INDEX_UNLOADED index. Returns false if it is
+     * already queued, loaded or failed.
+     */
+    bool schedule(AbstractVectorIndex* vi, int priority) {
+        if (!vi->casLoadState(INDEX_UNLOADED, INDEX_LOADING))
+            return false;
+        lock_guard<mutex> l(m_mutex);
+        m_queue.push({priority, m_seq++, vi->getName()});
+        m_pending.insert(vi->getName());
+        if (m_threads < std::max(1L, myvector_index_load_threads)) {
+            m_threads++;
+            std::thread(&IndexLoader::run, this).detach();
+        }
+        return true;
+    }
+
+    /* wait - until a queued index has been loaded or failed to load */
+    void wait(const string& name) {
+        unique_lock<mutex> l(m_mutex);
+        m_cv.wait(l, [&]() { return !m_pending.count(name); });
+    }
+
+private:
+    struct Request {
+        int priority;
+        unsigned long seq;
+        string name;
+        bool operator<(const Request& other) const {  // FIFO within priority
+            return priority < other.priority ||
+                   (priority == other.priority && seq > other.seq);
+        }
+    };
+
+    void run() {
+        unique_lock<mutex> l(m_mutex);
+        while (!m_queue.empty()) {
+            Request r = m_queue.top();
+            m_queue.pop();
+            l.unlock();
+            load(r.name);
+            l.lock();
+            m_pending.erase(r.name);
+            m_cv.notify_all();
+        }
+        m_threads--;
+    }
+
+    void load(const string& name) {
+        AbstractVectorIndex* vi = g_indexes.get(name);
+        if (!vi)
+            return;  // dropped while queued
+        SharedLockGuard g(vi);
+        unique_lock<mutex> ll(vi->loadMutex(), std::try_to_lock);
+        if (!ll || vi->getLoadState() != INDEX_LOADING)
+            return;  // loaded by MYVECTOR_INDEX_LOAD meanwhile
+
+        auto start = std::chrono::steady_clock::now();
+        bool ok = vi->loadIndex(myvector_index_dir);
+        vi->setLoadState(ok ? INDEX_READY : INDEX_FAILED);
+        double secs = std::chrono::duration<double>(
+                          std::chrono::steady_clock::now() - start)
+                          .count();
+        if (ok)
+            info_print("Loaded index %s in %.1f secs.", name.c_str(), secs);
+        else
+            error_print("Failed to load index %s.", name.c_str());
+    }
+
+    mutex m_mutex;
+    condition_variable m_cv;
+    priority_queue<Request> m_queue;
+    set<string> m_pending;
+    unsigned long m_seq = 0;
+    long m_threads = 0;
+};
+
+static IndexLoader g_loader;
+
+/* RecallCalibrator - measures the recall curve of an index on a background
+ * thread when a recall= search finds it due, one thread per index. The
+ * index is looked up by name so a dropped index is skipped, and the shared
+ * lock is held while it is calibrated.
+ */
+class RecallCalibrator {
+public:
+    void schedule(AbstractVectorIndex* vi) {
+        lock_guard<mutex> l(m_mutex);
+        if (!m_pending.insert(vi->getName()).second)
+            return;
+        std::thread(&RecallCalibrator::run, this, vi->getName()).detach();
+    }
+
+private:
+    void run(const string& name) {
+        AbstractVectorIndex* vi = g_indexes.get(name);
+        if (vi) {
+            SharedLockGuard g(vi);
+            if (vi->getLoadState() == INDEX_READY)
+                vi->calibrateRecall();
+        }
+        lock_guard<mutex> l(m_mutex);
+        m_pending.erase(name);
+    }
+
+    mutex m_mutex;
+    set<string> m_pending;
+};
+
+static RecallCalibrator g_calibrator;
+
+/* checkIndexReady - searches need a loaded index. The first search on a
+ * lazily loaded index queues it ahead of all eager loads.
+ */
+static bool checkIndexReady(AbstractVectorIndex* vi, char* message) {
+    IndexLoadState state = vi->getLoadState();
+    if (state == INDEX_READY)
+        return true;
+    if (state == INDEX_UNLOADED)
+        g_loader.schedule(vi, INT_MAX);
+    if (message)
+        snprintf(message,
+                 MYSQL_ERRMSG_SIZE,
+                 "%s (%s)",
+                 (state == INDEX_FAILED ? ER_MYVECTOR_INDEX_NOT_LOADED
+                                        : ER_MYVECTOR_INDEX_LOADING),
+                 vi->getName().c_str());
+    return false;
+}
+
 /* The MYVECTOR* Annotations supported by this plugin */
 const string MYVECTOR_COLUMN_A = "MYVECTOR(";
 const string MYVECTOR_IS_ANN_A = "MYVECTOR_IS_ANN(";
@@ -1181,7 +2709,8 @@ const string MYVECTOR_DEFAULT_INDEX_TYPE = "type=KNN";
 const string MYVECTOR_IS_ANN_USAGE =
     "MYVECTOR_IS_ANN('<vector col>','<id col>','<search_vec>'[,'<options>'])";
 const string MYVECTOR_SEARCH_USAGE =
-    "MYVECTOR_SEARCH(baseTable,idColumn,vectorColumn,queryTable[,options])";
+    "MYVECTOR_SEARCH(baseTable,idColumn,vectorColumn,queryTable"
+    "[,queryColumn][,options])";
 
 /* MySQL Column COMMENT max. length is 1024.e.g comment with all fields set :
  * MYVECTOR Column
@@ -1304,11 +2833,62 @@ bool rewriteMyVectorColumnDef(const string& query, string& newQuery) {
     return error;
 }
 
+/* annOutputDistance - do the myvector_ann_set() options in params[from...]
+ * ask for output=distance? The options string is split at its commas like
+ * the other parameters, and may still carry its quotes.
+ */
+static bool annOutputDistance(const vector<string>& params, size_t from) {
+    for (size_t i = from; i < params.size(); i++) {
+        std::string_view opt = params[i];
+        if (opt.length() && (opt.front() == '\'' || opt.front() == '"'))
+            opt.remove_prefix(1);
+        if (opt.length() && (opt.back() == '\'' || opt.back() == '"'))
+            opt.remove_suffix(1);
+        bool distance = false;
+        if (forEachOption(opt,
+                          [&](std::string_view k, std::string_view v) {
+                              if (k == "output")
+                                  distance = (v == "distance");
+                          }) &&
+            distance)
+            return true;
+    }
+    return false;
+}
+
+/* countSQLArgs - number of arguments in an SQL argument list, commas in
+ * quotes or nested () do not count
+ */
+static size_t countSQLArgs(const string& params) {
+    size_t nargs = 1;
+    int depth = 0;
+    char quote = 0;
+    for (size_t i = 0; i < params.length(); i++) {
+        char c = params[i];
+        if (quote) {
+            if (c == '\\')
+                i++;
+            else if (c == quote)
+                quote = 0;
+        } else if (c == '\'' || c == '"' || c == '`') {
+            quote = c;
+        } else if (c == '(') {
+            depth++;
+        } else if (c == ')') {
+            depth--;
+        } else if (c == ',' && depth == 0) {
+            nargs++;
+        }
+    }
+    return nargs;
+}
+
 /* rewriteMyVectorIsANN() - rewrite the "WHERE MYVECTOR_IS_ANN(...)" annotation
  */
 bool rewriteMyVectorIsANN(const string& query, string& newQuery) {
     size_t pos;
     bool error = false;
+    unsigned int handle = 0;
 
     newQuery = query;
     while ((pos = newQuery.find(MYVECTOR_IS_ANN_A)) != string::npos) {
@@ -1348,11 +2928,23 @@ bool rewriteMyVectorIsANN(const string& query, string& newQuery) {
         idcolexpr = idcolexpr.substr(
             1, idcolexpr.length() - 2);  // remove the single quote
 
+        /// output=distance returns [[id,dist],...]
+        string idpath = annOutputDistance(annparams, 3) ? "$[0]" : "$";
+
+        /// n-th MYVECTOR_IS_ANN, myvector_row_distance(id, n) reads its
+        /// distances
+        size_t nargs = countSQLArgs(strparams);
+        handle++;
+        if (nargs == 3)
+            strparams += ", ''";
+        if (nargs <= 4)
+            strparams += ", " + to_string(handle);
+
         stringstream ss;
         ss << "( " << idcolexpr << " IN "
            << "(select `myvecid` from JSON_TABLE(myvector_ann_set(" << strparams
-           << "), " << '"' << "$[*]" << '"'
-           << " COLUMNS(`myvecid` BIGINT PATH \"$\")) `myvector_ann`) )";
+           << "), " << '"' << "$[*]" << '"' << " COLUMNS(`myvecid` BIGINT PATH "
+           << '"' << idpath << '"' << ")) `myvector_ann`) )";
 
         newQuery =
             newQuery.substr(0, pos) + ss.str() + newQuery.substr(epos + 1);
@@ -1369,6 +2961,7 @@ bool rewriteMyVectorIsANN(const string& query, string& newQuery) {
 bool rewriteMyVectorSearch(const string& query, string& newQuery) {
     bool error = false;
     size_t pos;
+    unsigned int handle = 0;
 
     newQuery = query;
     string delim;
@@ -1395,7 +2988,7 @@ bool rewriteMyVectorSearch(const string& query, string& newQuery) {
         vector<string> annparams;
         split(strparams, annparams);
 
-        if (annparams.size() < 4 || annparams.size() > 5) {
+        if (annparams.size() < 4) {
             my_plugin_log_message(
                 &gplugin,
                 MY_ERROR_LEVEL,
@@ -1407,24 +3000,52 @@ bool rewriteMyVectorSearch(const string& query, string& newQuery) {
         }
 
         /*  select article5 from MYVECTOR_SEARCH[test.t1, id, test.t1.v1, query,
-         * n=5]; */
+         * qvec, n=5]; */
 
         string basetable = annparams[0];
         string idcol = annparams[1];
         string vecindex = annparams[2];
         string queryt = annparams[3];
 
+        /// The 5th argument is the vector column of the query table unless
+        /// it is an option, the column defaults to 'searchvec'
+        size_t optstart = 4;
+        string querycol = "searchvec";
+        if (annparams.size() > 4 &&
+            annparams[4].find('=') == string::npos) {
+            querycol = annparams[4];
+            optstart = 5;
+        }
+
         string annopt = "";
-        if (annparams.size() > 4)
-            annopt = annparams[4];
+        for (size_t i = optstart; i < annparams.size(); i++)
+            annopt += (i > optstart ? "," : "") + annparams[i];
+
+        handle++;  /// see rewriteMyVectorIsANN()
+
+        /// All rows of the query table are searched in one
+        /// myvector_ann_batch() call, which returns each neighbour once with
+        /// its nearest distance.
+        stringstream batch;
+        batch << "(select myvector_ann_batch('" << vecindex << "','" << idcol
+              << "', " << querycol << ", '" << annopt << "', " << handle
+              << ") myvecset from " << queryt << ") b";
 
         stringstream ss;
-        /// The query table must have a vector column named 'searchvec'
-        ss << basetable << " where " << idcol << " in (select myvecid from "
-           << queryt << " b, json_table(myvector_ann_set('" << vecindex << "','"
-           << idcol << "', searchvec, '" << annopt << "') , " << '"' << "$[*]"
-           << '"' << " COLUMNS(`myvecid` BIGINT PATH " << '"' << "$" << '"'
-           << ")) `myvector_ann`)";
+        if (annOutputDistance(annparams, optstart)) {
+            /// Join instead of IN so that `myvecdist` can be selected
+            ss << basetable << " join (select myvecid, myvecdist from "
+               << batch.str() << ", json_table(b.myvecset, " << '"' << "$[*]"
+               << '"' << " COLUMNS(`myvecid` BIGINT PATH " << '"' << "$[0]"
+               << '"' << ", `myvecdist` DOUBLE PATH " << '"' << "$[1]" << '"'
+               << ")) `myvector_ann`) `myvector_search` on " << basetable
+               << "." << idcol << " = `myvector_search`.myvecid";
+        } else {
+            ss << basetable << " where " << idcol << " in (select myvecid from "
+               << batch.str() << ", json_table(b.myvecset, " << '"' << "$[*]"
+               << '"' << " COLUMNS(`myvecid` BIGINT PATH " << '"' << "$" << '"'
+               << ")) `myvector_ann`)";
+        }
 
         newQuery = newQuery.substr(0, pos) + ss.str() +
                    newQuery.substr(epos + delim.length());
@@ -1433,6 +3054,30 @@ bool rewriteMyVectorSearch(const string& query, string& newQuery) {
     return error;
 }
 
+/* startsWithKeywords - does the statement start with these keywords (any
+ * case) separated by whitespace, and followed by whitespace if 'spaceAfter'
+ */
+static bool startsWithKeywords(std::string_view query,
+                               std::initializer_list<std::string_view> words,
+                               bool spaceAfter) {
+    size_t pos = 0;
+    for (std::string_view word : words) {
+        if (pos) {
+            size_t sp = pos;
+            while (pos < query.length() && isspace((unsigned char)query[pos]))
+                pos++;
+            if (pos == sp)
+                return false;
+        }
+        if (query.length() - pos < word.length() ||
+            strncasecmp(query.data() + pos, word.data(), word.length()))
+            return false;
+        pos += word.length();
+    }
+    return (!spaceAfter ||
+            (pos < query.length() && isspace((unsigned char)query[pos])));
+}
+
 /* myvector_query_rewrite() - Entrypoint of pre-parse query rewrite by this
  * plugin. This routine looks for CREATE TABLE, ALTER TABLE, SELECT and
  * EXPLAIN and presence of MYVECTOR and proceeds to perform  the query
@@ -1447,19 +3092,11 @@ bool myvector_query_rewrite(const string& query, string* rewritten_query) {
     if (!strstr(query.c_str(), "MYVECTOR"))
         return false;
 
-    static const regex create_table("^CREATE\\s+TABLE",
-                                    regex::icase | regex::nosubs);
-    static const regex alter_table("^ALTER\\s+TABLE",
-                                   regex::icase | regex::nosubs);
-    static const regex select_stmt("^SELECT\\s+", regex::icase | regex::nosubs);
-    static const regex explain_stmt("^EXPLAIN\\s+",
-                                    regex::icase | regex::nosubs);
-
     string newQuery = "";
     *rewritten_query = query;
 
-    if ((regex_search(query, select_stmt) ||
-         regex_search(query, explain_stmt))) {
+    if (startsWithKeywords(query, {"SELECT"}, true) ||
+        startsWithKeywords(query, {"EXPLAIN"}, true)) {
         if (strstr(query.c_str(), MYVECTOR_IS_ANN_A.c_str())) {
             if (rewriteMyVectorIsANN(query, newQuery)) {
                 newQuery = "";
@@ -1469,8 +3106,8 @@ bool myvector_query_rewrite(const string& query, string* rewritten_query) {
                 newQuery = "";
             }
         }
-    } else if ((regex_search(query, create_table) ||
-                regex_search(query, alter_table)) &&
+    } else if ((startsWithKeywords(query, {"CREATE", "TABLE"}, false) ||
+                startsWithKeywords(query, {"ALTER", "TABLE"}, false)) &&
                (strstr(query.c_str(), MYVECTOR_COLUMN_A.c_str()))) {
         if (rewriteMyVectorColumnDef(query, newQuery)) {
             newQuery = "";
@@ -1483,14 +3120,132 @@ bool myvector_query_rewrite(const string& query, string* rewritten_query) {
     return (*rewritten_query != query);
 }
 
+/* annSetOptions - nn, ef_search, recall, search budget and output of the
+ * myvector_ann_set() options string. recall=R (0 < R <= 1) asks for the
+ * least ef_search of the index that finds R of the nn nearest, an explicit
+ * ef_search wins. budget_us=U and max_dist_comps=D cut an HNSW search short
+ * after U microseconds or D distance computations.
+ */
+static void annSetOptions(const char* options,
+                          unsigned long length,
+                          int& nn,
+                          int& ef_search,
+                          double& recall,
+                          SearchBudget& budget,
+                          bool& withDistance) {
+    nn = MYVECTOR_DEFAULT_ANN_RETURN_COUNT;
+    ef_search = 0;
+    recall = 0;
+    budget.budgetUs = 0;
+    budget.maxDistComps = 0;
+    budget.efSearch = 0;
+    budget.exhausted = false;
+    withDistance = false;
+    if (!options || !length)
+        return;
+
+    /* Parsed in place, this runs for every row with per-row options */
+    forEachOption(std::string_view(options, length),
+                  [&](std::string_view k, std::string_view v) {
+                      if (k == "nn") {
+                          if (!parseIntOption(v, nn))
+                              nn = MYVECTOR_DEFAULT_ANN_RETURN_COUNT;
+                      } else if (k == "ef_search") {
+                          if (!parseIntOption(v, ef_search))
+                              ef_search = 0;
+                      } else if (k == "recall") {
+                          if (!parseDoubleOption(v, recall) || recall <= 0 ||
+                              recall > 1)
+                              recall = 0;
+                      } else if (k == "budget_us") {
+                          int us = 0;
+                          if (parseIntOption(v, us) && us > 0)
+                              budget.budgetUs = us;
+                      } else if (k == "max_dist_comps") {
+                          int comps = 0;
+                          if (parseIntOption(v, comps) && comps > 0)
+                              budget.maxDistComps = comps;
+                      } else if (k == "output") {
+                          withDistance = (v == "distance");
+                      }
+                  });
+
+    /* How many neighbours to return? */
+    if (nn <= 0)
+        nn = MYVECTOR_DEFAULT_ANN_RETURN_COUNT;
+
+    nn = min((const unsigned int)nn, MYVECTOR_MAX_ANN_RETURN_COUNT);
+}
+
+/* annEffortForRecall - ef_search for a recall= search. A missing or stale
+ * recall curve is measured in the background, the search does not wait for
+ * it and uses the curve it has, or the index ef_search (0).
+ */
+static int annEffortForRecall(AbstractVectorIndex* vi, int nn, double recall) {
+    if (vi->recallCalibrationDue())
+        g_calibrator.schedule(vi);
+    return vi->searchEffortForRecall(nn, recall);
+}
+
+/* formatAnnDistance - shortest round trip text of a distance, "null" for
+ * NaN/Inf that JSON cannot represent. to_chars of a float needs GCC 11.
+ */
+static char* formatAnnDistance(char* p, char* end, float dist) {
+    if (!std::isfinite(dist)) {
+        memcpy(p, "null", 4);
+        return p + 4;
+    }
+#if defined(__cpp_lib_to_chars)
+    return std::to_chars(p, end, dist).ptr;
+#else
+    return p + snprintf(p, end - p, "%.9g", dist);
+#endif
+}
+
+/* formatAnnSet - JSON list of neighbour rows Pkid, or [Pkid,distance] pairs
+ * with 'withDistance'. Stops at the last entry that fits before 'end'.
+ */
+static char* formatAnnSet(char* p,
+                          char* end,
+                          const vector<KeyTypeInteger>& keys,
+                          const vector<double>& dists,
+                          bool withDistance) {
+    const unsigned int entryLen =
+        withDistance ? MYVECTOR_ANN_ID_DIST_MAX_LEN : MYVECTOR_ANN_ID_MAX_LEN;
+    *p++ = '[';
+    for (size_t i = 0; i < keys.size() && (size_t)(end - p) > entryLen; i++) {
+        if (i)
+            *p++ = ',';
+        if (withDistance)
+            *p++ = '[';
+        p = std::to_chars(p, end, keys[i]).ptr;
+        if (withDistance) {
+            *p++ = ',';
+            p = formatAnnDistance(p, end, dists[i]);
+            *p++ = ']';
+        }
+    }
+    *p++ = ']';
+    return p;
+}
+
+/* annHandleArg - the result handle argument, 0 if not passed */
+static unsigned int annHandleArg(UDF_ARGS* args, unsigned int arg) {
+    if (args->arg_count > arg && args->args[arg])
+        return (unsigned int)*((long long*)args->args[arg]);
+    return 0;
+}
+
 PLUGIN_EXPORT bool myvector_ann_set_init(UDF_INIT* initid,
                                          UDF_ARGS* args,
                                          char* message) {
     initid->ptr = nullptr;
-    if (args->arg_count < 3 || args->arg_count > 4) {
+    if (args->arg_count < 3 || args->arg_count > 5) {
         strcpy(message, ER_MYVECTOR_INCORRECT_ARGUMENTS);
         return true;  // error
     }
+    if (args->arg_count == 5)
+        args->arg_type[4] = INT_RESULT;  // result handle
 
     char* col = args->args[0];
     AbstractVectorIndex* vi = g_indexes.get(col);
@@ -1499,17 +3254,35 @@ PLUGIN_EXPORT bool myvector_ann_set_init(UDF_INIT* initid,
         return true;  // error
     }
     SharedLockGuard l(vi);
+    if (!checkIndexReady(vi, message))
+        return true;  // error
 
-    /* Users can possibly ask for 100s of neighbours. With buffer of 128000,
-     * about 12800 PK ids can be filled in the return string
+    /* Size the result buffer for the nn & output of constant options, for
+     * the largest result when the options vary per row.
      */
-    initid->max_length = MYVECTOR_DISPLAY_MAX_LEN;
+    int nn = MYVECTOR_MAX_ANN_RETURN_COUNT, ef_search = 0;
+    double recall = 0;
+    SearchBudget budget;
+    bool withDistance = true;
+    if (args->arg_count >= 4 && args->args[3])
+        annSetOptions(args->args[3],
+                      args->lengths[3],
+                      nn,
+                      ef_search,
+                      recall,
+                      budget,
+                      withDistance);
+    unsigned long len =
+        2 + (unsigned long)nn * (withDistance ? MYVECTOR_ANN_ID_DIST_MAX_LEN
+                                              : MYVECTOR_ANN_ID_MAX_LEN);
+    initid->max_length = std::max(len, (unsigned long)MYVECTOR_DISPLAY_MAX_LEN);
     initid->ptr = (char*)malloc(initid->max_length);
     (*h_udf_metadata_service)->result_set(initid, "charset", latin1);
 
-    /* tls_distances is now a static thread_local object, no allocation needed
-     */
-    tls_distances->clear();
+    /* No stale distances from an earlier statement with the same handle */
+    unsigned int handle = annHandleArg(args, 4);
+    if (handle < MYVECTOR_MAX_ANN_HANDLES)
+        annResult(handle).clear();
 
     return false;
 }
@@ -1517,10 +3290,9 @@ PLUGIN_EXPORT bool myvector_ann_set_init(UDF_INIT* initid,
 PLUGIN_EXPORT void myvector_ann_set_deinit(UDF_INIT* initid) {
     if (initid && initid->ptr)
         free(initid->ptr);
-    /* tls_distances is a static thread_local object, no deallocation needed.
-     * Clear it to free memory used by the map entries.
+    /* The AnnResult stays for myvector_row_distance() calls of the statement
+     * and keeps its memory for the next search.
      */
-    tls_distances->clear();
 }
 
 PLUGIN_EXPORT char* myvector_ann_set(UDF_INIT* initid,
@@ -1541,23 +3313,22 @@ PLUGIN_EXPORT char* myvector_ann_set(UDF_INIT* initid,
         return initid->ptr;
     }
 
-    if (args->arg_count == 4)
+    if (args->arg_count >= 4)
         searchoptions = args->args[3];
 
-    int nn = MYVECTOR_DEFAULT_ANN_RETURN_COUNT;
-    int ef_search = 0;
-    if (searchoptions && args->lengths[3]) {
-        MyVectorOptions vo(searchoptions);
-
-        /* How many neighbours to return? */
-        nn = vo.getIntOption("nn", MYVECTOR_DEFAULT_ANN_RETURN_COUNT);
-        if (nn <= 0)
-            nn = MYVECTOR_DEFAULT_ANN_RETURN_COUNT;
+    unsigned int handle = annHandleArg(args, 4);
 
-        nn = min((const unsigned int)nn, MYVECTOR_MAX_ANN_RETURN_COUNT);
-
-        ef_search = vo.getIntOption("ef_search", 0);
-    }
+    int nn, ef_search;
+    double recall;
+    SearchBudget budget;
+    bool withDistance;
+    annSetOptions(searchoptions,
+                  searchoptions ? args->lengths[3] : 0,
+                  nn,
+                  ef_search,
+                  recall,
+                  budget,
+                  withDistance);
 
     AbstractVectorIndex* vi = g_indexes.get(col);
     if (!vi) {
@@ -1567,32 +3338,276 @@ PLUGIN_EXPORT char* myvector_ann_set(UDF_INIT* initid,
         return initid->ptr;
     }
     SharedLockGuard l(vi);
+    if (!checkIndexReady(vi, nullptr)) {
+        *error = 1;
+        *is_null = 1;
+        *length = 0;
+        return initid->ptr;
+    }
 
-    stringstream ss;
-    if (searchvec) {
-        vector<KeyTypeInteger> result;
-        if (ef_search)
-            vi->setSearchEffort(ef_search);
-        vi->searchVectorNN(searchvec, vi->getDimension(), result, nn);
-
-        /* simple JSON list of neighbour rows Pkid */
-        ss << "[";
-        for (int i = 0; i < result.size(); i++) {
-            if (i)
-                ss << ",";
-            ss << result[i];
-        }
-        ss << "]";
-    } else {
+    if (!ef_search && recall > 0)
+        ef_search = annEffortForRecall(vi, nn, recall);
+    budget.efSearch = ef_search;
+
+    vector<KeyTypeInteger> keys;
+    vector<double> dists;
+    AnnResultCache& cache = vi->resultCache();
+    uint64_t epoch = vi->mutationEpoch();  // before the search, see insert()
+    if (!cache.enabled() || !cache.lookup(searchvec,
+                                          args->lengths[2],
+                                          nn,
+                                          ef_search,
+                                          epoch,
+                                          keys,
+                                          dists)) {
+        vi->searchVectorNN(
+            searchvec, vi->getDimension(), keys, dists, nn, &budget);
+        /* A search cut short by its budget is not kept for later queries */
+        if (cache.enabled() && !budget.exhausted)
+            cache.insert(searchvec,
+                         args->lengths[2],
+                         nn,
+                         ef_search,
+                         epoch,
+                         keys,
+                         dists);
+    }
+
+    if (handle < MYVECTOR_MAX_ANN_HANDLES) {
+        annResult(handle).set(keys, dists);
+        tls_ann_last_handle = handle;
+    }
+
+    /* Formatted in place, init sized the buffer for 'nn' entries */
+    char* p = formatAnnSet(initid->ptr,
+                           initid->ptr + initid->max_length,
+                           keys,
+                           dists,
+                           withDistance);
+
+    *length = p - initid->ptr;
+    return initid->ptr;
+}
+
+/* AnnBatch - the query vectors of a myvector_ann_batch() group, each one
+ * starting on a FP32 boundary of 'vectors', and the JSON result.
+ */
+struct AnnBatch {
+    vector<FP32> vectors;
+    vector<pair<size_t, unsigned long>> queries;  // offset in vectors, bytes
+    string result;
+};
+
+/* myvector_ann_batch(veccol, idcol, searchvec [, options [, handle]]) -
+ * aggregate form of myvector_ann_set() used by MYVECTOR_SEARCH. The query
+ * vectors of all the rows are collected and searched as one batch on
+ * myvector_search_threads threads (KNN indexes share one scan of the rows
+ * between them). Returns the union of the neighbours, a row matched by
+ * several queries once with its nearest distance.
+ */
+PLUGIN_EXPORT bool myvector_ann_batch_init(UDF_INIT* initid,
+                                           UDF_ARGS* args,
+                                           char* message) {
+    initid->ptr = nullptr;
+    if (args->arg_count < 3 || args->arg_count > 5) {
+        strcpy(message, ER_MYVECTOR_INCORRECT_ARGUMENTS);
+        return true;  // error
+    }
+    if (args->arg_count == 5)
+        args->arg_type[4] = INT_RESULT;  // result handle
+
+    char* col = args->args[0];
+    AbstractVectorIndex* vi = g_indexes.get(col);
+    if (!vi) {
+        snprintf(message, MYSQL_ERRMSG_SIZE, ER_MYVECTOR_INDEX_NOT_FOUND " (%s)", col);
+        return true;  // error
+    }
+    SharedLockGuard l(vi);
+    if (!checkIndexReady(vi, message))
+        return true;  // error
+
+    /* nn neighbours of every query row, the length is not known up front */
+    initid->max_length = MYVECTOR_ANN_BATCH_MAX_LEN;
+    initid->ptr = (char*)new AnnBatch();
+    (*h_udf_metadata_service)->result_set(initid, "charset", latin1);
+
+    unsigned int handle = annHandleArg(args, 4);
+    if (handle < MYVECTOR_MAX_ANN_HANDLES)
+        annResult(handle).clear();
+
+    return false;
+}
+
+PLUGIN_EXPORT void myvector_ann_batch_deinit(UDF_INIT* initid) {
+    if (initid && initid->ptr)
+        delete (AnnBatch*)initid->ptr;
+}
+
+PLUGIN_EXPORT void myvector_ann_batch_clear(UDF_INIT* initid,
+                                            unsigned char*,
+                                            unsigned char*) {
+    AnnBatch* batch = (AnnBatch*)initid->ptr;
+    batch->vectors.clear();
+    batch->queries.clear();
+}
+
+PLUGIN_EXPORT void myvector_ann_batch_add(UDF_INIT* initid,
+                                          UDF_ARGS* args,
+                                          unsigned char*,
+                                          unsigned char*) {
+    AnnBatch* batch = (AnnBatch*)initid->ptr;
+    const char* searchvec = args->args[2];
+    unsigned long len = args->lengths[2];
+    if (!searchvec || !len)
+        return;  /// a NULL query vector has no neighbours
+
+    size_t offset = batch->vectors.size();
+    batch->vectors.resize(offset + (len + sizeof(FP32) - 1) / sizeof(FP32));
+    memcpy(&batch->vectors[offset], searchvec, len);
+    batch->queries.push_back({offset, len});
+}
+
+PLUGIN_EXPORT char* myvector_ann_batch(UDF_INIT* initid,
+                                       UDF_ARGS* args,
+                                       char* result,
+                                       unsigned long* length,
+                                       unsigned char* is_null,
+                                       unsigned char* error) {
+    AnnBatch* batch = (AnnBatch*)initid->ptr;
+    char* col = args->args[0];
+    const char* searchoptions = (args->arg_count >= 4 ? args->args[3] : nullptr);
+    unsigned int handle = annHandleArg(args, 4);
+
+    int nn, ef_search;
+    double recall;
+    SearchBudget budget;
+    bool withDistance;
+    annSetOptions(searchoptions,
+                  searchoptions ? args->lengths[3] : 0,
+                  nn,
+                  ef_search,
+                  recall,
+                  budget,
+                  withDistance);
+
+    AbstractVectorIndex* vi = (col ? g_indexes.get(col) : nullptr);
+    if (!vi) {
+        *error = 1;
         *is_null = 1;
+        *length = 0;
+        return result;
+    }
+    SharedLockGuard l(vi);
+    if (!checkIndexReady(vi, nullptr)) {
         *error = 1;
-        ss << "[NULL]";
+        *is_null = 1;
+        *length = 0;
+        return result;
     }
 
-    *length = ss.str().length();
-    result = initid->ptr;
-    strcpy(result, ss.str().c_str());
-    return result;
+    if (!ef_search && recall > 0)
+        ef_search = annEffortForRecall(vi, nn, recall);
+    budget.efSearch = ef_search;
+
+    /* Queries in the result cache are answered from it, the rest are
+     * searched together.
+     */
+    const size_t nq = batch->queries.size();
+    vector<vector<KeyTypeInteger>> nnkeys(nq);
+    vector<vector<double>> nndists(nq);
+    vector<VectorPtr> missvecs;
+    vector<size_t> misses;
+    AnnResultCache& cache = vi->resultCache();
+    uint64_t epoch = vi->mutationEpoch();  // before the search, see insert()
+    for (size_t q = 0; q < nq; q++) {
+        const FP32* qvec = &batch->vectors[batch->queries[q].first];
+        if (!cache.enabled() || !cache.lookup(qvec,
+                                              batch->queries[q].second,
+                                              nn,
+                                              ef_search,
+                                              epoch,
+                                              nnkeys[q],
+                                              nndists[q])) {
+            missvecs.push_back((VectorPtr)qvec);
+            misses.push_back(q);
+        }
+    }
+
+    if (missvecs.size()) {
+        vector<vector<KeyTypeInteger>> mkeys;
+        vector<vector<double>> mdists;
+        if (!vi->searchVectorsNN(missvecs,
+                                 vi->getDimension(),
+                                 mkeys,
+                                 mdists,
+                                 nn,
+                                 std::max(1L, myvector_search_threads),
+                                 &budget)) {
+            *error = 1;
+            *is_null = 1;
+            *length = 0;
+            return result;
+        }
+        for (size_t i = 0; i < misses.size(); i++) {
+            size_t q = misses[i];
+            nnkeys[q] = std::move(mkeys[i]);
+            nndists[q] = std::move(mdists[i]);
+            /* The budget is per query, one cut short keeps the batch out */
+            if (cache.enabled() && !budget.exhausted)
+                cache.insert(missvecs[i],
+                             batch->queries[q].second,
+                             nn,
+                             ef_search,
+                             epoch,
+                             nnkeys[q],
+                             nndists[q]);
+        }
+    }
+
+    /* Union of the neighbours, nearest distance of each row, nearest first */
+    vector<pair<KeyTypeInteger, double>> rows;
+    for (size_t q = 0; q < nq; q++) {
+        for (size_t i = 0; i < nnkeys[q].size(); i++)
+            rows.push_back({nnkeys[q][i], nndists[q][i]});
+    }
+    sort(rows.begin(), rows.end());
+    rows.erase(unique(rows.begin(),
+                      rows.end(),
+                      [](const pair<KeyTypeInteger, double>& a,
+                         const pair<KeyTypeInteger, double>& b) {
+                          return a.first == b.first;
+                      }),
+               rows.end());
+    sort(rows.begin(),
+         rows.end(),
+         [](const pair<KeyTypeInteger, double>& a,
+            const pair<KeyTypeInteger, double>& b) {
+             return a.second < b.second;
+         });
+
+    vector<KeyTypeInteger> keys;
+    vector<double> dists;
+    for (auto& r : rows) {
+        keys.push_back(r.first);
+        dists.push_back(r.second);
+    }
+
+    if (handle < MYVECTOR_MAX_ANN_HANDLES) {
+        annResult(handle).set(keys, dists);
+        tls_ann_last_handle = handle;
+    }
+
+    const unsigned int entryLen =
+        withDistance ? MYVECTOR_ANN_ID_DIST_MAX_LEN : MYVECTOR_ANN_ID_MAX_LEN;
+    batch->result.resize(2 + (keys.size() + 1) * entryLen);
+    char* p = formatAnnSet(batch->result.data(),
+                           batch->result.data() + batch->result.size(),
+                           keys,
+                           dists,
+                           withDistance);
+
+    *length = p - batch->result.data();
+    return batch->result.data();
 }
 
 /* SQFloatVectorToBinaryVector - Simple scalar quantization to convert
@@ -1622,7 +3637,7 @@ int SQFloatVectorToBinaryVector(FP32* fvec, unsigned long* ivec, int dim) {
 }
 
 /* Forward declaration for o=bv path */
-char* myvector_construct_bv(const std::string& srctype,
+char* myvector_construct_bv(std::string_view srctype,
                             char* src,
                             char* dst,
                             unsigned long srclen,
@@ -1630,6 +3645,20 @@ char* myvector_construct_bv(const std::string& srctype,
                             unsigned char* is_null,
                             unsigned char* error);
 
+/* constructOptions - i= and o= of the myvector_construct() options */
+static void constructOptions(const char* opt,
+                             unsigned long optlen,
+                             std::string_view& in,
+                             std::string_view& out) {
+    forEachOption(std::string_view(opt, optlen),
+                  [&](std::string_view k, std::string_view v) {
+                      if (k == "i")
+                          in = v;
+                      else if (k == "o")
+                          out = v;
+                  });
+}
+
 /* Helper: perform myvector_construct conversion. Used for both constant-arg
  * caching (in init) and per-row conversion. Returns true on success.
  */
@@ -1645,11 +3674,12 @@ static bool myvector_construct_do_convert(char* ptr,
     if (!opt || !optlen)
         opt = "i=string,o=float";
     else {
-        MyVectorOptions vo(string(opt, optlen));
-        if (vo.getOption("i") == "float" && vo.getOption("o") == "float")
+        std::string_view in, out;
+        constructOptions(opt, optlen, in, out);
+        if (in == "float" && out == "float")
             skipConvert = true;
-        if (vo.getOption("o") == "bv") {
-            myvector_construct_bv(vo.getOption("i"),
+        if (out == "bv") {
+            myvector_construct_bv(in,
                                  ptr,
                                  retvec,
                                  ptrlen,
@@ -1711,7 +3741,7 @@ static bool myvector_construct_do_convert(char* ptr,
     return true;
 }
 
-char* myvector_construct_bv(const std::string& srctype,
+char* myvector_construct_bv(std::string_view srctype,
                             char* src,
                             char* dst,
                             unsigned long srclen,
@@ -1859,9 +3889,10 @@ PLUGIN_EXPORT char* myvector_construct(UDF_INIT* initid,
 
     /* o=bv branches to myvector_construct_bv - not handled by helper */
     if (opt && optlen) {
-        MyVectorOptions vo(string(opt, optlen));
-        if (vo.getOption("o") == "bv")
-            return myvector_construct_bv(vo.getOption("i"),
+        std::string_view in, out;
+        constructOptions(opt, optlen, in, out);
+        if (out == "bv")
+            return myvector_construct_bv(in,
                                          ptr,
                                          initid->ptr + sizeof(size_t),
                                          args->lengths[0],
@@ -2099,9 +4130,21 @@ PLUGIN_EXPORT bool myvector_search_open_udf_init(UDF_INIT* initid,
         strcpy(message, "Incorrect arguments to MyVector internal UDF.");
         return true;
     }
+    /* The status report is longer than the 255 byte default result */
+    initid->max_length = MYVECTOR_OPEN_RESULT_MAX_LEN;
+    initid->ptr = (char*)malloc(MYVECTOR_OPEN_RESULT_MAX_LEN);
+    if (!initid->ptr) {
+        strcpy(message, "Out of memory in MyVector internal UDF.");
+        return true;
+    }
     return false;
 }
 
+/* copyResult - 'str' to the admin action result, truncated to 'len' - 1 */
+static void copyResult(char* result, size_t len, const char* str) {
+    snprintf(result, len, "%s", str);
+}
+
 void BuildMyVectorIndexSQL(const char* db,
                            const char* table,
                            const char* idcol,
@@ -2111,12 +4154,15 @@ void BuildMyVectorIndexSQL(const char* db,
                            AbstractVectorIndex* vi,
                            char* errorbuf);
 
+void RequestBinlogRewind();
+
 void myvector_open_index_impl(char* vecid,
                               char* details,
                               char* pkidcol,
                               char* action,
                               char* extra,
-                              char* result) {
+                              char* result,
+                              size_t resultLen) {
     bool existing = true;
     /* Admin operations usecases :-
 
@@ -2131,19 +4177,44 @@ void myvector_open_index_impl(char* vecid,
      be loaded first. refresh will not persist. After reboot/restart, call
      myvector("load") followed by myvector("refresh")
      6. For explicit persist  -> call myvector("save"), needed after "refresh"
+     7. Many deleted rows in an HNSW index -> call myvector("compact")
+     8. Check the persisted HNSW index files -> call myvector("verify")
+     9. Seed another host -> call myvector("export") here, copy the file to
+     its myvector_index_dir and call myvector("import") there
     */
 
     AbstractVectorIndex* vi = g_indexes.get(vecid);
     if (!vi) {
         vi = g_indexes.open(vecid, details, action);
         if (!vi) {
-            strcpy(result, "Failed to open index");
+            copyResult(result, resultLen, "Failed to open index");
             return;
         }
         existing = false;
     }
     SharedLockGuard l(vi);
 
+    /* let a queued startup load finish before the index is changed */
+    if (strcmp(action, "status") && vi->getLoadState() == INDEX_LOADING)
+        g_loader.wait(vecid);
+
+    /* One load, build, save, drop, compact, verify, export or import of an
+     * index at a time, see loadMutex()
+     */
+    unique_lock<mutex> adminLock(vi->loadMutex(), std::defer_lock);
+    static const char* adminActions[] = {"load",   "build",  "save",
+                                         "drop",   "compact", "verify",
+                                         "export", "import"};
+    for (const char* a : adminActions) {
+        if (!strcmp(action, a) && !adminLock.try_lock()) {
+            copyResult(result,
+                       resultLen,
+                       "Another load, build, save, drop, compaction, verify, "
+                       "export or import of the index is in progress.");
+            return;
+        }
+    }
+
     string trackingColumn = "";
     int nthreads = 0;
 
@@ -2152,7 +4223,9 @@ void myvector_open_index_impl(char* vecid,
         trackingColumn = vo.getOption("track");
     }
     if (!strcmp(action, "refresh") && !trackingColumn.length()) {
-        strcpy(result, "Tracking column not found for incremental refresh.");
+        copyResult(result,
+                   resultLen,
+                   "Tracking column not found for incremental refresh.");
         return;
     }
     if (vo.getOption("threads").length()) {  // override
@@ -2164,28 +4237,65 @@ void myvector_open_index_impl(char* vecid,
     if (!strcmp(action, "save")) {
         vi->saveIndex(myvector_index_dir);
     } else if (!strcmp(action, "status")) {
-        string s = vi->getStatus();
-        strcpy(result, s.c_str());
+        static const char* loadStates[] = {"unloaded", "loading", "ready", "failed"};
+        string s = vi->getStatus() + "Load State : " +
+                   loadStates[vi->getLoadState()] + "\n";
+        size_t dirtyNodes, dirtyBytes;
+        vi->getDirtyStats(dirtyNodes, dirtyBytes);
+        s += "Dirty Nodes : " + to_string(dirtyNodes) + "\n";
+        if (vi->resultCache().enabled()) {
+            size_t hits, misses, entries, bytes;
+            vi->resultCache().getStats(hits, misses, entries, bytes);
+            s += "Result Cache : " + to_string(entries) + " entries, " +
+                 to_string(bytes / 1024) + " KB, " + to_string(hits) +
+                 " hits, " + to_string(misses) + " misses\n";
+        }
+        copyResult(result, resultLen, s.c_str());
     } else if (!strcmp(action, "drop")) {
         vi->dropIndex(myvector_index_dir);
         l.release();
-        g_indexes.close(vi);
+        g_indexes.close(vi, &adminLock);  // unlocks it before the delete
         vi = nullptr;
     }
 
     else if (!strcmp(action, "load")) {
         debug_print("Loading index %s.", vecid);
-        vi->loadIndex(myvector_index_dir);  // will handle 'reload' also
+        vi->setLoadState(INDEX_LOADING);
+        // will handle 'reload' also
+        vi->setLoadState(vi->loadIndex(myvector_index_dir) ? INDEX_READY
+                                                           : INDEX_FAILED);
     } else if (!strcmp(action, "build")) {
         vi->dropIndex(myvector_index_dir);
 
         vi->initIndex();  // start new
+        vi->setLoadState(INDEX_READY);
 
         if (nthreads >= 2)
             vi->startParallelBuild(nthreads);
     } else if (!strcmp(action, "refresh")) {
+        vi->setLoadState(INDEX_READY);
         if (nthreads >= 2)
             vi->startParallelBuild(nthreads);
+    } else if (!strcmp(action, "compact")) {
+        string report;
+        vi->compactIndex(myvector_index_dir, report);
+        copyResult(result, resultLen, report.c_str());
+    } else if (!strcmp(action, "verify")) {
+        string report;
+        vi->verifyIndex(myvector_index_dir, report);
+        copyResult(result, resultLen, report.c_str());
+    } else if (!strcmp(action, "export")) {
+        string report;
+        vi->exportIndex(myvector_index_dir, (extra ? extra : ""), report);
+        copyResult(result, resultLen, report.c_str());
+    } else if (!strcmp(action, "import")) {
+        string report;
+        if (vi->importIndex(myvector_index_dir, (extra ? extra : ""), report)) {
+            vi->setLoadState(INDEX_READY);
+            if (vi->supportsIncrUpdates())
+                RequestBinlogRewind();  // resume tailing at the export's coordinates
+        }
+        copyResult(result, resultLen, report.c_str());
     }
 
     if (!strcmp(action, "build") || !strcmp(action, "refresh")) {
@@ -2206,11 +4316,11 @@ void myvector_open_index_impl(char* vecid,
                               trackingColumn.c_str(),
                               vi,
                               errorbuf);
-        strcpy(result, errorbuf);
+        copyResult(result, resultLen, errorbuf);
         if (!strcmp(action, "refresh")) {
             unsigned long lastts = vi->getUpdateTs();
             char timebuf[64];
-            strcat(result, ", Vector Index refreshed at : ");
+            size_t used = strlen(result);
 #ifdef _WIN32
             time_t t = (time_t)lastts;
             struct tm tm_buf;
@@ -2225,7 +4335,10 @@ void myvector_open_index_impl(char* vecid,
             gmtime_r(&t, &tm_buf);
             strftime(timebuf, sizeof(timebuf), "%a %b %d %H:%M:%S %Y\n", &tm_buf);
 #endif
-            strcat(result, timebuf);
+            snprintf(result + used,
+                     resultLen - used,
+                     ", Vector Index refreshed at : %s",
+                     timebuf);
         }
 
         vi->saveIndex(myvector_index_dir, action);
@@ -2233,9 +4346,9 @@ void myvector_open_index_impl(char* vecid,
     return;
 }
 
-PLUGIN_EXPORT char* myvector_search_open_udf(UDF_INIT*,
+PLUGIN_EXPORT char* myvector_search_open_udf(UDF_INIT* initid,
                                              UDF_ARGS* args,
-                                             char* result,
+                                             char*,
                                              unsigned long* length,
                                              unsigned char* is_null,
                                              unsigned char*) {
@@ -2254,15 +4367,25 @@ PLUGIN_EXPORT char* myvector_search_open_udf(UDF_INIT*,
                           action,
                           extra);
 
+    char* result = initid->ptr;
     strcpy(result, "SUCCESS");
 
-    myvector_open_index_impl(vecid, details, pkidcol, action, extra, result);
+    myvector_open_index_impl(vecid,
+                             details,
+                             pkidcol,
+                             action,
+                             extra,
+                             result,
+                             MYVECTOR_OPEN_RESULT_MAX_LEN);
 
     *length = strlen(result);
     return result;
 }
 
-PLUGIN_EXPORT void myvector_search_open_udf_deinit() {}
+PLUGIN_EXPORT void myvector_search_open_udf_deinit(UDF_INIT* initid) {
+    if (initid && initid->ptr)
+        free(initid->ptr);
+}
 
 PLUGIN_EXPORT bool myvector_search_save_udf_init(UDF_INIT* initid,
                                                  UDF_ARGS* args,
@@ -2421,12 +4544,15 @@ PLUGIN_EXPORT void myvector_is_valid_deinit(UDF_INIT*) {}
 PLUGIN_EXPORT bool myvector_row_distance_init(UDF_INIT* initid,
                                               UDF_ARGS* args,
                                               char* message) {
-    if (!initid || args->arg_count != 1) {
+    if (!initid || args->arg_count < 1 || args->arg_count > 2) {
         strcpy(message,
                "Incorrect arguments to myvector_row_distance(), "
-               "Usage : myvector_row_distance(idval)");
+               "Usage : myvector_row_distance(idval [, handle])");
         return true;
     }
+    args->arg_type[0] = INT_RESULT;
+    if (args->arg_count == 2)
+        args->arg_type[1] = INT_RESULT;
     initid->const_item = 0;
     initid->decimals = 20; /* For some reason, this is explicitly needed here */
     return false;
@@ -2437,13 +4563,20 @@ PLUGIN_EXPORT double myvector_row_distance(UDF_INIT*,
                                            char*,
                                            char*) {
     double dist = 99999999999.99;
+    if (!args->args[0])
+        return dist;
     KeyTypeInteger idval = *((KeyTypeInteger*)args->args[0]);
 
-    if (tls_distances->size()) {
-        if (tls_distances->find(idval) != tls_distances->end())
-            dist = (*tls_distances)[idval];
+    unsigned int handle = tls_ann_last_handle;
+    if (args->arg_count == 2) {
+        if (!args->args[1])
+            return dist;
+        handle = (unsigned int)*((long long*)args->args[1]);
     }
 
+    if (handle < tls_ann_results.size())
+        tls_ann_results[handle].find(idval, dist);
+
     return dist;
 }
 PLUGIN_EXPORT void myvector_row_distance_deinit(UDF_INIT*) {}
@@ -2456,10 +4589,17 @@ bool isAfter(const string& binlogfile2,
             (binlogfile2 > binlogfile1));
 }
 
+/* myvector_table_op() - apply one binlog row to an online index. UPDATE
+ * and DELETE rows are applied only by indexes that supportsDeletes(), an
+ * UPDATE is a delete of the old id (if the id changed) and an insert that
+ * replaces the vector.
+ */
 void myvector_table_op(const string& dbname,
                        const string& tbname,
                        const string& cname,
+                       int op,
                        unsigned int pkid,
+                       unsigned int oldpkid,
                        vector<unsigned char>& vec,
                        const string& binlogfile,
                        const size_t& binlogpos) {
@@ -2473,7 +4613,16 @@ void myvector_table_op(const string& dbname,
 
         vi->getLastUpdateCoordinates(binlogfileold, binlogposold);
         if (isAfter(binlogfile, binlogpos, binlogfileold, binlogposold)) {
-            vi->insertVector(vec.data(), vi->getDimension(), pkid);
+            if (op == VECTOR_INDEX_INSERT) {
+                vi->insertVector(vec.data(), vi->getDimension(), pkid);
+            } else if (vi->supportsDeletes()) {
+                if (op == VECTOR_INDEX_DELETE ||
+                    (op == VECTOR_INDEX_UPDATE && oldpkid != pkid))
+                    vi->deleteVector(op == VECTOR_INDEX_DELETE ? pkid
+                                                               : oldpkid);
+                if (op == VECTOR_INDEX_UPDATE && vec.size())
+                    vi->insertVector(vec.data(), vi->getDimension(), pkid);
+            }
         } else {
             debug_print("Skipping index update (%s %lu) < (%s %lu).",
                         binlogfile.c_str(),
@@ -2486,10 +4635,13 @@ void myvector_table_op(const string& dbname,
 
 /* myvector_checkpoint_index() - Incrementally persist a vector index. Check
  * hnswdisk.i for implementation details. This routine is called from the
- * binlog event listener thread at every binlog file rotation. The frequency
- * can be changed in future if needed.
+ * background checkpointer thread of each online index (myvector_binlog.cc),
+ * when the dirty node count, dirty bytes or elapsed time crosses the
+ * myvector_checkpoint_* thresholds or the binlog rotates. Returns false if
+ * a load, build, compaction, verify, export, import or drop of the index
+ * holds loadMutex(), the checkpointer then retries.
  */
-void myvector_checkpoint_index(const string& dbtable,
+bool myvector_checkpoint_index(const string& dbtable,
                                const string& veccol,
                                const string& binlogFile,
                                size_t binlogPos) {
@@ -2498,6 +4650,12 @@ void myvector_checkpoint_index(const string& dbtable,
 
     if (vi) {
         SharedLockGuard l(vi);
+        /* try_lock - a compaction or import waits for the exclusive lock
+         * while it holds loadMutex()
+         */
+        unique_lock<mutex> adminLock(vi->loadMutex(), std::try_to_lock);
+        if (!adminLock.owns_lock())
+            return false;
         string binlogfileold;
         size_t binlogposold;
 
@@ -2511,6 +4669,61 @@ void myvector_checkpoint_index(const string& dbtable,
             vi->saveIndex(myvector_index_dir, "checkpoint");
         }
     }
+    return true;
+}
+
+/* myvector_index_dirty_stats() - dirty nodes and bytes of an online index
+ * waiting for its next checkpoint. Returns false if the index is not open.
+ */
+bool myvector_index_dirty_stats(const string& dbtable,
+                                const string& veccol,
+                                size_t& nodes,
+                                size_t& bytes) {
+    string vecid = dbtable + "." + veccol;
+    AbstractVectorIndex* vi = g_indexes.get(vecid);
+
+    nodes = bytes = 0;
+    if (!vi)
+        return false;
+
+    SharedLockGuard l(vi);
+    vi->getDirtyStats(nodes, bytes);
+    return true;
+}
+
+/* myvector_register_index() - open an index found at plugin start and
+ * hand it to the loader pool. Column option startup=eager loads it in
+ * load_priority order (highest first), startup=lazy on its first search.
+ * Online indexes are always loaded eagerly, the binlog reader needs them.
+ */
+void myvector_register_index(const string& vecid,
+                             const string& details,
+                             bool online) {
+    AbstractVectorIndex* vi = g_indexes.get(vecid);
+    if (!vi) {
+        vi = g_indexes.open(vecid, details, "load");
+        if (!vi)
+            return;
+    }
+    SharedLockGuard l(vi);
+
+    MyVectorOptions vo(details);
+    if (online || vo.getOption("startup") == "eager")
+        g_loader.schedule(vi, vo.getIntOption("load_priority", 0));
+}
+
+/* myvector_wait_index_load() - wait for a registered eager index load */
+void myvector_wait_index_load(const string& vecid) { g_loader.wait(vecid); }
+
+/* myvector_index_supports_deletes() - should the binlog reader queue the
+ * UPDATE and DELETE rows of this index?
+ */
+bool myvector_index_supports_deletes(const string& vecid) {
+    AbstractVectorIndex* vi = g_indexes.get(vecid);
+    if (!vi)
+        return false;
+    SharedLockGuard l(vi);
+    return vi->supportsDeletes();
 }
 
 string myvector_find_earliest_binlog_file() {
@@ -29,9 +29,11 @@
 #include <time.h>
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <map>
-#include <regex>
+#include <set>
 #include <sstream>
 #include <utility>
 #include <vector>
@@ -120,11 +122,14 @@ extern char* myvector_index_dir;
 void myvector_table_op(const string& dbname,
                        const string& tbname,
                        const string& cname,
+                       int op,
                        unsigned int pkid,
+                       unsigned int oldpkid,
                        vector<unsigned char>& vec,
                        const string& binlogfile,
                        const size_t& pos);
 string myvector_find_earliest_binlog_file();
+bool myvector_index_supports_deletes(const string& vecid);
 
 typedef struct {
     string dbName_;
@@ -133,6 +138,8 @@ typedef struct {
     vector<unsigned char> vec_;
     unsigned int veclen_;  // bytes
     unsigned int pkid_;
+    int op_;               // VectorIndexOp
+    unsigned int oldPkid_;  // UPDATE - id in the before image
     string binlogFile_;
     size_t binlogPos_;
 } VectorIndexUpdateItem;
@@ -141,6 +148,7 @@ typedef struct {
     string vectorColumn;
     int idColumnPosition;
     int vecColumnPosition;
+    bool applyDeletes;  // queue UPDATE & DELETE rows, see supportsDeletes()
 } VectorIndexColumnInfo;
 
 // boost::lockfree::queue<VectorIndexUpdateItem*> gqueue(128); /* FUTURE */
@@ -148,28 +156,83 @@ typedef struct {
 /* Simple Queue class for single producer-multiple consumer pattern. This
  * implementation currently uses std::mutex & std::cv. Rework later to use
  * boost::lockfree::queue<> if scalability issues hit.
+ *
+ * The queue also tracks the binlog coordinates of every item that has been
+ * enqueued but not yet applied to its index (done() is called by the
+ * consumer). Checkpoints use the oldest in-flight coordinate as the restart
+ * point instead of waiting for the queue to drain.
+ *
+ * Inserts of different rows commute and are applied in parallel. An UPDATE
+ * or DELETE item is a barrier: it is handed out only when no other item is
+ * being applied, and nothing is handed out until it is done, so changes to
+ * one row are applied in binlog order.
  */
 class EventsQ {
 public:
     void enqueue(VectorIndexUpdateItem* item) {
         lock_guard lk(m_);
         items_.push_back(item);
+        inflight_[{item->binlogFile_, item->binlogPos_}]++;
         cv_.notify_one();
     }
+    /* setReadCoordinates - binlog reader has enqueued everything upto here */
+    void setReadCoordinates(const string& file, size_t pos) {
+        lock_guard lk(m_);
+        readFile_ = file;
+        readPos_ = pos;
+    }
     VectorIndexUpdateItem* dequeue() {
         std::unique_lock lk(m_);
-        cv_.wait(lk, [] { return items_.size(); });
+        cv_.wait(lk, [this] {
+            return items_.size() && !barrier_ &&
+                   (items_.front()->op_ == VECTOR_INDEX_INSERT || !running_);
+        });
 
         VectorIndexUpdateItem* next = items_.front();
         items_.pop_front();
-        return next;  // consumer to call delete
+        running_++;
+        barrier_ = (next->op_ != VECTOR_INDEX_INSERT);
+        return next;  // consumer to call done() & delete
+    }
+    void done(const VectorIndexUpdateItem* item) {
+        lock_guard lk(m_);
+        auto it = inflight_.find({item->binlogFile_, item->binlogPos_});
+        if (it != inflight_.end() && --it->second == 0)
+            inflight_.erase(it);
+        running_--;
+        if (item->op_ != VECTOR_INDEX_INSERT)
+            barrier_ = false;
+        if (!barrier_ && (item->op_ != VECTOR_INDEX_INSERT || !running_))
+            cv_.notify_all();
+    }
+    bool empty() {
+        lock_guard lk(m_);
+        return inflight_.empty();
+    }
+    /* checkpointCoordinates - binlog coordinates upto which all events have
+     * been applied. Items carry the end position of their event, so an
+     * in-flight event is re-applied on restart (inserts are idempotent).
+     */
+    void checkpointCoordinates(string& file, size_t& pos) {
+        lock_guard lk(m_);
+        if (inflight_.empty()) {
+            file = readFile_;
+            pos = readPos_;
+            return;
+        }
+        file = inflight_.begin()->first.first;
+        pos = inflight_.begin()->first.second - 1;
     }
-    bool empty() const { return items_.size() == 0; }
 
 private:
     mutex m_;
     condition_variable cv_;
     static list<VectorIndexUpdateItem*> items_;
+    map<std::pair<string, size_t>, int> inflight_;
+    int running_{0};       // dequeued, not done
+    bool barrier_{false};  // an UPDATE/DELETE item is running
+    string readFile_;
+    size_t readPos_{0};
 };
 
 list<VectorIndexUpdateItem*> EventsQ::items_;
@@ -179,6 +242,7 @@ EventsQ gqueue_;
 // vector column. But MyVector supports multiple vector index in 1 table.
 mutex binlog_stream_mutex_;
 map<string, VectorIndexColumnInfo> g_OnlineVectorIndexes;
+void StartOnlineIndexCheckpointer(const string& dbtable, const string& veccol);
 string currentBinlogFile = "";
 size_t currentBinlogPos = 0;
 
@@ -200,6 +264,20 @@ typedef struct {
     vector<int> columnMetadata;
 } TableMapEvent;
 
+/* readPackedInteger - the length encoded integer of the binlog format
+ * (column counts), advances index past it.
+ */
+static unsigned long readPackedInteger(const unsigned char* event_buf,
+                                       unsigned int& index) {
+    unsigned long val = 0;
+    unsigned char b = event_buf[index++];
+    if (b < 251) return b;
+    unsigned int nbytes = (b == 252 ? 2 : b == 253 ? 3 : 8);
+    memcpy(&val, &event_buf[index], nbytes);
+    index += nbytes;
+    return val;
+}
+
 /* parseTableMapEvent - Parse the TableMap binlog event that appears before
  * any *ROWS* event.
  */
@@ -230,17 +308,15 @@ void parseTableMapEvent(const unsigned char* event_buf,
     if (g_OnlineVectorIndexes.find(key) == g_OnlineVectorIndexes.end())
         return;  /// we don't need to parse rest of the metadata
 
-    tev.nColumns = (unsigned int)
-        event_buf[index];  // TODO - we support only <= 255 columns
-    index++;
+    tev.nColumns = (unsigned int)readPackedInteger(event_buf, index);
 
     tev.columnTypes.insert(tev.columnTypes.end(),
                            &event_buf[index],
                            &event_buf[index + tev.nColumns]);
     index += tev.nColumns;
-    unsigned int metadatalen = (unsigned int)event_buf[index];
+    unsigned int metadatalen =
+        (unsigned int)readPackedInteger(event_buf, index);
     (void)metadatalen;
-    index++;
 
     for (unsigned int i = 0; i < (unsigned int)tev.nColumns; i++) {
         unsigned int md = 0;
@@ -283,11 +359,20 @@ void parseTableMapEvent(const unsigned char* event_buf,
     return;
 }
 
+/* parseRowsEvent() : WRITE, UPDATE and DELETE rows events. 'op' is the
+ * VectorIndexOp of the event. An UPDATE row has a before and an after
+ * image, the id of the before image becomes the item's oldPkid_. Columns
+ * left out of an image (binlog_row_image=MINIMAL or NOBLOB) and NULL
+ * columns carry no value, an UPDATE that leaves the vector column out of
+ * the after image keeps the vector of the before image and one that sets
+ * it to NULL removes the row from the index.
+ */
 void parseRowsEvent(const unsigned char* event_buf,
                     unsigned int event_len,
                     TableMapEvent& tev,
                     unsigned int pos1,
                     unsigned int pos2,
+                    int op,
                     vector<VectorIndexUpdateItem*>& updates) {
     unsigned int index = EVENT_HEADER_LENGTH;
 
@@ -305,31 +390,71 @@ void parseRowsEvent(const unsigned char* event_buf,
     memcpy(&extrainfo, &event_buf[index], 2);
     index += extrainfo;
 
-    unsigned int ncols = (unsigned int)event_buf[index];
-    index++;
+    unsigned int ncols = (unsigned int)readPackedInteger(event_buf, index);
+    if (ncols > tev.columnTypes.size()) {
+        error_print("Rows event of %s.%s has %u columns, table map has %lu",
+                    tev.dbName.c_str(),
+                    tev.tableName.c_str(),
+                    ncols,
+                    (unsigned long)tev.columnTypes.size());
+        return;
+    }
     unsigned int inclen = (((unsigned int)(ncols) + 7) >> 3);
-    (void)inclen;
-    // TODO : Assuming included & null bitmaps are single byte
-    unsigned int incbitmap = (unsigned int)event_buf[index];
-    (void)incbitmap;
-    index++;
-    while (true) {
-        unsigned int nullbitmap = (unsigned int)event_buf[index];
-        (void)nullbitmap;
-        index++;
+
+    auto isBitSet = [](const unsigned char* bitmap, unsigned int i) {
+        return (bitmap[i >> 3] & (1U << (i & 7))) != 0;
+    };
+
+    /* Columns present in the before image (the after image of a WRITE),
+     * UPDATE has a second bitmap for the after image.
+     */
+    const unsigned char* incBefore = &event_buf[index];
+    index += inclen;
+    const unsigned char* incAfter = incBefore;
+    if (op == VECTOR_INDEX_UPDATE) {
+        incAfter = &event_buf[index];
+        index += inclen;
+    }
+
+    /* parseRowImage - one row image, returns the id & vector columns and
+     * whether each was present with a non-NULL value.
+     */
+    auto parseRowImage = [&](const unsigned char* incbitmap,
+                             unsigned int& idVal,
+                             bool& hasId,
+                             const unsigned char*& vec,
+                             unsigned int& vecsz,
+                             bool& hasVec) {
+        unsigned int npresent = 0;
+        for (unsigned int i = 0; i < ncols; i++)
+            if (isBitSet(incbitmap, i))
+                npresent++;
+        // NULL bitmap has one bit per present column
+        const unsigned char* nullbitmap = &event_buf[index];
+        index += ((npresent + 7) >> 3);
 
         unsigned int lval = 0;
         unsigned long llval = 0;
 
-        unsigned int idVal = 0, vecsz = 0;
-        const unsigned char* vec = nullptr;
+        idVal = 0;
+        hasId = false;
+        vecsz = 0;
+        vec = nullptr;
+        hasVec = false;
+        unsigned int nth = 0;
         for (unsigned int i = 0; i < ncols; i++) {
+            if (!isBitSet(incbitmap, i))
+                continue;  // not in this image
+            if (isBitSet(nullbitmap, nth++))
+                continue;  // NULL, no value
             switch (tev.columnTypes[i]) {
                 case MYSQL_TYPE_LONG:
                     memcpy(&lval, &event_buf[index], 4);
                     index += 4;
-                    if (i == pos1)
+                    if (i == pos1) {
                         idVal = lval;
+                        hasId = true;
+                    }
                     break;
                 case MYSQL_TYPE_LONGLONG:
                     memcpy(&llval, &event_buf[index], 8);
@@ -347,6 +472,7 @@ void parseRowsEvent(const unsigned char* event_buf,
                     if (i == pos2) {  // found vector column
                         vec = &event_buf[index];
                         vecsz = clen;
+                        hasVec = true;
                     }
                     index += clen;
                     break;
@@ -359,6 +485,7 @@ void parseRowsEvent(const unsigned char* event_buf,
                     if (i == pos2) {  // found vector column
                         vec = &event_buf[index];
                         vecsz = clen;
+                        hasVec = true;
                     }
                     index += clen;
                     break;
@@ -372,23 +499,66 @@ void parseRowsEvent(const unsigned char* event_buf,
                                 (int)tev.columnTypes[i]);
             }  // switch
         }  // for columns
+    };
+
+    string key = tev.dbName + "." + tev.tableName;
+    string columnName = g_OnlineVectorIndexes[key].vectorColumn;
+
+    while (index < event_len) {
+        unsigned int idVal = 0, oldIdVal = 0, vecsz = 0, oldVecsz = 0;
+        const unsigned char *vec = nullptr, *oldVec = nullptr;
+        bool hasId = false, hasOldId = false, hasVec = false,
+             hasOldVec = false;
+        int rowop = op;
+        if (op == VECTOR_INDEX_UPDATE)
+            parseRowImage(
+                incBefore, oldIdVal, hasOldId, oldVec, oldVecsz, hasOldVec);
+        parseRowImage(incAfter, idVal, hasId, vec, vecsz, hasVec);
+
+        if (op == VECTOR_INDEX_UPDATE) {
+            if (!hasId) {  // id unchanged, left out of the after image
+                idVal = oldIdVal;
+                hasId = hasOldId;
+            }
+            if (!isBitSet(incAfter, pos2)) {  // vector unchanged
+                if (idVal == oldIdVal)
+                    continue;  // nothing for the index to do
+                if (!isBitSet(incBefore, pos2)) {
+                    error_print(
+                        "UPDATE of id %u to %u in %s.%s has no vector, "
+                        "needs binlog_row_image=FULL, row skipped",
+                        oldIdVal,
+                        idVal,
+                        tev.dbName.c_str(),
+                        tev.tableName.c_str());
+                    continue;
+                }
+                vec = oldVec;
+                vecsz = oldVecsz;
+                hasVec = hasOldVec;
+            }
+            if (!hasVec) {  // vector is NULL, drop the old id
+                rowop = VECTOR_INDEX_DELETE;
+                idVal = oldIdVal;
+                hasId = hasOldId;
+            }
+        }
+        if (!hasId || (rowop == VECTOR_INDEX_INSERT && !hasVec))
+            continue;  // NULL id or vector, not indexed
 
         VectorIndexUpdateItem* item = new VectorIndexUpdateItem();
-        string key = tev.dbName + "." + tev.tableName;
-        string columnName = g_OnlineVectorIndexes[key].vectorColumn;
         item->dbName_ = tev.dbName;
         item->tableName_ = tev.tableName;
         item->columnName_ = columnName;
-        item->vec_.assign(vec, vec + vecsz);
+        if (rowop != VECTOR_INDEX_DELETE)
+            item->vec_.assign(vec, vec + vecsz);
         item->pkid_ = idVal;
+        item->op_ = rowop;
+        item->oldPkid_ = oldIdVal;
         item->binlogFile_ = currentBinlogFile;
         item->binlogPos_ = currentBinlogPos;
         updates.push_back(item);
-        // index += 4;
-        if (index >= event_len)
-            break;  // done - multi rows
-
-    }  // while (true) - single row or multi-row event!
+    }  // while - single row or multi-row event!
     return;
 }
 
@@ -616,16 +786,17 @@ void GetBaseTableColumnPositions(MYSQL* hnd,
     return;
 }
 
-void myvector_open_index_impl(char* vecid,
-                              char* details,
-                              char* pkidcol,
-                              char* action,
-                              char* extra,
-                              char* result);
-
-/* OpenAllOnlineVectorIndexes() - Query MYVECTOR_COLUMNS view and open/load
- * all vector indexes that have online=Y i.e updated online when DMLs are
- * done on the base table. This routine is called during plugin init.
+void myvector_register_index(const string& vecid,
+                             const string& details,
+                             bool online);
+void myvector_wait_index_load(const string& vecid);
+
+/* OpenAllOnlineVectorIndexes() - Query MYVECTOR_COLUMNS view and open all
+ * vector indexes. They are loaded by the loader threads in myvector.cc,
+ * the other indexes serve searches as soon as they are loaded. Online
+ * indexes (online=Y, updated from the binlog when DMLs are done on the
+ * base table) are waited for, binlog reading starts at their checkpoints.
+ * This routine is called during plugin init.
  */
 void OpenAllOnlineVectorIndexes(MYSQL* hnd) {
     static const char* q = "select db,tbl,col,info from test.myvector_columns";
@@ -641,6 +812,13 @@ void OpenAllOnlineVectorIndexes(MYSQL* hnd) {
         return;
     }
 
+    struct OnlineIndex {
+        string vecid;
+        string dbtable;
+        VectorIndexColumnInfo vc;
+    };
+    vector<OnlineIndex> online_indexes;
+
     MYSQL_ROW row;
     while ((row = mysql_fetch_row(result))) {
         unsigned long* lengths;
@@ -668,6 +846,12 @@ void OpenAllOnlineVectorIndexes(MYSQL* hnd) {
 
         string online = vo.getOption("online");
         string idcol = vo.getOption("idcol");
+        string vecid = string(dbname) + "." + tbl + "." + col;
+
+        if (online != "y" && online != "Y") {
+            myvector_register_index(vecid, info, false);
+            continue;
+        }
 
         int idcolpos = 0, veccolpos = 0;
         GetBaseTableColumnPositions(
@@ -675,20 +859,21 @@ void OpenAllOnlineVectorIndexes(MYSQL* hnd) {
         if (idcolpos == 0 || veccolpos == 0)
             continue;
 
-        if (online == "y" || online == "Y") {
-            char empty[1024];
-            char action[] = "load";
-            char vecid[1024];
-            snprintf(vecid, sizeof(vecid), "%s.%s.%s", dbname, tbl, col);
-            myvector_open_index_impl(vecid, info, empty, action, empty, empty);
-
-            snprintf(vecid, sizeof(vecid), "%s.%s", dbname, tbl);
-            VectorIndexColumnInfo vc{col, idcolpos, veccolpos};
-            g_OnlineVectorIndexes[vecid] = vc;
-        }
+        myvector_register_index(vecid, info, true);
+        online_indexes.push_back(
+            {vecid,
+             string(dbname) + "." + tbl,
+             VectorIndexColumnInfo{col, idcolpos, veccolpos, false}});
     }  // while
 
     mysql_free_result(result);
+
+    for (auto& oi : online_indexes) {
+        myvector_wait_index_load(oi.vecid);
+        oi.vc.applyDeletes = myvector_index_supports_deletes(oi.vecid);
+        g_OnlineVectorIndexes[oi.dbtable] = oi.vc;
+        StartOnlineIndexCheckpointer(oi.dbtable, oi.vc.vectorColumn);
+    }
 }
 
 /* BuildMyVectorIndexSQL - Build/Refresh the Vector Index! This function uses
@@ -846,8 +1031,10 @@ void BuildMyVectorIndexSQL(const char* db,
             int idcolpos = 0, veccolpos = 0;
             GetBaseTableColumnPositions(
                 &mysql, db, table, idcol, veccol, idcolpos, veccolpos);
-            VectorIndexColumnInfo vc{veccol, idcolpos, veccolpos};
+            VectorIndexColumnInfo vc{
+                veccol, idcolpos, veccolpos, vi->supportsDeletes()};
             g_OnlineVectorIndexes[key] = vc;
+            StartOnlineIndexCheckpointer(key, veccol);
         }
 
         snprintf(query, sizeof(query), "UNLOCK TABLES");
@@ -866,32 +1053,110 @@ void BuildMyVectorIndexSQL(const char* db,
     mysql_close(&mysql);
 }
 
-void myvector_checkpoint_index(const string& dbtable,
+bool myvector_checkpoint_index(const string& dbtable,
                                const string& veccol,
                                const string& binlogFile,
                                size_t binlogPos);
 
-/* FlushOnlineVectorIndexes - flush or checkpoint all vector indexes that
- * registered for online binlog based DML updates. This routine is currently
- * called on every binlog file rotation. Binlog global mutex should be held
- * by caller so that current binlog filename and position are locked.
+bool myvector_index_dirty_stats(const string& dbtable,
+                                const string& veccol,
+                                size_t& nodes,
+                                size_t& bytes);
+
+/* Background checkpointer - every online vector index has a thread that
+ * checkpoints it when its dirty node count or dirty bytes crosses
+ * myvector_checkpoint_dirty_nodes / myvector_checkpoint_dirty_mb, when it
+ * has been dirty for myvector_checkpoint_interval seconds, or after a
+ * binlog file rotation. The binlog reader and the vector_q threads never
+ * wait for a checkpoint. The checkpoint records the oldest binlog
+ * coordinate that is still in flight in the event Q.
  */
-void FlushOnlineVectorIndexes() {
-    /* first wait for the binlog event Q to drain out */
-    while (1) {
-        if (gqueue_.empty()) {
-            break;
+mutex ckpt_mutex_;
+condition_variable ckpt_cv_;
+std::atomic<unsigned long> ckpt_rotations_{0};
+std::set<string> ckpt_threads_;
+
+void vector_ckpt_thread_fn(string dbtable, string veccol) {
+    unsigned long rotations = ckpt_rotations_.load();
+    time_t lastCheckpoint = time(nullptr);
+
+    info_print("checkpointer thread started %s.%s",
+               dbtable.c_str(),
+               veccol.c_str());
+
+    while (!shutdown_binlog_thread.load()) {
+        {
+            unique_lock lk(ckpt_mutex_);
+            ckpt_cv_.wait_for(lk, std::chrono::seconds(1));
+        }
+        size_t nodes = 0, bytes = 0;
+        if (!myvector_index_dirty_stats(dbtable, veccol, nodes, bytes))
+            continue;
+
+        bool due = (rotations != ckpt_rotations_.load());
+        if (myvector_checkpoint_dirty_nodes &&
+            nodes >= (size_t)myvector_checkpoint_dirty_nodes)
+            due = true;
+        if (myvector_checkpoint_dirty_mb &&
+            bytes >= (size_t)myvector_checkpoint_dirty_mb * 1024 * 1024)
+            due = true;
+        if (nodes && myvector_checkpoint_interval &&
+            time(nullptr) - lastCheckpoint >= myvector_checkpoint_interval)
+            due = true;
+        if (!due)
+            continue;
+
+        string ckptFile;
+        size_t ckptPos = 0;
+        gqueue_.checkpointCoordinates(ckptFile, ckptPos);
+        if (!ckptFile.length())
+            continue;  // binlog reader has not started yet
+
+        unsigned long r = ckpt_rotations_.load();
+        bool done = true;
+        try {
+            // false while an admin action holds the index, retried
+            done = myvector_checkpoint_index(dbtable, veccol, ckptFile, ckptPos);
+        } catch (std::exception& e) {
+            error_print("Checkpoint of %s.%s failed : %s",
+                        dbtable.c_str(),
+                        veccol.c_str(),
+                        e.what());
+        }
+        if (done) {
+            rotations = r;
+            lastCheckpoint = time(nullptr);
         }
-        usleep(500 * 1000);  // 1/2 second
-    }
-    for (auto vi : g_OnlineVectorIndexes) {
-        myvector_checkpoint_index(vi.first,
-                                  vi.second.vectorColumn,
-                                  currentBinlogFile,
-                                  currentBinlogPos);
     }
 }
 
+/* StartOnlineIndexCheckpointer - start the checkpointer thread of an index
+ * registered for online binlog based DML updates, once per index.
+ */
+void StartOnlineIndexCheckpointer(const string& dbtable, const string& veccol) {
+    lock_guard lk(ckpt_mutex_);
+    if (!ckpt_threads_.insert(dbtable + "." + veccol).second)
+        return;
+    std::thread(vector_ckpt_thread_fn, dbtable, veccol).detach();
+}
+
+/* RequestOnlineIndexCheckpoints - binlog file rotation, checkpoint all
+ * online indexes so that recovery never replays more than one binlog.
+ */
+void RequestOnlineIndexCheckpoints() {
+    ckpt_rotations_++;
+    ckpt_cv_.notify_all();
+}
+
+/* RequestBinlogRewind - an index was imported with older binlog
+ * coordinates than the read position. Before its next event the reader
+ * reopens the binlog from the earliest index checkpoint; events the other
+ * indexes already have are applied again as updates of the same rows.
+ */
+std::atomic<bool> binlog_rewind_{false};
+
+void RequestBinlogRewind() { binlog_rewind_ = true; }
+
 void myvector_binlog_loop(int id) {
     (void)id;
     MYSQL mysql;
@@ -990,6 +1255,18 @@ void myvector_binlog_loop(int id) {
 
     TableMapEvent tev;
     while (!shutdown_binlog_thread.load()) {
+        if (binlog_rewind_.exchange(false)) {
+            mysql_binlog_close(&mysql, &rpl);
+            startbinlog = myvector_find_earliest_binlog_file();
+            info_print("Rewinding binlog stream to %s.", startbinlog.c_str());
+            rpl.file_name = (startbinlog.length() ? startbinlog.c_str() : NULL);
+            rpl.file_name_length = 0;
+            rpl.start_position = 4;
+            if (mysql_binlog_open(&mysql, &rpl)) {
+                error_print("Binlog rewind failed: %s", mysql_error(&mysql));
+                break;
+            }
+        }
         int fetch_rc = mysql_binlog_fetch(&mysql, &rpl);
         if (fetch_rc != 0) {
             if (shutdown_binlog_thread.load()) {
@@ -1011,6 +1288,10 @@ void myvector_binlog_loop(int id) {
             binary_log::TABLE_MAP_EVENT;
         constexpr MyvectorLogEventType kWriteRowsEvent =
             binary_log::WRITE_ROWS_EVENT;
+        constexpr MyvectorLogEventType kUpdateRowsEvent =
+            binary_log::UPDATE_ROWS_EVENT;
+        constexpr MyvectorLogEventType kDeleteRowsEvent =
+            binary_log::DELETE_ROWS_EVENT;
         MYVECTOR_DIAGNOSTIC_POP
 #else
         using MyvectorLogEventType = binary_log::Log_event_type;
@@ -1019,6 +1300,10 @@ void myvector_binlog_loop(int id) {
             binary_log::TABLE_MAP_EVENT;
         constexpr MyvectorLogEventType kWriteRowsEvent =
             binary_log::WRITE_ROWS_EVENT;
+        constexpr MyvectorLogEventType kUpdateRowsEvent =
+            binary_log::UPDATE_ROWS_EVENT;
+        constexpr MyvectorLogEventType kDeleteRowsEvent =
+            binary_log::DELETE_ROWS_EVENT;
 #endif
 
         MyvectorLogEventType type = static_cast<MyvectorLogEventType>(
@@ -1027,14 +1312,16 @@ void myvector_binlog_loop(int id) {
         const unsigned char* event_buf = rpl.buffer + 1;
 
         if (type == kRotateEvent) {
-            if (currentBinlogFile.length()) {
-                FlushOnlineVectorIndexes();
-            }
+            bool rotated = (currentBinlogFile.length() > 0);
             parseRotateEvent(event_buf,
                              event_len,
                              currentBinlogFile,
                              currentBinlogPos,
-                             (currentBinlogFile.length() > 0));
+                             rotated);
+            gqueue_.setReadCoordinates(currentBinlogFile, currentBinlogPos);
+            if (rotated) {
+                RequestOnlineIndexCheckpoints();
+            }
             continue;
         }
         /// fprintf(stderr, "binlog position : %s %lu (%lu)\n",
@@ -1045,12 +1332,20 @@ void myvector_binlog_loop(int id) {
             continue;  // optimization!
         if (type == kTableMapEvent) {
             parseTableMapEvent(event_buf, event_len, tev);
-        } else if (type == kWriteRowsEvent) {
+        } else if (type == kWriteRowsEvent || type == kUpdateRowsEvent ||
+                   type == kDeleteRowsEvent) {
             string key = tev.dbName + "." + tev.tableName;
             if (g_OnlineVectorIndexes.find(key) ==
                 g_OnlineVectorIndexes.end()) {
                 continue;
             }
+            int op = (type == kWriteRowsEvent    ? VECTOR_INDEX_INSERT
+                      : type == kUpdateRowsEvent ? VECTOR_INDEX_UPDATE
+                                                 : VECTOR_INDEX_DELETE);
+            if (op != VECTOR_INDEX_INSERT &&
+                !g_OnlineVectorIndexes[key].applyDeletes) {
+                continue;  // HNSW/DiskANN indexes are append only
+            }
             int idcolpos = g_OnlineVectorIndexes[key].idColumnPosition;
             int veccolpos = g_OnlineVectorIndexes[key].vecColumnPosition;
             vector<VectorIndexUpdateItem*> updates;
@@ -1059,12 +1354,14 @@ void myvector_binlog_loop(int id) {
                            tev,
                            idcolpos - 1,
                            veccolpos - 1,
+                           op,
                            updates);
             nrows += updates.size();
             for (auto item : updates) {
                 gqueue_.enqueue(item);
             }
         }
+        gqueue_.setReadCoordinates(currentBinlogFile, currentBinlogPos);
         cnt++;
     }  // while (binlog_fetch)
     error_print("Exiting binlog func, error %s", mysql_error(&mysql));
@@ -1081,10 +1378,13 @@ void vector_q_thread_fn(int id) {
         myvector_table_op(item->dbName_,
                           item->tableName_,
                           item->columnName_,
+                          item->op_,
                           item->pkid_,
+                          item->oldPkid_,
                           item->vec_,
                           item->binlogFile_,
                           item->binlogPos_);
+        gqueue_.done(item);
         delete item;
     }
 }
@@ -34,6 +34,7 @@
 #include <mysql/status_var.h>
 #include <mysql_version.h>
 
+#include <climits>
 #include <cstring>
 #include <string>
 #include <thread>
@@ -89,6 +90,12 @@ static int plugin_init(MYSQL_PLUGIN plugin_info) {
 /* Config variables of the MyVector plugin */
 long myvector_feature_level;
 long myvector_index_bg_threads;
+long myvector_checkpoint_dirty_nodes;
+long myvector_checkpoint_dirty_mb;
+long myvector_checkpoint_interval;
+long myvector_checkpoint_io_mbps;
+long myvector_index_load_threads;
+long myvector_search_threads;
 char* myvector_index_dir;
 char* myvector_config_file;
 
@@ -114,6 +121,78 @@ static MYSQL_SYSVAR_LONG(index_bg_threads,
                          100L,
                          0);
 
+static MYSQL_SYSVAR_LONG(checkpoint_dirty_nodes,
+                         myvector_checkpoint_dirty_nodes,
+                         PLUGIN_VAR_RQCMDARG,
+                         "Checkpoint an online index when this many nodes are "
+                         "dirty, 0 to disable.",
+                         nullptr,
+                         nullptr,
+                         1000000L,
+                         0L,
+                         LONG_MAX,
+                         0);
+
+static MYSQL_SYSVAR_LONG(checkpoint_dirty_mb,
+                         myvector_checkpoint_dirty_mb,
+                         PLUGIN_VAR_RQCMDARG,
+                         "Checkpoint an online index when this many MB are "
+                         "dirty, 0 to disable.",
+                         nullptr,
+                         nullptr,
+                         1024L,
+                         0L,
+                         LONG_MAX,
+                         0);
+
+static MYSQL_SYSVAR_LONG(checkpoint_interval,
+                         myvector_checkpoint_interval,
+                         PLUGIN_VAR_RQCMDARG,
+                         "Seconds between checkpoints of a dirty online "
+                         "index, 0 to disable.",
+                         nullptr,
+                         nullptr,
+                         300L,
+                         0L,
+                         LONG_MAX,
+                         0);
+
+static MYSQL_SYSVAR_LONG(checkpoint_io_mbps,
+                         myvector_checkpoint_io_mbps,
+                         PLUGIN_VAR_RQCMDARG,
+                         "Checkpoint write budget in MB per second, 0 for "
+                         "unlimited.",
+                         nullptr,
+                         nullptr,
+                         0L,
+                         0L,
+                         LONG_MAX,
+                         0);
+
+static MYSQL_SYSVAR_LONG(index_load_threads,
+                         myvector_index_load_threads,
+                         PLUGIN_VAR_RQCMDARG,
+                         "Threads that load the vector indexes at plugin "
+                         "start.",
+                         nullptr,
+                         nullptr,
+                         4L,
+                         1L,
+                         100L,
+                         0);
+
+static MYSQL_SYSVAR_LONG(search_threads,
+                         myvector_search_threads,
+                         PLUGIN_VAR_RQCMDARG,
+                         "Threads that run the searches of one MYVECTOR_SEARCH "
+                         "join.",
+                         nullptr,
+                         nullptr,
+                         4L,
+                         1L,
+                         100L,
+                         0);
+
 static MYSQL_SYSVAR_STR(index_dir,
                         myvector_index_dir,
                         PLUGIN_VAR_RQCMDARG | PLUGIN_VAR_MEMALLOC,
@@ -132,6 +211,12 @@ static MYSQL_SYSVAR_STR(config_file,
 
 static SYS_VAR* myvector_system_variables[] = {MYSQL_SYSVAR(feature_level),
                                                MYSQL_SYSVAR(index_bg_threads),
+                                               MYSQL_SYSVAR(checkpoint_dirty_nodes),
+                                               MYSQL_SYSVAR(checkpoint_dirty_mb),
+                                               MYSQL_SYSVAR(checkpoint_interval),
+                                               MYSQL_SYSVAR(checkpoint_io_mbps),
+                                               MYSQL_SYSVAR(index_load_threads),
+                                               MYSQL_SYSVAR(search_threads),
                                                MYSQL_SYSVAR(index_dir),
                                                MYSQL_SYSVAR(config_file),
                                                nullptr};